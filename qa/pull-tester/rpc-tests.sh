@@ -49,10 +49,22 @@ testScripts=(
   'getchaintips.py'
   'rawtransactions.py'
   'rest.py'
+  'addressindex.py'
+  'spentindex.py'
+  'txoutsetinfo.py'
+  'blockfilters.py'
+  'rpc_prevouts.py'
+  'orphan_resolution.py'
+  'sendheaders.py'
+  'p2p-stalling.py'
+  'p2p-txrelay.py'
   'mempool_spendcoinbase.py'
   'mempool_coinbase_spends.py'
   'mempool_tx_input_limit.py'
+  'mempool_persist.py'
   'httpbasics.py'
+  'rpc_batch.py'
+  'rpc_queues.py'
   'zapwallettxes.py'
   'proxy_test.py'
   'merkle_blocks.py'
@@ -0,0 +1,116 @@
+#!/usr/bin/env python2
+# Copyright (c) 2014-2017 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the address index (-addressindex) and its RPC calls.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.authproxy import JSONRPCException
+from test_framework.util import assert_equal, start_nodes, stop_nodes, \
+    connect_nodes_bi, wait_bitcoinds, initialize_chain_clean
+
+from decimal import Decimal
+
+COIN = 100000000
+
+
+class AddressIndexTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory " + self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(2, self.options.tmpdir, [["-addressindex"], []])
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def run_test(self):
+        self.nodes[0].generate(101)
+        self.sync_all()
+
+        print "Calls fail without -addressindex"
+        address = self.nodes[1].getnewaddress()
+        try:
+            self.nodes[1].getaddressbalance({"addresses": [address]})
+            assert False, "getaddressbalance without -addressindex"
+        except JSONRPCException as e:
+            assert "No information available" in e.error["message"]
+
+        print "Invalid addresses are rejected"
+        try:
+            self.nodes[0].getaddressbalance({"addresses": ["notanaddress"]})
+            assert False, "getaddressbalance with an invalid address"
+        except JSONRPCException as e:
+            assert "Invalid address" in e.error["message"]
+
+        print "Payments to an address are indexed"
+        assert_equal(self.nodes[0].getaddressbalance({"addresses": [address]}), {"balance": 0, "received": 0})
+        txid = self.nodes[0].sendtoaddress(address, Decimal("10"))
+        self.nodes[0].generate(1)
+        self.sync_all()
+        height = self.nodes[0].getblockcount()
+
+        assert_equal(self.nodes[0].getaddressbalance({"addresses": [address]}),
+                     {"balance": 10 * COIN, "received": 10 * COIN})
+        assert_equal(self.nodes[0].getaddressbalance(address)["balance"], 10 * COIN)
+        utxos = self.nodes[0].getaddressutxos({"addresses": [address]})
+        assert_equal(len(utxos), 1)
+        assert_equal(utxos[0]["address"], address)
+        assert_equal(utxos[0]["txid"], txid)
+        assert_equal(utxos[0]["satoshis"], 10 * COIN)
+        assert_equal(utxos[0]["height"], height)
+        assert_equal(self.nodes[0].getaddresstxids({"addresses": [address]}), [txid])
+
+        print "Spending from an address is indexed"
+        spend = self.nodes[1].sendtoaddress(self.nodes[0].getnewaddress(), Decimal("4"))
+        self.sync_all()
+        self.nodes[0].generate(1)
+        self.sync_all()
+
+        assert_equal(self.nodes[0].getaddressbalance({"addresses": [address]}),
+                     {"balance": 0, "received": 10 * COIN})
+        assert_equal(self.nodes[0].getaddressutxos({"addresses": [address]}), [])
+        assert_equal(self.nodes[0].getaddresstxids({"addresses": [address]}), [txid, spend])
+        deltas = self.nodes[0].getaddressdeltas({"addresses": [address]})
+        assert_equal([d["satoshis"] for d in deltas], [10 * COIN, -10 * COIN])
+        assert_equal([d["txid"] for d in deltas], [txid, spend])
+        assert_equal([d["height"] for d in deltas], [height, height + 1])
+
+        print "Height ranges"
+        assert_equal(self.nodes[0].getaddresstxids({"addresses": [address], "start": height + 1, "end": height + 1}), [spend])
+        assert_equal(self.nodes[0].getaddresstxids({"addresses": [address], "start": 1, "end": height}), [txid])
+        try:
+            self.nodes[0].getaddresstxids({"addresses": [address], "start": height, "end": 1})
+            assert False, "getaddresstxids with end before start"
+        except JSONRPCException as e:
+            assert "Invalid start or end height" in e.error["message"]
+
+        print "Disconnected blocks are taken out of the index"
+        spend_block = self.nodes[0].getblockhash(height + 1)
+        self.nodes[0].invalidateblock(spend_block)
+        assert_equal(self.nodes[0].getaddressbalance({"addresses": [address]}),
+                     {"balance": 10 * COIN, "received": 10 * COIN})
+        assert_equal(self.nodes[0].getaddressutxos({"addresses": [address]}), utxos)
+        assert_equal(self.nodes[0].getaddresstxids({"addresses": [address]}), [txid])
+
+        self.nodes[0].reconsiderblock(spend_block)
+        assert_equal(self.nodes[0].getbestblockhash(), spend_block)
+        assert_equal(self.nodes[0].getaddressbalance({"addresses": [address]}),
+                     {"balance": 0, "received": 10 * COIN})
+        assert_equal(self.nodes[0].getaddressutxos({"addresses": [address]}), [])
+        assert_equal(self.nodes[0].getaddresstxids({"addresses": [address]}), [txid, spend])
+
+        print "Index survives a restart"
+        stop_nodes(self.nodes)
+        wait_bitcoinds()
+        self.setup_network()
+        assert_equal(self.nodes[0].getaddresstxids({"addresses": [address]}), [txid, spend])
+
+
+if __name__ == '__main__':
+    AddressIndexTest().main()
@@ -0,0 +1,162 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The Zen Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the compact block filter index through getblockfilter and REST.
+#
+# Every filter header must chain the filter hashes from the genesis block on,
+# also after a reorganization and a restart, and REST must serve the same
+# filters and headers as RPC.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.authproxy import JSONRPCException
+from test_framework.util import assert_equal, start_node, start_nodes, \
+    stop_node, initialize_chain_clean, connect_nodes_bi
+
+import binascii
+import hashlib
+import json
+import time
+
+try:
+    import http.client as httplib
+except ImportError:
+    import httplib
+try:
+    import urllib.parse as urlparse
+except ImportError:
+    import urlparse
+
+# The zen filter is not the BIP158 basic filter, so this bit isn't advertised
+NODE_COMPACT_FILTERS = 1 << 6
+
+
+def http_get_call(host, port, path):
+    conn = httplib.HTTPConnection(host, port)
+    conn.request('GET', path)
+    return conn.getresponse()
+
+
+def dsha256(data):
+    return hashlib.sha256(hashlib.sha256(data).digest()).digest()
+
+
+def filter_header(filter_hex, prev_header_hex):
+    # Hashes are shown byte-reversed
+    prev_header = binascii.unhexlify(prev_header_hex)[::-1]
+    filter_hash = dsha256(binascii.unhexlify(filter_hex))
+    return dsha256(filter_hash + prev_header)[::-1].encode('hex')
+
+
+class BlockFiltersTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory " + self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(2, self.options.tmpdir, [
+            ['-blockfilterindex', '-peerblockfilters', '-rest'],
+            []])
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def wait_for_filter(self, node, blockhash):
+        for i in range(100):
+            try:
+                return node.getblockfilter(blockhash)
+            except JSONRPCException as e:
+                assert "still in the process of being indexed" in e.error['message']
+            time.sleep(0.1)
+        raise AssertionError("block %s was not indexed" % blockhash)
+
+    def check_headers(self, node):
+        # The header of the genesis block commits to a zero previous header
+        prev_header = "00" * 32
+        for height in range(node.getblockcount() + 1):
+            result = node.getblockfilter(node.getblockhash(height))
+            assert_equal(result["header"], filter_header(result["filter"], prev_header))
+            prev_header = result["header"]
+        return prev_header
+
+    def run_test(self):
+        node = self.nodes[0]
+        url = urlparse.urlparse(node.url)
+
+        print "Mining blocks..."
+        node.generate(101)
+        self.sync_all()
+        self.nodes[1].generate(10)
+        self.sync_all()
+        node.sendtoaddress(self.nodes[1].getnewaddress(), 1)
+        node.generate(1)
+        self.sync_all()
+
+        tip = node.getbestblockhash()
+        self.wait_for_filter(node, tip)
+        tip_header = self.check_headers(node)
+        assert_equal(node.getblockfilter(tip)["header"], tip_header)
+
+        print "Filter service bit is not set"
+        assert not int(node.getnetworkinfo()["localservices"], 16) & NODE_COMPACT_FILTERS
+        assert not int(self.nodes[1].getnetworkinfo()["localservices"], 16) & NODE_COMPACT_FILTERS
+
+        print "Errors"
+        try:
+            node.getblockfilter(tip, "basic")
+            raise AssertionError("unknown filter type accepted")
+        except JSONRPCException as e:
+            assert_equal(e.error['message'], "Unknown filtertype")
+        try:
+            self.nodes[1].getblockfilter(tip)
+            raise AssertionError("filter served without an index")
+        except JSONRPCException as e:
+            assert_equal(e.error['message'], "Index is not enabled for filtertype zen")
+
+        print "REST serves the same filters"
+        result = node.getblockfilter(tip, "zen")
+        response = http_get_call(url.hostname, url.port, '/rest/blockfilter/zen/' + tip + '.json')
+        assert_equal(response.status, 200)
+        assert_equal(json.loads(response.read()), result)
+
+        response = http_get_call(url.hostname, url.port, '/rest/blockfilter/zen/' + tip + '.bin')
+        assert_equal(response.status, 200)
+        data = response.read()
+        # Filter type, block hash, then the encoded filter behind a CompactSize length
+        assert_equal(data[0], '\x80')
+        assert_equal(data[1:33][::-1].encode('hex'), tip)
+        assert_equal(data[34:].encode('hex'), result["filter"])
+
+        start = node.getblockhash(5)
+        response = http_get_call(url.hostname, url.port, '/rest/blockfilterheaders/zen/4/' + start + '.json')
+        assert_equal(response.status, 200)
+        headers = json.loads(response.read())
+        assert_equal(headers, [node.getblockfilter(node.getblockhash(h))["header"] for h in range(5, 9)])
+
+        response = http_get_call(url.hostname, url.port, '/rest/blockfilter/basic/' + tip + '.json')
+        assert_equal(response.status, 400)
+        response = http_get_call(url.hostname, url.port, '/rest/blockfilterheaders/zen/0/' + start + '.json')
+        assert_equal(response.status, 400)
+
+        print "Headers chain from the fork after a reorganization"
+        node.invalidateblock(tip)
+        node.generate(2)
+        new_tip = node.getbestblockhash()
+        self.wait_for_filter(node, new_tip)
+        self.check_headers(node)
+        # The filter of the disconnected block is kept
+        assert_equal(node.getblockfilter(tip)["header"], tip_header)
+
+        print "Filters are kept across a restart"
+        stop_node(node, 0)
+        self.nodes[0] = node = start_node(0, self.options.tmpdir, ['-blockfilterindex', '-peerblockfilters', '-rest'])
+        node.generate(1)
+        self.wait_for_filter(node, node.getbestblockhash())
+        self.check_headers(node)
+
+if __name__ == '__main__':
+    BlockFiltersTest().main()
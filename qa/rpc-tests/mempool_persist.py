@@ -0,0 +1,71 @@
+#!/usr/bin/env python2
+# Copyright (c) 2014-2017 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test mempool persistence.
+#
+# Node1 sends transactions that node0 only knows through relay, so node0's
+# wallet cannot put them back into its mempool on restart:
+# - after a normal restart node0 reloads them from mempool.dat
+# - after a restart with -persistmempool=0 its mempool stays empty, and
+#   mempool.dat is neither read nor overwritten
+# - after one more normal restart the transactions are back
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, start_node, start_nodes, \
+    stop_node, connect_nodes_bi
+
+import time
+
+
+class MempoolPersistTest(BitcoinTestFramework):
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(2, self.options.tmpdir)
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def restart_node0(self, extra_args=[]):
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, extra_args)
+
+    def wait_for_mempool_size(self, node, size, timeout=60):
+        # The mempool is reloaded in the background after startup
+        for _ in range(timeout * 10):
+            if len(node.getrawmempool()) == size:
+                break
+            time.sleep(0.1)
+        assert_equal(len(node.getrawmempool()), size)
+
+    def run_test(self):
+        address = self.nodes[1].getnewaddress()
+        txids = []
+        for _ in range(5):
+            txids.append(self.nodes[1].sendtoaddress(address, 0.1))
+        self.sync_all()
+        assert_equal(len(self.nodes[0].getrawmempool()), 5)
+
+        print "Restarting node0, mempool should be reloaded"
+        self.restart_node0()
+        self.wait_for_mempool_size(self.nodes[0], 5)
+        assert_equal(set(self.nodes[0].getrawmempool()), set(txids))
+
+        print "Restarting node0 with -persistmempool=0, mempool should be empty"
+        self.restart_node0(["-persistmempool=0"])
+        time.sleep(2)
+        assert_equal(len(self.nodes[0].getrawmempool()), 0)
+
+        print "Restarting node0 once more, mempool.dat must have been left alone"
+        self.restart_node0()
+        self.wait_for_mempool_size(self.nodes[0], 5)
+
+        # The reloaded transactions are still mineable
+        self.nodes[0].generate(1)
+        assert_equal(len(self.nodes[0].getrawmempool()), 0)
+
+if __name__ == '__main__':
+    MempoolPersistTest().main()
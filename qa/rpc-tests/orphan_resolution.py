@@ -0,0 +1,134 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The Zen Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test that an orphan transaction enters the mempool once its parent is mined,
+# both with ThreadTxVerify workers and with -txverifythreads=0, where the
+# orphans are evaluated by the thread connecting the block.
+#
+# Node0 and node1 receive the orphan from a mininode peer and the block with
+# its parent through submitblock, so that they never see the parent as a
+# loose transaction. Node2 mines.
+#
+
+from test_framework.mininode import CTransaction, NodeConn, NodeConnCB, \
+    NetworkThread, msg_tx, msg_ping, msg_pong, mininode_lock, FromHex
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, initialize_chain_clean, \
+    start_nodes, p2p_port
+
+from decimal import Decimal
+import time
+
+
+class TestNode(NodeConnCB):
+    def __init__(self):
+        NodeConnCB.__init__(self)
+        self.create_callback_map()
+        self.connection = None
+        self.ping_counter = 1
+        self.last_pong = msg_pong()
+
+    def add_connection(self, conn):
+        self.connection = conn
+
+    def wait_for_verack(self):
+        while True:
+            with mininode_lock:
+                if self.verack_received:
+                    return
+            time.sleep(0.05)
+
+    def send_message(self, message):
+        self.connection.send_message(message)
+
+    def on_pong(self, conn, message):
+        self.last_pong = message
+
+    def sync_with_ping(self, timeout=30):
+        self.connection.send_message(msg_ping(nonce=self.ping_counter))
+        received_pong = False
+        sleep_time = 0.05
+        while not received_pong and timeout > 0:
+            time.sleep(sleep_time)
+            timeout -= sleep_time
+            with mininode_lock:
+                if self.last_pong.nonce == self.ping_counter:
+                    received_pong = True
+        self.ping_counter += 1
+        return received_pong
+
+
+class OrphanResolutionTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory " + self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 3)
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(3, self.options.tmpdir, [
+            ['-debug=mempool', '-txverifythreads=0'],
+            ['-debug=mempool'],
+            []])
+        self.is_network_split = False
+
+    def submit_blocks(self, blockhashes):
+        for blockhash in blockhashes:
+            block = self.nodes[2].getblock(blockhash, False)
+            for node in self.nodes[0:2]:
+                node.submitblock(block)
+        for node in self.nodes[0:2]:
+            assert_equal(node.getbestblockhash(), blockhashes[-1])
+
+    def wait_for_mempool(self, node, txid):
+        for i in range(100):
+            if txid in node.getrawmempool():
+                return
+            time.sleep(0.1)
+        raise AssertionError("orphan %s was not accepted" % txid)
+
+    def run_test(self):
+        test_nodes = [TestNode(), TestNode()]
+        connections = []
+        for i in range(2):
+            connections.append(NodeConn('127.0.0.1', p2p_port(i), self.nodes[i], test_nodes[i]))
+            test_nodes[i].add_connection(connections[i])
+        NetworkThread().start()
+        for test_node in test_nodes:
+            test_node.wait_for_verack()
+
+        miner = self.nodes[2]
+        self.submit_blocks(miner.generate(101))
+
+        print "Building a parent and a child spending it"
+        parent_txid = miner.sendtoaddress(miner.getnewaddress(), Decimal("10"))
+        parent = miner.getrawtransaction(parent_txid, 1)
+        n = [out["n"] for out in parent["vout"] if out["value"] == Decimal("10")][0]
+        raw = miner.createrawtransaction([{"txid": parent_txid, "vout": n}],
+                                         {miner.getnewaddress(): Decimal("9.9999")})
+        child_hex = miner.signrawtransaction(raw)["hex"]
+        child_txid = miner.decoderawtransaction(child_hex)["txid"]
+
+        print "The child is kept as an orphan"
+        for test_node in test_nodes:
+            test_node.send_message(msg_tx(FromHex(CTransaction(), child_hex)))
+            assert test_node.sync_with_ping()
+        for node in self.nodes[0:2]:
+            assert_equal(node.getrawmempool(), [])
+
+        print "Mining the parent resolves the orphan"
+        blockhashes = miner.generate(1)
+        assert parent_txid in miner.getblock(blockhashes[0])["tx"]
+        self.submit_blocks(blockhashes)
+        # Without workers the orphan is evaluated before submitblock returns
+        assert_equal(self.nodes[0].getrawmempool(), [child_txid])
+        self.wait_for_mempool(self.nodes[1], child_txid)
+        assert_equal(self.nodes[1].getrawmempool(), [child_txid])
+
+        for conn in connections:
+            conn.disconnect_node()
+
+if __name__ == '__main__':
+    OrphanResolutionTest().main()
@@ -0,0 +1,114 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The Zen Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test that blocks requested from a peer which never delivers them are
+# requested again from a faster peer, instead of stalling the download.
+#
+# A mininode peer announces the headers of node0's chain to node1 and ignores
+# the blocks it is asked for. Once node1 connects to node0, the blocks holding
+# back the download window are taken over by node0 and node1 syncs, while the
+# slow peer is kept and counted as slow.
+#
+
+from test_framework.mininode import CBlockHeader, NodeConn, NodeConnCB, \
+    NetworkThread, msg_headers, mininode_lock, FromHex
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, initialize_chain_clean, \
+    start_nodes, p2p_port, connect_nodes, sync_blocks
+
+import time
+
+# More blocks than fit into the download window
+NUM_BLOCKS = 1100
+HEADERS_PER_MESSAGE = 500
+MIN_BLOCKS_IN_TRANSIT_PER_PEER = 4
+
+
+class TestNode(NodeConnCB):
+    def __init__(self):
+        NodeConnCB.__init__(self)
+        self.create_callback_map()
+        self.connection = None
+        self.getdata_blocks = []
+
+    def add_connection(self, conn):
+        self.connection = conn
+
+    def wait_for_verack(self):
+        while True:
+            with mininode_lock:
+                if self.verack_received:
+                    return
+            time.sleep(0.05)
+
+    def send_message(self, message):
+        self.connection.send_message(message)
+
+    # Blocks are requested, but never sent
+    def on_getdata(self, conn, message):
+        for inv in message.inv:
+            if inv.type == 2:
+                self.getdata_blocks.append(inv.hash)
+
+
+class StallingTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory " + self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(2, self.options.tmpdir, [[], ["-debug=net"]])
+        self.is_network_split = False
+
+    def slow_peer(self):
+        peers = [peer for peer in self.nodes[1].getpeerinfo() if peer["inbound"]]
+        assert_equal(len(peers), 1)
+        return peers[0]
+
+    def run_test(self):
+        print "Mining blocks..."
+        blockhashes = self.nodes[0].generate(NUM_BLOCKS)
+
+        test_node = TestNode()
+        conn = NodeConn('127.0.0.1', p2p_port(1), self.nodes[1], test_node)
+        test_node.add_connection(conn)
+        NetworkThread().start()
+        test_node.wait_for_verack()
+
+        print "Announcing the headers from a peer that doesn't send blocks"
+        headers = [FromHex(CBlockHeader(), self.nodes[0].getblockheader(h, False)) for h in blockhashes]
+        for i in range(0, NUM_BLOCKS, HEADERS_PER_MESSAGE):
+            message = msg_headers()
+            message.headers = headers[i:i + HEADERS_PER_MESSAGE]
+            test_node.send_message(message)
+        for i in range(100):
+            if len(self.slow_peer()["inflight"]) > 0:
+                break
+            time.sleep(0.1)
+        inflight = self.slow_peer()["inflight"]
+        assert len(inflight) > 0
+        # The first blocks are in flight, so nothing can be connected yet
+        assert_equal(min(inflight), 1)
+        assert_equal(self.nodes[1].getblockcount(), 0)
+
+        print "A faster peer takes over the stalled blocks"
+        connect_nodes(self.nodes[1], 0)
+        sync_blocks(self.nodes)
+        assert_equal(self.nodes[1].getbestblockhash(), blockhashes[-1])
+
+        peer = self.slow_peer()
+        assert_equal(peer["inflight"], [])
+        # It is counted as slow by the time the blocks were taken away from it
+        assert peer["blocktime"] >= 0.5
+        assert_equal(peer["inflightlimit"], MIN_BLOCKS_IN_TRANSIT_PER_PEER)
+        with mininode_lock:
+            assert len(test_node.getdata_blocks) >= len(inflight)
+
+        conn.disconnect_node()
+
+if __name__ == '__main__':
+    StallingTest().main()
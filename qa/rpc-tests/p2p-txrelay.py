@@ -0,0 +1,175 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The Zen Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test how transactions are announced to a peer.
+#
+# A mininode peer records the transaction invs it gets from node0. They come
+# in batches of at most INVENTORY_BROADCAST_MAX, highest fee rate first.
+# Once the peer sent a feefilter, transactions paying less are neither
+# announced nor listed in the reply to a mempool message.
+#
+
+from test_framework.mininode import NodeConn, NodeConnCB, NetworkThread, \
+    msg_feefilter, msg_mempool, msg_ping, msg_pong, mininode_lock
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, initialize_chain_clean, \
+    start_nodes, p2p_port
+
+from decimal import Decimal
+import time
+
+INVENTORY_BROADCAST_MAX = 35
+NUM_BATCHED = 40
+NUM_FILTERED = 20
+COIN = 100000000
+
+
+class TestNode(NodeConnCB):
+    def __init__(self):
+        NodeConnCB.__init__(self)
+        self.create_callback_map()
+        self.connection = None
+        self.ping_counter = 1
+        self.last_pong = msg_pong()
+        # The txids of each inv message, in the order they were announced
+        self.tx_invs = []
+
+    def add_connection(self, conn):
+        self.connection = conn
+
+    def wait_for_verack(self):
+        while True:
+            with mininode_lock:
+                if self.verack_received:
+                    return
+            time.sleep(0.05)
+
+    def send_message(self, message):
+        self.connection.send_message(message)
+
+    # Record announcements instead of asking for them
+    def on_inv(self, conn, message):
+        txids = ["%064x" % inv.hash for inv in message.inv if inv.type == 1]
+        if txids:
+            self.tx_invs.append(txids)
+
+    def on_pong(self, conn, message):
+        self.last_pong = message
+
+    def sync_with_ping(self, timeout=30):
+        self.connection.send_message(msg_ping(nonce=self.ping_counter))
+        received_pong = False
+        sleep_time = 0.05
+        while not received_pong and timeout > 0:
+            time.sleep(sleep_time)
+            timeout -= sleep_time
+            with mininode_lock:
+                if self.last_pong.nonce == self.ping_counter:
+                    received_pong = True
+        self.ping_counter += 1
+        return received_pong
+
+    def announced(self):
+        with mininode_lock:
+            return [txid for txids in self.tx_invs for txid in txids]
+
+    def wait_for_announced(self, txids, timeout=60):
+        while timeout > 0:
+            if set(txids).issubset(self.announced()):
+                return
+            time.sleep(0.1)
+            timeout -= 0.1
+        raise AssertionError("transactions were not announced")
+
+
+class TxRelayTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory " + self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(1, self.options.tmpdir, [["-debug=net"]])
+        self.is_network_split = False
+
+    def fee_rates(self):
+        # Per 1000 bytes, as the node compares them
+        return dict((txid, int(entry["fee"] * COIN) * 1000 // entry["size"])
+                    for txid, entry in self.nodes[0].getrawmempool(True).items())
+
+    def run_test(self):
+        node = self.nodes[0]
+        node.generate(110)
+
+        print "Preparing transactions with increasing fees"
+        outputs = dict((node.getnewaddress(), Decimal("0.1")) for i in range(NUM_BATCHED + NUM_FILTERED))
+        fundingtxid = node.sendmany("", outputs)
+        node.generate(1)
+        funding = node.getrawtransaction(fundingtxid, 1)
+        signed = []
+        for vout in funding["vout"]:
+            if vout["value"] != Decimal("0.1"):
+                continue
+            fee = Decimal("0.0001") + len(signed) * Decimal("0.00001")
+            raw = node.createrawtransaction([{"txid": fundingtxid, "vout": vout["n"]}],
+                                            {node.getnewaddress(): Decimal("0.1") - fee})
+            signed.append(node.signrawtransaction(raw)["hex"])
+        assert_equal(len(signed), NUM_BATCHED + NUM_FILTERED)
+
+        test_node = TestNode()
+        conn = NodeConn('127.0.0.1', p2p_port(0), node, test_node)
+        test_node.add_connection(conn)
+        NetworkThread().start()
+        test_node.wait_for_verack()
+        assert test_node.sync_with_ping()
+
+        print "Transactions are announced in batches, highest fee rate first"
+        batched = [node.sendrawtransaction(tx) for tx in signed[:NUM_BATCHED]]
+        test_node.wait_for_announced(batched)
+        feerates = self.fee_rates()
+        announced = test_node.announced()
+        assert_equal(sorted(announced), sorted(batched))
+        with mininode_lock:
+            # There are more than fit into one batch
+            assert len(test_node.tx_invs) > 1
+            for txids in test_node.tx_invs:
+                assert len(txids) <= INVENTORY_BROADCAST_MAX
+                rates = [feerates[txid] for txid in txids]
+                assert_equal(rates, sorted(rates, reverse=True))
+
+        print "Transactions below the peer's fee filter are not announced"
+        filtered = signed[NUM_BATCHED:]
+        threshold = Decimal("0.0001") + (NUM_BATCHED + NUM_FILTERED / 2) * Decimal("0.00001")
+        threshold = int(threshold * COIN) * 1000 // (len(filtered[0]) // 2)
+        test_node.send_message(msg_feefilter(threshold))
+        assert test_node.sync_with_ping()
+        peers = node.getpeerinfo()
+        assert_equal(len(peers), 1)
+        assert_equal(peers[0]["minfeefilter"], Decimal(threshold) / COIN)
+
+        txids = [node.sendrawtransaction(tx) for tx in filtered]
+        feerates = self.fee_rates()
+        above = [txid for txid in txids if feerates[txid] >= threshold]
+        below = [txid for txid in txids if feerates[txid] < threshold]
+        assert len(above) > 0 and len(below) > 0
+        test_node.wait_for_announced(above)
+        assert test_node.sync_with_ping()
+        # The filter was set before they entered the mempool, so these never go out
+        for txid in below:
+            assert txid not in test_node.announced()
+
+        print "The mempool reply leaves them out too"
+        with mininode_lock:
+            test_node.tx_invs = []
+        test_node.send_message(msg_mempool())
+        assert test_node.sync_with_ping()
+        expected = [txid for txid, rate in feerates.items() if rate >= threshold]
+        assert_equal(sorted(test_node.announced()), sorted(expected))
+
+        conn.disconnect_node()
+
+if __name__ == '__main__':
+    TxRelayTest().main()
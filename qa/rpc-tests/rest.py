@@ -342,6 +342,50 @@ class RESTTest (BitcoinTestFramework):
         for tx in txs:
             assert_equal(tx in json_obj['tx'], True)
 
+        # range endpoints return the same bytes as one request per block
+        height = self.nodes[0].getblockcount()
+        hashes = [self.nodes[0].getblockhash(h) for h in range(height - 4, height + 1)]
+        blocks = ''.join(http_get_call(url.hostname, url.port, '/rest/block/'+h+self.FORMAT_SEPARATOR+'bin') for h in hashes)
+        response = http_get_call(url.hostname, url.port, '/rest/blockrange/'+str(height - 4)+'/5'+self.FORMAT_SEPARATOR+'bin', True)
+        assert_equal(response.status, 200)
+        # sent as it is read rather than built in memory first
+        assert_equal(response.getheader('transfer-encoding'), 'chunked')
+        assert_equal(response.read(), blocks)
+        # ranges past the tip are cut short
+        response = http_get_call(url.hostname, url.port, '/rest/blockrange/'+str(height - 4)+'/100'+self.FORMAT_SEPARATOR+'hex', True)
+        assert_equal(response.status, 200)
+        assert_equal(response.read(), binascii.hexlify(blocks)+"\n")
+
+        headers = http_get_call(url.hostname, url.port, '/rest/headers/5/'+hashes[0]+self.FORMAT_SEPARATOR+'bin')
+        response = http_get_call(url.hostname, url.port, '/rest/headerrange/'+str(height - 4)+'/5'+self.FORMAT_SEPARATOR+'bin', True)
+        assert_equal(response.status, 200)
+        assert_equal(response.read(), headers)
+
+        response = http_get_call(url.hostname, url.port, '/rest/undorange/1/'+str(height)+self.FORMAT_SEPARATOR+'bin', True)
+        assert_equal(response.status, 200)
+        assert_greater_than(len(response.read()), height)
+
+        response = http_get_call(url.hostname, url.port, '/rest/undorange/0/1'+self.FORMAT_SEPARATOR+'bin', True)
+        assert_equal(response.status, 400) # the genesis block has no undo data
+        response = http_get_call(url.hostname, url.port, '/rest/blockrange/'+str(height + 1)+'/1'+self.FORMAT_SEPARATOR+'bin', True)
+        assert_equal(response.status, 404)
+        response = http_get_call(url.hostname, url.port, '/rest/blockrange/0/100000'+self.FORMAT_SEPARATOR+'bin', True)
+        assert_equal(response.status, 400)
+        response = http_get_call(url.hostname, url.port, '/rest/blockrange/0/1'+self.FORMAT_SEPARATOR+'json', True)
+        assert_equal(response.status, 404)
+
+        # large outpoint batches can be posted
+        binaryRequest = b'\x00\xfd' + struct.pack("<H", 1000)
+        for x in range(0, 1000):
+            binaryRequest += binascii.unhexlify(txid)[::-1] + struct.pack("<I", x)
+        response = http_post_call(url.hostname, url.port, '/rest/getutxos'+self.FORMAT_SEPARATOR+'bin', binaryRequest, True)
+        assert_equal(response.status, 200)
+        output = StringIO.StringIO()
+        output.write(response.read())
+        output.seek(0)
+        assert_equal(struct.unpack("<i", output.read(4))[0], height)
+        assert_equal(deser_uint256(output), int(self.nodes[0].getbestblockhash(), 16))
+
         # test rest bestblock
         bb_hash = self.nodes[0].getbestblockhash()
 
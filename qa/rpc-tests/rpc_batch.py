@@ -0,0 +1,64 @@
+#!/usr/bin/env python2
+# Copyright (c) 2014-2017 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test JSON-RPC batches.
+#
+# Read-only calls in a batch run in parallel; replies must still come back in
+# request order, with errors in place, and calls that change state must see
+# everything before them in the batch done.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, start_nodes
+
+
+class RPCBatchTest(BitcoinTestFramework):
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(2, self.options.tmpdir, [["-rpcbatchparallel=4"], ["-rpcbatchparallel=1"]])
+        self.is_network_split = False
+
+    def batch(self, node, calls):
+        requests = [{"version": "1.1", "method": method, "params": params, "id": i}
+                    for i, (method, params) in enumerate(calls)]
+        replies = node._batch(requests)
+        assert_equal([reply["id"] for reply in replies], range(len(calls)))
+        return replies
+
+    def run_test(self):
+        node = self.nodes[0]
+        height = node.getblockcount()
+        hashes = [node.getblockhash(h) for h in range(height + 1)]
+
+        print "Read-only batch, replies in request order"
+        calls = []
+        for h in range(height + 1):
+            calls.append(("getblockhash", [h]))
+            calls.append(("getblockheader", [hashes[h]]))
+        calls.append(("getblockhash", [height + 1]))
+        replies = self.batch(node, calls)
+        for h in range(height + 1):
+            assert_equal(replies[2 * h]["result"], hashes[h])
+            assert_equal(replies[2 * h + 1]["result"]["height"], h)
+        assert replies[-1]["error"] is not None
+        assert_equal(replies[-1]["result"], None)
+
+        print "Same replies with parallel execution disabled"
+        replies_serial = self.batch(self.nodes[1], calls)
+        assert_equal([r["result"] for r in replies], [r["result"] for r in replies_serial])
+
+        print "Calls that change state are ordered with the rest of the batch"
+        calls = [("getblockcount", []), ("getbestblockhash", []),
+                 ("generate", [1]),
+                 ("getblockcount", []), ("getbestblockhash", [])]
+        replies = self.batch(node, calls)
+        assert_equal(replies[0]["result"], height)
+        assert_equal(replies[1]["result"], hashes[height])
+        assert_equal(replies[3]["result"], height + 1)
+        assert_equal(replies[4]["result"], replies[2]["result"][0])
+
+if __name__ == '__main__':
+    RPCBatchTest().main()
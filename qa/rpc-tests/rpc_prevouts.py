@@ -0,0 +1,89 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The Zen Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test getrawtransaction verbosity 2 and getblock verbosity 3, which describe
+# the outputs spent by the inputs of a transaction, and its fee.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, start_nodes, initialize_chain_clean
+
+from decimal import Decimal
+
+
+class RPCPrevoutsTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory " + self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(1, self.options.tmpdir, [["-txindex"]])
+        self.is_network_split = False
+
+    def check_prevouts(self, tx):
+        # Each input describes the output it spends, as the funding transaction does
+        value_in = Decimal("0")
+        for vin in tx["vin"]:
+            funding = self.nodes[0].getrawtransaction(vin["txid"], 1)
+            spent = funding["vout"][vin["vout"]]
+            assert_equal(vin["prevout"]["value"], spent["value"])
+            assert_equal(vin["prevout"]["valueZat"], spent["valueZat"])
+            assert_equal(vin["prevout"]["scriptPubKey"], spent["scriptPubKey"])
+            value_in += spent["value"]
+        value_out = sum(out["value"] for out in tx["vout"])
+        assert_equal(tx["fee"], value_in - value_out)
+
+    def run_test(self):
+        node = self.nodes[0]
+        node.generate(101)
+
+        print "Unconfirmed transactions are resolved from the mempool and UTXO set"
+        txid = node.sendtoaddress(node.getnewaddress(), Decimal("3"))
+        tx = node.getrawtransaction(txid, 2)
+        self.check_prevouts(tx)
+        fee = node.gettransaction(txid)["fee"]
+        assert_equal(tx["fee"], -fee)
+
+        child = node.sendtoaddress(node.getnewaddress(), Decimal("5"))
+        self.check_prevouts(node.getrawtransaction(child, 2))
+
+        print "Confirmed transactions are resolved from the undo data"
+        blockhash = node.generate(1)[0]
+        tx = node.getrawtransaction(txid, 2)
+        self.check_prevouts(tx)
+        assert_equal(tx["fee"], -fee)
+        self.check_prevouts(node.getrawtransaction(child, 2))
+
+        verbose = node.getrawtransaction(txid, 1)
+        assert "fee" not in verbose
+        assert "prevout" not in verbose["vin"][0]
+
+        print "getblock describes the spent outputs at verbosity 3"
+        block = node.getblock(blockhash, 3)
+        assert_equal(len(block["tx"]), 3)
+        # The coinbase spends nothing
+        assert "prevout" not in block["tx"][0]["vin"][0]
+        assert "fee" not in block["tx"][0]
+        for tx in block["tx"][1:]:
+            self.check_prevouts(tx)
+            raw = node.getrawtransaction(tx["txid"], 2)
+            assert_equal(tx["vin"], raw["vin"])
+            assert_equal(tx["fee"], raw["fee"])
+
+        block2 = node.getblock(blockhash, 2)
+        assert_equal([tx["txid"] for tx in block2["tx"]], [tx["txid"] for tx in block["tx"]])
+        assert "prevout" not in block2["tx"][1]["vin"][0]
+        assert_equal(node.getblock(blockhash, 1)["tx"], [tx["txid"] for tx in block["tx"]])
+        assert_equal(node.getblock(blockhash, True), node.getblock(blockhash, 1))
+        assert_equal(node.getblock(blockhash, False), node.getblock(blockhash, 0))
+
+        # The genesis block has no undo data
+        genesis = node.getblock(node.getblockhash(0), 3)
+        assert "prevout" not in genesis["tx"][0]["vin"][0]
+
+if __name__ == '__main__':
+    RPCPrevoutsTest().main()
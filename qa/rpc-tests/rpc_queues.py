@@ -0,0 +1,145 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The Zen Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the RPC work queues.
+#
+# Wallet and mining calls are served by queues of their own, unless their
+# thread count is 0, and getrpcinfo reports what each queue did.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.authproxy import AuthServiceProxy
+from test_framework.util import assert_equal, start_nodes, connect_nodes, \
+    sync_blocks
+
+import base64
+import threading
+import time
+
+try:
+    import http.client as httplib
+except ImportError:
+    import httplib
+try:
+    import urllib.parse as urlparse
+except ImportError:
+    import urlparse
+
+
+class LongpollThread(threading.Thread):
+    def __init__(self, node):
+        threading.Thread.__init__(self)
+        self.longpollid = node.getblocktemplate()['longpollid']
+        # A connection of its own, which cannot be shared between threads
+        self.node = AuthServiceProxy(node.url, timeout=600)
+
+    def run(self):
+        self.node.getblocktemplate({'longpollid': self.longpollid})
+
+
+def post_status(node, body):
+    url = urlparse.urlparse(node.url)
+    auth = base64.b64encode("%s:%s" % (url.username, url.password))
+    conn = httplib.HTTPConnection(url.hostname, url.port)
+    conn.request('POST', '/', body, {"Authorization": "Basic " + auth})
+    response = conn.getresponse()
+    response.read()
+    return response.status
+
+
+class RPCQueuesTest(BitcoinTestFramework):
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(3, self.options.tmpdir, [
+            [],
+            ["-rpcwalletthreads=0", "-rpcminingthreads=0", "-rpcclientmaxinflight=-5"],
+            ["-rpcclientmaxinflight=1"]])
+        self.is_network_split = False
+
+    def queues(self, node):
+        return dict((q["name"], q) for q in node.getrpcinfo()["queues"])
+
+    def wait_processed(self, node, name, count):
+        # A queue counts a request once its worker is done with it, which may
+        # be just after the reply went out
+        for i in range(50):
+            if self.queues(node)[name]["processed"] >= count:
+                return
+            time.sleep(0.1)
+        assert False, "%s queue did not serve %d requests" % (name, count)
+
+    def run_test(self):
+        node = self.nodes[0]
+
+        print "Each kind of call has its own queue"
+        queues = self.queues(node)
+        assert_equal(sorted(queues.keys()), ["default", "mining", "wallet"])
+        assert_equal(queues["wallet"]["threads"], 2)
+        assert_equal(queues["mining"]["threads"], 2)
+        assert_equal(queues["wallet"]["processed"], 0)
+        assert_equal(queues["mining"]["processed"], 0)
+
+        for i in range(3):
+            node.getbalance()
+        node.getmininginfo()
+        node.getblockcount()
+        self.wait_processed(node, "wallet", 3)
+        self.wait_processed(node, "mining", 1)
+        queues = self.queues(node)
+        assert_equal(queues["wallet"]["processed"], 3)
+        assert_equal(queues["mining"]["processed"], 1)
+        assert_equal(queues["wallet"]["rejected"], 0)
+        assert queues["wallet"]["maxrunms"] >= queues["wallet"]["avgrunms"]
+
+        print "A batch goes to the wallet queue only if all its calls do"
+        node._batch([{"method": "getbalance", "params": [], "id": 0},
+                     {"method": "listunspent", "params": [], "id": 1}])
+        self.wait_processed(node, "wallet", 4)
+        node._batch([{"method": "getbalance", "params": [], "id": 0},
+                     {"method": "getblockcount", "params": [], "id": 1}])
+        time.sleep(0.5)
+        assert_equal(self.queues(node)["wallet"]["processed"], 4)
+
+        print "Queues without threads leave their calls to the default queue"
+        queues = self.queues(self.nodes[1])
+        assert_equal(queues.keys(), ["default"])
+        assert_equal(self.nodes[1].getbalance(), self.nodes[1].getbalance())
+
+        print "getrpcinfo reports the limit in effect"
+        assert_equal(self.nodes[1].getrpcinfo()["clientmaxinflight"], 0)
+
+        print "Requests in flight are counted per client and given back"
+        node = self.nodes[2]
+        for i in range(20):
+            node.getblockcount()
+        info = node.getrpcinfo()
+        assert_equal(info["clientmaxinflight"], 1)
+        assert_equal(info["clientrejected"], 0)
+        assert_equal(info["clients"], 1)
+
+        print "Requests over the limit are turned away with 429"
+        # getblocktemplate needs a peer, which also ends the long poll with a new block
+        connect_nodes(node, 0)
+        thr = LongpollThread(node)
+        thr.start()
+        body = '{"method": "getblockcount", "params": [], "id": 0}'
+        for i in range(50):
+            status = post_status(node, body)
+            if status == 429:
+                break
+            time.sleep(0.1)
+        assert_equal(status, 429)
+        self.nodes[0].generate(1)
+        thr.join(10)
+        assert not thr.is_alive()
+        sync_blocks([self.nodes[0], node])
+        assert_equal(post_status(node, body), 200)
+        info = node.getrpcinfo()
+        assert info["clientrejected"] >= 1
+        assert_equal(info["clients"], 1)
+
+if __name__ == '__main__':
+    RPCQueuesTest().main()
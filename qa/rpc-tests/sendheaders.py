@@ -0,0 +1,166 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The Zen Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test block announcements with headers (BIP 130).
+#
+# A mininode peer connected to node0 first gets new blocks announced with an
+# inv. Once it sent sendheaders and node0 knows a header it has, it gets them
+# as headers. A header announced by the peer for a block that extends the tip
+# is fetched right away. Node1 mines that block without being connected.
+#
+
+from test_framework.mininode import CBlock, CBlockHeader, CBlockLocator, NodeConn, \
+    NodeConnCB, NetworkThread, msg_block, msg_getheaders, msg_headers, msg_ping, \
+    msg_pong, msg_sendheaders, mininode_lock, FromHex
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, initialize_chain_clean, \
+    start_nodes, p2p_port
+
+import time
+
+
+class TestNode(NodeConnCB):
+    def __init__(self):
+        NodeConnCB.__init__(self)
+        self.create_callback_map()
+        self.connection = None
+        self.ping_counter = 1
+        self.last_pong = msg_pong()
+        self.block_invs = []
+        self.block_headers = []
+        self.getdata_blocks = []
+
+    def add_connection(self, conn):
+        self.connection = conn
+
+    def wait_for_verack(self):
+        while True:
+            with mininode_lock:
+                if self.verack_received:
+                    return
+            time.sleep(0.05)
+
+    def send_message(self, message):
+        self.connection.send_message(message)
+
+    # Record announcements instead of asking for them
+    def on_inv(self, conn, message):
+        for inv in message.inv:
+            if inv.type == 2:
+                self.block_invs.append(inv.hash)
+
+    def on_headers(self, conn, message):
+        for header in message.headers:
+            header.calc_sha256()
+            self.block_headers.append(header.sha256)
+
+    def on_getdata(self, conn, message):
+        for inv in message.inv:
+            if inv.type == 2:
+                self.getdata_blocks.append(inv.hash)
+
+    def on_pong(self, conn, message):
+        self.last_pong = message
+
+    def sync_with_ping(self, timeout=30):
+        self.connection.send_message(msg_ping(nonce=self.ping_counter))
+        received_pong = False
+        sleep_time = 0.05
+        while not received_pong and timeout > 0:
+            time.sleep(sleep_time)
+            timeout -= sleep_time
+            with mininode_lock:
+                if self.last_pong.nonce == self.ping_counter:
+                    received_pong = True
+        self.ping_counter += 1
+        return received_pong
+
+    def wait_for(self, predicate, timeout=30):
+        while timeout > 0:
+            with mininode_lock:
+                if predicate():
+                    return True
+            time.sleep(0.05)
+            timeout -= 0.05
+        return False
+
+    def clear(self):
+        with mininode_lock:
+            self.block_invs = []
+            self.block_headers = []
+            self.getdata_blocks = []
+
+
+class SendHeadersTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory " + self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(2, self.options.tmpdir, [["-debug=net"], []])
+        self.is_network_split = False
+
+    def copy_blocks(self, blockhashes):
+        # Node1 follows node0 without a connection to it
+        for blockhash in blockhashes:
+            self.nodes[1].submitblock(self.nodes[0].getblock(blockhash, False))
+        assert_equal(self.nodes[1].getbestblockhash(), blockhashes[-1])
+
+    def run_test(self):
+        node = self.nodes[0]
+        test_node = TestNode()
+        conn = NodeConn('127.0.0.1', p2p_port(0), node, test_node)
+        test_node.add_connection(conn)
+        NetworkThread().start()
+        test_node.wait_for_verack()
+
+        self.copy_blocks(node.generate(10))
+        assert test_node.sync_with_ping()
+        test_node.clear()
+
+        print "Without sendheaders, new blocks are announced with an inv"
+        blockhash = node.generate(1)[0]
+        assert test_node.wait_for(lambda: int(blockhash, 16) in test_node.block_invs)
+        assert_equal(test_node.block_headers, [])
+        self.copy_blocks([blockhash])
+
+        print "With sendheaders, blocks that connect to a known header come as headers"
+        test_node.send_message(msg_sendheaders())
+        # Ask for the tip, so that node0 knows we have its header
+        getheaders = msg_getheaders()
+        getheaders.locator = CBlockLocator()
+        getheaders.locator.vHave = [int(node.getblockhash(node.getblockcount() - 1), 16)]
+        test_node.send_message(getheaders)
+        assert test_node.wait_for(lambda: int(blockhash, 16) in test_node.block_headers)
+        test_node.clear()
+
+        blockhashes = node.generate(3)
+        assert test_node.wait_for(lambda: len(test_node.block_headers) >= 3)
+        assert_equal(test_node.block_headers, [int(h, 16) for h in blockhashes])
+        assert test_node.sync_with_ping()
+        assert_equal(test_node.block_invs, [])
+        self.copy_blocks(blockhashes)
+
+        print "A header announcement extending the tip is fetched directly"
+        blockhash = self.nodes[1].generate(1)[0]
+        header = FromHex(CBlockHeader(), self.nodes[1].getblockheader(blockhash, False))
+        headers = msg_headers()
+        headers.headers = [header]
+        test_node.send_message(headers)
+        assert test_node.wait_for(lambda: int(blockhash, 16) in test_node.getdata_blocks)
+        test_node.send_message(msg_block(FromHex(CBlock(), self.nodes[1].getblock(blockhash, False))))
+        assert test_node.sync_with_ping()
+        assert_equal(node.getbestblockhash(), blockhash)
+        # It isn't announced back to the peer that announced it
+        assert test_node.sync_with_ping()
+        assert_equal(test_node.block_invs, [])
+        assert int(blockhash, 16) not in test_node.block_headers
+
+        conn.disconnect_node()
+
+if __name__ == '__main__':
+    SendHeadersTest().main()
@@ -0,0 +1,89 @@
+#!/usr/bin/env python2
+# Copyright (c) 2014-2017 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the spent index (-spentindex) and timestamp index (-timestampindex).
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.authproxy import JSONRPCException
+from test_framework.util import assert_equal, start_nodes, connect_nodes_bi, \
+    initialize_chain_clean
+
+from decimal import Decimal
+
+
+class SpentIndexTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory " + self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(2, self.options.tmpdir, [["-spentindex", "-timestampindex"], []])
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def run_test(self):
+        self.nodes[0].generate(101)
+        self.sync_all()
+
+        print "Spent outputs are indexed"
+        address = self.nodes[1].getnewaddress()
+        txid = self.nodes[0].sendtoaddress(address, Decimal("10"))
+        self.nodes[0].generate(1)
+        self.sync_all()
+        spend = self.nodes[1].sendtoaddress(self.nodes[0].getnewaddress(), Decimal("4"))
+        self.sync_all()
+        self.nodes[0].generate(1)
+        self.sync_all()
+        height = self.nodes[0].getblockcount()
+
+        tx = self.nodes[0].getrawtransaction(txid, 1)
+        n = [out["n"] for out in tx["vout"] if address in out["scriptPubKey"].get("addresses", [])][0]
+        info = self.nodes[0].getspentinfo({"txid": txid, "index": n})
+        assert_equal(info["txid"], spend)
+        assert_equal(info["height"], height)
+        assert_equal(tx["vout"][n]["spentTxId"], spend)
+        assert_equal(tx["vout"][n]["spentIndex"], info["index"])
+        assert_equal(tx["vout"][n]["spentHeight"], height)
+
+        print "Inputs carry the value and address of the spent output"
+        spendtx = self.nodes[0].getrawtransaction(spend, 1)
+        vin = spendtx["vin"][info["index"]]
+        assert_equal(vin["address"], address)
+        assert_equal(vin["value"], Decimal("10"))
+        assert_equal(vin["valueZat"], 1000000000)
+
+        print "Unspent outputs have no spent info"
+        try:
+            self.nodes[0].getspentinfo({"txid": spend, "index": 0})
+            assert False, "getspentinfo of an unspent output"
+        except JSONRPCException as e:
+            assert "Unable to get spent info" in e.error["message"]
+        try:
+            self.nodes[1].getspentinfo({"txid": txid, "index": n})
+            assert False, "getspentinfo without -spentindex"
+        except JSONRPCException as e:
+            assert "Unable to get spent info" in e.error["message"]
+
+        print "Blocks are indexed by time"
+        first = self.nodes[0].getblock(self.nodes[0].getblockhash(1))
+        last = self.nodes[0].getblock(self.nodes[0].getblockhash(height))
+        hashes = self.nodes[0].getblockhashes(last["time"] + 1, first["time"])
+        assert_equal(len(hashes), height)
+        assert last["hash"] in hashes
+        assert first["hash"] in hashes
+        assert_equal(self.nodes[0].getblockhashes(first["time"], first["time"]), [])
+        try:
+            self.nodes[1].getblockhashes(last["time"] + 1, first["time"])
+            assert False, "getblockhashes without -timestampindex"
+        except JSONRPCException as e:
+            assert "No information available" in e.error["message"]
+
+
+if __name__ == '__main__':
+    SpentIndexTest().main()
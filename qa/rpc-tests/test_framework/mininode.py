@@ -1159,6 +1159,40 @@ class msg_mempool(object):
         return "msg_mempool()"
 
 
+class msg_sendheaders(object):
+    command = "sendheaders"
+
+    def __init__(self):
+        pass
+
+    def deserialize(self, f):
+        pass
+
+    def serialize(self):
+        return ""
+
+    def __repr__(self):
+        return "msg_sendheaders()"
+
+
+class msg_feefilter(object):
+    command = "feefilter"
+
+    def __init__(self, feerate=0):
+        self.feerate = feerate
+
+    def deserialize(self, f):
+        self.feerate = struct.unpack("<q", f.read(8))[0]
+
+    def serialize(self):
+        r = ""
+        r += struct.pack("<q", self.feerate)
+        return r
+
+    def __repr__(self):
+        return "msg_feefilter(feerate=%08x)" % self.feerate
+
+
 # getheaders message has
 # number of entries
 # vector of hashes
@@ -1262,7 +1296,9 @@ class NodeConnCB(object):
             "headers": self.on_headers,
             "getheaders": self.on_getheaders,
             "reject": self.on_reject,
-            "mempool": self.on_mempool
+            "mempool": self.on_mempool,
+            "sendheaders": self.on_sendheaders,
+            "feefilter": self.on_feefilter
         }
 
     def deliver(self, conn, message):
@@ -1307,6 +1343,8 @@ class NodeConnCB(object):
     def on_reject(self, conn, message): pass
     def on_close(self, conn): pass
     def on_mempool(self, conn): pass
+    def on_sendheaders(self, conn, message): pass
+    def on_feefilter(self, conn, message): pass
     def on_pong(self, conn, message): pass
 
 
@@ -1329,7 +1367,9 @@ class NodeConn(asyncore.dispatcher):
         "headers": msg_headers,
         "getheaders": msg_getheaders,
         "reject": msg_reject,
-        "mempool": msg_mempool
+        "mempool": msg_mempool,
+        "sendheaders": msg_sendheaders,
+        "feefilter": msg_feefilter
     }
     MAGIC_BYTES = {
         "mainnet": "\x63\x61\x73\x68",  # mainnet
@@ -0,0 +1,79 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The Zen Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the running UTXO set statistics of gettxoutsetinfo.
+#
+# They must match a full read of the set after blocks are connected and
+# disconnected, and after a restart.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, start_node, stop_node, \
+    initialize_chain_clean
+
+from decimal import Decimal
+
+
+class TxOutSetInfoTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory " + self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self, split=False):
+        self.nodes = [start_node(0, self.options.tmpdir)]
+        self.is_network_split = False
+
+    def check(self, node):
+        info = node.gettxoutsetinfo()
+        verified = node.gettxoutsetinfo(True)
+        assert verified["verified"]
+        for key in info:
+            assert_equal(info[key], verified[key])
+        return info
+
+    def run_test(self):
+        node = self.nodes[0]
+
+        print "The genesis block leaves the set empty"
+        info = self.check(node)
+        assert_equal(info["height"], 0)
+        assert_equal(info["txouts"], 0)
+
+        print "Connecting blocks"
+        node.generate(101)
+        info = self.check(node)
+        assert_equal(info["height"], 101)
+        assert_equal(info["transactions"], 101)
+
+        print "Spending outputs"
+        address = node.getnewaddress()
+        for i in range(3):
+            node.sendtoaddress(address, Decimal("1.5"))
+        node.generate(1)
+        before = self.check(node)
+        assert before["txouts"] > info["txouts"]
+
+        node.sendtoaddress(address, Decimal("2"))
+        node.generate(1)
+        after = self.check(node)
+        assert after["muhash"] != before["muhash"]
+
+        print "Disconnecting blocks"
+        tip = node.getbestblockhash()
+        node.invalidateblock(tip)
+        assert_equal(self.check(node)["muhash"], before["muhash"])
+        node.reconsiderblock(tip)
+        assert_equal(self.check(node), after)
+
+        print "The statistics are kept across a restart"
+        stop_node(node, 0)
+        self.nodes[0] = node = start_node(0, self.options.tmpdir)
+        assert_equal(node.gettxoutsetinfo(), after)
+        assert node.gettxoutsetinfo(True)["verified"]
+
+if __name__ == '__main__':
+    TxOutSetInfoTest().main()
@@ -65,7 +65,7 @@ class ZapWalletTXesTest (BitcoinTestFramework):
         bitcoind_processes[0].wait()
 
         # restart zcashd with zapwallettxes
-        self.nodes[0] = start_node(0,self.options.tmpdir, ["-zapwallettxes=1"])
+        self.nodes[0] = start_node(0,self.options.tmpdir, ["-zapwallettxes=1", "-persistmempool=0"])
 
         aException = False
         try:
@@ -0,0 +1,30 @@
+// Copyright (c) 2018 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+
+#include "script/standard.h"
+
+bool GetAddressIndexKey(const CScript& script, int& type, uint160& hashBytes)
+{
+    txnouttype whichType;
+    std::vector<std::vector<unsigned char> > vSolutions;
+    if (!Solver(script, whichType, vSolutions))
+        return false;
+
+    switch (whichType) {
+    case TX_PUBKEYHASH:
+    case TX_PUBKEYHASH_REPLAY:
+        type = ADDRESS_INDEX_P2PKH;
+        break;
+    case TX_SCRIPTHASH:
+    case TX_SCRIPTHASH_REPLAY:
+        type = ADDRESS_INDEX_P2SH;
+        break;
+    default:
+        return false;
+    }
+    hashBytes = uint160(vSolutions[0]);
+    return true;
+}
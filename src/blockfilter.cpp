@@ -0,0 +1,335 @@
+// Copyright (c) 2018 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "crypto/common.h"
+#include "hash.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "streams.h"
+#include "version.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#include <boost/foreach.hpp>
+
+namespace {
+
+//! Parameters of the zen filter, those of the BIP158 basic filter
+const uint8_t ZEN_FILTER_P = 19;
+const uint32_t ZEN_FILTER_M = 784931;
+
+/** Appends bits to a byte vector, most significant bit first */
+class BitWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+    unsigned char nBuffer;
+    int nBits;
+
+public:
+    BitWriter(std::vector<unsigned char>& vchIn) : vch(vchIn), nBuffer(0), nBits(0) {}
+
+    /** Write the nCount lowest bits of nData */
+    void Write(uint64_t nData, int nCount)
+    {
+        while (nCount > 0) {
+            int nChunk = std::min(8 - nBits, nCount);
+            unsigned char chunk = (nData >> (nCount - nChunk)) & ((1 << nChunk) - 1);
+            nBuffer |= chunk << (8 - nBits - nChunk);
+            nBits += nChunk;
+            nCount -= nChunk;
+            if (nBits == 8) {
+                vch.push_back(nBuffer);
+                nBuffer = 0;
+                nBits = 0;
+            }
+        }
+    }
+
+    /** Pad the last byte with zeros */
+    void Flush()
+    {
+        if (nBits > 0)
+            vch.push_back(nBuffer);
+        nBuffer = 0;
+        nBits = 0;
+    }
+};
+
+/** Reads bits written by BitWriter from a range of bytes */
+class BitReader
+{
+private:
+    std::vector<unsigned char>::const_iterator it;
+    std::vector<unsigned char>::const_iterator end;
+    int nBits;  //!< bits of *it already read
+
+public:
+    BitReader(std::vector<unsigned char>::const_iterator itIn, std::vector<unsigned char>::const_iterator endIn) :
+        it(itIn), end(endIn), nBits(0) {}
+
+    uint64_t Read(int nCount)
+    {
+        uint64_t nData = 0;
+        while (nCount > 0) {
+            if (it == end)
+                throw std::ios_base::failure("BitReader::Read(): end of data");
+            int nChunk = std::min(8 - nBits, nCount);
+            nData = (nData << nChunk) | ((*it >> (8 - nBits - nChunk)) & ((1 << nChunk) - 1));
+            nBits += nChunk;
+            nCount -= nChunk;
+            if (nBits == 8) {
+                ++it;
+                nBits = 0;
+            }
+        }
+        return nData;
+    }
+};
+
+void GolombRiceEncode(BitWriter& writer, uint8_t nP, uint64_t x)
+{
+    // The quotient is written in unary, then the remainder in P bits
+    uint64_t q = x >> nP;
+    while (q > 0) {
+        int nOnes = std::min(q, (uint64_t)64);
+        writer.Write(~(uint64_t)0, nOnes);
+        q -= nOnes;
+    }
+    writer.Write(0, 1);
+    writer.Write(x, nP);
+}
+
+uint64_t GolombRiceDecode(BitReader& reader, uint8_t nP)
+{
+    uint64_t q = 0;
+    while (reader.Read(1) == 1)
+        q++;
+    return (q << nP) + reader.Read(nP);
+}
+
+/** (x * n) >> 64, a fair map of x into [0, n), without 128-bit integers */
+uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+    uint64_t x_hi = x >> 32, x_lo = x & 0xffffffff;
+    uint64_t n_hi = n >> 32, n_lo = n & 0xffffffff;
+
+    uint64_t ac = x_hi * n_hi;
+    uint64_t ad = x_hi * n_lo;
+    uint64_t bc = x_lo * n_hi;
+    uint64_t bd = x_lo * n_lo;
+
+    uint64_t mid34 = (bd >> 32) + (bc & 0xffffffff) + (ad & 0xffffffff);
+    return ac + (bc >> 32) + (ad >> 32) + (mid34 >> 32);
+}
+
+/**
+ * The element of an output script. Replay protection appends the hash and
+ * height of a recent block to the script, which a light client cannot know in
+ * advance, so it is left out: the client looks for its plain script.
+ */
+GCSFilter::Element OutputScriptElement(const CScript& script)
+{
+    std::vector<CScript::const_iterator> vOpStart;
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode = OP_INVALIDOPCODE;
+    while (pc < script.end()) {
+        vOpStart.push_back(pc);
+        if (!script.GetOp(pc, opcode))
+            return GCSFilter::Element(script.begin(), script.end());
+    }
+    if (opcode == OP_CHECKBLOCKATHEIGHT && vOpStart.size() > 3)
+        return GCSFilter::Element(script.begin(), vOpStart[vOpStart.size() - 3]);
+    return GCSFilter::Element(script.begin(), script.end());
+}
+
+} // anon namespace
+
+GCSFilter::GCSFilter(const Params& paramsIn) : params(paramsIn), nN(0), nF(0)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(ss, nN);
+    vEncoded.assign(ss.begin(), ss.end());
+}
+
+GCSFilter::GCSFilter(const Params& paramsIn, const std::vector<unsigned char>& vEncodedIn) :
+    params(paramsIn), vEncoded(vEncodedIn)
+{
+    CDataStream ss(vEncoded, SER_NETWORK, PROTOCOL_VERSION);
+    uint64_t nElements = ReadCompactSize(ss);
+    if (nElements > std::numeric_limits<uint32_t>::max())
+        throw std::ios_base::failure("GCSFilter: N must be below 2^32");
+    nN = nElements;
+    nF = (uint64_t)nN * params.nM;
+
+    // Decode everything once, so that a filter which is short of data is refused up front
+    BitReader reader(vEncoded.end() - ss.size(), vEncoded.end());
+    for (uint32_t i = 0; i < nN; i++)
+        GolombRiceDecode(reader, params.nP);
+}
+
+GCSFilter::GCSFilter(const Params& paramsIn, const ElementSet& elements) : params(paramsIn)
+{
+    if (elements.size() > std::numeric_limits<uint32_t>::max())
+        throw std::invalid_argument("GCSFilter: N must be below 2^32");
+    nN = elements.size();
+    nF = (uint64_t)nN * params.nM;
+
+    std::vector<uint64_t> vHashed;
+    vHashed.reserve(nN);
+    for (ElementSet::const_iterator it = elements.begin(); it != elements.end(); ++it)
+        vHashed.push_back(HashToRange(*it));
+    std::sort(vHashed.begin(), vHashed.end());
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(ss, nN);
+    vEncoded.assign(ss.begin(), ss.end());
+
+    BitWriter writer(vEncoded);
+    uint64_t nLast = 0;
+    for (size_t i = 0; i < vHashed.size(); i++) {
+        GolombRiceEncode(writer, params.nP, vHashed[i] - nLast);
+        nLast = vHashed[i];
+    }
+    writer.Flush();
+}
+
+uint64_t GCSFilter::HashToRange(const Element& element) const
+{
+    uint64_t hash = CSipHasher(params.nSipHashK0, params.nSipHashK1)
+        .Write(element.data(), element.size())
+        .Finalize();
+    return MapIntoRange(hash, nF);
+}
+
+bool GCSFilter::MatchSorted(const std::vector<uint64_t>& vQueries) const
+{
+    BitReader reader(vEncoded.begin() + GetSizeOfCompactSize(nN), vEncoded.end());
+
+    // Walk the set and the queries together, both being sorted
+    uint64_t nValue = 0;
+    size_t nQuery = 0;
+    for (uint32_t i = 0; i < nN && nQuery < vQueries.size(); i++) {
+        nValue += GolombRiceDecode(reader, params.nP);
+        while (nQuery < vQueries.size() && vQueries[nQuery] < nValue)
+            nQuery++;
+        if (nQuery < vQueries.size() && vQueries[nQuery] == nValue)
+            return true;
+    }
+    return false;
+}
+
+bool GCSFilter::Match(const Element& element) const
+{
+    if (nN == 0)
+        return false;
+    return MatchSorted(std::vector<uint64_t>(1, HashToRange(element)));
+}
+
+bool GCSFilter::MatchAny(const ElementSet& elements) const
+{
+    if (nN == 0 || elements.empty())
+        return false;
+    std::vector<uint64_t> vQueries;
+    vQueries.reserve(elements.size());
+    for (ElementSet::const_iterator it = elements.begin(); it != elements.end(); ++it)
+        vQueries.push_back(HashToRange(*it));
+    std::sort(vQueries.begin(), vQueries.end());
+    return MatchSorted(vQueries);
+}
+
+std::string BlockFilterTypeName(BlockFilterType filterType)
+{
+    switch (filterType) {
+    case BLOCK_FILTER_ZEN:
+        return "zen";
+    }
+    return "";
+}
+
+bool BlockFilterTypeByName(const std::string& strName, BlockFilterType& filterType)
+{
+    if (strName == "zen") {
+        filterType = BLOCK_FILTER_ZEN;
+        return true;
+    }
+    return false;
+}
+
+GCSFilter::ElementSet ZenFilterElements(const CBlock& block)
+{
+    GCSFilter::ElementSet elements;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH(const CTxOut& txout, tx.vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.insert(OutputScriptElement(script));
+        }
+
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                ss << txin.prevout;
+                elements.insert(GCSFilter::Element(ss.begin(), ss.end()));
+            }
+        }
+
+        BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
+            BOOST_FOREACH(const uint256& nullifier, joinsplit.nullifiers)
+                elements.insert(GCSFilter::Element(nullifier.begin(), nullifier.end()));
+            BOOST_FOREACH(const uint256& commitment, joinsplit.commitments)
+                elements.insert(GCSFilter::Element(commitment.begin(), commitment.end()));
+        }
+    }
+    return elements;
+}
+
+bool BlockFilter::BuildParams(GCSFilter::Params& params) const
+{
+    switch (filterType) {
+    case BLOCK_FILTER_ZEN:
+        // Keyed by the block, so that nobody can craft elements that collide in every filter
+        params.nSipHashK0 = ReadLE64(hashBlock.begin());
+        params.nSipHashK1 = ReadLE64(hashBlock.begin() + 8);
+        params.nP = ZEN_FILTER_P;
+        params.nM = ZEN_FILTER_M;
+        return true;
+    }
+    return false;
+}
+
+BlockFilter::BlockFilter(BlockFilterType filterTypeIn, const CBlock& block) :
+    filterType(filterTypeIn), hashBlock(block.GetHash())
+{
+    GCSFilter::Params params;
+    if (!BuildParams(params))
+        throw std::invalid_argument("unknown filter type");
+    filter = GCSFilter(params, ZenFilterElements(block));
+}
+
+BlockFilter::BlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn, const std::vector<unsigned char>& vEncoded) :
+    filterType(filterTypeIn), hashBlock(hashBlockIn)
+{
+    GCSFilter::Params params;
+    if (!BuildParams(params))
+        throw std::invalid_argument("unknown filter type");
+    filter = GCSFilter(params, vEncoded);
+}
+
+uint256 BlockFilter::GetHash() const
+{
+    const std::vector<unsigned char>& vEncoded = filter.GetEncoded();
+    return Hash(vEncoded.begin(), vEncoded.end());
+}
+
+uint256 BlockFilter::ComputeHeader(const uint256& prevHeader) const
+{
+    uint256 hashFilter = GetHash();
+    return Hash(hashFilter.begin(), hashFilter.end(), prevHeader.begin(), prevHeader.end());
+}
@@ -0,0 +1,147 @@
+// Copyright (c) 2018 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class CBlock;
+
+/**
+ * Golomb-coded set (BIP158): a compact probabilistic filter of a set of
+ * elements. Each element is hashed to a number below N * M, and the sorted
+ * differences between those numbers are Golomb-Rice coded with parameter P.
+ * Testing an element that is not in the set matches with probability 1/M.
+ */
+class GCSFilter
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+    struct Params
+    {
+        uint64_t nSipHashK0;
+        uint64_t nSipHashK1;
+        uint8_t nP;     //!< Golomb-Rice coding parameter
+        uint32_t nM;    //!< inverse false positive rate
+
+        Params(uint64_t nSipHashK0In = 0, uint64_t nSipHashK1In = 0, uint8_t nPIn = 0, uint32_t nMIn = 1) :
+            nSipHashK0(nSipHashK0In), nSipHashK1(nSipHashK1In), nP(nPIn), nM(nMIn) {}
+    };
+
+    /** An empty filter */
+    explicit GCSFilter(const Params& params = Params());
+    /** Read an encoded filter; throws std::ios_base::failure if it cannot be decoded */
+    GCSFilter(const Params& params, const std::vector<unsigned char>& vEncodedIn);
+    /** Build the filter of a set of elements */
+    GCSFilter(const Params& params, const ElementSet& elements);
+
+    uint32_t GetN() const { return nN; }
+    const Params& GetParams() const { return params; }
+    const std::vector<unsigned char>& GetEncoded() const { return vEncoded; }
+
+    /** Whether element is in the set; may give false positives */
+    bool Match(const Element& element) const;
+    /** Whether any of the elements is in the set, decoding the filter only once */
+    bool MatchAny(const ElementSet& elements) const;
+
+private:
+    Params params;
+    uint32_t nN;        //!< number of elements
+    uint64_t nF;        //!< range the elements are hashed to, N * M
+    std::vector<unsigned char> vEncoded;
+
+    uint64_t HashToRange(const Element& element) const;
+    bool MatchSorted(const std::vector<uint64_t>& vQueries) const;
+};
+
+/**
+ * Kinds of block filter; the values are those used on the wire. The zen filter
+ * is not the BIP158 basic filter (type 0), whose spent output scripts would
+ * need the undo data, so it has a number of its own outside the range BIP158
+ * assigns.
+ */
+enum BlockFilterType {
+    BLOCK_FILTER_ZEN = 0x80,
+};
+
+/** Name of a filter type, as used by the -blockfilterindex option, REST and RPC */
+std::string BlockFilterTypeName(BlockFilterType filterType);
+/** Look up a filter type by name */
+bool BlockFilterTypeByName(const std::string& strName, BlockFilterType& filterType);
+
+/**
+ * The elements of a block that a zen filter is made of: the output scripts
+ * other than empty and OP_RETURN ones, the outpoints that the inputs spend,
+ * and the nullifiers and note commitments of the joinsplits. A light client
+ * can then tell whether a block pays to or spends from its transparent
+ * addresses, or touches its shielded notes.
+ */
+GCSFilter::ElementSet ZenFilterElements(const CBlock& block);
+
+/** A GCS filter of a block, keyed and sized as its filter type requires */
+class BlockFilter
+{
+private:
+    BlockFilterType filterType;
+    uint256 hashBlock;
+    GCSFilter filter;
+
+    bool BuildParams(GCSFilter::Params& params) const;
+
+public:
+    BlockFilter() : filterType(BLOCK_FILTER_ZEN) {}
+    /** Build the filter of a block */
+    BlockFilter(BlockFilterType filterTypeIn, const CBlock& block);
+    /** Read the encoded filter of a block; throws std::ios_base::failure if it cannot be decoded */
+    BlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn, const std::vector<unsigned char>& vEncoded);
+
+    BlockFilterType GetFilterType() const { return filterType; }
+    const uint256& GetBlockHash() const { return hashBlock; }
+    const GCSFilter& GetFilter() const { return filter; }
+    const std::vector<unsigned char>& GetEncodedFilter() const { return filter.GetEncoded(); }
+
+    /** Double SHA256 of the encoded filter */
+    uint256 GetHash() const;
+    /** The filter header commits to this filter and to the header of the filter of the previous block */
+    uint256 ComputeHeader(const uint256& prevHeader) const;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 32 + ::GetSerializeSize(filter.GetEncoded(), nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ser_writedata8(s, filterType);
+        hashBlock.Serialize(s, nType, nVersion);
+        ::Serialize(s, filter.GetEncoded(), nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        std::vector<unsigned char> vEncoded;
+        uint8_t nType8 = ser_readdata8(s);
+        hashBlock.Unserialize(s, nType, nVersion);
+        ::Unserialize(s, vEncoded, nType, nVersion);
+
+        filterType = static_cast<BlockFilterType>(nType8);
+        GCSFilter::Params params;
+        if (!BuildParams(params))
+            throw std::ios_base::failure("unknown filter type");
+        filter = GCSFilter(params, vEncoded);
+    }
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
@@ -0,0 +1,305 @@
+// Copyright (c) 2018 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilterindex.h"
+
+#include "clientversion.h"
+#include "hash.h"
+#include "main.h"
+#include "streams.h"
+#include "util.h"
+
+using namespace std;
+
+static const char DB_FILTER = 'f';
+static const char DB_BEST_BLOCK = 'B';
+static const char DB_FILE_POS = 'P';
+
+CBlockFilterIndex* pblockfilterindex = NULL;
+bool fPeerBlockFilters = DEFAULT_PEERBLOCKFILTERS;
+
+CBlockFilterIndex::CBlockFilterIndex(BlockFilterType filterTypeIn, size_t nCacheSize, bool fMemory, bool fWipe) :
+    filterType(filterTypeIn), db(GetDataDir() / "blocks" / "filter" / BlockFilterTypeName(filterTypeIn), nCacheSize, fMemory, fWipe),
+    posWrite(0, 0), fileWrite(NULL), fSynced(false), fTipChanged(false)
+{
+    db.Read(DB_FILE_POS, posWrite);
+}
+
+CBlockFilterIndex::~CBlockFilterIndex()
+{
+    if (fileWrite)
+        fclose(fileWrite);
+}
+
+void CBlockFilterIndex::UpdatedBlockTip(const CBlockIndex* pindex)
+{
+    boost::unique_lock<boost::mutex> lock(mutexTip);
+    fTipChanged = true;
+    condTip.notify_one();
+}
+
+bool CBlockFilterIndex::IsSynced() const
+{
+    LOCK(cs);
+    return fSynced;
+}
+
+void CBlockFilterIndex::SetSynced(bool fSyncedIn)
+{
+    LOCK(cs);
+    if (fSyncedIn && !fSynced)
+        LogPrintf("%s: %s block filter index is synced with the active chain\n", __func__, BlockFilterTypeName(filterType));
+    fSynced = fSyncedIn;
+}
+
+bool CBlockFilterIndex::ReadEntry(const uint256& hash, CBlockFilterIndexEntry& entry) const
+{
+    return db.Read(make_pair(DB_FILTER, hash), entry);
+}
+
+bool CBlockFilterIndex::ReadFilters(const vector<pair<uint256, CBlockFilterIndexEntry> >& vEntries, vector<BlockFilter>& vFilters) const
+{
+    vFilters.resize(vEntries.size());
+    size_t i = 0;
+    while (i < vEntries.size()) {
+        // Filters of consecutive blocks are mostly in the same file, which is then opened once
+        const int nFile = vEntries[i].second.pos.nFile;
+        CAutoFile filein(OpenDiskFile(vEntries[i].second.pos, "fltr", true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: cannot open filter file %d", __func__, nFile);
+
+        for (; i < vEntries.size() && vEntries[i].second.pos.nFile == nFile; i++) {
+            const CBlockFilterIndexEntry& entry = vEntries[i].second;
+            if (fseek(filein.Get(), entry.pos.nPos, SEEK_SET))
+                return error("%s: cannot seek to %s", __func__, entry.pos.ToString());
+            vector<unsigned char> vEncoded;
+            try {
+                filein >> vEncoded;
+            } catch (const std::exception& e) {
+                return error("%s: cannot read filter at %s: %s", __func__, entry.pos.ToString(), e.what());
+            }
+            if (Hash(vEncoded.begin(), vEncoded.end()) != entry.hashFilter)
+                return error("%s: filter at %s does not match its hash", __func__, entry.pos.ToString());
+            try {
+                vFilters[i] = BlockFilter(filterType, vEntries[i].first, vEncoded);
+            } catch (const std::exception& e) {
+                return error("%s: cannot decode filter at %s: %s", __func__, entry.pos.ToString(), e.what());
+            }
+        }
+    }
+    return true;
+}
+
+bool CBlockFilterIndex::GetRange(int nStartHeight, const CBlockIndex* pindexStop, vector<const CBlockIndex*>& vIndex) const
+{
+    if (nStartHeight < 0 || nStartHeight > pindexStop->nHeight)
+        return false;
+    // The ancestry of a block never changes, so this needs no lock
+    vIndex.resize(pindexStop->nHeight - nStartHeight + 1);
+    for (const CBlockIndex* pindex = pindexStop; pindex && pindex->nHeight >= nStartHeight; pindex = pindex->pprev)
+        vIndex[pindex->nHeight - nStartHeight] = pindex;
+    return true;
+}
+
+bool CBlockFilterIndex::LookupFilter(const CBlockIndex* pindex, BlockFilter& filter) const
+{
+    vector<BlockFilter> vFilters;
+    if (!LookupFilterRange(pindex->nHeight, pindex, vFilters))
+        return false;
+    filter = vFilters[0];
+    return true;
+}
+
+bool CBlockFilterIndex::LookupFilterHeader(const CBlockIndex* pindex, uint256& header) const
+{
+    CBlockFilterIndexEntry entry;
+    if (!ReadEntry(pindex->GetBlockHash(), entry))
+        return false;
+    header = entry.header;
+    return true;
+}
+
+bool CBlockFilterIndex::LookupFilterRange(int nStartHeight, const CBlockIndex* pindexStop, vector<BlockFilter>& vFilters) const
+{
+    vector<const CBlockIndex*> vIndex;
+    if (!GetRange(nStartHeight, pindexStop, vIndex))
+        return false;
+    vector<pair<uint256, CBlockFilterIndexEntry> > vEntries(vIndex.size());
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        vEntries[i].first = vIndex[i]->GetBlockHash();
+        if (!ReadEntry(vEntries[i].first, vEntries[i].second))
+            return false;
+    }
+    return ReadFilters(vEntries, vFilters);
+}
+
+bool CBlockFilterIndex::LookupFilterHashRange(int nStartHeight, const CBlockIndex* pindexStop, vector<uint256>& vHashes) const
+{
+    vector<const CBlockIndex*> vIndex;
+    if (!GetRange(nStartHeight, pindexStop, vIndex))
+        return false;
+    vHashes.resize(vIndex.size());
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        CBlockFilterIndexEntry entry;
+        if (!ReadEntry(vIndex[i]->GetBlockHash(), entry))
+            return false;
+        vHashes[i] = entry.hashFilter;
+    }
+    return true;
+}
+
+bool CBlockFilterIndex::WriteFilter(const BlockFilter& filter, CDiskBlockPos& pos)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << filter.GetEncodedFilter();
+
+    if (posWrite.nPos > 0 && posWrite.nPos + ss.size() > MAX_FILTER_FILE_SIZE) {
+        if (fileWrite) {
+            FileCommit(fileWrite);
+            fclose(fileWrite);
+            fileWrite = NULL;
+        }
+        posWrite.nFile++;
+        posWrite.nPos = 0;
+    }
+    if (!fileWrite) {
+        // Anything past the last position written to the index is left over from a crash and overwritten
+        fileWrite = OpenDiskFile(posWrite, "fltr", false);
+        if (!fileWrite)
+            return error("%s: cannot open filter file %d", __func__, posWrite.nFile);
+    }
+    if (fwrite(&ss[0], 1, ss.size(), fileWrite) != ss.size())
+        return error("%s: cannot write to filter file %d", __func__, posWrite.nFile);
+
+    pos = posWrite;
+    posWrite.nPos += ss.size();
+    return true;
+}
+
+bool CBlockFilterIndex::IndexBlock(const CBlockIndex* pindex, const CDiskBlockPos& posBlock, map<uint256, CBlockFilterIndexEntry>& mapPending)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, posBlock) || block.GetHash() != pindex->GetBlockHash())
+        return error("%s: cannot read block %s", __func__, pindex->GetBlockHash().ToString());
+
+    uint256 prevHeader;
+    if (pindex->pprev) {
+        const uint256 hashPrev = pindex->pprev->GetBlockHash();
+        map<uint256, CBlockFilterIndexEntry>::const_iterator it = mapPending.find(hashPrev);
+        CBlockFilterIndexEntry entryPrev;
+        if (it != mapPending.end())
+            entryPrev = it->second;
+        else if (!ReadEntry(hashPrev, entryPrev))
+            return error("%s: the filter of the parent of block %s is missing", __func__, pindex->GetBlockHash().ToString());
+        prevHeader = entryPrev.header;
+    }
+
+    BlockFilter filter(filterType, block);
+    CBlockFilterIndexEntry entry;
+    entry.hashFilter = filter.GetHash();
+    entry.header = filter.ComputeHeader(prevHeader);
+    if (!WriteFilter(filter, entry.pos))
+        return false;
+    mapPending[pindex->GetBlockHash()] = entry;
+    return true;
+}
+
+bool CBlockFilterIndex::Commit(map<uint256, CBlockFilterIndexEntry>& mapPending, const CBlockIndex* pindexBest)
+{
+    if (mapPending.empty())
+        return true;
+    if (fileWrite)
+        FileCommit(fileWrite);
+
+    CLevelDBBatch batch;
+    for (map<uint256, CBlockFilterIndexEntry>::const_iterator it = mapPending.begin(); it != mapPending.end(); ++it)
+        batch.Write(make_pair(DB_FILTER, it->first), it->second);
+    batch.Write(DB_BEST_BLOCK, pindexBest->GetBlockHash());
+    batch.Write(DB_FILE_POS, posWrite);
+    if (!db.WriteBatch(batch, true))
+        return error("%s: cannot write the block filter index", __func__);
+    mapPending.clear();
+    return true;
+}
+
+void CBlockFilterIndex::ThreadSync()
+{
+    const CBlockIndex* pindexBest = NULL;
+    {
+        LOCK(cs_main);
+        uint256 hashBest;
+        if (db.Read(DB_BEST_BLOCK, hashBest)) {
+            BlockMap::const_iterator mi = mapBlockIndex.find(hashBest);
+            if (mi != mapBlockIndex.end())
+                pindexBest = mi->second;
+        }
+    }
+    LogPrintf("%s: %s block filter index starts after %s\n", __func__, BlockFilterTypeName(filterType),
+              pindexBest ? pindexBest->GetBlockHash().ToString() : "nothing");
+
+    map<uint256, CBlockFilterIndexEntry> mapPending;
+    try {
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            const CBlockIndex* pindexNext = NULL;
+            CDiskBlockPos posBlock;
+            {
+                LOCK(cs_main);
+                if (!pindexBest)
+                    pindexNext = chainActive.Genesis();
+                else if (chainActive.Contains(pindexBest))
+                    pindexNext = chainActive.Next(pindexBest);
+                else
+                    pindexNext = chainActive.Next(chainActive.FindFork(pindexBest));
+                if (pindexNext) {
+                    if (!(pindexNext->nStatus & BLOCK_HAVE_DATA)) {
+                        error("%s: block %s is not available, stopping the block filter index", __func__, pindexNext->GetBlockHash().ToString());
+                        Commit(mapPending, pindexBest);
+                        return;
+                    }
+                    posBlock = pindexNext->GetBlockPos();
+                }
+            }
+
+            if (!pindexNext) {
+                if (!Commit(mapPending, pindexBest))
+                    return;
+                SetSynced(true);
+                boost::unique_lock<boost::mutex> lock(mutexTip);
+                while (!fTipChanged)
+                    condTip.wait(lock);
+                fTipChanged = false;
+                continue;
+            }
+
+            // Blocks of a branch that was active before, or of a -reindex, are indexed already
+            if (!mapPending.count(pindexNext->GetBlockHash()) && db.Exists(make_pair(DB_FILTER, pindexNext->GetBlockHash()))) {
+                pindexBest = pindexNext;
+                continue;
+            }
+
+            if (!IndexBlock(pindexNext, posBlock, mapPending)) {
+                LogPrintf("%s: stopping the block filter index\n", __func__);
+                Commit(mapPending, pindexBest);
+                return;
+            }
+            pindexBest = pindexNext;
+            if (pindexBest->nHeight % 10000 == 0)
+                LogPrintf("%s: block filters indexed up to height %d\n", __func__, pindexBest->nHeight);
+
+            if (mapPending.size() >= FILTER_INDEX_COMMIT_INTERVAL && !Commit(mapPending, pindexBest))
+                return;
+        }
+    } catch (const boost::thread_interrupted&) {
+        Commit(mapPending, pindexBest);
+        throw;
+    }
+}
+
+void ThreadBlockFilterIndex()
+{
+    RenameThread("horizen-blockfilter");
+    pblockfilterindex->ThreadSync();
+}
@@ -0,0 +1,119 @@
+// Copyright (c) 2018 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTERINDEX_H
+#define BITCOIN_BLOCKFILTERINDEX_H
+
+#include "blockfilter.h"
+#include "chain.h"
+#include "leveldbwrapper.h"
+#include "sync.h"
+#include "uint256.h"
+#include "validationinterface.h"
+
+#include <map>
+#include <stdio.h>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** Default for -blockfilterindex */
+static const bool DEFAULT_BLOCKFILTERINDEX = false;
+/** Default for -peerblockfilters */
+static const bool DEFAULT_PEERBLOCKFILTERS = false;
+/** The maximum size of a fltr?????.dat file */
+static const unsigned int MAX_FILTER_FILE_SIZE = 0x1000000; // 16 MiB
+/** Filters built between syncs of the filter files and the index while catching up */
+static const unsigned int FILTER_INDEX_COMMIT_INTERVAL = 1000;
+
+/** Where the filter of a block is stored, with the hash and header the peers ask for */
+struct CBlockFilterIndexEntry {
+    uint256 hashFilter;
+    uint256 header;
+    CDiskBlockPos pos;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hashFilter);
+        READWRITE(header);
+        READWRITE(pos);
+    }
+};
+
+/**
+ * Block filters of the blocks of the active chain, built once and served to
+ * any number of light clients (BIP157).
+ *
+ * The filters are appended to fltr?????.dat files next to the block files, and
+ * blocks/filter/ maps each block hash to its filter, filter hash and filter
+ * header. A filter only depends on its block and a header on the block's
+ * ancestors, so entries stay valid across reorganizations and a -reindex.
+ *
+ * ThreadSync builds the filters of the blocks already in the active chain in
+ * the background, then follows the tip. Files are synced before the entries
+ * pointing into them are written, so a crash loses at most the last batch.
+ */
+class CBlockFilterIndex : public CValidationInterface
+{
+private:
+    BlockFilterType filterType;
+    CLevelDBWrapper db;
+
+    //! Next position to write a filter at, and the file open there; only used by ThreadSync
+    CDiskBlockPos posWrite;
+    FILE* fileWrite;
+
+    //! Whether ThreadSync has caught up with the active chain
+    mutable CCriticalSection cs;
+    bool fSynced;
+
+    //! Tells ThreadSync about a new tip
+    boost::mutex mutexTip;
+    boost::condition_variable condTip;
+    bool fTipChanged;
+
+    bool ReadEntry(const uint256& hash, CBlockFilterIndexEntry& entry) const;
+    bool ReadFilters(const std::vector<std::pair<uint256, CBlockFilterIndexEntry> >& vEntries, std::vector<BlockFilter>& vFilters) const;
+    /** The blocks from nStartHeight to pindexStop, in order */
+    bool GetRange(int nStartHeight, const CBlockIndex* pindexStop, std::vector<const CBlockIndex*>& vIndex) const;
+
+    bool WriteFilter(const BlockFilter& filter, CDiskBlockPos& pos);
+    bool IndexBlock(const CBlockIndex* pindex, const CDiskBlockPos& posBlock, std::map<uint256, CBlockFilterIndexEntry>& mapPending);
+    bool Commit(std::map<uint256, CBlockFilterIndexEntry>& mapPending, const CBlockIndex* pindexBest);
+    void SetSynced(bool fSyncedIn);
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex* pindex);
+
+public:
+    CBlockFilterIndex(BlockFilterType filterTypeIn, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CBlockFilterIndex();
+
+    BlockFilterType GetFilterType() const { return filterType; }
+    bool IsSynced() const;
+
+    /** The filter of a block; false if it is not indexed (yet) */
+    bool LookupFilter(const CBlockIndex* pindex, BlockFilter& filter) const;
+    bool LookupFilterHeader(const CBlockIndex* pindex, uint256& header) const;
+    /** The filters of pindexStop and its ancestors from nStartHeight on; false unless all are indexed */
+    bool LookupFilterRange(int nStartHeight, const CBlockIndex* pindexStop, std::vector<BlockFilter>& vFilters) const;
+    /** Same as LookupFilterRange, for the filter hashes */
+    bool LookupFilterHashRange(int nStartHeight, const CBlockIndex* pindexStop, std::vector<uint256>& vHashes) const;
+
+    /** Build the missing filters of the active chain, then those of new tips, until interrupted */
+    void ThreadSync();
+};
+
+/** The block filter index, if -blockfilterindex is set */
+extern CBlockFilterIndex* pblockfilterindex;
+/** Whether the filters are served to peers, -peerblockfilters */
+extern bool fPeerBlockFilters;
+
+/** Run pblockfilterindex->ThreadSync */
+void ThreadBlockFilterIndex();
+
+#endif // BITCOIN_BLOCKFILTERINDEX_H
@@ -203,6 +203,89 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
     return false;
 }
 
+bool CBloomFilter::IsRelevantAndUpdate(const CBloomTxElements& tx)
+{
+    // Must give the same answer, and update the filter the same way, as
+    // IsRelevantAndUpdate(const CTransaction&) above
+    bool fFound = false;
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    if (contains(tx.vchHash))
+        fFound = true;
+
+    for (unsigned int i = 0; i < tx.vOutputs.size(); i++)
+    {
+        const CBloomTxElements::Output& output = tx.vOutputs[i];
+        BOOST_FOREACH(const vector<unsigned char>& data, output.vData)
+        {
+            if (contains(data))
+            {
+                fFound = true;
+                if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
+                    insert(COutPoint(tx.hash, i));
+                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY && output.fPayToPubKey)
+                    insert(COutPoint(tx.hash, i));
+                break;
+            }
+        }
+    }
+
+    if (fFound)
+        return true;
+
+    BOOST_FOREACH(const vector<unsigned char>& data, tx.vInputData)
+    {
+        if (contains(data))
+            return true;
+    }
+
+    return false;
+}
+
+CBloomTxElements::CBloomTxElements(const CTransaction& tx) :
+    hash(tx.GetHash()), vchHash(hash.begin(), hash.end()), vOutputs(tx.vout.size())
+{
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CScript& scriptPubKey = tx.vout[i].scriptPubKey;
+        CScript::const_iterator pc = scriptPubKey.begin();
+        vector<unsigned char> data;
+        while (pc < scriptPubKey.end())
+        {
+            opcodetype opcode;
+            if (!scriptPubKey.GetOp(pc, opcode, data))
+                break;
+            if (data.size() != 0)
+                vOutputs[i].vData.push_back(data);
+        }
+
+        txnouttype type;
+        vector<vector<unsigned char> > vSolutions;
+        vOutputs[i].fPayToPubKey = Solver(scriptPubKey, type, vSolutions) &&
+            (type == TX_PUBKEY || type == TX_PUBKEY_REPLAY || type == TX_MULTISIG || type == TX_MULTISIG_REPLAY);
+    }
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << txin.prevout;
+        vInputData.push_back(vector<unsigned char>(stream.begin(), stream.end()));
+
+        CScript::const_iterator pc = txin.scriptSig.begin();
+        vector<unsigned char> data;
+        while (pc < txin.scriptSig.end())
+        {
+            opcodetype opcode;
+            if (!txin.scriptSig.GetOp(pc, opcode, data))
+                break;
+            if (data.size() != 0)
+                vInputData.push_back(data);
+        }
+    }
+}
+
 void CBloomFilter::UpdateEmptyFull()
 {
     bool full = true;
@@ -6,12 +6,12 @@
 #define BITCOIN_BLOOM_H
 
 #include "serialize.h"
+#include "uint256.h"
 
 #include <vector>
 
 class COutPoint;
 class CTransaction;
-class uint256;
 
 //! 20,000 items with fp rate < 0.1% or 10,000 items and <0.0001%
 static const unsigned int MAX_BLOOM_FILTER_SIZE = 36000; // bytes
@@ -30,6 +30,29 @@ enum bloomflags
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements of a transaction that CBloomFilter::IsRelevantAndUpdate
+ * looks for, extracted from its scripts once. A block served to many bloom
+ * filtering peers is then matched with filter lookups only, without parsing
+ * its scripts or serializing its outpoints again for every peer.
+ */
+class CBloomTxElements
+{
+public:
+    struct Output
+    {
+        std::vector<std::vector<unsigned char> > vData; //!< the non-empty pushes of the scriptPubKey
+        bool fPayToPubKey;                              //!< pay-to-pubkey or multisig, for BLOOM_UPDATE_P2PUBKEY_ONLY
+    };
+
+    uint256 hash;
+    std::vector<unsigned char> vchHash;
+    std::vector<Output> vOutputs;
+    std::vector<std::vector<unsigned char> > vInputData; //!< serialized prevouts and the non-empty pushes of the scriptSigs
+
+    explicit CBloomTxElements(const CTransaction& tx);
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we send them.
@@ -97,6 +120,8 @@ public:
 
     //! Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx);
+    //! Same as above, for the elements extracted from the transaction beforehand
+    bool IsRelevantAndUpdate(const CBloomTxElements& tx);
 
     //! Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
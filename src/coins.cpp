@@ -6,6 +6,7 @@
 
 #include "memusage.h"
 #include "random.h"
+#include "streams.h"
 #include "version.h"
 #include "policy/fees.h"
 
@@ -487,3 +488,52 @@ CCoinsModifier::~CCoinsModifier()
         cache.cachedCoinsUsage += it->second.coins.DynamicMemoryUsage();
     }
 }
+
+namespace {
+
+/** The MuHash element of an unspent output */
+CDataStream TxOutElement(const uint256& txid, uint32_t n, const CTxOut& out, int nHeight, bool fCoinBase)
+{
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    ss << txid << n << (uint32_t)(nHeight * 2 + (fCoinBase ? 1 : 0)) << out;
+    return ss;
+}
+
+int64_t TxOutBogoSize(const CTxOut& out)
+{
+    // txid, index, height and coinbase flag, amount, script length
+    return 32 + 4 + 4 + 8 + 2 + out.scriptPubKey.size();
+}
+
+} // anon namespace
+
+void CCoinsRunningStats::AddOutput(const uint256& txid, uint32_t n, const CTxOut& out, int nHeight, bool fCoinBase)
+{
+    if (out.scriptPubKey.IsUnspendable())
+        return;
+    CDataStream ss = TxOutElement(txid, n, out, nHeight, fCoinBase);
+    muhash.Insert((const unsigned char*)&ss[0], ss.size());
+    nTransactionOutputs++;
+    nBogoSize += TxOutBogoSize(out);
+    nTotalAmount += out.nValue;
+}
+
+void CCoinsRunningStats::RemoveOutput(const uint256& txid, uint32_t n, const CTxOut& out, int nHeight, bool fCoinBase)
+{
+    if (out.scriptPubKey.IsUnspendable())
+        return;
+    CDataStream ss = TxOutElement(txid, n, out, nHeight, fCoinBase);
+    muhash.Remove((const unsigned char*)&ss[0], ss.size());
+    nTransactionOutputs--;
+    nBogoSize -= TxOutBogoSize(out);
+    nTotalAmount -= out.nValue;
+}
+
+void CCoinsRunningStats::Apply(const CCoinsRunningStats& delta)
+{
+    nTransactions += delta.nTransactions;
+    nTransactionOutputs += delta.nTransactionOutputs;
+    nBogoSize += delta.nBogoSize;
+    nTotalAmount += delta.nTotalAmount;
+    muhash *= delta.muhash;
+}
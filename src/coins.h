@@ -7,6 +7,7 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "crypto/muhash.h"
 #include "core_memusage.h"
 #include "memusage.h"
 #include "serialize.h"
@@ -334,8 +335,54 @@ struct CCoinsStats
     uint64_t nSerializedSize;
     uint256 hashSerialized;
     CAmount nTotalAmount;
+    uint64_t nBogoSize;
+    MuHash3072 muhash;
 
-    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0), nBogoSize(0) {}
+};
+
+/**
+ * Statistics of the UTXO set kept up to date as blocks are connected and
+ * disconnected, so that they can be had without reading the whole set.
+ * The MuHash commits to the set of unspent outputs in any order, so it can
+ * be updated one output at a time and still match a full scan.
+ *
+ * The same class holds the changes made by one block, starting from zeroes
+ * and an empty MuHash, to be added with Apply once the block is accepted.
+ */
+class CCoinsRunningStats
+{
+public:
+    //! Best block of the chain state these statistics are of
+    uint256 hashBlock;
+    //! Transactions with unspent outputs
+    int64_t nTransactions;
+    int64_t nTransactionOutputs;
+    //! Rough serialized size of the outputs: 50 bytes plus the script for each
+    int64_t nBogoSize;
+    CAmount nTotalAmount;
+    MuHash3072 muhash;
+
+    CCoinsRunningStats() : nTransactions(0), nTransactionOutputs(0), nBogoSize(0), nTotalAmount(0) {}
+
+    /** Count an output added to the set. Outputs that can never be spent are not part of it. */
+    void AddOutput(const uint256& txid, uint32_t n, const CTxOut& out, int nHeight, bool fCoinBase);
+    /** Count an output leaving the set */
+    void RemoveOutput(const uint256& txid, uint32_t n, const CTxOut& out, int nHeight, bool fCoinBase);
+    /** Add the changes collected in delta */
+    void Apply(const CCoinsRunningStats& delta);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hashBlock);
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nBogoSize);
+        READWRITE(nTotalAmount);
+        READWRITE(muhash);
+    }
 };
 
 
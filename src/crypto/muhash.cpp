@@ -0,0 +1,161 @@
+// Copyright (c) 2018 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "crypto/sha512.h"
+#include "uint256.h"
+
+#include <string.h>
+
+namespace {
+
+/** 2^3072 - MAX_PRIME_DIFF is the largest prime below 2^3072 */
+const uint32_t MAX_PRIME_DIFF = 1103717;
+
+} // anon namespace
+
+Num3072::Num3072(const unsigned char (&data)[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; i++)
+        limbs[i] = ReadLE32(data + 4 * i);
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; i++)
+        limbs[i] = 0;
+}
+
+uint64_t Num3072::AddSmall(uint64_t v)
+{
+    uint64_t carry = v;
+    for (int i = 0; i < LIMBS && carry; i++) {
+        uint64_t t = (uint64_t)limbs[i] + (carry & 0xffffffff);
+        limbs[i] = (uint32_t)t;
+        carry = (carry >> 32) + (t >> 32);
+    }
+    return carry;
+}
+
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] < (uint32_t)(0 - MAX_PRIME_DIFF))
+        return false;
+    for (int i = 1; i < LIMBS; i++)
+        if (limbs[i] != 0xffffffff)
+            return false;
+    return true;
+}
+
+void Num3072::FullReduce()
+{
+    // Subtracting the prime is adding MAX_PRIME_DIFF and dropping 2^3072
+    if (IsOverflow())
+        AddSmall(MAX_PRIME_DIFF);
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    uint32_t prod[2 * LIMBS];
+    memset(prod, 0, sizeof(prod));
+    for (int i = 0; i < LIMBS; i++) {
+        uint64_t carry = 0;
+        for (int j = 0; j < LIMBS; j++) {
+            uint64_t t = (uint64_t)limbs[i] * a.limbs[j] + prod[i + j] + carry;
+            prod[i + j] = (uint32_t)t;
+            carry = t >> 32;
+        }
+        prod[i + LIMBS] = (uint32_t)carry;
+    }
+
+    // 2^3072 is MAX_PRIME_DIFF modulo the prime, so the upper half folds into the lower half
+    uint64_t carry = 0;
+    for (int i = 0; i < LIMBS; i++) {
+        uint64_t t = (uint64_t)prod[LIMBS + i] * MAX_PRIME_DIFF + prod[i] + carry;
+        limbs[i] = (uint32_t)t;
+        carry = t >> 32;
+    }
+    // Fold what is still above 2^3072 the same way
+    while (carry)
+        carry = AddSmall(carry * MAX_PRIME_DIFF);
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // Fermat: the inverse is this to the power of prime - 2, taken 4 bits at a time
+    Num3072 table[16];
+    table[1] = *this;
+    for (int i = 2; i < 16; i++) {
+        table[i] = table[i - 1];
+        table[i].Multiply(*this);
+    }
+
+    Num3072 r;
+    for (int i = LIMBS - 1; i >= 0; i--) {
+        uint32_t e = (i == 0) ? (uint32_t)(0 - MAX_PRIME_DIFF - 2) : 0xffffffff;
+        for (int shift = 28; shift >= 0; shift -= 4) {
+            for (int k = 0; k < 4; k++)
+                r.Multiply(r);
+            uint32_t nibble = (e >> shift) & 0xf;
+            if (nibble)
+                r.Multiply(table[nibble]);
+        }
+    }
+    return r;
+}
+
+void Num3072::Divide(const Num3072& a)
+{
+    Multiply(a.GetInverse());
+}
+
+void Num3072::ToBytes(unsigned char (&out)[BYTE_SIZE]) const
+{
+    Num3072 reduced = *this;
+    reduced.FullReduce();
+    for (int i = 0; i < LIMBS; i++)
+        WriteLE32(out + 4 * i, reduced.limbs[i]);
+}
+
+Num3072 MuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    unsigned char seed[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(data, len).Finalize(seed);
+    unsigned char bytes[Num3072::BYTE_SIZE];
+    for (unsigned char i = 0; i < Num3072::BYTE_SIZE / CSHA512::OUTPUT_SIZE; i++)
+        CSHA512().Write(seed, sizeof(seed)).Write(&i, 1).Finalize(bytes + i * CSHA512::OUTPUT_SIZE);
+    return Num3072(bytes);
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& other)
+{
+    numerator.Multiply(other.numerator);
+    denominator.Multiply(other.denominator);
+    return *this;
+}
+
+void MuHash3072::Finalize(uint256& out) const
+{
+    Num3072 result = numerator;
+    result.Divide(denominator);
+    unsigned char bytes[Num3072::BYTE_SIZE];
+    result.ToBytes(bytes);
+    CSHA256().Write(bytes, sizeof(bytes)).Finalize(out.begin());
+}
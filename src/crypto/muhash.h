@@ -0,0 +1,102 @@
+// Copyright (c) 2018 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+class uint256;
+
+/** A number modulo the prime 2^3072 - 1103717, in 32-bit limbs, least significant first. */
+class Num3072
+{
+public:
+    static const size_t BYTE_SIZE = 384;
+    static const int LIMBS = 96;
+
+    /** Start out as 1 */
+    Num3072() { SetToOne(); }
+    /** Read a little endian number */
+    explicit Num3072(const unsigned char (&data)[BYTE_SIZE]);
+
+    void SetToOne();
+    void Multiply(const Num3072& a);
+    /** Multiply by the inverse of a */
+    void Divide(const Num3072& a);
+    /** Write the number, reduced to below the prime, little endian */
+    void ToBytes(unsigned char (&out)[BYTE_SIZE]) const;
+
+private:
+    uint32_t limbs[LIMBS];
+
+    /** Add v, returning what carries out of the top limb */
+    uint64_t AddSmall(uint64_t v);
+    bool IsOverflow() const;
+    void FullReduce();
+    Num3072 GetInverse() const;
+};
+
+/**
+ * Rolling hash of a multiset, after "A New Paradigm for Collision-free
+ * Hashing: Incrementality at Reduced Cost" (Bellare and Micciancio).
+ *
+ * Each element is hashed to a number modulo a 3072-bit prime, and the set is
+ * the product of its elements. Elements can be added and removed in any order
+ * and the result only depends on what is in the set. Removals are kept as a
+ * separate denominator, so that the one costly modular inversion is only done
+ * when the hash is finalized.
+ *
+ * Elements are expanded from their SHA256 with SHA512 in counter mode.
+ */
+class MuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(const unsigned char* data, size_t len);
+
+public:
+    /** The hash of the empty set */
+    MuHash3072() {}
+
+    /** Add an element */
+    MuHash3072& Insert(const unsigned char* data, size_t len);
+    /** Remove an element. It may be added afterwards, the result is the same. */
+    MuHash3072& Remove(const unsigned char* data, size_t len);
+    /** Add the elements added to other, and remove the elements removed from it */
+    MuHash3072& operator*=(const MuHash3072& other);
+
+    /** Get the 256-bit hash of the set */
+    void Finalize(uint256& out) const;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 2 * Num3072::BYTE_SIZE;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char buf[Num3072::BYTE_SIZE];
+        numerator.ToBytes(buf);
+        s.write((const char*)buf, sizeof(buf));
+        denominator.ToBytes(buf);
+        s.write((const char*)buf, sizeof(buf));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned char buf[Num3072::BYTE_SIZE];
+        s.read((char*)buf, sizeof(buf));
+        numerator = Num3072(buf);
+        s.read((char*)buf, sizeof(buf));
+        denominator = Num3072(buf);
+    }
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
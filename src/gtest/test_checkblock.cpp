@@ -71,6 +71,46 @@ TEST(CheckBlock, BlockRejectsBadVersion) {
 }
 
 
+extern ZCJoinSplit* params;
+extern ZCJoinSplit* pzcashParams;
+extern CMutableTransaction GetValidTransaction();
+
+// Test that the JoinSplit proofs of a block are verified
+// even when its transactions are in the mempool.
+TEST(CheckBlock, BlockRejectsBadProofOfMempoolTx) {
+    SelectParams(CBaseChainParams::REGTEST);
+    pzcashParams = params;
+
+    CMutableTransaction mtx_cb;
+    mtx_cb.vin.resize(1);
+    mtx_cb.vin[0].prevout.SetNull();
+    mtx_cb.vin[0].scriptSig = CScript() << 1 << OP_0;
+    mtx_cb.vout.resize(1);
+    mtx_cb.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    mtx_cb.vout[0].nValue = 0;
+
+    // Its joinsplits carry empty proofs, which don't verify
+    CTransaction tx(GetValidTransaction());
+    ASSERT_TRUE(mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, 0, 0.00, 1)));
+
+    CBlock block;
+    block.nVersion = MIN_BLOCK_VERSION;
+    block.vtx.push_back(mtx_cb);
+    block.vtx.push_back(tx);
+
+    MockCValidationState state;
+
+    auto verifier = libzcash::ProofVerifier::Strict();
+
+    EXPECT_CALL(state, DoS(100, false, REJECT_INVALID, "bad-txns-joinsplit-verification-failed", false)).Times(1);
+    EXPECT_FALSE(CheckBlock(block, state, verifier, false, false));
+
+    std::list<CTransaction> removed;
+    mempool.remove(tx, removed);
+    pzcashParams = NULL;
+}
+
+
 extern CBlockIndex* AddToBlockIndex(const CBlockHeader& block);
 extern void CleanUpAll();
 std::vector<CBlockIndex*> vecBlocks;
@@ -139,6 +139,25 @@ TEST(Mempool, TxInputLimit) {
     EXPECT_FALSE(AcceptToMemoryPool(pool, state4, tx3, false, &missingInputs));
     EXPECT_EQ(state4.GetRejectReason(), "bad-txns-version-too-low");
 }
+
+// PreCheckTransactionForMempool runs the same checks AcceptToMemoryPool does
+// before looking at the chain, so a pre-checked rejection must match.
+TEST(Mempool, PreCheckMatchesAcceptToMemoryPool) {
+    CMutableTransaction mtx;
+    mtx.nVersion = 0;
+    mtx.vin.resize(10);
+    CTransaction tx1(mtx);
+
+    CValidationState state1;
+    EXPECT_FALSE(PreCheckTransactionForMempool(tx1, state1));
+    EXPECT_EQ(state1.GetRejectReason(), "bad-txns-version-too-low");
+
+    mapArgs["-mempooltxinputlimit"] = "9";
+    CValidationState state2;
+    EXPECT_FALSE(PreCheckTransactionForMempool(tx1, state2));
+    EXPECT_EQ(state2.GetRejectReason(), "");
+    mapArgs.erase("-mempooltxinputlimit");
+}
 //TO BE UPDATED WITH OUR TX VERSIONS
 // Valid overwinter v3 format tx gets rejected because overwinter hasn't activated yet.
 /*
@@ -10,6 +10,7 @@
 #endif
 
 #include <boost/optional.hpp>
+#include <memory>
 
 using ::testing::Return;
 
@@ -101,3 +102,40 @@ TEST(Miner, GetMinerScriptPubKey) {
     EXPECT_TRUE((bool) scriptPubKey);
     EXPECT_EQ(expectedScriptPubKey, *scriptPubKey);
 }
+
+#ifdef ENABLE_MINING
+TEST(Miner, EquihashSolvers) {
+    EXPECT_TRUE(IsKnownEquihashSolver("default"));
+    EXPECT_TRUE(IsKnownEquihashSolver("tromp"));
+    EXPECT_FALSE(IsKnownEquihashSolver("unknown"));
+
+    // The tromp solver is only built for n = 200, k = 9
+    std::unique_ptr<CEquihashSolver> solver(CreateEquihashSolver("tromp", 48, 5));
+    EXPECT_EQ("default", solver->GetName());
+
+    // The solutions the default solver finds are valid
+    bool found = false;
+    for (uint32_t nonce = 0; nonce < 16 && !found; nonce++) {
+        eh_HashState state;
+        EhInitialiseState(48, 5, state);
+        crypto_generichash_blake2b_update(&state, (const unsigned char*)&nonce, sizeof(nonce));
+
+        std::vector<unsigned char> soln;
+        found = solver->Solve(state, [&soln](std::vector<unsigned char> s) { soln = s; return true; },
+                              [](EhSolverCancelCheck pos) { return false; });
+        if (found) {
+            bool fValid;
+            EhIsValidSolution(48, 5, state, soln, fValid);
+            EXPECT_TRUE(fValid);
+        }
+    }
+    EXPECT_TRUE(found);
+
+    // Cancelling stops the solver
+    eh_HashState state;
+    EhInitialiseState(48, 5, state);
+    EXPECT_THROW(solver->Solve(state, [](std::vector<unsigned char> s) { return false; },
+                               [](EhSolverCancelCheck pos) { return true; }),
+                 EhSolverCancelledException);
+}
+#endif
@@ -7,9 +7,10 @@
 #include "primitives/block.h"
 #include "rpc/server.h"
 #include "streams.h"
+#include "undo.h"
 #include "utilstrencodings.h"
 
-extern UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false);
+extern UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false, const CBlockUndo* pblockUndo = NULL);
 
 TEST(rpc, check_blockToJSON_returns_minified_solution) {
     SelectParams(CBaseChainParams::TESTNET);
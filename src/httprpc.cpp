@@ -3,6 +3,7 @@
 #include "base58.h"
 #include "chainparams.h"
 #include "httpserver.h"
+#include "rpc/jsonstream.h"
 #include "rpc/protocol.h"
 #include "rpc/server.h"
 #include "random.h"
@@ -11,7 +12,10 @@
 #include "utilstrencodings.h"
 #include "ui_interface.h"
 
+#include <string.h>
+
 #include <boost/algorithm/string.hpp> // boost::trim
+#include <boost/bind.hpp>
 
 /** WWW-Authenticate to present with 401 Unauthorized response */
 static const char* WWW_AUTH_HEADER_DATA = "Basic realm=\"jsonrpc\"";
@@ -127,6 +131,24 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
         if (valRequest.isObject()) {
             jreq.parse(valRequest);
 
+            // Large results are written into the reply as they are produced
+            RPCStreamResult writeResult = tableRPC.executeStream(jreq.strMethod, jreq.params);
+            if (writeResult) {
+                req->WriteHeader("Content-Type", "application/json");
+                req->StartReply(HTTP_OK);
+                CJSONStreamWriter writer(boost::bind(&HTTPRequest::WriteReplyChunk, req, _1));
+                writer.BeginObject();
+                writer.Key("result");
+                writeResult(writer);
+                writer.KeyValue("error", NullUniValue);
+                writer.KeyValue("id", jreq.id);
+                writer.EndObject();
+                writer.Flush();
+                req->WriteReplyChunk("\n");
+                req->EndReply();
+                return true;
+            }
+
             UniValue result = tableRPC.execute(jreq.strMethod, jreq.params);
 
             // Send reply
@@ -134,7 +156,7 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
 
         // array of requests
         } else if (valRequest.isArray())
-            strReply = JSONRPCExecBatch(valRequest.get_array());
+            strReply = JSONRPCExecBatch(valRequest.get_array(), &HTTPDispatchWork);
         else
             throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
@@ -150,6 +172,85 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
     return true;
 }
 
+/** Work queue for the calls of one RPC category */
+static HTTPWorkQueueId RPCCategoryQueue(const std::string& strMethod)
+{
+    const CRPCCommand* pcmd = tableRPC[strMethod];
+    if (!pcmd)
+        return HTTP_QUEUE_DEFAULT;
+    if (pcmd->category == "wallet")
+        return HTTP_QUEUE_WALLET;
+    if (pcmd->category == "mining" || pcmd->category == "generating")
+        return HTTP_QUEUE_MINING;
+    return HTTP_QUEUE_DEFAULT;
+}
+
+/**
+ * Pick the work queue of a JSON-RPC request from the "method" members of the
+ * request object, or of the request objects of a batch, without parsing the
+ * body on the event thread. Strings and nested values are skipped, so that
+ * a "method" inside params does not count. A batch goes to the wallet or
+ * mining queue only if all its calls belong there; anything else, including
+ * bodies that fail to parse later, goes to the default queue.
+ */
+static HTTPWorkQueueId JSONRPCRequestQueue(HTTPRequest* req, const std::string &)
+{
+    size_t nSize;
+    const char* pBody = req->PeekBody(nSize);
+    if (!pBody)
+        return HTTP_QUEUE_DEFAULT;
+    const char* pEnd = pBody + nSize;
+
+    std::vector<char> vNesting;     // '{' and '[' that are open
+    bool fBatch = false;
+    char chLast = 0;                // last token: a structural character, '"' for a string, 'v' for a literal
+    bool fMethodKey = false;        // the last string was a "method" key of a request object
+    bool fFound = false;
+    HTTPWorkQueueId queueId = HTTP_QUEUE_DEFAULT;
+    for (const char* p = pBody; p < pEnd; p++) {
+        const char ch = *p;
+        if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n')
+            continue;
+        if (ch == '"') {
+            const char* pStart = ++p;
+            while (p < pEnd && *p != '"')
+                p += (*p == '\\') ? 2 : 1;
+            if (p >= pEnd)
+                break;
+            const bool fRequestLevel = vNesting.size() == (fBatch ? 2U : 1U) && vNesting.back() == '{';
+            if (fMethodKey && chLast == ':') {
+                HTTPWorkQueueId methodQueue = RPCCategoryQueue(std::string(pStart, p));
+                if (fFound && methodQueue != queueId)
+                    return HTTP_QUEUE_DEFAULT;
+                queueId = methodQueue;
+                fFound = true;
+                fMethodKey = false;
+            } else {
+                fMethodKey = fRequestLevel && (chLast == '{' || chLast == ',') &&
+                    p - pStart == 6 && memcmp(pStart, "method", 6) == 0;
+            }
+            chLast = '"';
+            continue;
+        }
+        if (ch == ':' || ch == ',') {
+            chLast = ch;
+            continue;
+        }
+        fMethodKey = false;
+        if (ch == '{' || ch == '[') {
+            if (vNesting.empty() && ch == '[')
+                fBatch = true;
+            vNesting.push_back(ch);
+        } else if (ch == '}' || ch == ']') {
+            if (vNesting.empty())
+                break;
+            vNesting.pop_back();
+        }
+        chLast = (ch == '{' || ch == '[' || ch == '}' || ch == ']') ? ch : 'v';
+    }
+    return queueId;
+}
+
 static bool InitRPCAuthentication()
 {
     if (mapArgs["-rpcpassword"] == "")
@@ -173,7 +274,7 @@ bool StartHTTPRPC()
     if (!InitRPCAuthentication())
         return false;
 
-    RegisterHTTPHandler("/", true, HTTPReq_JSONRPC);
+    RegisterHTTPHandler("/", true, HTTPReq_JSONRPC, JSONRPCRequestQueue);
 
     assert(EventBase());
     httpRPCTimerInterface = new HTTPRPCTimerInterface(EventBase());
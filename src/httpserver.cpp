@@ -24,6 +24,7 @@
 #include <event2/http.h>
 #include <event2/thread.h>
 #include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <event2/util.h>
 #include <event2/keyvalq_struct.h>
 
@@ -58,6 +59,22 @@ private:
     HTTPRequestHandler func;
 };
 
+/** Work item running a plain function */
+class HTTPFunctionWorkItem : public HTTPClosure
+{
+public:
+    HTTPFunctionWorkItem(const boost::function<void(void)>& func): func(func)
+    {
+    }
+    void operator()()
+    {
+        func();
+    }
+
+private:
+    boost::function<void(void)> func;
+};
+
 /** Simple work queue for distributing work over multiple threads.
  * Work items are simply callable objects.
  */
@@ -69,10 +86,18 @@ private:
     CWaitableCriticalSection cs;
     CConditionVariable cond;
     /* XXX in C++11 we can use std::unique_ptr here and avoid manual cleanup */
-    std::deque<WorkItem*> queue;
+    /** Queued items with the time they were queued */
+    std::deque<std::pair<WorkItem*, int64_t> > queue;
     bool running;
     size_t maxDepth;
     int numThreads;
+    /** Counters for GetStats */
+    uint64_t nProcessed;
+    uint64_t nRejected;
+    int64_t nWaitMicrosTotal;
+    int64_t nWaitMicrosMax;
+    int64_t nRunMicrosTotal;
+    int64_t nRunMicrosMax;
 
     /** RAII object to keep track of number of running worker threads */
     class ThreadCounter
@@ -95,7 +120,13 @@ private:
 public:
     WorkQueue(size_t maxDepth) : running(true),
                                  maxDepth(maxDepth),
-                                 numThreads(0)
+                                 numThreads(0),
+                                 nProcessed(0),
+                                 nRejected(0),
+                                 nWaitMicrosTotal(0),
+                                 nWaitMicrosMax(0),
+                                 nRunMicrosTotal(0),
+                                 nRunMicrosMax(0)
     {
     }
     /*( Precondition: worker threads have all stopped
@@ -104,18 +135,19 @@ public:
     ~WorkQueue()
     {
         while (!queue.empty()) {
-            delete queue.front();
+            delete queue.front().first;
             queue.pop_front();
         }
     }
-    /** Enqueue a work item */
-    bool Enqueue(WorkItem* item)
+    /** Enqueue a work item, leaving at least nReserve slots of the queue free */
+    bool Enqueue(WorkItem* item, size_t nReserve = 0)
     {
         boost::unique_lock<boost::mutex> lock(cs);
-        if (queue.size() >= maxDepth) {
+        if (queue.size() + nReserve >= maxDepth) {
+            nRejected++;
             return false;
         }
-        queue.push_back(item);
+        queue.push_back(std::make_pair(item, GetTimeMicros()));
         cond.notify_one();
         return true;
     }
@@ -125,17 +157,29 @@ public:
         ThreadCounter count(*this);
         while (running) {
             WorkItem* i = 0;
+            int64_t nStart;
             {
                 boost::unique_lock<boost::mutex> lock(cs);
                 while (running && queue.empty())
                     cond.wait(lock);
                 if (!running)
                     break;
-                i = queue.front();
+                i = queue.front().first;
+                nStart = GetTimeMicros();
+                int64_t nWait = nStart - queue.front().second;
                 queue.pop_front();
+                nWaitMicrosTotal += nWait;
+                nWaitMicrosMax = std::max(nWaitMicrosMax, nWait);
             }
             (*i)();
             delete i;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                int64_t nRun = GetTimeMicros() - nStart;
+                nProcessed++;
+                nRunMicrosTotal += nRun;
+                nRunMicrosMax = std::max(nRunMicrosMax, nRun);
+            }
         }
     }
     /** Interrupt and exit loops */
@@ -159,18 +203,40 @@ public:
         boost::unique_lock<boost::mutex> lock(cs);
         return queue.size();
     }
+
+    /** Return maximum depth of queue */
+    size_t MaxDepth()
+    {
+        return maxDepth;
+    }
+
+    /** Fill in the counters of stats */
+    void GetStats(HTTPWorkQueueStats& stats)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        stats.nThreads = numThreads;
+        stats.nDepth = queue.size();
+        stats.nMaxDepth = maxDepth;
+        stats.nProcessed = nProcessed;
+        stats.nRejected = nRejected;
+        stats.nWaitMicrosTotal = nWaitMicrosTotal;
+        stats.nWaitMicrosMax = nWaitMicrosMax;
+        stats.nRunMicrosTotal = nRunMicrosTotal;
+        stats.nRunMicrosMax = nRunMicrosMax;
+    }
 };
 
 struct HTTPPathHandler
 {
     HTTPPathHandler() {}
-    HTTPPathHandler(std::string prefix, bool exactMatch, HTTPRequestHandler handler):
-        prefix(prefix), exactMatch(exactMatch), handler(handler)
+    HTTPPathHandler(std::string prefix, bool exactMatch, HTTPRequestHandler handler, HTTPRequestClassifier classifier):
+        prefix(prefix), exactMatch(exactMatch), handler(handler), classifier(classifier)
     {
     }
     std::string prefix;
     bool exactMatch;
     HTTPRequestHandler handler;
+    HTTPRequestClassifier classifier;
 };
 
 /** HTTP module state */
@@ -181,8 +247,19 @@ static struct event_base* eventBase = 0;
 struct evhttp* eventHTTP = 0;
 //! List of subnets to allow RPC connections from
 static std::vector<CSubNet> rpc_allow_subnets;
-//! Work queue for handling longer requests off the event loop thread
-static WorkQueue<HTTPClosure>* workQueue = 0;
+//! Work queues for handling longer requests off the event loop thread, by HTTPWorkQueueId.
+//! A null entry sends its requests to the default queue.
+static WorkQueue<HTTPClosure>* workQueues[HTTP_QUEUE_COUNT] = {0};
+//! Names of the work queues, for logging and getrpcinfo
+static const char* const workQueueNames[HTTP_QUEUE_COUNT] = {"default", "wallet", "mining"};
+//! Worker threads of each work queue
+static int workQueueThreads[HTTP_QUEUE_COUNT] = {0};
+//! Most requests one client may have queued or running, 0 for no limit
+static int nClientMaxInFlight = DEFAULT_HTTP_CLIENT_MAX_INFLIGHT;
+//! Requests queued or running per client, and requests refused for exceeding nClientMaxInFlight
+static CCriticalSection cs_clientInFlight;
+static std::map<CNetAddr, int> mapClientInFlight;
+static uint64_t nClientRejected = 0;
 //! Handlers for (sub)paths
 std::vector<HTTPPathHandler> pathHandlers;
 //! Bound listening sockets
@@ -199,6 +276,37 @@ static bool ClientAllowed(const CNetAddr& netaddr)
     return false;
 }
 
+/** Take an in-flight slot for a request from peer, unless it has nClientMaxInFlight already */
+static bool ClientAdmit(const CNetAddr& peer)
+{
+    LOCK(cs_clientInFlight);
+    int& nInFlight = mapClientInFlight[peer];
+    if (nClientMaxInFlight > 0 && nInFlight >= nClientMaxInFlight) {
+        if (nInFlight == 0)
+            mapClientInFlight.erase(peer);
+        nClientRejected++;
+        return false;
+    }
+    nInFlight++;
+    return true;
+}
+
+/** Give back a slot taken by ClientAdmit */
+static void ClientRelease(const CNetAddr& peer)
+{
+    LOCK(cs_clientInFlight);
+    std::map<CNetAddr, int>::iterator it = mapClientInFlight.find(peer);
+    assert(it != mapClientInFlight.end());
+    if (--it->second == 0)
+        mapClientInFlight.erase(it);
+}
+
+/** Work queue serving id */
+static WorkQueue<HTTPClosure>* GetWorkQueue(HTTPWorkQueueId id)
+{
+    return workQueues[id] ? workQueues[id] : workQueues[HTTP_QUEUE_DEFAULT];
+}
+
 /** Initialize ACL list for HTTP server */
 static bool InitHTTPAllowList()
 {
@@ -285,8 +393,18 @@ static void http_request_cb(struct evhttp_request* req, void* arg)
 
     // Dispatch to worker thread
     if (i != iend) {
-        std::unique_ptr<HTTPWorkItem> item(new HTTPWorkItem(hreq.release(), path, i->handler));
+        HTTPWorkQueueId queueId = HTTP_QUEUE_DEFAULT;
+        if (!i->classifier.empty())
+            queueId = i->classifier(hreq.get(), path);
+        WorkQueue<HTTPClosure>* workQueue = GetWorkQueue(queueId);
         assert(workQueue);
+
+        if (!hreq->AdmitClient()) {
+            LogPrint("http", "Too many requests in flight from %s\n", hreq->GetPeer().ToString());
+            hreq->WriteReply(HTTP_TOO_MANY_REQUESTS, "Too many requests in flight");
+            return;
+        }
+        std::unique_ptr<HTTPWorkItem> item(new HTTPWorkItem(hreq.release(), path, i->handler));
         if (workQueue->Enqueue(item.get()))
             item.release(); /* if true, queue took ownership */
         else
@@ -296,6 +414,19 @@ static void http_request_cb(struct evhttp_request* req, void* arg)
     }
 }
 
+bool HTTPDispatchWork(const boost::function<void(void)>& func)
+{
+    WorkQueue<HTTPClosure>* workQueue = workQueues[HTTP_QUEUE_DEFAULT];
+    if (!workQueue)
+        return false;
+    std::unique_ptr<HTTPFunctionWorkItem> item(new HTTPFunctionWorkItem(func));
+    // Keep half of the queue for incoming requests
+    if (!workQueue->Enqueue(item.get(), workQueue->MaxDepth() / 2))
+        return false;
+    item.release(); /* queue took ownership */
+    return true;
+}
+
 /** Callback to reject HTTP requests after shutdown. */
 static void http_reject_request_cb(struct evhttp_request* req, void*)
 {
@@ -431,9 +562,18 @@ bool InitHTTPServer()
 
     LogPrint("http", "Initialized HTTP server\n");
     int workQueueDepth = std::max((long)GetArg("-rpcworkqueue", DEFAULT_HTTP_WORKQUEUE), 1L);
-    LogPrintf("HTTP: creating work queue of depth %d\n", workQueueDepth);
-
-    workQueue = new WorkQueue<HTTPClosure>(workQueueDepth);
+    workQueueThreads[HTTP_QUEUE_DEFAULT] = std::max((long)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS), 1L);
+    workQueueThreads[HTTP_QUEUE_WALLET] = std::max((long)GetArg("-rpcwalletthreads", DEFAULT_HTTP_WALLET_THREADS), 0L);
+    workQueueThreads[HTTP_QUEUE_MINING] = std::max((long)GetArg("-rpcminingthreads", DEFAULT_HTTP_MINING_THREADS), 0L);
+    nClientMaxInFlight = std::max((long)GetArg("-rpcclientmaxinflight", DEFAULT_HTTP_CLIENT_MAX_INFLIGHT), 0L);
+
+    // A queue without threads of its own leaves its requests to the default queue
+    for (int id = 0; id < HTTP_QUEUE_COUNT; id++) {
+        if (workQueueThreads[id] == 0)
+            continue;
+        LogPrintf("HTTP: creating %s work queue of depth %d\n", workQueueNames[id], workQueueDepth);
+        workQueues[id] = new WorkQueue<HTTPClosure>(workQueueDepth);
+    }
     eventBase = base;
     eventHTTP = http;
     return true;
@@ -444,13 +584,16 @@ boost::thread threadHTTP;
 bool StartHTTPServer()
 {
     LogPrint("http", "Starting HTTP server\n");
-    int rpcThreads = std::max((long)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS), 1L);
-    LogPrintf("HTTP: starting %d worker threads\n", rpcThreads);
     threadHTTP = boost::thread(boost::bind(&ThreadHTTP, eventBase, eventHTTP));
 
-    for (int i = 0; i < rpcThreads; i++) {
-        boost::thread rpc_worker(HTTPWorkQueueRun, workQueue);
-        rpc_worker.detach();
+    for (int id = 0; id < HTTP_QUEUE_COUNT; id++) {
+        if (!workQueues[id])
+            continue;
+        LogPrintf("HTTP: starting %d %s worker threads\n", workQueueThreads[id], workQueueNames[id]);
+        for (int i = 0; i < workQueueThreads[id]; i++) {
+            boost::thread rpc_worker(HTTPWorkQueueRun, workQueues[id]);
+            rpc_worker.detach();
+        }
     }
     return true;
 }
@@ -466,17 +609,21 @@ void InterruptHTTPServer()
         // Reject requests on current connections
         evhttp_set_gencb(eventHTTP, http_reject_request_cb, NULL);
     }
-    if (workQueue)
-        workQueue->Interrupt();
+    for (int id = 0; id < HTTP_QUEUE_COUNT; id++)
+        if (workQueues[id])
+            workQueues[id]->Interrupt();
 }
 
 void StopHTTPServer()
 {
     LogPrint("http", "Stopping HTTP server\n");
-    if (workQueue) {
-        LogPrint("http", "Waiting for HTTP worker threads to exit\n");
-        workQueue->WaitExit();
-        delete workQueue;
+    LogPrint("http", "Waiting for HTTP worker threads to exit\n");
+    for (int id = 0; id < HTTP_QUEUE_COUNT; id++) {
+        if (workQueues[id]) {
+            workQueues[id]->WaitExit();
+            delete workQueues[id];
+            workQueues[id] = 0;
+        }
     }
     if (eventBase) {
         LogPrint("http", "Waiting for HTTP event thread to exit\n");
@@ -505,6 +652,27 @@ void StopHTTPServer()
     LogPrint("http", "Stopped HTTP server\n");
 }
 
+void GetHTTPWorkQueueStats(std::vector<HTTPWorkQueueStats>& vStats)
+{
+    vStats.clear();
+    for (int id = 0; id < HTTP_QUEUE_COUNT; id++) {
+        if (!workQueues[id])
+            continue;
+        HTTPWorkQueueStats stats;
+        stats.name = workQueueNames[id];
+        workQueues[id]->GetStats(stats);
+        vStats.push_back(stats);
+    }
+}
+
+void GetHTTPClientStats(size_t& nClients, int& nMaxInFlight, uint64_t& nRejected)
+{
+    LOCK(cs_clientInFlight);
+    nClients = mapClientInFlight.size();
+    nMaxInFlight = nClientMaxInFlight;
+    nRejected = nClientRejected;
+}
+
 struct event_base* EventBase()
 {
     return eventBase;
@@ -536,7 +704,89 @@ void HTTPEvent::trigger(struct timeval* tv)
     else
         evtimer_add(ev, tv); // trigger after timeval passed
 }
+/** Bytes of a chunked reply that may wait to be written to the client before its producer waits */
+static const size_t MAX_REPLY_STREAM_BACKLOG = 1024 * 1024;
+
+/**
+ * A chunked reply, written by a worker and sent by the main http thread.
+ * The worker counts what it hands over and waits while the client is too
+ * far behind, so that a slow client doesn't get the whole reply queued up.
+ */
+struct HTTPReplyStream
+{
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    //! Bytes handed over by the worker that evhttp didn't get yet
+    size_t nPending;
+    //! Bytes in the output buffer of the connection
+    size_t nUnsent;
+    //! The connection went away
+    bool fClosed;
+
+    HTTPReplyStream() : nPending(0), nUnsent(0), fClosed(false) {}
+};
+
+static void UpdateReplyStream(HTTPReplyStream* stream, struct evhttp_connection* evcon, size_t nSent)
+{
+    struct bufferevent* bev = evhttp_connection_get_bufferevent(evcon);
+    boost::unique_lock<boost::mutex> lock(stream->mutex);
+    stream->nPending -= nSent;
+    stream->nUnsent = bev ? evbuffer_get_length(bufferevent_get_output(bev)) : 0;
+    stream->cond.notify_all();
+}
+
+static void http_reply_stream_written_cb(struct evhttp_connection* evcon, void* arg)
+{
+    UpdateReplyStream((HTTPReplyStream*)arg, evcon, 0);
+}
+
+static void http_reply_stream_closed_cb(struct evhttp_connection*, void* arg)
+{
+    HTTPReplyStream* stream = (HTTPReplyStream*)arg;
+    boost::unique_lock<boost::mutex> lock(stream->mutex);
+    stream->fClosed = true;
+    stream->cond.notify_all();
+}
+
+static void http_reply_stream_start(struct evhttp_request* req, int nStatus, boost::shared_ptr<HTTPReplyStream> stream)
+{
+    struct evhttp_connection* evcon = evhttp_request_get_connection(req);
+    if (!evcon) {
+        http_reply_stream_closed_cb(NULL, stream.get());
+        return;
+    }
+    evhttp_connection_set_closecb(evcon, http_reply_stream_closed_cb, stream.get());
+    evhttp_send_reply_start(req, nStatus, NULL);
+}
+
+static void http_reply_stream_chunk(struct evhttp_request* req, struct evbuffer* evb, boost::shared_ptr<HTTPReplyStream> stream)
+{
+    size_t nSize = evbuffer_get_length(evb);
+    struct evhttp_connection* evcon = evhttp_request_get_connection(req);
+    if (evcon) {
+        evhttp_send_reply_chunk_with_cb(req, evb, http_reply_stream_written_cb, stream.get());
+        UpdateReplyStream(stream.get(), evcon, nSize);
+    }
+    evbuffer_free(evb);
+}
+
+static void http_reply_stream_end(struct evhttp_request* req, bool fComplete, boost::shared_ptr<HTTPReplyStream> stream)
+{
+    struct evhttp_connection* evcon = evhttp_request_get_connection(req);
+    if (evcon) {
+        evhttp_connection_set_closecb(evcon, NULL, NULL);
+        if (!fComplete) {
+            // Without the last chunk the client knows the reply is cut short; this frees req too
+            evhttp_connection_free(evcon);
+            return;
+        }
+    }
+    // Without a connection this only frees req
+    evhttp_send_reply_end(req);
+}
+
 HTTPRequest::HTTPRequest(struct evhttp_request* req) : req(req),
+                                                       clientSlot(false),
                                                        replySent(false)
 {
 }
@@ -545,7 +795,10 @@ HTTPRequest::~HTTPRequest()
     if (!replySent) {
         // Keep track of whether reply was sent to avoid request leaks
         LogPrintf("%s: Unhandled request\n", __func__);
-        WriteReply(HTTP_INTERNAL, "Unhandled request");
+        if (stream)
+            EndReply(false);
+        else
+            WriteReply(HTTP_INTERNAL, "Unhandled request");
     }
     // evhttpd cleans up the request, as long as a reply was sent.
 }
@@ -561,6 +814,20 @@ std::pair<bool, std::string> HTTPRequest::GetHeader(const std::string& hdr)
         return std::make_pair(false, "");
 }
 
+const char* HTTPRequest::PeekBody(size_t& nSize)
+{
+    nSize = 0;
+    struct evbuffer* buf = evhttp_request_get_input_buffer(req);
+    if (!buf)
+        return NULL;
+    size_t size = evbuffer_get_length(buf);
+    // ReadBody makes the buffer contiguous as well, so this costs nothing extra
+    const char* data = (const char*)evbuffer_pullup(buf, size);
+    if (data)
+        nSize = size;
+    return data;
+}
+
 std::string HTTPRequest::ReadBody()
 {
     struct evbuffer* buf = evhttp_request_get_input_buffer(req);
@@ -588,6 +855,13 @@ void HTTPRequest::WriteHeader(const std::string& hdr, const std::string& value)
     evhttp_add_header(headers, hdr.c_str(), value.c_str());
 }
 
+bool HTTPRequest::AdmitClient()
+{
+    assert(!clientSlot);
+    clientSlot = ClientAdmit(GetPeer());
+    return clientSlot;
+}
+
 /** Closure sent to main thread to request a reply to be sent to
  * a HTTP request.
  * Replies must be sent in the main loop in the main http thread,
@@ -595,7 +869,8 @@ void HTTPRequest::WriteHeader(const std::string& hdr, const std::string& value)
  */
 void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
 {
-    assert(!replySent && req);
+    assert(!replySent && req && !stream);
+    ReleaseClient();
     // Send event to main http thread to send reply message
     struct evbuffer* evb = evhttp_request_get_output_buffer(req);
     assert(evb);
@@ -607,6 +882,58 @@ void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
     req = 0; // transferred back to main thread
 }
 
+/** Free the -rpcclientmaxinflight slot before the reply goes out, so that the client may send its next request right away */
+void HTTPRequest::ReleaseClient()
+{
+    if (clientSlot) {
+        ClientRelease(GetPeer());
+        clientSlot = false;
+    }
+}
+
+void HTTPRequest::StartReply(int nStatus)
+{
+    assert(!replySent && req && !stream);
+    ReleaseClient();
+    stream.reset(new HTTPReplyStream());
+    HTTPEvent* ev = new HTTPEvent(eventBase, true,
+        boost::bind(http_reply_stream_start, req, nStatus, stream));
+    ev->trigger(0);
+}
+
+void HTTPRequest::WriteReplyChunk(const std::string& strData)
+{
+    assert(!replySent && req && stream);
+    if (strData.empty())
+        return;
+    {
+        boost::unique_lock<boost::mutex> lock(stream->mutex);
+        // A stalled client is disconnected by the -rpcservertimeout of the connection
+        while (!stream->fClosed && stream->nPending + stream->nUnsent >= MAX_REPLY_STREAM_BACKLOG)
+            stream->cond.wait(lock);
+        if (stream->fClosed)
+            return;
+        stream->nPending += strData.size();
+    }
+    struct evbuffer* evb = evbuffer_new();
+    assert(evb);
+    evbuffer_add(evb, strData.data(), strData.size());
+    HTTPEvent* ev = new HTTPEvent(eventBase, true,
+        boost::bind(http_reply_stream_chunk, req, evb, stream));
+    ev->trigger(0);
+}
+
+void HTTPRequest::EndReply(bool fComplete)
+{
+    assert(!replySent && req && stream);
+    HTTPEvent* ev = new HTTPEvent(eventBase, true,
+        boost::bind(http_reply_stream_end, req, fComplete, stream));
+    ev->trigger(0);
+    stream.reset();
+    replySent = true;
+    req = 0; // transferred back to main thread
+}
+
 CService HTTPRequest::GetPeer()
 {
     evhttp_connection* con = evhttp_request_get_connection(req);
@@ -647,10 +974,11 @@ HTTPRequest::RequestMethod HTTPRequest::GetRequestMethod()
     }
 }
 
-void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler)
+void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler,
+                         const HTTPRequestClassifier &classifier)
 {
     LogPrint("http", "Registering HTTP handler for %s (exactmatch %d)\n", prefix, exactMatch);
-    pathHandlers.push_back(HTTPPathHandler(prefix, exactMatch, handler));
+    pathHandlers.push_back(HTTPPathHandler(prefix, exactMatch, handler, classifier));
 }
 
 void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch)
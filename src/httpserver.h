@@ -6,19 +6,26 @@
 #define BITCOIN_HTTPSERVER_H
 
 #include <string>
+#include <vector>
 #include <stdint.h>
 #include <boost/thread.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/function.hpp>
 
 static const int DEFAULT_HTTP_THREADS=4;
 static const int DEFAULT_HTTP_WORKQUEUE=16;
+static const int DEFAULT_HTTP_WALLET_THREADS=2;
+static const int DEFAULT_HTTP_MINING_THREADS=2;
+/** Default for -rpcclientmaxinflight, 0 = no limit */
+static const int DEFAULT_HTTP_CLIENT_MAX_INFLIGHT=0;
 static const int DEFAULT_HTTP_SERVER_TIMEOUT=30;
 
 struct evhttp_request;
 struct event_base;
 class CService;
 class HTTPRequest;
+struct HTTPReplyStream;
 
 /** Initialize HTTP server.
  * Call this before RegisterHTTPHandler or EventBase().
@@ -34,16 +41,56 @@ void InterruptHTTPServer();
 /** Stop HTTP server */
 void StopHTTPServer();
 
+/** Work queues requests are spread over. Each has its own worker threads, so
+ * that slow requests of one kind do not hold up requests of another kind.
+ */
+enum HTTPWorkQueueId {
+    HTTP_QUEUE_DEFAULT,
+    HTTP_QUEUE_WALLET,
+    HTTP_QUEUE_MINING,
+    HTTP_QUEUE_COUNT
+};
+
 /** Handler for requests to a certain HTTP path */
 typedef boost::function<void(HTTPRequest* req, const std::string &)> HTTPRequestHandler;
+/** Picks the work queue for a request. Runs on the event thread, so it must be quick. */
+typedef boost::function<HTTPWorkQueueId(HTTPRequest* req, const std::string &)> HTTPRequestClassifier;
 /** Register handler for prefix.
  * If multiple handlers match a prefix, the first-registered one will
- * be invoked.
+ * be invoked. Requests go to the default work queue unless a classifier
+ * picks another one.
  */
-void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler);
+void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler,
+                         const HTTPRequestClassifier &classifier = HTTPRequestClassifier());
 /** Unregister handler for prefix */
 void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch);
 
+/** Run func on one of the HTTP worker threads.
+ * Only half of the work queue can be filled this way, so that such work does
+ * not crowd out incoming requests. Returns false if func was not queued.
+ */
+bool HTTPDispatchWork(const boost::function<void(void)>& func);
+
+/** Counters of one work queue, for getrpcinfo */
+struct HTTPWorkQueueStats
+{
+    std::string name;
+    int nThreads;
+    size_t nDepth;
+    size_t nMaxDepth;
+    uint64_t nProcessed;
+    uint64_t nRejected;
+    int64_t nWaitMicrosTotal;
+    int64_t nWaitMicrosMax;
+    int64_t nRunMicrosTotal;
+    int64_t nRunMicrosMax;
+};
+
+/** Get the counters of the work queues that are running */
+void GetHTTPWorkQueueStats(std::vector<HTTPWorkQueueStats>& vStats);
+/** Number of clients with requests in flight, the -rpcclientmaxinflight limit in effect, and requests it turned away */
+void GetHTTPClientStats(size_t& nClients, int& nMaxInFlight, uint64_t& nRejected);
+
 /** Return evhttp event base. This can be used by submodules to
  * queue timers or custom events.
  */
@@ -56,6 +103,12 @@ class HTTPRequest
 {
 private:
     struct evhttp_request* req;
+    //! Whether the request holds one of the -rpcclientmaxinflight slots of its peer
+    bool clientSlot;
+    //! The reply begun with StartReply, shared with the main http thread
+    boost::shared_ptr<HTTPReplyStream> stream;
+
+    void ReleaseClient();
 
     // For test access
 protected:
@@ -99,6 +152,19 @@ public:
      */
     std::string ReadBody();
 
+    /**
+     * Get the request body without consuming or copying it; valid until the
+     * body is read.
+     */
+    const char* PeekBody(size_t& nSize);
+
+    /**
+     * Count the request against the -rpcclientmaxinflight limit of its peer
+     * until the reply is written.
+     * @return false if the peer has the most requests in flight it may have.
+     */
+    bool AdmitClient();
+
     /**
      * Write output header.
      *
@@ -115,6 +181,30 @@ public:
      * main thread, do not call any other HTTPRequest methods after calling this.
      */
     virtual void WriteReply(int nStatus, const std::string& strReply = "");
+
+    /**
+     * Start a chunked reply with status nStatus and the headers written so far.
+     * This lets a large reply be sent in pieces as it is produced, with
+     * WriteReplyChunk, instead of being built in memory first.
+     *
+     * @note Call EndReply instead of WriteReply to finish it.
+     */
+    void StartReply(int nStatus);
+
+    /**
+     * Send a piece of a reply begun with StartReply. Waits while the client
+     * is too far behind. Data is dropped if the client went away.
+     */
+    void WriteReplyChunk(const std::string& strData);
+
+    /**
+     * Finish a reply begun with StartReply. If fComplete is false the
+     * connection is dropped instead, so that the client can tell the reply
+     * is incomplete.
+     *
+     * @note Same restrictions as WriteReply.
+     */
+    void EndReply(bool fComplete = true);
 };
 
 /** Event handler closure.
@@ -7,19 +7,25 @@
 
 #include "sodium.h"
 
+#include "addressindex.h"
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
+#include "blockfilterindex.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/validation.h"
+#include "core_memusage.h"
 #include "deprecation.h"
 #include "init.h"
 #include "merkleblock.h"
 #include "metrics.h"
 #include "net.h"
 #include "pow.h"
+#include "spentindex.h"
+#include "timestampindex.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -71,6 +77,9 @@ bool fExperimentalMode = false;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
+bool fAddressIndex = DEFAULT_ADDRESSINDEX;
+bool fSpentIndex = DEFAULT_SPENTINDEX;
+bool fTimestampIndex = DEFAULT_TIMESTAMPINDEX;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = true;
@@ -91,9 +100,21 @@ CTxMemPool mempool(::minRelayTxFee);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    size_t nUsage;
 };
 map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
+/** Memory used by the orphans of each peer, and the orphans themselves ordered by expiry time */
+struct COrphanPeerUsage {
+    size_t nUsage;
+    set<pair<int64_t, uint256> > setOrphans;
+    COrphanPeerUsage() : nUsage(0) {}
+};
+map<NodeId, COrphanPeerUsage> mapOrphanUsageByPeer GUARDED_BY(cs_main);
+size_t nOrphanUsage GUARDED_BY(cs_main) = 0;
+/** Transactions accepted or mined since their orphan children were last evaluated */
+set<uint256> setOrphanWorkSet GUARDED_BY(cs_main);
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 /**
@@ -102,6 +123,7 @@ void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
  */
 static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned nRequired, const Consensus::Params& consensusParams);
 static void CheckBlockIndex();
+static bool CheckInputsForMempool(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, unsigned int flags);
 
 /** Constant stuff for coinbase transactions we create: */
 CScript COINBASE_FLAGS;
@@ -221,6 +243,13 @@ namespace {
     boost::scoped_ptr<CRollingBloomFilter> recentRejects;
     uint256 hashRecentRejectsChainTip;
 
+    /**
+     * Transactions received from peers that are waiting for, or going
+     * through, their context-free checks in a ThreadTxVerify worker.
+     * Protected by cs_main.
+     */
+    set<uint256> setTxVerifyInFlight;
+
     /** Blocks that are in flight, and that are in the queue to be downloaded. Protected by cs_main. */
     struct QueuedBlock {
         uint256 hash;
@@ -228,15 +257,41 @@ namespace {
         int64_t nTime;  //! Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //! Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //! The timeout for this block request (for disconnecting a slow peer)
+        boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;  //! Optional, used for CMPCTBLOCK downloads
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
     /** Number of blocks in flight with validated headers. */
     int nQueuedValidatedHeaders = 0;
 
+    /** Peers we asked to announce new blocks as cmpctblock messages, least recent first. */
+    std::list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
+    /**
+     * Serialized "block" and "cmpctblock" messages of the most recent blocks,
+     * most recently used first. A new tip is asked for by most peers at about
+     * the same time, and they all get the same buffer. Protected by cs_recentBlockMsgs.
+     */
+    CCriticalSection cs_recentBlockMsgs;
+    std::list<std::pair<CInv, CSerializedNetMsg> > lRecentBlockMsgs;
+
+    /** A block with the bloom filter data elements of its transactions, for serving merkleblocks. */
+    struct CFilterableBlock {
+        CBlock block;
+        std::vector<CBloomTxElements> vtxElements;
+    };
+
+    /**
+     * Blocks recently served as merkleblocks, most recently used first. Light
+     * clients syncing ask for the same blocks, each with a filter of its own.
+     * Protected by cs_filterableBlocks.
+     */
+    CCriticalSection cs_filterableBlocks;
+    std::list<std::pair<uint256, std::shared_ptr<const CFilterableBlock> > > lFilterableBlocks;
+
     /** Dirty block index entries. */
     set<CBlockIndex*> setDirtyBlockIndex;
 
@@ -244,6 +299,64 @@ namespace {
     set<int> setDirtyFileInfo;
 } // anon namespace
 
+namespace {
+
+CSerializedNetMsg GetRecentBlockMsg(const CInv& inv)
+{
+    LOCK(cs_recentBlockMsgs);
+    for (std::list<std::pair<CInv, CSerializedNetMsg> >::iterator it = lRecentBlockMsgs.begin(); it != lRecentBlockMsgs.end(); it++) {
+        if (it->first.type == inv.type && it->first.hash == inv.hash) {
+            lRecentBlockMsgs.splice(lRecentBlockMsgs.begin(), lRecentBlockMsgs, it);
+            return lRecentBlockMsgs.front().second;
+        }
+    }
+    return CSerializedNetMsg();
+}
+
+void AddRecentBlockMsg(const CInv& inv, const CSerializedNetMsg& msg)
+{
+    LOCK(cs_recentBlockMsgs);
+    for (std::list<std::pair<CInv, CSerializedNetMsg> >::iterator it = lRecentBlockMsgs.begin(); it != lRecentBlockMsgs.end(); it++) {
+        if (it->first.type == inv.type && it->first.hash == inv.hash) {
+            lRecentBlockMsgs.erase(it);
+            break;
+        }
+    }
+    lRecentBlockMsgs.push_front(std::make_pair(inv, msg));
+    if (lRecentBlockMsgs.size() > MAX_RECENT_BLOCK_MSGS)
+        lRecentBlockMsgs.pop_back();
+}
+
+std::shared_ptr<const CFilterableBlock> GetFilterableBlock(const uint256& hash, const CDiskBlockPos& pos)
+{
+    typedef std::list<std::pair<uint256, std::shared_ptr<const CFilterableBlock> > > FilterableBlockList;
+    {
+        LOCK(cs_filterableBlocks);
+        for (FilterableBlockList::iterator it = lFilterableBlocks.begin(); it != lFilterableBlocks.end(); it++) {
+            if (it->first == hash) {
+                lFilterableBlocks.splice(lFilterableBlocks.begin(), lFilterableBlocks, it);
+                return lFilterableBlocks.front().second;
+            }
+        }
+    }
+
+    // Read and take the block apart without holding the lock
+    std::shared_ptr<CFilterableBlock> pfblock = std::make_shared<CFilterableBlock>();
+    if (!ReadBlockFromDisk(pfblock->block, pos) || pfblock->block.GetHash() != hash)
+        return std::shared_ptr<const CFilterableBlock>();
+    pfblock->vtxElements.reserve(pfblock->block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, pfblock->block.vtx)
+        pfblock->vtxElements.push_back(CBloomTxElements(tx));
+
+    LOCK(cs_filterableBlocks);
+    lFilterableBlocks.push_front(std::make_pair(hash, pfblock));
+    if (lFilterableBlocks.size() > MAX_FILTERABLE_BLOCKS)
+        lFilterableBlocks.pop_back();
+    return pfblock;
+}
+
+} // anon namespace
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Registration of network node signals.
@@ -291,6 +404,22 @@ struct CNodeState {
     int nBlocksInFlightValidHeaders;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer wants new blocks announced to it as cmpctblock messages.
+    bool fPreferHeaderAndIDs;
+    //! Whether this peer can give us compact blocks (it sent us a sendcmpct we understand).
+    bool fProvidesHeaderAndIDs;
+    //! Whether this peer wants new blocks announced with headers instead of invs.
+    bool fPreferHeaders;
+    //! The last header we sent this peer, in a headers message or an announcement.
+    CBlockIndex *pindexBestHeaderSent;
+    //! Length of the current run of headers announcements from this peer that didn't connect.
+    int nUnconnectingHeaders;
+    //! How many blocks we request from this peer at once, see UpdateBlockDownloadLimit().
+    int nBlocksInFlightLimit;
+    //! Smoothed time (in microseconds) this peer takes to deliver one of our block requests, or 0.
+    int64_t nBlockServiceTime;
+    //! When this peer last delivered a block we requested from it (in microseconds).
+    int64_t nLastBlockReceived;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -304,6 +433,14 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaders = false;
+        pindexBestHeaderSent = NULL;
+        nUnconnectingHeaders = 0;
+        nBlocksInFlightLimit = MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+        nBlockServiceTime = 0;
+        nLastBlockReceived = 0;
     }
 };
 
@@ -367,6 +504,7 @@ void FinalizeNode(NodeId nodeid) {
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
 
     mapNodeState.erase(nodeid);
@@ -374,10 +512,22 @@ void FinalizeNode(NodeId nodeid) {
 
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
-bool MarkBlockAsReceived(const uint256& hash) {
+// nodeFrom is the peer that delivered the block, if it's known.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (itInFlight->second.first == nodeFrom) {
+            // Requests to a peer are served one after the other, so a block's service
+            // time starts when it was requested or when the previous one arrived.
+            int64_t nNow = GetTimeMicros();
+            int64_t nServiceTime = nNow - std::max(itInFlight->second.second->nTime, state->nLastBlockReceived);
+            if (state->nBlockServiceTime == 0)
+                state->nBlockServiceTime = nServiceTime;
+            else
+                state->nBlockServiceTime = (state->nBlockServiceTime * 7 + nServiceTime) / 8;
+            state->nLastBlockReceived = nNow;
+        }
         nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
@@ -390,7 +540,8 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// Returns the new in-flight entry through pit, so a compact block download can attach its partial block.
+void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL, list<QueuedBlock>::iterator *pit = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
@@ -404,6 +555,72 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    if (pit)
+        *pit = it;
+}
+
+/**
+ * Ask a peer that just gave us a new tip to announce its next blocks as
+ * cmpctblock messages, dropping the least recent of the peers we asked
+ * before once there are MAX_CMPCTBLOCK_HB_PEERS of them. Requires cs_main.
+ */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom) {
+    if (!nodestate->fProvidesHeaderAndIDs)
+        return;
+    for (std::list<NodeId>::iterator it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); it++) {
+        if (*it == pfrom->GetId()) {
+            lNodesAnnouncingHeaderAndIDs.erase(it);
+            lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+            return;
+        }
+    }
+    uint64_t nCMPCTBLOCKVersion = 1;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_HB_PEERS) {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode->GetId() == lNodesAnnouncingHeaderAndIDs.front()) {
+                pnode->PushMessage("sendcmpct", false, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+    }
+    pfrom->PushMessage("sendcmpct", true, nCMPCTBLOCKVersion);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+}
+
+int GetBlockDownloadLimit(int64_t nMinPingUsecTime, int64_t nBlockServiceTime)
+{
+    if (nBlockServiceTime <= 0 || nMinPingUsecTime == std::numeric_limits<int64_t>::max())
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nLimit = 2 * (1 + nMinPingUsecTime / nBlockServiceTime);
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_PEER_LIMIT, nLimit));
+}
+
+/** Adapt the number of blocks we keep requested from a peer to what it can deliver. Requires cs_main. */
+void UpdateBlockDownloadLimit(CNodeState* state, const CNode* pnode) {
+    int nLimit = GetBlockDownloadLimit(pnode->nMinPingUsecTime, state->nBlockServiceTime);
+    if (nLimit != state->nBlocksInFlightLimit) {
+        LogPrint("net", "Block download limit for peer=%d: %d -> %d (ping %dus, %dus per block)\n", pnode->id,
+            state->nBlocksInFlightLimit, nLimit, pnode->nMinPingUsecTime, state->nBlockServiceTime);
+        state->nBlocksInFlightLimit = nLimit;
+    }
+}
+
+/** Whether our tip is recent enough to fetch announced blocks right away. Requires cs_main. */
+bool CanDirectFetch(const Consensus::Params &consensusParams)
+{
+    return chainActive.Tip()->GetBlockTime() > GetTime() - consensusParams.nPowTargetSpacing * 20;
+}
+
+/** Whether a peer has the header of pindex: it announced it, or we sent it. Requires cs_main. */
+bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
+{
+    if (state->pindexBestKnownBlock && pindex == state->pindexBestKnownBlock->GetAncestor(pindex->nHeight))
+        return true;
+    if (state->pindexBestHeaderSent && pindex == state->pindexBestHeaderSent->GetAncestor(pindex->nHeight))
+        return true;
+    return false;
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -560,6 +777,8 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlocksInFlightLimit = state->nBlocksInFlightLimit;
+    stats.nBlockServiceTime = state->nBlockServiceTime;
     return true;
 }
 
@@ -599,6 +818,86 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
+namespace {
+
+/**
+ * Transactions relayed by peers wait here for a ThreadTxVerify worker, which
+ * runs PreCheckTransactionForMempool (joinsplit proofs and signatures) without
+ * holding cs_main and only then takes it for the mempool admission proper.
+ * This lets several transactions from different peers be verified at once,
+ * while blocks and other messages keep being processed. The workers also
+ * re-evaluate orphans in batches once they are told their parents arrived.
+ */
+class CTxVerifyQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<std::pair<CTransaction, CNode*> > queue;
+    size_t nMaxSize;
+    int nWorkers;
+    bool fOrphanWork;
+
+public:
+    CTxVerifyQueue(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn), nWorkers(0), fOrphanWork(false) {}
+
+    //! Hand a transaction to the workers; false if none is running or the queue is full
+    bool Push(const CTransaction& tx, CNode* pfrom)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nWorkers == 0 || queue.size() >= nMaxSize)
+            return false;
+        queue.push_back(std::make_pair(tx, pfrom->AddRef()));
+        cond.notify_one();
+        return true;
+    }
+
+    //! Ask a worker to run ProcessOrphanWork; false if none is running
+    bool NotifyOrphanWork()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nWorkers == 0)
+            return false;
+        fOrphanWork = true;
+        cond.notify_one();
+        return true;
+    }
+
+    /**
+     * Block until there is something to do (interruption point). Returns true
+     * with a transaction in item, or false if orphan work was requested.
+     */
+    bool Pop(std::pair<CTransaction, CNode*>& item)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty() && !fOrphanWork)
+            cond.wait(lock);
+        if (fOrphanWork) {
+            fOrphanWork = false;
+            return false;
+        }
+        item = queue.front();
+        queue.pop_front();
+        return true;
+    }
+
+    void AddWorker()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nWorkers++;
+    }
+
+    void RemoveWorker()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nWorkers--;
+    }
+};
+
+CTxVerifyQueue txverifyqueue(MAX_TXVERIFY_QUEUE_SIZE);
+
+} // anon namespace
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
@@ -624,13 +923,21 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nUsage = RecursiveDynamicUsage(tx);
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    COrphanPeerUsage& peerUsage = mapOrphanUsageByPeer[peer];
+    peerUsage.nUsage += orphan.nUsage;
+    peerUsage.setOrphans.insert(make_pair(orphan.nTimeExpire, hash));
+    nOrphanUsage += orphan.nUsage;
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u usage %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanUsage);
     return true;
 }
 
@@ -648,30 +955,74 @@ void static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+
+    map<NodeId, COrphanPeerUsage>::iterator itPeer = mapOrphanUsageByPeer.find(it->second.fromPeer);
+    assert(itPeer != mapOrphanUsageByPeer.end());
+    itPeer->second.nUsage -= it->second.nUsage;
+    itPeer->second.setOrphans.erase(make_pair(it->second.nTimeExpire, hash));
+    if (itPeer->second.setOrphans.empty())
+        mapOrphanUsageByPeer.erase(itPeer);
+    nOrphanUsage -= it->second.nUsage;
+
     mapOrphanTransactions.erase(it);
 }
 
 void EraseOrphansFor(NodeId peer)
 {
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+    map<NodeId, COrphanPeerUsage>::iterator itPeer = mapOrphanUsageByPeer.find(peer);
+    if (itPeer == mapOrphanUsageByPeer.end())
+        return;
+    // Erasing the last orphan of the peer invalidates itPeer, so work on a copy
+    set<pair<int64_t, uint256> > setOrphans = itPeer->second.setOrphans;
+    BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, setOrphans)
+        EraseOrphanTx(item.second);
+    LogPrint("mempool", "Erased %d orphan tx from peer %d\n", setOrphans.size(), peer);
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxUsage) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+
+    // Sweep out expired orphans every now and then
+    static int64_t nNextSweep;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end())
+        {
+            map<uint256, COrphanTx>::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                EraseOrphanTx(maybeErase->first);
+                ++nEvicted;
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
+        }
+        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nEvicted > 0)
+            LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nEvicted);
+    }
+
+    // A single peer may only fill its share of the pool; it loses its own oldest orphans first
+    size_t nMaxPeerUsage = nMaxUsage / ORPHAN_POOL_PEER_SHARE;
+    map<NodeId, COrphanPeerUsage>::iterator itPeer = mapOrphanUsageByPeer.begin();
+    while (itPeer != mapOrphanUsageByPeer.end())
+    {
+        map<NodeId, COrphanPeerUsage>::iterator itCurrent = itPeer++;
+        // EraseOrphanTx drops the entry once the peer has no orphans left
+        while (itCurrent->second.nUsage > nMaxPeerUsage) {
+            bool fLast = itCurrent->second.setOrphans.size() == 1;
+            EraseOrphanTx(itCurrent->second.setOrphans.begin()->second);
+            ++nEvicted;
+            if (fLast)
+                break;
+        }
+    }
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanUsage > nMaxUsage)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
@@ -684,6 +1035,83 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRE
     return nEvicted;
 }
 
+/**
+ * Re-evaluate the orphans depending on transactions in setOrphanWorkSet, up
+ * to about nMaxOrphans of them under a single cs_main acquisition. Accepted
+ * orphans feed their own children back into the work set.
+ * @return true if there is work left for another call
+ */
+static bool ProcessOrphanWork(unsigned int nMaxOrphans)
+{
+    LOCK(cs_main);
+
+    set<uint256> setToProcess;
+    while (!setOrphanWorkSet.empty() && setToProcess.size() < nMaxOrphans)
+    {
+        map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(*setOrphanWorkSet.begin());
+        setOrphanWorkSet.erase(setOrphanWorkSet.begin());
+        if (itByPrev != mapOrphanTransactionsByPrev.end())
+            setToProcess.insert(itByPrev->second.begin(), itByPrev->second.end());
+    }
+
+    set<NodeId> setMisbehaving;
+    BOOST_FOREACH(const uint256& orphanHash, setToProcess)
+    {
+        // An earlier orphan of this batch may have displaced it
+        map<uint256, COrphanTx>::iterator itOrphan = mapOrphanTransactions.find(orphanHash);
+        if (itOrphan == mapOrphanTransactions.end())
+            continue;
+        const CTransaction orphanTx = itOrphan->second.tx;
+        NodeId fromPeer = itOrphan->second.fromPeer;
+        bool fMissingInputs2 = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+
+        if (setMisbehaving.count(fromPeer))
+            continue;
+        if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+        {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(orphanTx);
+            setOrphanWorkSet.insert(orphanHash);
+            EraseOrphanTx(orphanHash);
+        }
+        else if (!fMissingInputs2)
+        {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0)
+            {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos);
+                setMisbehaving.insert(fromPeer);
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            EraseOrphanTx(orphanHash);
+            assert(recentRejects);
+            recentRejects->insert(orphanHash);
+        }
+        mempool.check(pcoinsTip);
+    }
+
+    return !setOrphanWorkSet.empty();
+}
+
+/** Have the orphans of hash re-evaluated, by a ThreadTxVerify worker if there is one */
+static void QueueOrphanWork(const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    if (!mapOrphanTransactionsByPrev.count(hash))
+        return;
+    setOrphanWorkSet.insert(hash);
+    if (!txverifyqueue.NotifyOrphanWork()) {
+        while (ProcessOrphanWork(MAX_ORPHAN_WORK_BATCH)) {}
+    }
+}
+
 
 bool IsStandardTx(const CTransaction& tx, string& reason, const int nHeight)
 {
@@ -980,6 +1408,16 @@ bool ContextualCheckTransaction(
 
 bool CheckTransaction(const CTransaction& tx, CValidationState &state,
                       libzcash::ProofVerifier& verifier)
+{
+    if (!CheckTransactionContextFree(tx, state, verifier)) {
+        return false;
+    }
+
+    return CheckTransactionOutputsAllowed(tx, state);
+}
+
+bool CheckTransactionContextFree(const CTransaction& tx, CValidationState &state,
+                                 libzcash::ProofVerifier& verifier)
 {
     // Don't count coinbase transactions because mining skews the count
     if (!tx.IsCoinBase()) {
@@ -997,6 +1435,11 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state,
         }
     }
 
+    return true;
+}
+
+bool CheckTransactionOutputsAllowed(const CTransaction& tx, CValidationState &state)
+{
     // Check for vout's without OP_CHECKBLOCKATHEIGHT opcode
     BOOST_FOREACH(const CTxOut& txout, tx.vout)
     {
@@ -1207,14 +1650,8 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+bool PreCheckTransactionForMempool(const CTransaction& tx, CValidationState& state)
 {
-    AssertLockHeld(cs_main);
-    if (pfMissingInputs)
-        *pfMissingInputs = false;
-
-    int nextBlockHeight = chainActive.Height() + 1; // OR chainActive.Tip()->nHeight
     // Node operator can choose to reject tx by number of transparent inputs
     static_assert(std::numeric_limits<size_t>::max() >= std::numeric_limits<int64_t>::max(), "size_t too small");
     size_t limit = (size_t) GetArg("-mempooltxinputlimit", 0);
@@ -1226,9 +1663,26 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
     }
 
-
     auto verifier = libzcash::ProofVerifier::Strict();
-    if (!CheckTransaction(tx, state, verifier))
+    if (!CheckTransactionContextFree(tx, state, verifier))
+        return error("AcceptToMemoryPool: CheckTransaction failed");
+
+    return true;
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fPreChecked)
+{
+    AssertLockHeld(cs_main);
+    if (pfMissingInputs)
+        *pfMissingInputs = false;
+
+    int nextBlockHeight = chainActive.Height() + 1; // OR chainActive.Tip()->nHeight
+
+    if (!fPreChecked && !PreCheckTransactionForMempool(tx, state))
+        return false;
+
+    if (!CheckTransactionOutputsAllowed(tx, state))
         return error("AcceptToMemoryPool: CheckTransaction failed");
 
 
@@ -1403,7 +1857,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!ContextualCheckInputs(tx, state, view, true, chainActive, STANDARD_CONTEXTUAL_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus()))
+        if (!CheckInputsForMempool(tx, state, view, STANDARD_CONTEXTUAL_SCRIPT_VERIFY_FLAGS))
         {
             return error("AcceptToMemoryPool: ConnectInputs failed %s", hash.ToString());
         }
@@ -1429,6 +1883,189 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return true;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Mempool persistence
+//
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+/** Append hash and, before it, its unconfirmed ancestors to vOrdered */
+static void OrderForDump(const uint256& hash, const std::map<uint256, CTransaction>& mapTxs,
+                         std::set<uint256>& setDone, std::vector<const CTransaction*>& vOrdered)
+{
+    if (!setDone.insert(hash).second)
+        return;
+    const CTransaction& tx = mapTxs.find(hash)->second;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        if (mapTxs.count(txin.prevout.hash))
+            OrderForDump(txin.prevout.hash, mapTxs, setDone, vOrdered);
+    }
+    vOrdered.push_back(&tx);
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::map<uint256, CTransaction> mapTxs;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            mapTxs.insert(std::make_pair(it->first, it->second.GetTx()));
+    }
+
+    // Parents go first, so that loading can accept every transaction in a single pass
+    std::set<uint256> setDone;
+    std::vector<const CTransaction*> vOrdered;
+    vOrdered.reserve(mapTxs.size());
+    for (std::map<uint256, CTransaction>::const_iterator it = mapTxs.begin(); it != mapTxs.end(); ++it)
+        OrderForDump(it->first, mapTxs, setDone, vOrdered);
+
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+        FILE* filestr = fopen(pathTmp.string().c_str(), "wb");
+        if (!filestr)
+            return error("%s: failed to open %s", __func__, pathTmp.string());
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        file << MEMPOOL_DUMP_VERSION;
+        file << mapDeltas;
+        file << (uint64_t)vOrdered.size();
+        BOOST_FOREACH(const CTransaction* ptx, vOrdered)
+            file << *ptx;
+
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+            return error("%s: failed to rename %s", __func__, pathTmp.string());
+    } catch (const std::exception& e) {
+        return error("%s: failed to dump mempool: %s", __func__, e.what());
+    }
+
+    int64_t nLast = GetTimeMicros();
+    LogPrintf("Dumped %u mempool transactions: %gs to copy, %gs to dump\n",
+              vOrdered.size(), (nMid - nStart) * 0.000001, (nLast - nMid) * 0.000001);
+    return true;
+}
+
+namespace {
+
+/** Splits PreCheckTransactionForMempool over a batch of transactions among several threads */
+class CParallelPreCheck
+{
+private:
+    const std::vector<CTransaction>& vtx;
+    std::vector<char>& vfOk;
+    boost::mutex mutex;
+    size_t nNext;
+
+public:
+    CParallelPreCheck(const std::vector<CTransaction>& vtxIn, std::vector<char>& vfOkIn) :
+        vtx(vtxIn), vfOk(vfOkIn), nNext(0)
+    {
+        vfOk.assign(vtx.size(), false);
+    }
+
+    void Thread()
+    {
+        while (true) {
+            size_t i;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (nNext >= vtx.size())
+                    return;
+                i = nNext++;
+            }
+            CValidationState state;
+            vfOk[i] = PreCheckTransactionForMempool(vtx[i], state);
+        }
+    }
+
+    void Run(int nThreads)
+    {
+        boost::thread_group threads;
+        for (int i = 1; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CParallelPreCheck::Thread, this));
+        Thread();
+        threads.join_all();
+    }
+};
+
+} // anon namespace
+
+bool LoadMempool()
+{
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    FILE* filestr = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t nStart = GetTimeMicros();
+    int nThreads = std::max(1, std::min(GetNumCores(), MAX_SCRIPTCHECK_THREADS));
+    uint64_t nAccepted = 0, nFailed = 0, nAlreadyThere = 0;
+
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("%s: unknown mempool dump version %u", __func__, nVersion);
+
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t nTotal;
+        file >> nTotal;
+        uint64_t nRead = 0;
+        while (nRead < nTotal && !ShutdownRequested()) {
+            // Proofs of a whole batch are verified in parallel without any lock, then
+            // every transaction takes cs_main on its own so that block templates and
+            // block processing are not held up by the reload.
+            std::vector<CTransaction> vtx;
+            vtx.resize((size_t)std::min<uint64_t>(nTotal - nRead, MEMPOOL_LOAD_BATCH_SIZE));
+            BOOST_FOREACH(CTransaction& tx, vtx)
+                file >> tx;
+            nRead += vtx.size();
+
+            std::vector<char> vfOk;
+            CParallelPreCheck precheck(vtx, vfOk);
+            precheck.Run(nThreads);
+
+            for (size_t i = 0; i < vtx.size() && !ShutdownRequested(); i++) {
+                if (!vfOk[i]) {
+                    ++nFailed;
+                    continue;
+                }
+                LOCK(cs_main);
+                CValidationState state;
+                if (AcceptToMemoryPool(mempool, state, vtx[i], true, NULL, false, true)) {
+                    ++nAccepted;
+                } else if (mempool.exists(vtx[i].GetHash())) {
+                    ++nAlreadyThere;
+                } else {
+                    ++nFailed;
+                }
+            }
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i already there, %gs (%d threads)\n",
+              nAccepted, nFailed, nAlreadyThere, (GetTimeMicros() - nStart) * 0.000001, nThreads);
+    return true;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1495,11 +2132,45 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 
 
 
-//////////////////////////////////////////////////////////////////////////////
-//
-// CBlock and CBlockIndex
-//
-
+bool GetAddressIndex(int type, const uint160& hashBytes, std::vector<std::pair<CAddressIndexKey, CAmount> >& vIndex, int nStart, int nEnd)
+{
+    if (!fAddressIndex)
+        return error("%s: address index not enabled", __func__);
+    if (!pblocktree->ReadAddressIndex(type, hashBytes, vIndex, nStart, nEnd))
+        return error("%s: unable to get txids for address", __func__);
+    return true;
+}
+
+bool GetAddressUnspent(int type, const uint160& hashBytes, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent)
+{
+    if (!fAddressIndex)
+        return error("%s: address index not enabled", __func__);
+    if (!pblocktree->ReadAddressUnspentIndex(type, hashBytes, vUnspent))
+        return error("%s: unable to get unspent outputs for address", __func__);
+    return true;
+}
+
+bool GetSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value)
+{
+    if (!fSpentIndex)
+        return false;
+    return pblocktree->ReadSpentIndex(key, value);
+}
+
+bool GetTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<uint256>& vHashes)
+{
+    if (!fTimestampIndex)
+        return error("%s: timestamp index not enabled", __func__);
+    if (!pblocktree->ReadTimestampIndex(nHigh, nLow, vHashes))
+        return error("%s: unable to get hashes for timestamps", __func__);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// CBlock and CBlockIndex
+//
+
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
 {
     // Open history file to append
@@ -1693,6 +2364,7 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -1986,6 +2658,8 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     return true;
 }
 
+} // anon namespace
+
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
     // Open history file to read
@@ -2013,6 +2687,8 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
     return true;
 }
 
+namespace {
+
 /** Abort with a message */
 bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
 {
@@ -2031,8 +2707,53 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
     return state.Error(strMessage);
 }
 
+/**
+ * UTXO set statistics of the chain state with best block
+ * coinsRunningStats.hashBlock. A block only changes them when it is connected
+ * to or disconnected from that very chain state, which leaves out the scratch
+ * views of block checks and VerifyDB.
+ */
+CCoinsRunningStats coinsRunningStats;
+//! Where coinsRunningStats are stored with the chain state
+CCoinsViewDB* pcoinsStatsView = NULL;
+
 } // anon namespace
 
+bool LoadCoinsRunningStats(CCoinsViewDB* pview)
+{
+    LOCK(cs_main);
+    pcoinsStatsView = pview;
+    uint256 hashBest = pcoinsTip->GetBestBlock();
+    if (pview->GetRunningStats(coinsRunningStats) && coinsRunningStats.hashBlock == hashBest)
+        return true;
+
+    coinsRunningStats = CCoinsRunningStats();
+    coinsRunningStats.hashBlock = hashBest;
+    if (hashBest.IsNull())
+        return true;
+
+    LogPrintf("Computing UTXO set statistics, this may take a while...\n");
+    int64_t nStart = GetTimeMillis();
+    if (pview->GetBestBlock() != hashBest)
+        FlushStateToDisk();
+    CCoinsStats stats;
+    if (!pview->GetStats(stats) || stats.hashBlock != hashBest)
+        return error("%s: failed to read the UTXO set", __func__);
+    coinsRunningStats.nTransactions = stats.nTransactions;
+    coinsRunningStats.nTransactionOutputs = stats.nTransactionOutputs;
+    coinsRunningStats.nBogoSize = stats.nBogoSize;
+    coinsRunningStats.nTotalAmount = stats.nTotalAmount;
+    coinsRunningStats.muhash = stats.muhash;
+    LogPrintf("Computed UTXO set statistics of %u outputs in %dms\n", stats.nTransactionOutputs, GetTimeMillis() - nStart);
+    return true;
+}
+
+const CCoinsRunningStats& GetCoinsRunningStats()
+{
+    AssertLockHeld(cs_main);
+    return coinsRunningStats;
+}
+
 /**
  * Apply the undo operation of a CTxInUndo to the given chain state.
  * @param undo The undo object.
@@ -2085,11 +2806,31 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock(): block and undo data inconsistent");
 
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspent;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
+
+    // Callers passing pfClean only check blocks against a scratch view
+    bool fUpdateStats = !pfClean && coinsRunningStats.hashBlock == pindex->GetBlockHash();
+    CCoinsRunningStats statsDelta;
+
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = block.vtx[i];
         uint256 hash = tx.GetHash();
 
+        if (fAddressIndex) {
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                const CTxOut &out = tx.vout[k];
+                int type;
+                uint160 hashBytes;
+                if (!GetAddressIndexKey(out.scriptPubKey, type, hashBytes))
+                    continue;
+                vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, hash, k, false), out.nValue));
+                vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, hash, k), CAddressUnspentValue()));
+            }
+        }
+
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
         {
@@ -2106,6 +2847,11 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
             fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
 
         // remove outputs
+        if (fUpdateStats && !outs->IsPruned()) {
+            statsDelta.nTransactions--;
+            for (unsigned int k = 0; k < tx.vout.size(); k++)
+                statsDelta.RemoveOutput(hash, k, tx.vout[k], pindex->nHeight, tx.IsCoinBase());
+        }
         outs->Clear();
         }
 
@@ -2126,6 +2872,27 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
                 const CTxInUndo &undo = txundo.vprevout[j];
                 if (!ApplyTxInUndo(undo, view, out))
                     fClean = false;
+
+                if (fUpdateStats) {
+                    // The undo data only has the height with the last output of a transaction
+                    const CCoins* coins = view.AccessCoins(out.hash);
+                    if (undo.nHeight != 0)
+                        statsDelta.nTransactions++;
+                    statsDelta.AddOutput(out.hash, out.n, undo.txout, coins->nHeight, coins->fCoinBase);
+                }
+
+                int type;
+                uint160 hashBytes;
+                if (fAddressIndex && GetAddressIndexKey(undo.txout.scriptPubKey, type, hashBytes)) {
+                    // The undo data only has the height with the last output of a transaction
+                    const CCoins* coins = view.AccessCoins(out.hash);
+                    int nPrevHeight = coins ? coins->nHeight : undo.nHeight;
+                    vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, hash, j, true), -undo.txout.nValue));
+                    vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, out.hash, out.n),
+                                                             CAddressUnspentValue(undo.txout.nValue, undo.txout.scriptPubKey, nPrevHeight)));
+                }
+                if (fSpentIndex)
+                    vSpentIndex.push_back(std::make_pair(CSpentIndexKey(out.hash, out.n), CSpentIndexValue()));
             }
         }
     }
@@ -2136,6 +2903,25 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
+    // Callers passing pfClean only check blocks against a scratch view
+    if (fAddressIndex && !pfClean) {
+        if (!pblocktree->UpdateAddressIndex(vAddressIndex, vAddressUnspent, false))
+            return AbortNode(state, "Failed to write address index");
+    }
+    if (fSpentIndex && !pfClean) {
+        if (!pblocktree->UpdateSpentIndex(vSpentIndex))
+            return AbortNode(state, "Failed to write spent index");
+    }
+    if (fTimestampIndex && !pfClean) {
+        if (!pblocktree->EraseTimestampIndex(CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash())))
+            return AbortNode(state, "Failed to write timestamp index");
+    }
+
+    if (fUpdateStats && fClean) {
+        coinsRunningStats.Apply(statsDelta);
+        coinsRunningStats.hashBlock = pindex->pprev->GetBlockHash();
+    }
+
     if (pfClean) {
         *pfClean = fClean;
         return true;
@@ -2176,6 +2962,26 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+static bool CheckInputsForMempool(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, unsigned int flags)
+{
+    AssertLockHeld(cs_main);
+    // Between blocks the script verification threads are idle, so spread the
+    // signature checks of multi-input transactions over them. cs_main keeps
+    // ConnectBlock from using the queue at the same time. On failure the
+    // serial check below is what sets the reject reason in state.
+    if (nScriptCheckThreads && tx.vin.size() > 1) {
+        std::vector<CScriptCheck> vChecks;
+        CValidationState stateDummy;
+        if (ContextualCheckInputs(tx, stateDummy, view, true, chainActive, flags, true, Params().GetConsensus(), &vChecks)) {
+            CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+            control.Add(vChecks);
+            if (control.Wait())
+                return true;
+        }
+    }
+    return ContextualCheckInputs(tx, state, view, true, chainActive, flags, true, Params().GetConsensus());
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -2319,6 +3125,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (block.GetHash() == chainparams.GetConsensus().hashGenesisBlock) {
         if (!fJustCheck) {
             view.SetBestBlock(pindex->GetBlockHash());
+            if (coinsRunningStats.hashBlock == hashPrevBlock)
+                coinsRunningStats.hashBlock = pindex->GetBlockHash();
             // Before the genesis block, there was an empty tree
             ZCIncrementalMerkleTree tree;
             pindex->hashAnchor = tree.root();
@@ -2358,6 +3166,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspent;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
+
+    // Blocks checked against a scratch view leave the running stats alone
+    bool fUpdateStats = !fJustCheck && coinsRunningStats.hashBlock == hashPrevBlock;
+    CCoinsRunningStats statsDelta;
 
     // Construct the incremental merkle tree at the current
     // block position,
@@ -2414,12 +3229,65 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             control.Add(vChecks);
         }
 
+        if ((fAddressIndex || fSpentIndex) && !fJustCheck && !tx.IsCoinBase()) {
+            const uint256 hash = tx.GetHash();
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const CTxIn &input = tx.vin[j];
+                const CTxOut &prevout = view.GetOutputFor(input);
+                int type = ADDRESS_INDEX_NONE;
+                uint160 hashBytes;
+                bool fIndexed = GetAddressIndexKey(prevout.scriptPubKey, type, hashBytes);
+                if (fSpentIndex) {
+                    vSpentIndex.push_back(std::make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n),
+                                                         CSpentIndexValue(hash, j, pindex->nHeight, prevout.nValue, type, hashBytes)));
+                }
+                if (fAddressIndex && fIndexed) {
+                    vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, hash, j, true), -prevout.nValue));
+                    vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue()));
+                }
+            }
+        }
+        if (fAddressIndex && !fJustCheck) {
+            const uint256 hash = tx.GetHash();
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                const CTxOut &out = tx.vout[k];
+                int type;
+                uint160 hashBytes;
+                if (!GetAddressIndexKey(out.scriptPubKey, type, hashBytes))
+                    continue;
+                vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, hash, k, false), out.nValue));
+                vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, hash, k),
+                                                         CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+            }
+        }
+
+        if (fUpdateStats && !tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& input, tx.vin) {
+                const CCoins* coins = view.AccessCoins(input.prevout.hash);
+                statsDelta.RemoveOutput(input.prevout.hash, input.prevout.n, coins->vout[input.prevout.n], coins->nHeight, coins->fCoinBase);
+            }
+        }
+
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
         }
         UpdateCoins(tx, state, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
 
+        if (fUpdateStats) {
+            const uint256 hash = tx.GetHash();
+            // Spending the last output of a transaction removes it from the set, which the undo data marks with its height
+            if (i > 0) {
+                BOOST_FOREACH(const CTxInUndo& undo, blockundo.vtxundo.back().vprevout)
+                    if (undo.nHeight != 0)
+                        statsDelta.nTransactions--;
+            }
+            if (!view.AccessCoins(hash)->IsPruned())
+                statsDelta.nTransactions++;
+            for (unsigned int k = 0; k < tx.vout.size(); k++)
+                statsDelta.AddOutput(hash, k, tx.vout[k], pindex->nHeight, tx.IsCoinBase());
+        }
+
         BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
             BOOST_FOREACH(const uint256 &note_commitment, joinsplit.commitments) {
                 // Insert the note commitments into our temporary tree.
@@ -2479,9 +3347,26 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTxIndex(vPos))
             return AbortNode(state, "Failed to write transaction index");
 
+    if (fAddressIndex)
+        if (!pblocktree->UpdateAddressIndex(vAddressIndex, vAddressUnspent, true))
+            return AbortNode(state, "Failed to write address index");
+
+    if (fSpentIndex)
+        if (!pblocktree->UpdateSpentIndex(vSpentIndex))
+            return AbortNode(state, "Failed to write spent index");
+
+    if (fTimestampIndex)
+        if (!pblocktree->WriteTimestampIndex(CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash())))
+            return AbortNode(state, "Failed to write timestamp index");
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
+    if (fUpdateStats) {
+        coinsRunningStats.Apply(statsDelta);
+        coinsRunningStats.hashBlock = pindex->GetBlockHash();
+    }
+
     int64_t nTime3 = GetTimeMicros(); nTimeIndex += nTime3 - nTime2;
     LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime3 - nTime2), nTimeIndex * 0.000001);
 
@@ -2590,6 +3475,8 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
+        if (pcoinsStatsView)
+            pcoinsStatsView->SetRunningStats(coinsRunningStats);
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
@@ -2616,10 +3503,52 @@ void PruneAndFlush() {
     FlushStateToDisk(state, FLUSH_STATE_NONE);
 }
 
+namespace {
+
+/** The latest CChainTipSnapshot, swapped with std::atomic_store so that readers never wait */
+std::shared_ptr<const CChainTipSnapshot> pchainTipSnapshot = std::make_shared<const CChainTipSnapshot>();
+
+/**
+ * Held while entries are added to mapBlockIndex and being linked into the
+ * block tree, and while it is cleared, so LookupBlockIndex can search it
+ * without cs_main.
+ */
+CCriticalSection cs_blockIndexLookup;
+
+/** Publish a new chain tip snapshot from chainActive. Requires cs_main. */
+void PublishChainTipSnapshot()
+{
+    AssertLockHeld(cs_main);
+    std::shared_ptr<CChainTipSnapshot> snapshot = std::make_shared<CChainTipSnapshot>();
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip != NULL) {
+        snapshot->pindexTip = pindexTip;
+        snapshot->nHeight = pindexTip->nHeight;
+        snapshot->hashBlock = pindexTip->GetBlockHash();
+        snapshot->nNextBits = GetNextWorkRequired(pindexTip, NULL, Params().GetConsensus());
+    }
+    std::atomic_store(&pchainTipSnapshot, std::shared_ptr<const CChainTipSnapshot>(snapshot));
+}
+
+} // anon namespace
+
+std::shared_ptr<const CChainTipSnapshot> GetChainTipSnapshot()
+{
+    return std::atomic_load(&pchainTipSnapshot);
+}
+
+const CBlockIndex* LookupBlockIndex(const uint256& hash)
+{
+    LOCK(cs_blockIndexLookup);
+    BlockMap::const_iterator mi = mapBlockIndex.find(hash);
+    return mi == mapBlockIndex.end() ? NULL : mi->second;
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew) {
     const CChainParams& chainParams = Params();
     chainActive.SetTip(pindexNew);
+    PublishChainTipSnapshot();
 
     // New best block
     nTimeBestReceived = GetTime();
@@ -2797,6 +3726,12 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
         SyncWithWallets(tx, pblock);
     }
+    // Orphans spending mined transactions can be evaluated again, once
+    // ActivateBestChain has left the reorganization
+    BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
+        if (mapOrphanTransactionsByPrev.count(tx.GetHash()))
+            setOrphanWorkSet.insert(tx.GetHash());
+    }
     // Update cached incremental witnesses
     GetMainSignals().ChainTip(pindexNew, pblock, oldTree, true);
 
@@ -2961,6 +3896,9 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
         boost::this_thread::interruption_point();
 
         bool fInitialDownload;
+        bool fOrphanWork;
+        std::set<NodeId> setCmpctAnnounce;
+        std::vector<uint256> vHashes;
         {
             LOCK(cs_main);
             pindexMostWork = FindMostWorkChain();
@@ -2969,14 +3907,38 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
             if (pindexMostWork == NULL || pindexMostWork == chainActive.Tip())
                 return true;
 
+            CBlockIndex *pindexOldTip = chainActive.Tip();
+
             if (!ActivateBestChainStep(state, pindexMostWork, pblock && pblock->GetHash() == pindexMostWork->GetBlockHash() ? pblock : NULL))
                 return false;
 
             pindexNewTip = chainActive.Tip();
             fInitialDownload = IsInitialBlockDownload();
+            fOrphanWork = !setOrphanWorkSet.empty();
+
+            // The blocks connected in this step, newest first, for headers announcements
+            const CBlockIndex *pindexFork = chainActive.FindFork(pindexOldTip);
+            for (const CBlockIndex *pindex = pindexNewTip; pindex && pindex != pindexFork; pindex = pindex->pprev) {
+                vHashes.push_back(pindex->GetBlockHash());
+                if (vHashes.size() > MAX_BLOCKS_TO_ANNOUNCE)
+                    break;
+            }
+
+            // Peers that asked for high-bandwidth relay get the new tip as a cmpctblock
+            if (!fInitialDownload && pblock && pblock->GetHash() == pindexNewTip->GetBlockHash()) {
+                for (map<NodeId, CNodeState>::const_iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it)
+                    if (it->second.fPreferHeaderAndIDs)
+                        setCmpctAnnounce.insert(it->first);
+            }
         }
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
 
+        // Orphans whose parents were mined go to the ThreadTxVerify workers,
+        // or are evaluated here when -txverifythreads=0
+        if (fOrphanWork && !txverifyqueue.NotifyOrphanWork()) {
+            while (ProcessOrphanWork(MAX_ORPHAN_WORK_BATCH)) {}
+        }
+
         // Notifications/callbacks that can run without cs_main
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
@@ -2987,12 +3949,31 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
             // Don't relay blocks if pruning -- could cause a peer to try to download, resulting
             // in a stalled download if the block file is pruned before the request.
             if (nLocalServices & NODE_NETWORK) {
+                // Serialized once, pushed to the high-bandwidth peers and kept for the getdata of the others
+                CSerializedNetMsg cmpctblockMsg;
+                if (!setCmpctAnnounce.empty()) {
+                    cmpctblockMsg = MakeSerializedNetMsg("cmpctblock", CBlockHeaderAndShortTxIDs(*pblock));
+                    AddRecentBlockMsg(CInv(MSG_CMPCT_BLOCK, hashNewTip), cmpctblockMsg);
+                }
+                CInv inv(MSG_BLOCK, hashNewTip);
                 LOCK(cs_vNodes);
                 BOOST_FOREACH(CNode* pnode, vNodes)
                 {
                     if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
                     {
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                        bool fKnown = true;
+                        if (cmpctblockMsg && setCmpctAnnounce.count(pnode->GetId())) {
+                            LOCK(pnode->cs_inventory);
+                            fKnown = pnode->filterInventoryKnown.contains(inv.hash);
+                        }
+                        if (!fKnown) {
+                            pnode->AddInventoryKnown(inv);
+                            pnode->PushSerializedMessage(cmpctblockMsg);
+                        } else {
+                            // SendMessages decides whether these go out as headers or as an inv of the tip
+                            BOOST_REVERSE_FOREACH(const uint256& hash, vHashes)
+                                pnode->PushBlockHash(hash);
+                        }
                     }
                     else
                     {
@@ -3228,6 +4209,8 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
     pindexNew->nSequenceId = 0;
+    // Lookups without cs_main must not see the entry before it is linked in
+    LOCK(cs_blockIndexLookup);
     BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
     BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
@@ -3247,8 +4230,9 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
     	LogPrintf("%s: Block belong to a chain under punishment Delay VAL: %i BLOCKHEIGHT: %d\n",__func__, pindexNew->nChainDelay,pindexNew->nHeight);
     }
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
-    if (pindexBestHeader == NULL || (pindexBestHeader->nChainWork < pindexNew->nChainWork && pindexNew->nChainDelay==0))
+    if (pindexBestHeader == NULL || (pindexBestHeader->nChainWork < pindexNew->nChainWork && pindexNew->nChainDelay==0)) {
         pindexBestHeader = pindexNew;
+    }
 
     setDirtyBlockIndex.insert(pindexNew);
 
@@ -3774,7 +4758,7 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool
 
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1);
         fRequested |= fForceProcessing;
         if (!checked) {
             return error("%s: CheckBlock FAILED", __func__);
@@ -3992,6 +4976,7 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     CBlockIndex* pindexNew = new CBlockIndex();
     if (!pindexNew)
         throw runtime_error("LoadBlockIndex(): new CBlockIndex failed");
+    LOCK(cs_blockIndexLookup);
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -4102,6 +5087,18 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
 
+    // Check whether we have an address index
+    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    LogPrintf("%s: address index %s\n", __func__, fAddressIndex ? "enabled" : "disabled");
+
+    // Check whether we have a spent index
+    pblocktree->ReadFlag("spentindex", fSpentIndex);
+    LogPrintf("%s: spent index %s\n", __func__, fSpentIndex ? "enabled" : "disabled");
+
+    // Check whether we have a timestamp index
+    pblocktree->ReadFlag("timestampindex", fTimestampIndex);
+    LogPrintf("%s: timestamp index %s\n", __func__, fTimestampIndex ? "enabled" : "disabled");
+
     // Fill in-memory data
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
     {
@@ -4121,6 +5118,7 @@ bool static LoadBlockIndexDB()
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    PublishChainTipSnapshot();
     // Set hashAnchorEnd for the end of best chain
     it->second->hashAnchorEnd = pcoinsTip->GetBestAnchor();
 
@@ -4235,9 +5233,15 @@ void UnloadBlockIndex()
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
+    PublishChainTipSnapshot();
+    coinsRunningStats = CCoinsRunningStats();
+    pcoinsStatsView = NULL;
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
+    mapOrphanUsageByPeer.clear();
+    nOrphanUsage = 0;
+    setOrphanWorkSet.clear();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -4256,10 +5260,13 @@ void UnloadBlockIndex()
         warningcache[b].clear();
     }
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
+    {
+        LOCK(cs_blockIndexLookup);
+        BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
+            delete entry.second;
+        }
+        mapBlockIndex.clear();
     }
-    mapBlockIndex.clear();
     fHavePruned = false;
 }
 
@@ -4286,6 +5293,18 @@ bool InitBlockIndex() {
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", false);
     pblocktree->WriteFlag("txindex", fTxIndex);
+
+    // Use the provided setting for -addressindex in the new database
+    fAddressIndex = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
+    pblocktree->WriteFlag("addressindex", fAddressIndex);
+
+    // Use the provided setting for -spentindex in the new database
+    fSpentIndex = GetBoolArg("-spentindex", DEFAULT_SPENTINDEX);
+    pblocktree->WriteFlag("spentindex", fSpentIndex);
+
+    // Use the provided setting for -timestampindex in the new database
+    fTimestampIndex = GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX);
+    pblocktree->WriteFlag("timestampindex", fTimestampIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -4710,6 +5729,7 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
+                   setTxVerifyInFlight.count(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
                    pcoinsTip->HaveCoins(inv.hash);
         }
@@ -4720,83 +5740,154 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+/** The upload class the answer to a getdata request is charged to. */
+static UploadClass GetDataUploadClass(const CInv& inv)
+{
+    if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+        if (mi != mapBlockIndex.end() && mi->second->nHeight < chainActive.Height() - HISTORICAL_BLOCK_DEPTH)
+            return UPLOAD_HISTORICAL_BLOCKS;
+        return UPLOAD_TIP_RELAY;
+    }
+    if (inv.type == MSG_TX)
+        return UPLOAD_TX_RELAY;
+    return UPLOAD_OTHER;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
+    // cs_main is only held to decide which block to send, reading it from disk and
+    // pushing it happens without it so that other peers aren't held up meanwhile
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
             break;
 
         const CInv &inv = *it;
+        // Back off while the upload budget for this request is spent. The
+        // requests behind it wait too, so that they are answered in order.
+        UploadClass nClass = GetDataUploadClass(inv);
+        pfrom->fGetDataBackoff = !UploadBudgetAvailable(pfrom->fWhitelisted, nClass);
+        if (pfrom->fGetDataBackoff)
+            break;
         {
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                bool fSendCompact = false;
+                bool fRecent = false;
+                CDiskBlockPos blockPos;
+                uint256 hashTip;
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-
-                        // this is set by ConnectBlock method, when a new tip is added to the main chain
-                        bool b1 = mi->second->IsValid(BLOCK_VALID_SCRIPTS);
-                        bool b2 = (pindexBestHeader != NULL);
-                        bool b3 = (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth);
-                        bool b4 = (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
-
-                        send = b1 && b2 && b3 && b4;
-                        if (!send)
-                        {
-                            if (b2 && b3 && b4)
-                            {
-                                // BLOCK_VALID_SCRIPTS is set when connecting block on main chain, but we must
-                                // propagate also when relevant blocks are on a fork. Consider that a further check
-                                // on BLOCK_HAVE_DATA is performed below
-                                LogPrint("forks", "%s():%d: request from peer=%i: status[0x%x]\n",
-                                    __func__, __LINE__, pfrom->GetId(), mi->second->nStatus);
-                                send = true;
-                            }
-                            else
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+
+                            // this is set by ConnectBlock method, when a new tip is added to the main chain
+                            bool b1 = mi->second->IsValid(BLOCK_VALID_SCRIPTS);
+                            bool b2 = (pindexBestHeader != NULL);
+                            bool b3 = (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth);
+                            bool b4 = (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
+
+                            send = b1 && b2 && b3 && b4;
+                            if (!send)
                             {
-                                LogPrint("forks", "%s():%d: ignoring request from peer=%i: %s status[0x%x]\n",
-                                    __func__, __LINE__, pfrom->GetId(), inv.hash.ToString(), mi->second->nStatus);
+                                if (b2 && b3 && b4)
+                                {
+                                    // BLOCK_VALID_SCRIPTS is set when connecting block on main chain, but we must
+                                    // propagate also when relevant blocks are on a fork. Consider that a further check
+                                    // on BLOCK_HAVE_DATA is performed below
+                                    LogPrint("forks", "%s():%d: request from peer=%i: status[0x%x]\n",
+                                        __func__, __LINE__, pfrom->GetId(), mi->second->nStatus);
+                                    send = true;
+                                }
+                                else
+                                {
+                                    LogPrint("forks", "%s():%d: ignoring request from peer=%i: %s status[0x%x]\n",
+                                        __func__, __LINE__, pfrom->GetId(), inv.hash.ToString(), mi->second->nStatus);
+                                }
                             }
                         }
                     }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    if (send && !(mi->second->nStatus & BLOCK_HAVE_DATA))
+                    {
+                        LogPrint("forks", "%s():%d - NOT Pushing incomplete block [%s]\n", __func__, __LINE__, inv.hash.ToString() );
+                        send = false;
+                    }
+                    if (send)
+                    {
+                        blockPos = mi->second->GetBlockPos();
+                        hashTip = chainActive.Tip()->GetBlockHash();
+                        // Older blocks are unlikely to be reconstructible from the peer's
+                        // mempool, so they are always sent in full.
+                        fSendCompact = inv.type == MSG_CMPCT_BLOCK &&
+                            mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                        fRecent = chainActive.Contains(mi->second) &&
+                            mi->second->nHeight >= chainActive.Height() - MAX_BLOCKTXN_DEPTH;
+                    }
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+
+                if (send)
                 {
+                    // Recent blocks are served from the shared message cache
+                    CInv invMsg(fSendCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, inv.hash);
+                    CSerializedNetMsg msg;
+                    if (fRecent && inv.type != MSG_FILTERED_BLOCK)
+                        msg = GetRecentBlockMsg(invMsg);
+
                     // Send block from disk
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
+                    if (!msg && inv.type != MSG_FILTERED_BLOCK && (!ReadBlockFromDisk(block, blockPos) || block.GetHash() != inv.hash))
                     {
-                        LogPrint("forks", "%s():%d - Pushing block [%s]\n", __func__, __LINE__, block.GetHash().ToString() );
-                        pfrom->PushMessage("block", block);
+                        // the block file may have been pruned since cs_main was released
+                        LogPrint("net", "%s: cannot load block %s from disk, peer=%d\n", __func__, inv.hash.ToString(), pfrom->id);
+                        break;
+                    }
+                    if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        if (!msg)
+                        {
+                            if (fSendCompact)
+                                msg = MakeSerializedNetMsg("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                            else
+                                msg = MakeSerializedNetMsg("block", block);
+                            if (fRecent)
+                                AddRecentBlockMsg(invMsg, msg);
+                        }
+                        if (!fSendCompact)
+                            LogPrint("forks", "%s():%d - Pushing block [%s]\n", __func__, __LINE__, inv.hash.ToString() );
+                        pfrom->PushSerializedMessage(msg, nClass);
                     }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        std::shared_ptr<const CFilterableBlock> pfblock = GetFilterableBlock(inv.hash, blockPos);
+                        if (!pfblock)
+                        {
+                            LogPrint("net", "%s: cannot load block %s from disk, peer=%d\n", __func__, inv.hash.ToString(), pfrom->id);
+                            break;
+                        }
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                            CMerkleBlock merkleBlock(pfblock->block.GetBlockHeader(), pfblock->vtxElements, *pfrom->pfilter);
                             pfrom->PushMessage("merkleblock", merkleBlock);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                             // This avoids hurting performance by pointlessly requiring a round-trip
@@ -4806,8 +5897,15 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            {
+                                bool fKnown;
+                                {
+                                    LOCK(pfrom->cs_inventory);
+                                    fKnown = pfrom->filterInventoryKnown.contains(pair.second);
+                                }
+                                if (!fKnown)
+                                    pfrom->PushMessage("tx", pfblock->block.vtx[pair.first]);
+                            }
                         }
                         // else
                             // no response
@@ -4820,19 +5918,12 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashTip));
                         LogPrint("forks", "%s():%d - Pushing inv\n", __func__, __LINE__);
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue.SetNull();
                     }
                 }
-                else
-                {
-                    if (send && !(mi->second->nStatus & BLOCK_HAVE_DATA) )
-                    {
-                        LogPrint("forks", "%s():%d - NOT Pushing incomplete block [%s]\n", __func__, __LINE__, inv.hash.ToString() );
-                    }
-                }
             }
             else if (inv.IsKnownType())
             {
@@ -4840,9 +5931,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSerializedNetMsg>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSerializedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -4864,7 +5955,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4883,6 +5974,166 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/**
+ * Mempool admission of a transaction received from pfrom, together with the
+ * resolution of the orphans depending on it, relaying and reject/DoS handling.
+ * statePreCheck and fPreChecked are the outcome of PreCheckTransactionForMempool.
+ */
+static void ProcessTransactionFromPeer(CNode* pfrom, const CTransaction& tx, const CValidationState& statePreCheck, bool fPreChecked)
+{
+    CInv inv(MSG_TX, tx.GetHash());
+
+    LOCK(cs_main);
+    setTxVerifyInFlight.erase(inv.hash);
+
+    bool fMissingInputs = false;
+    CValidationState state(statePreCheck);
+
+    if (fPreChecked && !AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, true))
+    {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
+            pfrom->id, pfrom->cleanSubVer,
+            tx.GetHash().ToString(),
+            mempool.mapTx.size());
+
+        // Orphans that depended on this one are evaluated asynchronously, in batches
+        QueueOrphanWork(inv.hash);
+    }
+    // TODO: currently, prohibit joinsplits from entering mapOrphans
+    else if (fMissingInputs && tx.vjoinsplit.size() == 0)
+    {
+        AddOrphanTx(tx, pfrom->GetId());
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        size_t nMaxOrphanUsage = (size_t)std::max((int64_t)0, GetArg("-maxorphanpoolsize", DEFAULT_MAX_ORPHAN_POOL_SIZE)) * 1000;
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanUsage);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    } else {
+        assert(recentRejects);
+        recentRejects->insert(tx.GetHash());
+
+        if (pfrom->fWhitelisted) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they were already in the mempool or rejected from it due
+            // to policy, allowing the node to function as a gateway for
+            // nodes hidden behind it.
+            //
+            // Never relay transactions that we would assign a non-zero DoS
+            // score for, as we expect peers to do the same with us in that
+            // case.
+            int nDoS = 0;
+            if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
+                RelayTransaction(tx);
+            } else {
+                LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
+                    tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
+            }
+        }
+    }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+    {
+        LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", string("tx"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+void ThreadTxVerify()
+{
+    RenameThread("horizen-txverify");
+    txverifyqueue.AddWorker();
+    try {
+        while (true) {
+            std::pair<CTransaction, CNode*> item;
+            if (txverifyqueue.Pop(item)) {
+                CValidationState state;
+                bool fPreChecked = PreCheckTransactionForMempool(item.first, state);
+                ProcessTransactionFromPeer(item.second, item.first, state, fPreChecked);
+                item.second->Release();
+            } else if (ProcessOrphanWork(MAX_ORPHAN_WORK_BATCH)) {
+                txverifyqueue.NotifyOrphanWork();
+            }
+        }
+    } catch (const boost::thread_interrupted&) {
+        txverifyqueue.RemoveWorker();
+        throw;
+    }
+}
+
+/**
+ * Report the outcome of ProcessNewBlock for a block received from pfrom (as a
+ * block, a cmpctblock or a blocktxn). A peer that just gave us our new tip is
+ * a good candidate to announce the next ones as compact blocks.
+ */
+static void ProcessNewBlockResult(CNode* pfrom, CValidationState& state, const uint256& hash, const std::string& strCommand)
+{
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        LogPrint("forks", "%s():%d - Pushing reject, DoS[%d]\n", __func__, __LINE__, nDoS);
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), hash);
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+        return;
+    }
+
+    LOCK(cs_main);
+    if (!IsInitialBlockDownload() && chainActive.Tip()->GetBlockHash() == hash)
+        MaybeSetPeerAsAnnouncingHeaderAndIDs(State(pfrom->GetId()), pfrom);
+}
+
+/**
+ * Check a getcfilters, getcfheaders or getcfcheckpt request and find its stop
+ * block. Peers asking for filters we don't serve, or for a range we can't make
+ * sense of, are disconnected (BIP157). A stop block that is not on the active
+ * chain any more is only ignored, as the peer may not have seen a reorg yet.
+ */
+static bool PrepareBlockFilterRequest(CNode* pfrom, uint8_t nFilterType, uint32_t nStartHeight, const uint256& hashStop,
+                                      uint32_t nMaxHeightRange, const CBlockIndex*& pindexStop)
+{
+    if (!fPeerBlockFilters || !pblockfilterindex || nFilterType != pblockfilterindex->GetFilterType()) {
+        LogPrint("net", "peer %d requested unsupported block filter type %d\n", pfrom->id, nFilterType);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+        if (mi == mapBlockIndex.end()) {
+            LogPrint("net", "peer %d requested block filters up to unknown block %s\n", pfrom->id, hashStop.ToString());
+            pfrom->fDisconnect = true;
+            return false;
+        }
+        if (!chainActive.Contains(mi->second)) {
+            LogPrint("net", "peer %d requested block filters up to block %s, which is not in the active chain\n", pfrom->id, hashStop.ToString());
+            return false;
+        }
+        pindexStop = mi->second;
+    }
+
+    uint32_t nStopHeight = pindexStop->nHeight;
+    if (nStartHeight > nStopHeight || nStopHeight - nStartHeight >= nMaxHeightRange) {
+        LogPrint("net", "peer %d requested block filters of heights %u to %u\n", pfrom->id, nStartHeight, nStopHeight);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+    return true;
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -4957,7 +6208,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
         // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        {
+            LOCK(cs_main);
+            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        }
 
         // Change version
         pfrom->PushMessage("verack");
@@ -5034,6 +6288,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell our peer we prefer to receive new blocks as headers rather than invs.
+        pfrom->PushMessage("sendheaders");
+
+        // Tell our peer we can provide and receive compact blocks, but don't ask
+        // it to push them to us yet. Peers that don't know these messages ignore them.
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 1;
+        pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
     }
 
 
@@ -5161,9 +6424,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     }
                     pfrom->PushMessage("getheaders", bl, inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
-                    if (chainActive.Tip()->GetBlockTime() > GetTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                    if (CanDirectFetch(chainparams.GetConsensus()) &&
+                        nodestate->nBlocksInFlight < nodestate->nBlocksInFlightLimit) {
+                        // Near the tip most of the block is already in our mempool
+                        if (nodestate->fProvidesHeaderAndIDs)
+                            vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                        else
+                            vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -5297,9 +6564,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             vector<CBlock> vHeaders;
             int nLimit = MAX_HEADERS_RESULTS;
             LogPrint("net", "getheaders from h(%d) to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
+            CNodeState *nodestate = State(pfrom->GetId());
             for (; pindex; pindex = chainActive.Next(pindex))
             {
                 vHeaders.push_back(pindex->GetBlockHeader());
+                // Later announcements to this peer can be headers that connect to these
+                nodestate->pindexBestHeaderSent = pindex;
                 if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                     break;
             }
@@ -5459,130 +6729,38 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-
-        pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv);
-
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
         {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
-                pfrom->id, pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
+            LOCK(cs_main);
 
+            pfrom->setAskFor.erase(inv.hash);
+            mapAlreadyAskedFor.erase(inv);
 
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
+            // Another peer sent it too and it is still being verified
+            if (setTxVerifyInFlight.count(inv.hash))
+                return true;
+
+            // Nothing expensive to do for transactions we already know
+            if (AlreadyHave(inv)) {
+                ProcessTransactionFromPeer(pfrom, tx, CValidationState(), false);
+                return true;
             }
 
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            setTxVerifyInFlight.insert(inv.hash);
         }
-        // TODO: currently, prohibit joinsplits from entering mapOrphans
-        else if (fMissingInputs && tx.vjoinsplit.size() == 0)
-        {
-            AddOrphanTx(tx, pfrom->GetId());
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else {
-            assert(recentRejects);
-            recentRejects->insert(tx.GetHash());
-
-            if (pfrom->fWhitelisted) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
-                        tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
-                }
-            }
-        }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-        {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+        // Proofs and joinsplit signatures are checked by a ThreadTxVerify
+        // worker without cs_main; fall back to checking them here when the
+        // workers are disabled or already have enough queued.
+        if (!txverifyqueue.Push(tx, pfrom)) {
+            CValidationState state;
+            bool fPreChecked = PreCheckTransactionForMempool(tx, state);
+            ProcessTransactionFromPeer(pfrom, tx, state, fPreChecked);
         }
     }
 
@@ -5610,6 +6788,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // A peer announcing blocks with headers sends only the new ones. If we
+        // miss their parent, ask for the headers in between rather than treating
+        // the announcement as invalid, but don't let a peer do this forever.
+        if (nCount < MAX_HEADERS_RESULTS && mapBlockIndex.find(headers[0].hashPrevBlock) == mapBlockIndex.end()) {
+            nodestate->nUnconnectingHeaders++;
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            LogPrint("net", "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
+                headers[0].GetHash().ToString(), headers[0].hashPrevBlock.ToString(),
+                pindexBestHeader->nHeight, pfrom->id, nodestate->nUnconnectingHeaders);
+            // Remember the announcement, so the block can be fetched once the headers connect
+            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+            if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+                Misbehaving(pfrom->GetId(), 20);
+            return true;
+        }
+
         CBlockIndex *pindexLast = NULL;
         int cnt = 0;
         BOOST_FOREACH(const CBlockHeader& header, headers) {
@@ -5632,9 +6828,48 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
+        if (nodestate->nUnconnectingHeaders > 0)
+            LogPrint("net", "peer=%d: resetting nUnconnectingHeaders (%d -> 0)\n", pfrom->id, nodestate->nUnconnectingHeaders);
+        nodestate->nUnconnectingHeaders = 0;
+
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
+        // A short run of headers with more work than our tip is a new block announcement:
+        // fetch the blocks right away instead of waiting for the regular download logic.
+        if (pindexLast && nCount < MAX_HEADERS_RESULTS && CanDirectFetch(chainparams.GetConsensus()) &&
+            pindexLast->IsValid(BLOCK_VALID_TREE) && chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
+            vector<CBlockIndex*> vToFetch;
+            CBlockIndex *pindexWalk = pindexLast;
+            // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
+            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= (size_t)nodestate->nBlocksInFlightLimit) {
+                if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) && !mapBlocksInFlight.count(pindexWalk->GetBlockHash())) {
+                    // We don't have this block, and it's not yet in flight.
+                    vToFetch.push_back(pindexWalk);
+                }
+                pindexWalk = pindexWalk->pprev;
+            }
+            // A reorg this deep while we think we are caught up is left to the regular download logic.
+            if (!chainActive.Contains(pindexWalk)) {
+                LogPrint("net", "Large reorg, won't direct fetch to %s (%d)\n", pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
+            } else {
+                vector<CInv> vGetData;
+                // Download as much as possible, from earliest to latest.
+                BOOST_REVERSE_FOREACH(CBlockIndex *pindex, vToFetch) {
+                    if (nodestate->nBlocksInFlight >= nodestate->nBlocksInFlightLimit)
+                        break;
+                    vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex);
+                    LogPrint("net", "Requesting block %s from peer=%d\n", pindex->GetBlockHash().ToString(), pfrom->id);
+                }
+                // A single new block on top of our tip is mostly in our mempool already
+                if (vGetData.size() == 1 && nodestate->fProvidesHeaderAndIDs && pindexLast->pprev == chainActive.Tip())
+                    vGetData[0] = CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
+                if (!vGetData.empty())
+                    pfrom->PushMessage("getdata", vGetData);
+            }
+        }
+
         if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
             // Headers message had its maximum size; the peer may have more headers.
             // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
@@ -5672,17 +6907,233 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         // conditions in AcceptBlock().
         bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
         ProcessNewBlock(state, pfrom, &block, forceProcessing, NULL);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            LogPrint("forks", "%s():%d - Pushing reject, DoS[%d]\n", __func__, __LINE__, nDoS);
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
+        ProcessNewBlockResult(pfrom, state, block.GetHash(), strCommand);
+    }
+
+
+    else if (strCommand == "feefilter")
+    {
+        CAmount newFeeFilter = 0;
+        vRecv >> newFeeFilter;
+        if (MoneyRange(newFeeFilter)) {
+            {
+                LOCK(pfrom->cs_feeFilter);
+                pfrom->minFeeFilter = newFeeFilter;
+            }
+            LogPrint("net", "received: feefilter of %s from peer=%d\n", CFeeRate(newFeeFilter).ToString(), pfrom->id);
+        }
+    }
+
+
+    else if (strCommand == "sendheaders")
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fPreferHeaders = true;
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            CNodeState *nodestate = State(pfrom->GetId());
+            nodestate->fProvidesHeaderAndIDs = true;
+            nodestate->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        CDiskBlockPos blockPos;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+            if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+                LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+                return true;
+            }
+
+            if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+                // Answering with a full block makes a peer that asks for lots of old
+                // blocks pay for the disk reads it triggers with its own bandwidth.
+                LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+                pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+                ProcessGetData(pfrom);
+                return true;
+            }
+            blockPos = it->second->GetBlockPos();
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, blockPos) || block.GetHash() != req.blockhash) {
+            LogPrint("net", "%s: cannot load block %s from disk, peer=%d\n", __func__, req.blockhash.ToString(), pfrom->id);
+            return true;
+        }
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
                 LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer %d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        const uint256 hash = cmpctblock.header.GetHash();
+        LogPrint("net", "%s():%d - received cmpctblock %s peer=%d\n", __func__, __LINE__, hash.ToString(), pfrom->id);
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+                // Doesn't connect: rather than rejecting the header, ask for the ones leading up to it
+                if (!IsInitialBlockDownload())
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+                return true;
+            }
+
+            CBlockIndex *pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid header received via cmpctblock from peer=%d", pfrom->id);
+            }
+
+            pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+            UpdateBlockAvailability(pfrom->GetId(), hash);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(hash);
+            bool fInFlightFromPeer = blockInFlightIt != mapBlocksInFlight.end() && blockInFlightIt->second.first == pfrom->GetId();
+
+            if (pindex->nStatus & BLOCK_HAVE_DATA)
+                return true;
+
+            // Only a block extending our tip is worth reconstructing from the mempool;
+            // anything else is downloaded in full by the regular logic.
+            if (pindex->pprev != chainActive.Tip() || pindex->nTx != 0) {
+                if (fInFlightFromPeer) {
+                    vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                    pfrom->PushMessage("getdata", vInv);
+                }
+                return true;
+            }
+
+            if (blockInFlightIt != mapBlocksInFlight.end() && !fInFlightFromPeer) {
+                // Someone else is already sending us this block: use it only if our
+                // mempool has everything, without a round trip to this peer.
+                PartiallyDownloadedBlock tempBlock(&mempool);
+                if (tempBlock.InitData(cmpctblock) != READ_STATUS_OK)
+                    return true;
+                vector<CTransaction> vtxMissing;
+                if (tempBlock.FillBlock(block, vtxMissing) != READ_STATUS_OK)
+                    return true;
+            } else {
+                CNodeState *nodestate = State(pfrom->GetId());
+                list<QueuedBlock>::iterator queuedBlockIt;
+                if (fInFlightFromPeer) {
+                    queuedBlockIt = blockInFlightIt->second.second;
+                    if (queuedBlockIt->partialBlock)
+                        return true; // duplicate announcement
+                } else {
+                    if (nodestate->nBlocksInFlight >= nodestate->nBlocksInFlightLimit)
+                        return true;
+                    MarkBlockAsInFlight(pfrom->GetId(), hash, chainparams.GetConsensus(), pindex, &queuedBlockIt);
+                }
+
+                queuedBlockIt->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                PartiallyDownloadedBlock& partialBlock = *queuedBlockIt->partialBlock;
+                ReadStatus status = partialBlock.InitData(cmpctblock);
+                if (status == READ_STATUS_INVALID) {
+                    MarkBlockAsReceived(hash);
+                    Misbehaving(pfrom->GetId(), 100);
+                    return error("peer %d sent us an invalid compact block", pfrom->id);
+                }
+
+                BlockTransactionsRequest req;
+                if (status == READ_STATUS_OK) {
+                    for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                        if (!partialBlock.IsTxAvailable(i))
+                            req.indexes.push_back(i);
+                    }
+                    if (!req.indexes.empty()) {
+                        req.blockhash = hash;
+                        pfrom->PushMessage("getblocktxn", req);
+                        return true;
+                    }
+                    vector<CTransaction> vtxMissing;
+                    status = partialBlock.FillBlock(block, vtxMissing);
+                }
+                if (status != READ_STATUS_OK) {
+                    // Short id collision: the block stays in flight, fetch it in full
+                    queuedBlockIt->partialBlock.reset();
+                    vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                    pfrom->PushMessage("getdata", vInv);
+                    return true;
+                }
+            }
+        }
+
+        // The header was checked above and extends our tip, so this is processed
+        // even if it wasn't requested from this peer.
+        CValidationState state;
+        ProcessNewBlock(state, pfrom, &block, true, NULL);
+        ProcessNewBlockResult(pfrom, state, hash, strCommand);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+            if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+                    it->second.first != pfrom->GetId()) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;
+            partialBlock.swap(it->second.second->partialBlock);
+            ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer %d sent us invalid compact block/non-matching block transactions", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Might have collided, fall back to fetching the full block
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
             }
         }
 
+        CValidationState state;
+        ProcessNewBlock(state, pfrom, &block, true, NULL);
+        ProcessNewBlockResult(pfrom, state, resp.blockhash, strCommand);
     }
 
 
@@ -5701,7 +7152,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -5712,14 +7166,28 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     {
         LOCK2(cs_main, pfrom->cs_filter);
 
+        CAmount filterrate = 0;
+        {
+            LOCK(pfrom->cs_feeFilter);
+            filterrate = pfrom->minFeeFilter;
+        }
+
         std::vector<uint256> vtxid;
         mempool.queryHashes(vtxid);
         vector<CInv> vInv;
         BOOST_FOREACH(uint256& hash, vtxid) {
             CInv inv(MSG_TX, hash);
             CTransaction tx;
-            bool fInMemPool = mempool.lookup(hash, tx);
-            if (!fInMemPool) continue; // another thread removed since queryHashes, maybe...
+            CAmount nFeeRate = 0;
+            {
+                LOCK(mempool.cs);
+                std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.find(hash);
+                if (mi == mempool.mapTx.end()) continue; // another thread removed since queryHashes, maybe...
+                tx = mi->second.GetTx();
+                nFeeRate = CFeeRate(mi->second.GetFee(), mi->second.GetTxSize()).GetFeePerK();
+            }
+            if (filterrate && nFeeRate < filterrate)
+                continue;
             if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(tx)) ||
                (!pfrom->pfilter))
                 vInv.push_back(inv);
@@ -5870,16 +7338,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
         // and thus, the maximum size any matched object can have) in a filteradd message
+        bool bad = false;
         if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE)
         {
-            Misbehaving(pfrom->GetId(), 100);
+            bad = true;
         } else {
             LOCK(pfrom->cs_filter);
             if (pfrom->pfilter)
                 pfrom->pfilter->insert(vData);
             else
-                Misbehaving(pfrom->GetId(), 100);
+                bad = true;
         }
+        // Misbehaving takes cs_main, which must not be taken while holding cs_filter
+        if (bad)
+            Misbehaving(pfrom->GetId(), 100);
     }
 
 
@@ -5892,6 +7364,71 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "getcfilters")
+    {
+        uint8_t nFilterType;
+        uint32_t nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+        const CBlockIndex* pindexStop = NULL;
+        if (!PrepareBlockFilterRequest(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFILTERS_SIZE, pindexStop))
+            return true;
+
+        vector<BlockFilter> vFilters;
+        if (!pblockfilterindex->LookupFilterRange(nStartHeight, pindexStop, vFilters)) {
+            LogPrint("net", "block filters up to %s are not indexed yet, peer=%d\n", hashStop.ToString(), pfrom->id);
+            return true;
+        }
+        BOOST_FOREACH(const BlockFilter& filter, vFilters)
+            pfrom->PushMessage("cfilter", filter);
+    }
+
+
+    else if (strCommand == "getcfheaders")
+    {
+        uint8_t nFilterType;
+        uint32_t nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+        const CBlockIndex* pindexStop = NULL;
+        if (!PrepareBlockFilterRequest(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFHEADERS_SIZE, pindexStop))
+            return true;
+
+        uint256 prevHeader;
+        vector<uint256> vHashes;
+        if ((nStartHeight > 0 && !pblockfilterindex->LookupFilterHeader(pindexStop->GetAncestor(nStartHeight - 1), prevHeader)) ||
+            !pblockfilterindex->LookupFilterHashRange(nStartHeight, pindexStop, vHashes)) {
+            LogPrint("net", "block filters up to %s are not indexed yet, peer=%d\n", hashStop.ToString(), pfrom->id);
+            return true;
+        }
+        pfrom->PushMessage("cfheaders", nFilterType, hashStop, prevHeader, vHashes);
+    }
+
+
+    else if (strCommand == "getcfcheckpt")
+    {
+        uint8_t nFilterType;
+        uint256 hashStop;
+        vRecv >> nFilterType >> hashStop;
+
+        const CBlockIndex* pindexStop = NULL;
+        if (!PrepareBlockFilterRequest(pfrom, nFilterType, 0, hashStop, std::numeric_limits<uint32_t>::max(), pindexStop))
+            return true;
+
+        vector<uint256> vHeaders(pindexStop->nHeight / CFCHECKPT_INTERVAL);
+        for (size_t i = 0; i < vHeaders.size(); i++) {
+            const CBlockIndex* pindex = pindexStop->GetAncestor((i + 1) * CFCHECKPT_INTERVAL);
+            if (!pblockfilterindex->LookupFilterHeader(pindex, vHeaders[i])) {
+                LogPrint("net", "block filters up to %s are not indexed yet, peer=%d\n", hashStop.ToString(), pfrom->id);
+                return true;
+            }
+        }
+        pfrom->PushMessage("cfcheckpt", nFilterType, hashStop, vHeaders);
+    }
+
+
     else if (strCommand == "reject")
     {
         if (fDebug) {
@@ -5931,6 +7468,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     return true;
 }
 
+// Serializes the handling of the messages which aren't safe to process in parallel with other peers'
+// messages, see ThreadMessageHandler. Taken before cs_main.
+static CCriticalSection cs_serialMessages;
+
+/**
+ * Messages that only touch the state of the peer that sent them, or state with its own lock, and
+ * don't need cs_main for long: they are processed without cs_serialMessages, so that e.g. a peer
+ * downloading old blocks doesn't hold up the pings of the other peers.
+ */
+static bool IsParallelMessage(const std::string& strCommand)
+{
+    return strCommand == "ping" || strCommand == "pong" ||
+           strCommand == "addr" || strCommand == "getaddr" ||
+           strCommand == "getdata" || strCommand == "getblocktxn" || strCommand == "notfound" || strCommand == "reject" ||
+           strCommand == "feefilter" ||
+           strCommand == "filterload" || strCommand == "filteradd" || strCommand == "filterclear" ||
+           strCommand == "getcfilters" || strCommand == "getcfheaders" || strCommand == "getcfcheckpt";
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -5995,8 +7551,8 @@ bool ProcessMessages(CNode* pfrom)
 
         // Checksum
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = ReadLE32((unsigned char*)&hash);
+        const uint256& hash = msg.GetMessageHash();
+        unsigned int nChecksum = ReadLE32(hash.begin());
         if (nChecksum != hdr.nChecksum)
         {
             LogPrintf("%s(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n", __func__,
@@ -6008,7 +7564,12 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            if (IsParallelMessage(strCommand)) {
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            } else {
+                LOCK(cs_serialMessages);
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            }
             boost::this_thread::interruption_point();
         }
         catch (const std::ios_base::failure& e)
@@ -6052,9 +7613,24 @@ bool ProcessMessages(CNode* pfrom)
 }
 
 
+namespace {
+/** Orders (fee rate, txid) pairs highest fee rate first, for the transaction announcements of SendMessages. */
+struct CompareFeeRateDescending
+{
+    bool operator()(const pair<CAmount, uint256>& a, const pair<CAmount, uint256>& b) const
+    {
+        return a.first > b.first;
+    }
+};
+} // anon namespace
+
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
+    // Like cs_main below, don't wait for the serialized messages of other peers: the node is tried again later
+    TRY_LOCK(cs_serialMessages, lockSerial);
+    if (!lockSerial)
+        return true;
     {
         // Don't send anything until we get its version message
         if (pto->nVersion == 0)
@@ -6102,7 +7678,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 // Periodically clear addrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
+                {
+                    LOCK(pnode->cs_vAddrToSend);
                     pnode->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -6114,27 +7693,28 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: addr
         //
-        if (fSendTrickle)
+        if (fSendTrickle && UploadBudgetAvailable(pto->fWhitelisted, UPLOAD_ADDR))
         {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            vector<CAddress> vAddrAll;
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
+                LOCK(pto->cs_vAddrToSend);
+                vAddrAll.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddrAll.push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
+            // receiver rejects addr messages larger than 1000
+            for (size_t nStart = 0; nStart < vAddrAll.size(); nStart += 1000)
+            {
+                vector<CAddress> vAddr(vAddrAll.begin() + nStart, vAddrAll.begin() + std::min(nStart + 1000, vAddrAll.size()));
                 pto->PushMessage("addr", vAddr);
+            }
         }
 
         CNodeState &state = *State(pto->GetId());
@@ -6196,51 +7776,149 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             GetMainSignals().Broadcast(nTimeBestReceived);
         }
 
+        //
+        // Try sending block announcements via headers
+        //
+        {
+            // If the peer asked for headers announcements and the blocks we're relaying
+            // connect to a header it has, send the headers from the first one it doesn't
+            // have. Otherwise, or if there are too many of them, inv the tip.
+            LOCK(pto->cs_inventory);
+            vector<CBlock> vHeaders;
+            bool fRevertToInv = (!state.fPreferHeaders || pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
+            CBlockIndex *pBestIndex = NULL; // last header queued for delivery
+            ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
+
+            if (!fRevertToInv) {
+                bool fFoundStartingHeader = false;
+                BOOST_FOREACH(const uint256 &hash, pto->vBlockHashesToAnnounce) {
+                    BlockMap::iterator mi = mapBlockIndex.find(hash);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        // Bail out if we reorged away from this block
+                        fRevertToInv = true;
+                        break;
+                    }
+                    if (pBestIndex != NULL && pindex->pprev != pBestIndex) {
+                        // The blocks to announce don't connect to each other, e.g. after
+                        // the tip was invalidated and reconsidered.
+                        fRevertToInv = true;
+                        break;
+                    }
+                    pBestIndex = pindex;
+                    if (fFoundStartingHeader) {
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else if (PeerHasHeader(&state, pindex)) {
+                        continue; // keep looking for the first new block
+                    } else if (pindex->pprev == NULL || PeerHasHeader(&state, pindex->pprev)) {
+                        // Peer doesn't have this header but they do have the prior one.
+                        fFoundStartingHeader = true;
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else {
+                        // Nothing would connect
+                        fRevertToInv = true;
+                        break;
+                    }
+                }
+            }
+            if (fRevertToInv) {
+                // The last entry in vBlockHashesToAnnounce was our tip at some point in the past.
+                if (!pto->vBlockHashesToAnnounce.empty()) {
+                    const uint256 &hashToAnnounce = pto->vBlockHashesToAnnounce.back();
+                    BlockMap::iterator mi = mapBlockIndex.find(hashToAnnounce);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+
+                    // If the peer announced this block to us, don't inv it back.
+                    if (!PeerHasHeader(&state, pindex)) {
+                        pto->vInventoryToSend.push_back(CInv(MSG_BLOCK, hashToAnnounce));
+                        LogPrint("net", "%s: sending inv peer=%d hash=%s\n", __func__, pto->id, hashToAnnounce.ToString());
+                    }
+                }
+            } else if (!vHeaders.empty()) {
+                LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__, vHeaders.size(),
+                    vHeaders.front().GetHash().ToString(), vHeaders.back().GetHash().ToString(), pto->id);
+                pto->PushMessage("headers", vHeaders);
+                state.pindexBestHeaderSent = pBestIndex;
+            }
+            pto->vBlockHashesToAnnounce.clear();
+        }
+
         //
         // Message: inventory
         //
+        int64_t nNow = GetTimeMicros();
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
+            vInv.reserve(std::max<size_t>(pto->vInventoryToSend.size(), INVENTORY_BROADCAST_MAX));
+
+            // Blocks are announced right away
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() == MAX_INV_SZ) {
+                    LogPrint("forks", "%s():%d - Pushing inv\n", __func__, __LINE__);
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
+                }
+            }
+            pto->vInventoryToSend.clear();
+
+            // Transactions are announced in batches, at independent Poisson distributed
+            // times for each peer, so that the order in which peers hear of a transaction
+            // says little about where it came from. Whitelisted peers don't wait.
+            bool fSendTxInv = pto->fWhitelisted;
+            if (pto->nNextInvSend < nNow) {
+                fSendTxInv = true;
+                pto->nNextInvSend = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL >> !pto->fInbound);
+            }
+            if (fSendTxInv && !pto->setInventoryTxToSend.empty() && UploadBudgetAvailable(pto->fWhitelisted, UPLOAD_TX_RELAY)) {
+                CAmount filterrate = 0;
                 {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
+                    LOCK(pto->cs_feeFilter);
+                    filterrate = pto->minFeeFilter;
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                // Highest fee rate first; drop what left the mempool or pays less than the peer wants
+                vector<pair<CAmount, uint256> > vTxToSend;
+                vTxToSend.reserve(pto->setInventoryTxToSend.size());
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        LogPrint("forks", "%s():%d - Pushing inv\n", __func__, __LINE__);
+                    LOCK(mempool.cs);
+                    std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin();
+                    while (it != pto->setInventoryTxToSend.end()) {
+                        std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.find(*it);
+                        CAmount nFeeRate = 0;
+                        if (mi != mempool.mapTx.end())
+                            nFeeRate = CFeeRate(mi->second.GetFee(), mi->second.GetTxSize()).GetFeePerK();
+                        if (mi == mempool.mapTx.end() || (filterrate && nFeeRate < filterrate) ||
+                            pto->filterInventoryKnown.contains(*it)) {
+                            pto->setInventoryTxToSend.erase(it++);
+                            continue;
+                        }
+                        vTxToSend.push_back(make_pair(nFeeRate, *it));
+                        ++it;
+                    }
+                }
+                std::stable_sort(vTxToSend.begin(), vTxToSend.end(), CompareFeeRateDescending());
+
+                unsigned int nRelayedTransactions = 0;
+                for (vector<pair<CAmount, uint256> >::const_iterator it = vTxToSend.begin();
+                     it != vTxToSend.end() && nRelayedTransactions < INVENTORY_BROADCAST_MAX; ++it) {
+                    pto->setInventoryTxToSend.erase(it->second);
+                    pto->filterInventoryKnown.insert(it->second);
+                    vInv.push_back(CInv(MSG_TX, it->second));
+                    nRelayedTransactions++;
+                    if (vInv.size() == MAX_INV_SZ) {
                         pto->PushMessage("inv", vInv);
                         vInv.clear();
                     }
                 }
             }
-            pto->vInventoryToSend = vInvWait;
         }
         if (!vInv.empty())
         {
@@ -6248,8 +7926,23 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             pto->PushMessage("inv", vInv);
         }
 
+        //
+        // Message: feefilter
+        //
+        if (!IsInitialBlockDownload() && GetBoolArg("-feefilter", DEFAULT_FEEFILTER) && nNow > pto->nextSendTimeFeeFilter) {
+            // Transactions below the minimum relay fee are only turned away when free
+            // relay is disabled; otherwise some of them are still accepted.
+            CAmount currentFilter = 0;
+            if (GetArg("-limitfreerelay", 15) <= 0)
+                currentFilter = ::minRelayTxFee.GetFeePerK();
+            if (currentFilter != pto->lastSentFeeFilter) {
+                pto->PushMessage("feefilter", currentFilter);
+                pto->lastSentFeeFilter = currentFilter;
+            }
+            pto->nextSendTimeFeeFilter = PoissonNextSend(nNow, AVG_FEEFILTER_BROADCAST_INTERVAL);
+        }
+
         // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -6284,19 +7977,47 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        UpdateBlockDownloadLimit(&state, pto);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < state.nBlocksInFlightLimit) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            FindNextBlocksToDownload(pto->GetId(), state.nBlocksInFlightLimit - state.nBlocksInFlight, vToDownload, staller);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
                 LogPrint("net", "%s():%d Requesting block %s (%d) peer=%d\n",
                     __func__, __LINE__, pindex->GetBlockHash().ToString(), pindex->nHeight, pto->id);
             }
-            if (state.nBlocksInFlight == 0 && staller != -1) {
-                if (State(staller)->nStallingSince == 0) {
-                    State(staller)->nStallingSince = nNow;
+            if (vToDownload.empty() && staller != -1) {
+                // We could download more if the window could move. If the staller is late with
+                // the block it is serving now, take over its requests and count it as slower.
+                // That block is being served since it was requested or since the previous one
+                // arrived, like in MarkBlockAsReceived; the requests behind it just wait.
+                CNodeState *stallerState = State(staller);
+                assert(!stallerState->vBlocksInFlight.empty());
+                int64_t nServingSince = std::max(stallerState->vBlocksInFlight.front().nTime, stallerState->nLastBlockReceived);
+                int64_t nLateAfter = std::max<int64_t>(BLOCK_STALLING_TIMEOUT * 1000000 / 4, 4 * stallerState->nBlockServiceTime);
+                vector<CBlockIndex*> vReassign;
+                if (nNow - nServingSince > nLateAfter) {
+                    BOOST_FOREACH(const QueuedBlock& queuedBlock, stallerState->vBlocksInFlight) {
+                        if ((int)vReassign.size() >= state.nBlocksInFlightLimit - state.nBlocksInFlight)
+                            break;
+                        if (queuedBlock.pindex && state.pindexBestKnownBlock &&
+                            state.pindexBestKnownBlock->GetAncestor(queuedBlock.pindex->nHeight) == queuedBlock.pindex)
+                            vReassign.push_back(queuedBlock.pindex);
+                    }
+                }
+                BOOST_FOREACH(CBlockIndex *pindex, vReassign) {
+                    vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
+                }
+                if (!vReassign.empty()) {
+                    LogPrint("net", "Reassigning %u stalled blocks from peer=%d to peer=%d\n", vReassign.size(), staller, pto->id);
+                    // The block it is serving took at least this long already
+                    stallerState->nBlockServiceTime = std::max(stallerState->nBlockServiceTime, nNow - nServingSince);
+                    stallerState->nStallingSince = 0;
+                } else if (state.nBlocksInFlight == 0 && stallerState->nStallingSince == 0) {
+                    stallerState->nStallingSince = nNow;
                     LogPrint("net", "Stall started peer=%d\n", staller);
                 }
             }
@@ -6351,6 +8072,7 @@ public:
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanUsageByPeer.clear();
     }
 } instance_of_cmaincleanup;
 
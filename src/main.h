@@ -30,6 +30,7 @@
 #include <algorithm>
 #include <exception>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -40,12 +41,19 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewDB;
+class CBlockUndo;
 class CBloomFilter;
 class CInv;
 class CScriptCheck;
 class CValidationInterface;
 class CValidationState;
 
+struct CAddressIndexKey;
+struct CAddressUnspentKey;
+struct CAddressUnspentValue;
+struct CSpentIndexKey;
+struct CSpentIndexValue;
 struct CNodeStateStats;
 
 /** Default for -blockmaxsize and -blockminsize, which control the range of sizes the mining code will create **/
@@ -67,6 +75,28 @@ static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphanpoolsize, maximum memory used by orphan transactions in kilobytes */
+static const unsigned int DEFAULT_MAX_ORPHAN_POOL_SIZE = 1000;
+/** A single peer's orphans may use at most this fraction (1/n) of the orphan pool */
+static const unsigned int ORPHAN_POOL_PEER_SHARE = 5;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Number of orphans re-evaluated per cs_main acquisition once their parents arrive */
+static const unsigned int MAX_ORPHAN_WORK_BATCH = 100;
+/** Default for -addressindex */
+static const bool DEFAULT_ADDRESSINDEX = false;
+/** Default for -spentindex */
+static const bool DEFAULT_SPENTINDEX = false;
+/** Default for -timestampindex */
+static const bool DEFAULT_TIMESTAMPINDEX = false;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Interval in seconds between periodic dumps of the mempool */
+static const int64_t MEMPOOL_DUMP_INTERVAL = 15 * 60;
+/** Number of transactions read and verified at a time when loading the mempool */
+static const uint64_t MEMPOOL_LOAD_BATCH_SIZE = 1000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -77,8 +107,29 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Maximum number of threads verifying relayed transactions ahead of mempool admission */
+static const int MAX_TXVERIFY_THREADS = 16;
+/** -txverifythreads default (0 = verify relayed transactions in the message handler thread) */
+static const int DEFAULT_TXVERIFY_THREADS = 2;
+/** Relayed transactions waiting for a verification thread before the message handler verifies them itself */
+static const unsigned int MAX_TXVERIFY_QUEUE_SIZE = 1000;
+/** Number of blocks that can be requested at any given time from a single peer, until its throughput is known. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds of the per-peer block request limit, which adapts to the peer's round trip time and delivery rate. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 4;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER_LIMIT = 64;
+/** Maximum number of blocks to announce with a headers message, more are announced with an inv of the tip. */
+static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
+/** Number of unconnecting headers announcements a peer may send before it is penalized. */
+static const int MAX_UNCONNECTING_HEADERS = 10;
+/** Average delay between announcements of transactions to a peer, in seconds; outbound peers get half of it. */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of transactions announced at once, which limits how fast a low-fee flood propagates. */
+static const unsigned int INVENTORY_BROADCAST_MAX = 7 * INVENTORY_BROADCAST_INTERVAL;
+/** Average delay between checks of whether peers need to be told our fee filter, in seconds. */
+static const unsigned int AVG_FEEFILTER_BROADCAST_INTERVAL = 10 * 60;
+/** Default for -feefilter, whether to tell peers the fee rate below which we don't want to hear about transactions. */
+static const bool DEFAULT_FEEFILTER = true;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -89,6 +140,25 @@ static const unsigned int MAX_HEADERS_RESULTS = 160;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum depth of blocks we're willing to serve as compact blocks to peers
+ *  when requested. For older blocks, a regular BLOCK response will be sent. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of blocks we're willing to respond to GETBLOCKTXN requests for. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of peers we ask to announce new blocks to us as compact blocks without an inv round trip. */
+static const unsigned int MAX_CMPCTBLOCK_HB_PEERS = 3;
+/** Number of blocks whose filters can be asked for with one getcfilters message */
+static const uint32_t MAX_GETCFILTERS_SIZE = 1000;
+/** Number of blocks whose filter hashes can be asked for with one getcfheaders message */
+static const uint32_t MAX_GETCFHEADERS_SIZE = 2000;
+/** Height interval between the filter headers of a cfcheckpt message */
+static const int CFCHECKPT_INTERVAL = 1000;
+/** Number of blocks kept ready, with their transactions' bloom filter elements extracted, to serve merkleblocks */
+static const unsigned int MAX_FILTERABLE_BLOCKS = 16;
+/** Blocks more than this many blocks below the tip are served from the upload budget for historical blocks */
+static const int HISTORICAL_BLOCK_DEPTH = 144;
+/** Number of serialized block and cmpctblock messages of recent blocks kept to answer getdata without going to disk */
+static const unsigned int MAX_RECENT_BLOCK_MSGS = 8;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
@@ -126,6 +196,9 @@ extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fAddressIndex;
+extern bool fSpentIndex;
+extern bool fTimestampIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
@@ -208,6 +281,8 @@ bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Open an undo file (rev?????.dat) */
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
+/** Open a file of the kind prefix?????.dat next to the block files */
+FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly = false);
 /** Translation to a filesystem path */
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
@@ -227,6 +302,12 @@ bool ProcessMessages(CNode* pfrom);
  * @param[in]   fSendTrickle    When true send the trickled data, otherwise trickle the data until true.
  */
 bool SendMessages(CNode* pto, bool fSendTrickle);
+/**
+ * Number of blocks to keep requested from a peer: enough to cover its round
+ * trip at the rate it serves blocks, with the same again as headroom, or
+ * MAX_BLOCKS_IN_TRANSIT_PER_PEER while either is unknown.
+ */
+int GetBlockDownloadLimit(int64_t nMinPingUsecTime, int64_t nBlockServiceTime);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
 /** Try to detect Partition (network isolation) attacks against us */
@@ -237,6 +318,14 @@ bool IsInitialBlockDownload();
 std::string GetWarnings(const std::string& strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowSlow = false);
+/** Read the balance changes of an address from the address index, optionally only those from height nStart to nEnd */
+bool GetAddressIndex(int type, const uint160& hashBytes, std::vector<std::pair<CAddressIndexKey, CAmount> >& vIndex, int nStart = 0, int nEnd = 0);
+/** Read the unspent outputs of an address from the address index */
+bool GetAddressUnspent(int type, const uint160& hashBytes, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent);
+/** Find the input spending an output in the spent index */
+bool GetSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value);
+/** Read the hashes of blocks with a time from nLow up to but not including nHigh from the timestamp index */
+bool GetTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<uint256>& vHashes);
 /** Find the best known block, and make it the tip of the block chain */
 bool ActivateBestChain(CValidationState &state, CBlock *pblock = NULL);
 /** Find an alternative chain tip and propagate to the network */
@@ -286,9 +375,25 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
+/**
+ * Context-free part of AcceptToMemoryPool (input limit, structure, joinsplit
+ * signature and proofs). Does not need cs_main, so callers can run it before
+ * taking the lock and then pass fPreChecked to AcceptToMemoryPool.
+ */
+bool PreCheckTransactionForMempool(const CTransaction& tx, CValidationState& state);
+
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fPreChecked=false);
+
+/** Run a worker verifying transactions relayed by peers, see -txverifythreads */
+void ThreadTxVerify();
+
+/** Dump the mempool to disk, parents before children. */
+bool DumpMempool();
+
+/** Load the mempool from disk, verifying the proofs of the loaded transactions in parallel. */
+bool LoadMempool();
 
 /** Get the BIP9 state for a given deployment at the current tip. */
 ThresholdState VersionBitsTipState(const Consensus::Params& params, Consensus::DeploymentPos pos);
@@ -301,6 +406,8 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlocksInFlightLimit;
+    int64_t nBlockServiceTime;
 };
 
 struct CDiskTxPos : public CDiskBlockPos
@@ -386,6 +493,10 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 /** Context-independent validity checks */
 bool CheckTransaction(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier);
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state);
+/** The part of CheckTransaction that does not look at the active chain, safe to call without cs_main */
+bool CheckTransactionContextFree(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier);
+/** Reject outputs whose type is not yet allowed at the active chain height (replay protection) */
+bool CheckTransactionOutputsAllowed(const CTransaction& tx, CValidationState& state);
 
 /** Check for standard transaction types
  * @return True if all outputs (scriptPubKeys) use only standard transaction forms
@@ -448,6 +559,8 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read the undo data of a block, checking it against the hash of the block's parent */
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -560,12 +673,62 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex *pindex);
 /** The currently-connected chain of blocks. */
 extern CChain chainActive;
 
+/**
+ * The tip of chainActive at one point in time. A new snapshot is published
+ * under cs_main whenever the tip changes; a published snapshot is never
+ * modified. Block index entries do not change their place
+ * in the block tree once added, so walking back from pindexTip needs no lock.
+ */
+struct CChainTipSnapshot
+{
+    const CBlockIndex* pindexTip; //!< NULL until the block index is loaded
+    int nHeight;
+    uint256 hashBlock;
+    unsigned int nNextBits; //!< nBits required of a block on top of pindexTip
+
+    CChainTipSnapshot() : pindexTip(NULL), nHeight(-1), nNextBits(0) {}
+
+    /** The block at nHeightIn in this chain, or NULL */
+    const CBlockIndex* operator[](int nHeightIn) const {
+        if (pindexTip == NULL || nHeightIn < 0 || nHeightIn > nHeight)
+            return NULL;
+        return pindexTip->GetAncestor(nHeightIn);
+    }
+
+    bool Contains(const CBlockIndex* pindex) const {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** The successor of pindex in this chain, or NULL */
+    const CBlockIndex* Next(const CBlockIndex* pindex) const {
+        if (Contains(pindex))
+            return (*this)[pindex->nHeight + 1];
+        return NULL;
+    }
+};
+
+/** The latest chain tip snapshot. Does not take cs_main. */
+std::shared_ptr<const CChainTipSnapshot> GetChainTipSnapshot();
+
+/** Find an entry of mapBlockIndex without holding cs_main. Returns NULL if the hash is unknown. */
+const CBlockIndex* LookupBlockIndex(const uint256& hash);
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/**
+ * Load the running UTXO set statistics stored with the chain state in pview,
+ * or compute them by reading the whole set if they are missing or stale.
+ * They are stored back with every flush of the chain state.
+ * Call once the block index is loaded.
+ */
+bool LoadCoinsRunningStats(CCoinsViewDB* pview);
+/** Running UTXO set statistics of the chain tip (requires cs_main) */
+const CCoinsRunningStats& GetCoinsRunningStats();
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
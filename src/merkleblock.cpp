@@ -37,6 +37,32 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
     txn = CPartialMerkleTree(vHashes, vMatch);
 }
 
+CMerkleBlock::CMerkleBlock(const CBlockHeader& blockHeader, const std::vector<CBloomTxElements>& vtxElements, CBloomFilter& filter)
+{
+    header = blockHeader;
+
+    vector<bool> vMatch;
+    vector<uint256> vHashes;
+
+    vMatch.reserve(vtxElements.size());
+    vHashes.reserve(vtxElements.size());
+
+    for (unsigned int i = 0; i < vtxElements.size(); i++)
+    {
+        const uint256& hash = vtxElements[i].hash;
+        if (filter.IsRelevantAndUpdate(vtxElements[i]))
+        {
+            vMatch.push_back(true);
+            vMatchedTxn.push_back(make_pair(i, hash));
+        }
+        else
+            vMatch.push_back(false);
+        vHashes.push_back(hash);
+    }
+
+    txn = CPartialMerkleTree(vHashes, vMatch);
+}
+
 CMerkleBlock::CMerkleBlock(const CBlock& block, const std::set<uint256>& txids)
 {
     header = block.GetBlockHeader();
@@ -139,6 +139,12 @@ public:
      */
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
 
+    /**
+     * Same as above, for a block whose transactions' data elements were
+     * extracted beforehand, which is what serving it to many peers needs.
+     */
+    CMerkleBlock(const CBlockHeader& blockHeader, const std::vector<CBloomTxElements>& vtxElements, CBloomFilter& filter);
+
     // Create from a CBlock, matching the txids in the set
     CMerkleBlock(const CBlock& block, const std::set<uint256>& txids);
 
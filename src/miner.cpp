@@ -38,6 +38,7 @@
 #ifdef ENABLE_MINING
 #include <functional>
 #endif
+#include <memory>
 #include <mutex>
 
 using namespace std;
@@ -573,6 +574,95 @@ CBlockTemplate* CreateNewBlockWithKey()
 
 #ifdef ENABLE_MINING
 
+/** The solver in crypto/equihash, it supports the parameters of every network */
+class CDefaultEquihashSolver : public CEquihashSolver
+{
+private:
+    unsigned int n;
+    unsigned int k;
+
+public:
+    CDefaultEquihashSolver(unsigned int nIn, unsigned int kIn) : n(nIn), k(kIn) {}
+
+    std::string GetName() const { return "default"; }
+
+    bool Solve(const eh_HashState& base_state,
+               const std::function<bool(std::vector<unsigned char>)>& validBlock,
+               const std::function<bool(EhSolverCancelCheck)>& cancelled)
+    {
+        return EhOptimisedSolve(n, k, base_state, validBlock, cancelled);
+    }
+};
+
+/**
+ * John Tromp's solver in pow/tromp, built for n = WN, k = WK only.  Its memory
+ * is allocated once and reused for every nonce.  The Blake2b hashing goes
+ * through libsodium, which uses the SSSE3/AVX2 implementation the CPU
+ * supports.
+ */
+class CTrompEquihashSolver : public CEquihashSolver
+{
+private:
+    equi eq;
+
+public:
+    CTrompEquihashSolver() : eq(1) {}
+
+    std::string GetName() const { return "tromp"; }
+
+    bool Solve(const eh_HashState& base_state,
+               const std::function<bool(std::vector<unsigned char>)>& validBlock,
+               const std::function<bool(EhSolverCancelCheck)>& cancelled)
+    {
+        eq.setstate(&base_state);
+
+        // Intialization done, start algo driver.
+        eq.digit0(0);
+        eq.xfull = eq.bfull = eq.hfull = 0;
+        eq.showbsizes(0);
+        for (u32 r = 1; r < WK; r++) {
+            if (cancelled(RoundEnd))
+                throw EhSolverCancelledException();
+            (r&1) ? eq.digitodd(r, 0) : eq.digiteven(r, 0);
+            eq.xfull = eq.bfull = eq.hfull = 0;
+            eq.showbsizes(r);
+        }
+        eq.digitK(0);
+
+        // Convert solution indices to byte array (decompress) and pass it to validBlock method.
+        for (size_t s = 0; s < eq.nsols; s++) {
+            LogPrint("pow", "Checking solution %d\n", s+1);
+            std::vector<eh_index> index_vector(PROOFSIZE);
+            for (size_t i = 0; i < PROOFSIZE; i++) {
+                index_vector[i] = eq.sols[s][i];
+            }
+            std::vector<unsigned char> sol_char = GetMinimalFromIndices(index_vector, DIGITBITS);
+
+            if (validBlock(sol_char)) {
+                // If we find a POW solution, do not try other solutions
+                // because they become invalid as we created a new block in blockchain.
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+bool IsKnownEquihashSolver(const std::string& name)
+{
+    return name == "default" || name == "tromp";
+}
+
+CEquihashSolver* CreateEquihashSolver(const std::string& name, unsigned int n, unsigned int k)
+{
+    if (name == "tromp") {
+        if (n == WN && k == WK)
+            return new CTrompEquihashSolver();
+        LogPrintf("Equihash solver \"tromp\" doesn't support n = %u, k = %u, using \"default\"\n", n, k);
+    }
+    return new CDefaultEquihashSolver(n, k);
+}
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -631,31 +721,119 @@ static bool ProcessBlockFound(CBlock* pblock)
     return true;
 }
 
+/**
+ * Block template shared by the miner threads.  Each thread mines its own copy
+ * with its index in the top 16 bits of the nonce, so the threads never search
+ * the same nonces and the template is only rebuilt when the tip or the mempool
+ * changes, or when a thread has run through its nonces.
+ */
+class CMinerTemplate
+{
+private:
+    boost::mutex cs;
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    int64_t nTimeCreated;
+    unsigned int nExtraNonce;
+    uint64_t nGeneration;
+#ifdef ENABLE_WALLET
+    CWallet* pwallet;
+    CReserveKey reservekey;
+#endif
+
+    bool IsStale() const
+    {
+        return !pblocktemplate || pindexPrev != chainActive.Tip() ||
+               (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nTimeCreated > 60);
+    }
+
+public:
+#ifdef ENABLE_WALLET
+    CMinerTemplate(CWallet* pwalletIn)
+        : pindexPrev(NULL), nTransactionsUpdatedLast(0), nTimeCreated(0), nExtraNonce(0), nGeneration(0),
+          pwallet(pwalletIn), reservekey(pwalletIn) {}
+#else
+    CMinerTemplate()
+        : pindexPrev(NULL), nTransactionsUpdatedLast(0), nTimeCreated(0), nExtraNonce(0), nGeneration(0) {}
+#endif
+
+    /**
+     * Copy the current template into block, first rebuilding it if it is
+     * stale, or if fRenew is set and nGenerationInOut is still current.
+     * Returns false if no template could be created.
+     */
+    bool Get(CBlock& block, CBlockIndex*& pindexPrevOut, uint64_t& nGenerationInOut, bool fRenew)
+    {
+        boost::mutex::scoped_lock lock(cs);
+        if (IsStale() || (fRenew && nGenerationInOut == nGeneration)) {
+            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+            pindexPrev = chainActive.Tip();
+#ifdef ENABLE_WALLET
+            pblocktemplate.reset(CreateNewBlockWithKey(reservekey));
+#else
+            pblocktemplate.reset(CreateNewBlockWithKey());
+#endif
+            if (!pblocktemplate)
+                return false;
+            IncrementExtraNonce(&pblocktemplate->block, pindexPrev, nExtraNonce);
+            nTimeCreated = GetTime();
+            nGeneration++;
+            LogPrintf("Running HorizenMiner with %u transactions in block (%u bytes)\n", pblocktemplate->block.vtx.size(),
+                ::GetSerializeSize(pblocktemplate->block, SER_NETWORK, PROTOCOL_VERSION));
+        }
+        block = pblocktemplate->block;
+        pindexPrevOut = pindexPrev;
+        nGenerationInOut = nGeneration;
+        return true;
+    }
+
+    /** Return whether the template was replaced since nGenerationIn, or should be */
+    bool IsOutdated(uint64_t nGenerationIn)
+    {
+        boost::mutex::scoped_lock lock(cs);
+        return nGenerationIn != nGeneration || IsStale();
+    }
+
+    /** Submit a solved block; the next Get builds a new template */
+    bool BlockFound(CBlock* pblock)
+    {
+        boost::mutex::scoped_lock lock(cs);
+        pblocktemplate.reset();
 #ifdef ENABLE_WALLET
-void static BitcoinMiner(CWallet *pwallet)
+        return ProcessBlockFound(pblock, *pwallet, reservekey);
 #else
-void static BitcoinMiner()
+        return ProcessBlockFound(pblock);
 #endif
+    }
+};
+
+struct CMinerThreadStats
+{
+    AtomicCounter solutionTargetChecks;
+    AtomicTimer timer;
+    std::string solver; //! guarded by cs_minerStats
+};
+
+static boost::mutex cs_minerStats;
+static std::vector<std::shared_ptr<CMinerThreadStats> > vMinerThreadStats;
+
+void static BitcoinMiner(int nThread, std::shared_ptr<CMinerTemplate> minerTemplate, std::shared_ptr<CMinerThreadStats> stats)
 {
     LogPrintf("HorizenMiner started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("zen-miner");
     const CChainParams& chainparams = Params();
 
-#ifdef ENABLE_WALLET
-    // Each thread has its own key
-    CReserveKey reservekey(pwallet);
-#endif
-
-    // Each thread has its own counter
-    unsigned int nExtraNonce = 0;
-
     unsigned int n = chainparams.EquihashN();
     unsigned int k = chainparams.EquihashK();
 
-    std::string solver = GetArg("-equihashsolver", "default");
-    assert(solver == "tromp" || solver == "default");
-    LogPrint("pow", "Using Equihash solver \"%s\" with n = %u, k = %u\n", solver, n, k);
+    std::unique_ptr<CEquihashSolver> solver(CreateEquihashSolver(GetArg("-equihashsolver", "default"), n, k));
+    {
+        boost::mutex::scoped_lock lock(cs_minerStats);
+        stats->solver = solver->GetName();
+    }
+    LogPrint("pow", "Using Equihash solver \"%s\" with n = %u, k = %u\n", solver->GetName(), n, k);
 
     std::mutex m_cs;
     bool cancelSolver = false;
@@ -666,13 +844,17 @@ void static BitcoinMiner()
         }
     );
     miningTimer.start();
+    stats->timer.start();
 
     try {
+        uint64_t nGeneration = 0;
+        bool fRenew = false;
         while (true) {
             if (chainparams.MiningRequiresPeers()) {
                 // Busy-wait for the network to come online so we don't waste time mining
                 // on an obsolete chain. In regtest mode we expect to fly solo.
                 miningTimer.stop();
+                stats->timer.stop();
                 do {
                     bool fvNodesEmpty;
                     {
@@ -684,20 +866,16 @@ void static BitcoinMiner()
                     MilliSleep(1000);
                 } while (true);
                 miningTimer.start();
+                stats->timer.start();
             }
 
             //
-            // Create new block
+            // Get the shared block
             //
-            unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrev = chainActive.Tip();
-
-#ifdef ENABLE_WALLET
-            unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
-#else
-            unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey());
-#endif
-            if (!pblocktemplate.get())
+            CBlock block;
+            CBlock *pblock = &block;
+            CBlockIndex* pindexPrev;
+            if (!minerTemplate->Get(block, pindexPrev, nGeneration, fRenew))
             {
                 if (GetArg("-mineraddress", "").empty()) {
                     LogPrintf("Error in HorizenMiner: Keypool ran out, please call keypoolrefill before restarting the mining thread\n");
@@ -705,17 +883,18 @@ void static BitcoinMiner()
                     // Should never reach here, because -mineraddress validity is checked in init.cpp
                     LogPrintf("Error in HorizenMiner: Invalid -mineraddress\n");
                 }
-                return;
+                break;
             }
-            CBlock *pblock = &pblocktemplate->block;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-            LogPrintf("Running HorizenMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
-                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+            fRenew = false;
+
+            // Search this thread's share of the nonces
+            arith_uint256 nonce = UintToArith256(pblock->nNonce);
+            nonce |= arith_uint256(nThread & 0xffff) << 240;
+            pblock->nNonce = ArithToUint256(nonce);
 
             //
             // Search
             //
-            int64_t nStart = GetTime();
             arith_uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
 
             while (true) {
@@ -740,19 +919,16 @@ void static BitcoinMiner()
 
                 // (x_1, x_2, ...) = A(I, V, n, k)
                 LogPrint("pow", "Running Equihash solver \"%s\" with nNonce = %s\n",
-                         solver, pblock->nNonce.ToString());
+                         solver->GetName(), pblock->nNonce.ToString());
 
                 std::function<bool(std::vector<unsigned char>)> validBlock =
-#ifdef ENABLE_WALLET
-                        [&pblock, &hashTarget, &pwallet, &reservekey, &m_cs, &cancelSolver, &chainparams]
-#else
-                        [&pblock, &hashTarget, &m_cs, &cancelSolver, &chainparams]
-#endif
+                        [&pblock, &hashTarget, &minerTemplate, &stats, &m_cs, &cancelSolver, &chainparams]
                         (std::vector<unsigned char> soln) {
                     // Write the solution to the hash and compute the result.
                     LogPrint("pow", "- Checking solution against target\n");
                     pblock->nSolution = soln;
                     solutionTargetChecks.increment();
+                    stats->solutionTargetChecks.increment();
 
                     if (UintToArith256(pblock->GetHash()) > hashTarget) {
                         return false;
@@ -762,11 +938,7 @@ void static BitcoinMiner()
                     SetThreadPriority(THREAD_PRIORITY_NORMAL);
                     LogPrintf("HorizenMiner:\n");
                     LogPrintf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", pblock->GetHash().GetHex(), hashTarget.GetHex());
-#ifdef ENABLE_WALLET
-                    if (ProcessBlockFound(pblock, *pwallet, reservekey)) {
-#else
-                    if (ProcessBlockFound(pblock)) {
-#endif
+                    if (minerTemplate->BlockFound(pblock)) {
                         // Ignore chain updates caused by us
                         std::lock_guard<std::mutex> lock{m_cs};
                         cancelSolver = false;
@@ -787,52 +959,17 @@ void static BitcoinMiner()
                     return cancelSolver;
                 };
 
-                // TODO: factor this out into a function with the same API for each solver.
-                if (solver == "tromp") {
-                    // Create solver and initialize it.
-                    equi eq(1);
-                    eq.setstate(&curr_state);
-
-                    // Intialization done, start algo driver.
-                    eq.digit0(0);
-                    eq.xfull = eq.bfull = eq.hfull = 0;
-                    eq.showbsizes(0);
-                    for (u32 r = 1; r < WK; r++) {
-                        (r&1) ? eq.digitodd(r, 0) : eq.digiteven(r, 0);
-                        eq.xfull = eq.bfull = eq.hfull = 0;
-                        eq.showbsizes(r);
-                    }
-                    eq.digitK(0);
+                try {
+                    // If we find a valid block, we rebuild
+                    bool found = solver->Solve(curr_state, validBlock, cancelled);
                     ehSolverRuns.increment();
-
-                    // Convert solution indices to byte array (decompress) and pass it to validBlock method.
-                    for (size_t s = 0; s < eq.nsols; s++) {
-                        LogPrint("pow", "Checking solution %d\n", s+1);
-                        std::vector<eh_index> index_vector(PROOFSIZE);
-                        for (size_t i = 0; i < PROOFSIZE; i++) {
-                            index_vector[i] = eq.sols[s][i];
-                        }
-                        std::vector<unsigned char> sol_char = GetMinimalFromIndices(index_vector, DIGITBITS);
-
-                        if (validBlock(sol_char)) {
-                            // If we find a POW solution, do not try other solutions
-                            // because they become invalid as we created a new block in blockchain.
-                            break;
-                        }
-                    }
-                } else {
-                    try {
-                        // If we find a valid block, we rebuild
-                        bool found = EhOptimisedSolve(n, k, curr_state, validBlock, cancelled);
-                        ehSolverRuns.increment();
-                        if (found) {
-                            break;
-                        }
-                    } catch (EhSolverCancelledException&) {
-                        LogPrint("pow", "Equihash solver cancelled\n");
-                        std::lock_guard<std::mutex> lock{m_cs};
-                        cancelSolver = false;
+                    if (found) {
+                        break;
                     }
+                } catch (EhSolverCancelledException&) {
+                    LogPrint("pow", "Equihash solver cancelled\n");
+                    std::lock_guard<std::mutex> lock{m_cs};
+                    cancelSolver = false;
                 }
 
                 // Check for stop or if block needs to be rebuilt
@@ -840,11 +977,11 @@ void static BitcoinMiner()
                 // Regtest mode doesn't require peers
                 if (vNodes.empty() && chainparams.MiningRequiresPeers())
                     break;
-                if ((UintToArith256(pblock->nNonce) & 0xffff) == 0xffff)
-                    break;
-                if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
+                if ((UintToArith256(pblock->nNonce) & 0xffff) == 0xffff) {
+                    fRenew = true;
                     break;
-                if (pindexPrev != chainActive.Tip())
+                }
+                if (minerTemplate->IsOutdated(nGeneration))
                     break;
 
                 // Update nNonce and nTime
@@ -856,6 +993,7 @@ void static BitcoinMiner()
     catch (const boost::thread_interrupted&)
     {
         miningTimer.stop();
+        stats->timer.stop();
         c.disconnect();
         LogPrintf("HorizenMiner terminated\n");
         throw;
@@ -863,11 +1001,13 @@ void static BitcoinMiner()
     catch (const std::runtime_error &e)
     {
         miningTimer.stop();
+        stats->timer.stop();
         c.disconnect();
         LogPrintf("HorizenMiner runtime error: %s\n", e.what());
         return;
     }
     miningTimer.stop();
+    stats->timer.stop();
     c.disconnect();
 }
 
@@ -888,17 +1028,41 @@ void GenerateBitcoins(bool fGenerate, int nThreads)
         delete minerThreads;
         minerThreads = NULL;
     }
+    {
+        boost::mutex::scoped_lock lock(cs_minerStats);
+        vMinerThreadStats.clear();
+    }
 
     if (nThreads == 0 || !fGenerate)
         return;
 
-    minerThreads = new boost::thread_group();
-    for (int i = 0; i < nThreads; i++) {
+    // The threads hold on to the template, the previous one goes away with the last of them
 #ifdef ENABLE_WALLET
-        minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet));
+    std::shared_ptr<CMinerTemplate> minerTemplate(new CMinerTemplate(pwallet));
 #else
-        minerThreads->create_thread(&BitcoinMiner);
+    std::shared_ptr<CMinerTemplate> minerTemplate(new CMinerTemplate());
 #endif
+    minerThreads = new boost::thread_group();
+    for (int i = 0; i < nThreads; i++) {
+        std::shared_ptr<CMinerThreadStats> stats(new CMinerThreadStats());
+        {
+            boost::mutex::scoped_lock lock(cs_minerStats);
+            vMinerThreadStats.push_back(stats);
+        }
+        minerThreads->create_thread(boost::bind(&BitcoinMiner, i, minerTemplate, stats));
+    }
+}
+
+void GetMinerThreadRates(std::vector<CMinerThreadRate>& vRates)
+{
+    boost::mutex::scoped_lock lock(cs_minerStats);
+    vRates.clear();
+    for (unsigned int i = 0; i < vMinerThreadStats.size(); i++) {
+        CMinerThreadRate rate;
+        rate.nThread = i;
+        rate.solver = vMinerThreadStats[i]->solver;
+        rate.solps = vMinerThreadStats[i]->timer.rate(vMinerThreadStats[i]->solutionTargetChecks);
+        vRates.push_back(rate);
     }
 }
 
@@ -7,10 +7,18 @@
 #define BITCOIN_MINER_H
 
 #include "primitives/block.h"
+#ifdef ENABLE_MINING
+#include "crypto/equihash.h"
+#endif
 
 #include <boost/optional.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <stdint.h>
+#ifdef ENABLE_MINING
+#include <functional>
+#include <string>
+#include <vector>
+#endif
 
 class CBlockIndex;
 class CScript;
@@ -49,6 +57,33 @@ CBlockTemplate* CreateNewBlockWithKey();
 #endif
 
 #ifdef ENABLE_MINING
+/** An Equihash solver backend, selected with -equihashsolver */
+class CEquihashSolver
+{
+public:
+    virtual ~CEquihashSolver() {}
+
+    /** Name of the backend, as given to -equihashsolver */
+    virtual std::string GetName() const = 0;
+
+    /**
+     * Find the solutions for base_state and pass them to validBlock until it
+     * accepts one.  Returns whether one was accepted.  Throws
+     * EhSolverCancelledException when cancelled returns true.
+     */
+    virtual bool Solve(const eh_HashState& base_state,
+                       const std::function<bool(std::vector<unsigned char>)>& validBlock,
+                       const std::function<bool(EhSolverCancelCheck)>& cancelled) = 0;
+};
+
+/** Return whether name is a known -equihashsolver backend */
+bool IsKnownEquihashSolver(const std::string& name);
+/**
+ * Create the named solver for the given parameters.  Falls back to the
+ * default solver if the named one doesn't support them.
+ */
+CEquihashSolver* CreateEquihashSolver(const std::string& name, unsigned int n, unsigned int k);
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 /** Run the miner threads */
@@ -57,6 +92,16 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads);
  #else
 void GenerateBitcoins(bool fGenerate, int nThreads);
  #endif
+
+/** Solution rate of one miner thread */
+struct CMinerThreadRate
+{
+    int nThread;
+    std::string solver;
+    double solps;
+};
+/** Return the solution rates of the running miner threads */
+void GetMinerThreadRates(std::vector<CMinerThreadRate>& vRates);
 #endif
 
 void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
@@ -28,6 +28,12 @@
 #include <fcntl.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#include <math.h>
+
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
@@ -63,6 +69,12 @@ using namespace std;
 namespace {
     const int MAX_OUTBOUND_CONNECTIONS = 8;
 
+    // Frequency at which the socket handler checks for disconnected nodes when there is no socket activity
+    const int SOCKET_HANDLER_TIMEOUT_MS = 50;
+#ifdef USE_EPOLL
+    const int MAX_SOCKET_EVENTS = 256;
+#endif
+
     struct ListenSocket {
         SOCKET socket;
         bool whitelisted;
@@ -89,7 +101,7 @@ bool fAddressesInitialized = false;
 TLSManager tlsmanager = TLSManager();
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSerializedNetMsg> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -127,6 +139,69 @@ static CCriticalSection cs_vNonTLSNodesInbound;
 static std::vector<NODE_ADDR> vNonTLSNodesOutbound;
 static CCriticalSection cs_vNonTLSNodesOutbound;
 
+#ifdef USE_TLS
+/** An inbound connection whose TLS handshake is still in progress */
+struct CPendingTLSAccept
+{
+    SOCKET hSocket;
+    SSL* ssl;
+    CAddress addr;
+    bool fWhitelisted;
+    bool fWantWrite;
+    int64_t nTimeStarted;
+
+    CPendingTLSAccept(SOCKET hSocketIn, SSL* sslIn, const CAddress& addrIn, bool fWhitelistedIn) :
+        hSocket(hSocketIn), ssl(sslIn), addr(addrIn), fWhitelisted(fWhitelistedIn), fWantWrite(false),
+        nTimeStarted(GetTimeMillis()) {}
+};
+
+// Only used by ThreadSocketHandler
+static std::list<CPendingTLSAccept> lPendingTLSAccepts;
+#endif
+
+#ifdef USE_EPOLL
+// Peer sockets are registered edge-triggered for as long as they are open, with the CNode as event data.
+// Listening sockets and pending TLS handshakes are registered in a second, level-triggered instance
+// with the socket as event data, which is itself nested in the first one with NULL as event data.
+static int hEpollNodes = -1;
+static int hEpollAccept = -1;
+
+// Nodes with readiness that hasn't been consumed yet, only used by ThreadSocketHandler
+static std::set<CNode*> setReadyNodes;
+
+static bool EpollControl(int hEpoll, int nOp, SOCKET hSocket, uint32_t nEvents, epoll_data_t data)
+{
+    struct epoll_event event;
+    event.events = nEvents;
+    event.data = data;
+    if (epoll_ctl(hEpoll, nOp, hSocket, &event) == -1) {
+        LogPrintf("epoll_ctl failed for socket %d: %s\n", hSocket, NetworkErrorString(errno));
+        return false;
+    }
+    return true;
+}
+
+static void SetAcceptSocketEvents(int nOp, SOCKET hSocket, bool fWantWrite)
+{
+    epoll_data_t data;
+    data.fd = hSocket;
+    EpollControl(hEpollAccept, nOp, hSocket, fWantWrite ? EPOLLOUT : EPOLLIN, data);
+}
+
+// requires LOCK(pnode->cs_hSocket)
+static void SetNodeSocketEvents(CNode* pnode, int nOp, bool fWantWrite)
+{
+    if (hEpollNodes == -1 || pnode->hSocket == INVALID_SOCKET || (nOp != EPOLL_CTL_ADD && !pnode->fSocketRegistered))
+        return;
+    epoll_data_t data;
+    data.ptr = pnode;
+    if (!EpollControl(hEpollNodes, nOp, pnode->hSocket, EPOLLIN | EPOLLRDHUP | EPOLLET | (fWantWrite ? EPOLLOUT : 0), data))
+        pnode->fDisconnect = true;
+    else if (nOp == EPOLL_CTL_ADD)
+        pnode->fSocketRegistered = true;
+}
+#endif
+
 
 void AddOneShot(const std::string& strDest)
 {
@@ -479,6 +554,14 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false, ssl);
         pnode->AddRef();
 
+#ifdef USE_EPOLL
+        {
+            // No other thread knows about the node yet
+            LOCK(pnode->cs_hSocket);
+            SetNodeSocketEvents(pnode, EPOLL_CTL_ADD, pnode->fWriteInterest);
+        }
+#endif
+
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
@@ -515,6 +598,12 @@ void CNode::CloseSocketDisconnect()
                 // std::bad_alloc exception when instantiating internal objs for handling log category
                 LogPrintf("(node is probably shutting down) disconnecting peer=%d\n", id);
             }
+
+#ifdef USE_EPOLL
+            if (fSocketRegistered)
+                epoll_ctl(hEpollNodes, EPOLL_CTL_DEL, hSocket, NULL);
+            fSocketRegistered = false;
+#endif
         
             if (ssl)
             {
@@ -664,6 +753,10 @@ void CNode::copyStats(CNodeStats &stats)
     X(nSendBytes);
     X(nRecvBytes);
     X(fWhitelisted);
+    {
+        LOCK(cs_feeFilter);
+        X(minFeeFilter);
+    }
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -731,6 +824,86 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+namespace {
+
+/**
+ * Buffers of received messages that have been processed, kept to receive the
+ * next large messages into. Block downloads from many peers would otherwise
+ * allocate and free megabytes per message, and fragment the heap of a
+ * long-running node.
+ */
+class CRecvBufferPool
+{
+private:
+    //! Messages smaller than this are received into a buffer of their own
+    static const size_t MIN_POOLED_SIZE = 64 * 1024;
+    //! Most memory the pool keeps for buffers nobody is using
+    static const size_t MAX_POOL_BYTES = 16 * 1024 * 1024;
+
+    CCriticalSection cs;
+    std::vector<CSerializeData> vFree;
+    size_t nFreeBytes;
+
+public:
+    CRecvBufferPool() : nFreeBytes(0) {}
+
+    //! Give buf (empty) room for nSize bytes, from the pool when it has a buffer for it
+    void Get(CSerializeData& buf, size_t nSize)
+    {
+        if (nSize >= MIN_POOLED_SIZE) {
+            LOCK(cs);
+            // The smallest buffer that is large enough, else the largest one
+            std::vector<CSerializeData>::iterator itBest = vFree.end();
+            for (std::vector<CSerializeData>::iterator it = vFree.begin(); it != vFree.end(); ++it) {
+                if (itBest == vFree.end()) {
+                    itBest = it;
+                    continue;
+                }
+                bool fFits = it->capacity() >= nSize;
+                bool fBestFits = itBest->capacity() >= nSize;
+                if (fFits && (!fBestFits || it->capacity() < itBest->capacity()))
+                    itBest = it;
+                else if (!fFits && !fBestFits && it->capacity() > itBest->capacity())
+                    itBest = it;
+            }
+            if (itBest != vFree.end()) {
+                nFreeBytes -= itBest->capacity();
+                buf.swap(*itBest);
+                vFree.erase(itBest);
+            }
+        }
+        buf.reserve(nSize);
+    }
+
+    //! Take back the buffer of a message that is done with
+    void Put(CSerializeData& buf)
+    {
+        if (buf.capacity() < MIN_POOLED_SIZE)
+            return;
+        LOCK(cs);
+        if (nFreeBytes + buf.capacity() > MAX_POOL_BYTES)
+            return;
+        buf.clear();
+        nFreeBytes += buf.capacity();
+        vFree.push_back(CSerializeData());
+        vFree.back().swap(buf);
+    }
+};
+
+CRecvBufferPool recvBufferPool;
+
+/** Data received beyond this is not allocated ahead of its arrival, whatever the header announced. */
+const unsigned int MAX_RECV_PREALLOC = 1024 * 1024;
+
+} // anon namespace
+
+CNetMessage::~CNetMessage()
+{
+    CSerializeData buf;
+    vRecv.swap(buf);
+    recvBufferPool.Put(buf);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -759,6 +932,15 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    // Receive the data into a buffer sized from the header, but don't let a
+    // peer make us reserve more than a bounded amount for data it hasn't sent.
+    // Oversized messages are rejected by the caller.
+    if (hdr.nMessageSize > 0 && hdr.nMessageSize <= MAX_PROTOCOL_MESSAGE_LENGTH) {
+        CSerializeData buf;
+        recvBufferPool.Get(buf, std::min(hdr.nMessageSize, MAX_RECV_PREALLOC));
+        vRecv.swap(buf);
+    }
+
     return nCopy;
 }
 
@@ -775,9 +957,21 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     memcpy(&vRecv[nDataPos], pch, nCopy);
     nDataPos += nCopy;
 
+    // Hash the data as it arrives rather than all at once when the message is complete
+    hasher.Write((const unsigned char*)pch, nCopy);
+
     return nCopy;
 }
 
+const uint256& CNetMessage::GetMessageHash()
+{
+    assert(complete());
+    if (data_hash.IsNull())
+        hasher.Finalize(data_hash.begin());
+    return data_hash;
+}
+
+
 
 
 
@@ -789,11 +983,11 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializedNetMsg>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end())
     {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
 
         bool bIsSSL = false;
@@ -881,6 +1075,17 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+#ifdef USE_EPOLL
+    // Only wait for the socket to become writable while there is something left to send
+    bool fWantWrite = !pnode->vSendMsg.empty();
+    if (fWantWrite != pnode->fWriteInterest)
+    {
+        LOCK(pnode->cs_hSocket);
+        SetNodeSocketEvents(pnode, EPOLL_CTL_MOD, fWantWrite);
+        pnode->fWriteInterest = fWantWrite;
+    }
+#endif
 }
 
 static list<CNode*> vNodesDisconnected;
@@ -1040,6 +1245,42 @@ static bool AttemptToEvictConnection(bool fPreferNewConnection) {
 }
 
 
+/** Register an accepted inbound connection, once its TLS handshake (if any) has completed */
+static void FinishAcceptConnection(SOCKET hSocket, SSL* ssl, const CAddress& addr, bool whitelisted)
+{
+#ifdef USE_TLS
+    if (GetBoolArg("-tlsvalidate", false))
+    {
+        if (ssl && !ValidatePeerCertificate(ssl))
+        {
+            LogPrintf ("TLS: ERROR: Wrong client certificate from %s. Connection will be closed.\n", addr.ToString());
+        
+            SSL_shutdown(ssl);
+            CloseSocket(hSocket);
+            SSL_free(ssl);
+            return;
+        }
+    }
+#endif // USE_TLS
+
+    CNode* pnode = new CNode(hSocket, addr, "", true, ssl);
+    pnode->AddRef();
+    pnode->fWhitelisted = whitelisted;
+
+#ifdef USE_EPOLL
+    {
+        // No other thread knows about the node yet
+        LOCK(pnode->cs_hSocket);
+        SetNodeSocketEvents(pnode, EPOLL_CTL_ADD, pnode->fWriteInterest);
+    }
+#endif
+
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+}
+
 static void AcceptConnection(const ListenSocket& hListenSocket) {
     struct sockaddr_storage sockaddr;
     socklen_t len = sizeof(sockaddr);
@@ -1059,6 +1300,9 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
             if (pnode->fInbound)
                 nInbound++;
     }
+#ifdef USE_TLS
+    nInbound += lPendingTLSAccepts.size();
+#endif
 
     if (hSocket == INVALID_SOCKET)
     {
@@ -1102,33 +1346,21 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
 #endif
 
 
-    SSL *ssl = NULL;
-    
     SetSocketNonBlocking(hSocket, true);
     
 #ifdef USE_TLS
     /* TCP connection is ready. Do server side SSL. */
+    bool bUseTLS = true;
 #ifdef COMPAT_NON_TLS
     {
         LOCK(cs_vNonTLSNodesInbound);
     
         NODE_ADDR nodeAddr(addr.ToStringIP());
         
-        bool bUseTLS = (find(vNonTLSNodesInbound.begin(),
-                             vNonTLSNodesInbound.end(),
-                             nodeAddr) == vNonTLSNodesInbound.end());
-        if (bUseTLS)
-        {
-            ssl = tlsmanager.accept( hSocket, addr);
-            if(!ssl)
-            {
-                // Further reconnection will be made in non-TLS (unencrypted) mode
-                vNonTLSNodesInbound.push_back(NODE_ADDR(addr.ToStringIP(), GetTimeMillis()));
-                CloseSocket(hSocket);
-                return;
-            }
-        }
-        else
+        bUseTLS = (find(vNonTLSNodesInbound.begin(),
+                        vNonTLSNodesInbound.end(),
+                        nodeAddr) == vNonTLSNodesInbound.end());
+        if (!bUseTLS)
         {
             LogPrintf ("TLS: Connection from %s will be unencrypted\n", addr.ToString());
             
@@ -1141,38 +1373,96 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
                     vNonTLSNodesInbound.end());
         }
     }
-#else
-    ssl = TLSManager::accept( hSocket, addr);
-    if(!ssl)
-    {
-        CloseSocket(hSocket);
-        return;
-    }
 #endif // COMPAT_NON_TLS
-    
-    if (GetBoolArg("-tlsvalidate", false))
+
+    if (bUseTLS)
     {
-        if (ssl && !ValidatePeerCertificate(ssl))
+        if (lPendingTLSAccepts.size() >= MAX_PENDING_TLS_HANDSHAKES)
+        {
+            LogPrint("net", "TLS: too many pending handshakes - connection from %s dropped\n", addr.ToString());
+            CloseSocket(hSocket);
+            return;
+        }
+
+        SSL *ssl = tlsmanager.startAccept(hSocket, addr);
+        if (!ssl)
         {
-            LogPrintf ("TLS: ERROR: Wrong client certificate from %s. Connection will be closed.\n", addr.ToString());
-        
-            SSL_shutdown(ssl);
             CloseSocket(hSocket);
-            SSL_free(ssl);
             return;
         }
+
+        // ThreadSocketHandler drives the handshake, the node is added once it has completed
+        lPendingTLSAccepts.push_back(CPendingTLSAccept(hSocket, ssl, addr, whitelisted));
+#ifdef USE_EPOLL
+        SetAcceptSocketEvents(EPOLL_CTL_ADD, hSocket, false);
+#endif
+        return;
     }
 #endif // USE_TLS
 
-    CNode* pnode = new CNode(hSocket, addr, "", true, ssl);
-    pnode->AddRef();
-    pnode->fWhitelisted = whitelisted;
+    FinishAcceptConnection(hSocket, NULL, addr, whitelisted);
+}
+
+#ifdef USE_TLS
+/** Continue the pending TLS handshakes whose sockets are ready, and give up on the ones that take too long */
+static void ProcessPendingTLSAccepts(const std::set<SOCKET>& setReadySockets)
+{
+    int64_t nNow = GetTimeMillis();
 
+    std::list<CPendingTLSAccept>::iterator it = lPendingTLSAccepts.begin();
+    while (it != lPendingTLSAccepts.end())
     {
-        LOCK(cs_vNodes);
-        vNodes.push_back(pnode);
+        CPendingTLSAccept& pending = *it;
+
+        int nResult = 0;
+        if (setReadySockets.count(pending.hSocket))
+        {
+            bool fWantWrite = pending.fWantWrite;
+            nResult = tlsmanager.continueHandshake(SSL_ACCEPT, pending.ssl, pending.fWantWrite);
+#ifdef USE_EPOLL
+            if (nResult == 0 && fWantWrite != pending.fWantWrite)
+                SetAcceptSocketEvents(EPOLL_CTL_MOD, pending.hSocket, pending.fWantWrite);
+#endif
+        }
+
+        if (nResult == 0 && nNow - pending.nTimeStarted > DEFAULT_CONNECT_TIMEOUT)
+        {
+            LogPrint("net", "TLS: ERROR: %s: %s: handshake with %s timed out\n", __FILE__, __func__, pending.addr.ToString());
+            nResult = -1;
+        }
+
+        if (nResult == 0)
+        {
+            ++it;
+            continue;
+        }
+
+#ifdef USE_EPOLL
+        epoll_ctl(hEpollAccept, EPOLL_CTL_DEL, pending.hSocket, NULL);
+#endif
+
+        if (nResult == 1)
+        {
+            LogPrintf("TLS: connection from %s has been accepted. Using cipher: %s\n", pending.addr.ToString(), SSL_get_cipher(pending.ssl));
+            FinishAcceptConnection(pending.hSocket, pending.ssl, pending.addr, pending.fWhitelisted);
+        }
+        else
+        {
+            LogPrintf("TLS: ERROR: %s: %s: TLS connection from %s failed\n", __FILE__, __func__, pending.addr.ToString());
+#ifdef COMPAT_NON_TLS
+            {
+                // Further reconnection will be made in non-TLS (unencrypted) mode
+                LOCK(cs_vNonTLSNodesInbound);
+                vNonTLSNodesInbound.push_back(NODE_ADDR(pending.addr.ToStringIP(), GetTimeMillis()));
+            }
+#endif // COMPAT_NON_TLS
+            SSL_free(pending.ssl);
+            CloseSocket(pending.hSocket);
+        }
+        it = lPendingTLSAccepts.erase(it);
     }
 }
+#endif // USE_TLS
 
 #if defined(USE_TLS) && defined(COMPAT_NON_TLS)
 void ThreadNonTLSPoolsCleaner()
@@ -1188,9 +1478,88 @@ void ThreadNonTLSPoolsCleaner()
 #endif // USE_TLS && COMPAT_NON_TLS
 
 
+static void InactivityCheck(CNode* pnode, int64_t nTime)
+{
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+/**
+ * Decide what can be done right now with the socket of a node whose readiness has been
+ * reported by epoll, following the same rules as the select() loop: pending data is sent
+ * before receiving more, and nothing is received while the receive buffer is full.
+ */
+static void GetSocketWork(CNode* pnode, bool& fRecv, bool& fSend)
+{
+    fRecv = fSend = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend) {
+            if (!pnode->vSendMsg.empty()) {
+                fSend = pnode->fSendReady;
+                return;
+            }
+            // nothing to send, the socket will be reported again once the write interest is set
+            pnode->fSendReady = false;
+        }
+    }
+    if (pnode->fRecvReady) {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        fRecv = lockRecv && (
+            pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+            pnode->GetTotalRecvSize() <= ReceiveFloodSize());
+    }
+}
+
+static bool InitSocketEvents()
+{
+    hEpollNodes = epoll_create1(EPOLL_CLOEXEC);
+    hEpollAccept = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpollNodes == -1 || hEpollAccept == -1) {
+        LogPrintf("epoll_create1 failed: %s\n", NetworkErrorString(errno));
+        return false;
+    }
+
+    epoll_data_t data;
+    data.ptr = NULL;
+    if (!EpollControl(hEpollNodes, EPOLL_CTL_ADD, hEpollAccept, EPOLLIN, data))
+        return false;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        if (hListenSocket.socket != INVALID_SOCKET)
+            SetAcceptSocketEvents(EPOLL_CTL_ADD, hListenSocket.socket, false);
+    return true;
+}
+#endif
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+#ifdef USE_EPOLL
+    int64_t nLastInactivityCheck = 0;
+#endif
     while (true)
     {
         //
@@ -1207,6 +1576,9 @@ void ThreadSocketHandler()
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+#ifdef USE_EPOLL
+                    setReadyNodes.erase(pnode);
+#endif
 
                     // release outbound grant (if any)
                     pnode->grantOutbound.Release();
@@ -1256,12 +1628,139 @@ void ThreadSocketHandler()
             uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
         }
 
+#ifdef USE_EPOLL
+        //
+        // Wait for socket events, without waiting if some socket can already be serviced
+        //
+        vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy.assign(setReadyNodes.begin(), setReadyNodes.end());
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+        int nTimeout = SOCKET_HANDLER_TIMEOUT_MS;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            bool fRecv, fSend;
+            GetSocketWork(pnode, fRecv, fSend);
+            if (fRecv || fSend) {
+                nTimeout = 0;
+                break;
+            }
+        }
+
+        struct epoll_event events[MAX_SOCKET_EVENTS];
+        int nEvents = epoll_wait(hEpollNodes, events, MAX_SOCKET_EVENTS, nTimeout);
+        boost::this_thread::interruption_point();
+
+        if (nEvents == -1)
+        {
+            if (errno != EINTR)
+            {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+                MilliSleep(SOCKET_HANDLER_TIMEOUT_MS);
+            }
+            nEvents = 0;
+        }
+
+        std::set<SOCKET> setReadySockets;
+        for (int i = 0; i < nEvents; i++)
+        {
+            CNode* pnode = static_cast<CNode*>(events[i].data.ptr);
+            if (pnode == NULL)
+            {
+                // listening sockets and pending TLS handshakes
+                struct epoll_event acceptEvents[MAX_SOCKET_EVENTS];
+                int nAcceptEvents = epoll_wait(hEpollAccept, acceptEvents, MAX_SOCKET_EVENTS, 0);
+                for (int j = 0; j < nAcceptEvents; j++)
+                    setReadySockets.insert(acceptEvents[j].data.fd);
+                continue;
+            }
+
+            // Nodes are only deleted by this thread, and their sockets are unregistered before they are removed from vNodes
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                pnode->fRecvReady = true;
+            if (events[i].events & EPOLLOUT)
+                pnode->fSendReady = true;
+            if (setReadyNodes.insert(pnode).second)
+            {
+                LOCK(cs_vNodes);
+                pnode->AddRef();
+                vNodesCopy.push_back(pnode);
+            }
+        }
+
+#ifdef USE_TLS
+        //
+        // Continue TLS handshakes of inbound connections
+        //
+        ProcessPendingTLSAccepts(setReadySockets);
+#endif
+
+        //
+        // Accept new connections
+        //
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        {
+            if (hListenSocket.socket != INVALID_SOCKET && setReadySockets.count(hListenSocket.socket))
+            {
+                AcceptConnection(hListenSocket);
+            }
+        }
+
+        //
+        // Service the sockets which are ready
+        //
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            boost::this_thread::interruption_point();
+
+            bool fRecv, fSend;
+            GetSocketWork(pnode, fRecv, fSend);
+            if (fRecv || fSend)
+            {
+                bool fRecvDone = fRecv, fSendDone = fSend;
+                if (tlsmanager.threadSocketHandler(pnode, fRecvDone, fSendDone) == -1)
+                {
+                    pnode->fRecvReady = pnode->fSendReady = false;
+                }
+                else
+                {
+                    // only forget the readiness that has actually been consumed
+                    if (fRecv && !fRecvDone)
+                        pnode->fRecvReady = false;
+                    if (fSend && !fSendDone)
+                        pnode->fSendReady = false;
+                }
+            }
+            if (!pnode->fRecvReady && !pnode->fSendReady)
+                setReadyNodes.erase(pnode);
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+
+        //
+        // Inactivity checking, all the timeouts are in seconds
+        //
+        int64_t nTime = GetTime();
+        if (nTime != nLastInactivityCheck)
+        {
+            nLastInactivityCheck = nTime;
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                InactivityCheck(pnode, nTime);
+        }
+#else
         //
         // Find which sockets have data to receive
         //
         struct timeval timeout;
         timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = SOCKET_HANDLER_TIMEOUT_MS * 1000; // frequency to poll pnode->vSend
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -1278,6 +1777,15 @@ void ThreadSocketHandler()
             have_fds = true;
         }
 
+#ifdef USE_TLS
+        BOOST_FOREACH(const CPendingTLSAccept& pending, lPendingTLSAccepts) {
+            FD_SET(pending.hSocket, pending.fWantWrite ? &fdsetSend : &fdsetRecv);
+            FD_SET(pending.hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pending.hSocket);
+            have_fds = true;
+        }
+#endif
+
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes)
@@ -1342,6 +1850,17 @@ void ThreadSocketHandler()
             MilliSleep(timeout.tv_usec/1000);
         }
 
+#ifdef USE_TLS
+        //
+        // Continue TLS handshakes of inbound connections
+        //
+        std::set<SOCKET> setReadySockets;
+        BOOST_FOREACH(const CPendingTLSAccept& pending, lPendingTLSAccepts)
+            if (FD_ISSET(pending.hSocket, &fdsetRecv) || FD_ISSET(pending.hSocket, &fdsetSend) || FD_ISSET(pending.hSocket, &fdsetError))
+                setReadySockets.insert(pending.hSocket);
+        ProcessPendingTLSAccepts(setReadySockets);
+#endif
+
         //
         // Accept new connections
         //
@@ -1367,43 +1886,27 @@ void ThreadSocketHandler()
         {
             boost::this_thread::interruption_point();
 
-            if (tlsmanager.threadSocketHandler(pnode,fdsetRecv,fdsetSend,fdsetError)==-1){
-                continue;
+            bool fRecv = false, fSend = false;
+            {
+                LOCK(pnode->cs_hSocket);
+                if (pnode->hSocket == INVALID_SOCKET)
+                    continue;
+                fRecv = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+                fSend = FD_ISSET(pnode->hSocket, &fdsetSend);
             }
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
+            if (tlsmanager.threadSocketHandler(pnode, fRecv, fSend) == -1){
+                continue;
             }
+
+            InactivityCheck(pnode, GetTime());
         }
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
+#endif
     }
 }
 
@@ -1715,7 +2218,7 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+void ThreadMessageHandler(int nThread, int nThreads)
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
@@ -1734,16 +2237,25 @@ void ThreadMessageHandler()
 
         // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (nThread == 0 && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
         bool fSleep = true;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Each thread starts at a different node, so that the nodes after one which
+        // takes long to process are picked up by the other threads
+        size_t nStart = vNodesCopy.size() * nThread / nThreads;
+        for (size_t i = 0; i < vNodesCopy.size(); i++)
         {
+            CNode* pnode = vNodesCopy[(nStart + i) % vNodesCopy.size()];
             if (pnode->fDisconnect)
                 continue;
 
+            // A node is processed by one thread at a time, so its messages are handled in order
+            TRY_LOCK(pnode->cs_msgProcessing, lockProcessing);
+            if (!lockProcessing)
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1754,7 +2266,9 @@ void ThreadMessageHandler()
 
                     if (pnode->nSendSize < SendBufferSize())
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                        // A node waiting for upload budget is looked at again after the sleep
+                        if ((!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) &&
+                            !pnode->fGetDataBackoff)
                         {
                             fSleep = false;
                         }
@@ -1944,7 +2458,7 @@ void static Discover(boost::thread_group& threadGroup)
 
 
 
-void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
+bool StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 {
     uiInterface.InitMessage(_("Loading addresses..."));
     // Load addresses for peers.dat
@@ -1974,18 +2488,26 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (!tlsmanager.prepareCredentials())
     {
         LogPrintf("TLS: ERROR: %s: %s: Credentials weren't loaded. Node can't be started.\n", __FILE__, __func__);
-        return;
+        return false;
     }
     
     if (!tlsmanager.initialize())
     {
         LogPrintf("TLS: ERROR: %s: %s: TLS initialization failed. Node can't be started.\n", __FILE__, __func__);
-        return;
+        return false;
     }
 #else
     LogPrintf("TLS is not used!\n");
 #endif
 
+#ifdef USE_EPOLL
+    if (!InitSocketEvents())
+    {
+        LogPrintf("ERROR: %s: Socket event loop initialization failed. Node can't be started.\n", __func__);
+        return false;
+    }
+#endif
+
     //
     // Start threads
     //
@@ -2005,7 +2527,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMsgHandThreads = std::max(1, std::min((int)GetArg("-msghandthreads", DEFAULT_MSGHAND_THREADS), MAX_MSGHAND_THREADS));
+    for (int i = 0; i < nMsgHandThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand",
+                                              boost::function<void()>(boost::bind(&ThreadMessageHandler, i, nMsgHandThreads))));
 
 #if defined(USE_TLS) && defined(COMPAT_NON_TLS)
     // Clean pools of addresses for non-TLS connections
@@ -2014,6 +2539,8 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     
     // Dump network addresses
     scheduler.scheduleEvery(&DumpAddresses, DUMP_ADDRESSES_INTERVAL);
+
+    return true;
 }
 
 bool StopNode()
@@ -2046,6 +2573,22 @@ public:
             if (hListenSocket.socket != INVALID_SOCKET)
                 if (!CloseSocket(hListenSocket.socket))
                     LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#ifdef USE_TLS
+        BOOST_FOREACH(CPendingTLSAccept& pending, lPendingTLSAccepts)
+        {
+            SSL_free(pending.ssl);
+            CloseSocket(pending.hSocket);
+        }
+        lPendingTLSAccepts.clear();
+#endif
+
+#ifdef USE_EPOLL
+        if (hEpollAccept != -1)
+            close(hEpollAccept);
+        if (hEpollNodes != -1)
+            close(hEpollNodes);
+        hEpollAccept = hEpollNodes = -1;
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -2074,6 +2617,11 @@ instance_of_cnetcleanup;
 
 
 
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
 void RelayTransaction(const CTransaction& tx)
 {
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
@@ -2094,8 +2642,9 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved; the
+        // complete message is kept so every peer that asks for it shares one buffer
+        mapRelay.insert(std::make_pair(inv, MakeSerializedNetMsg("tx", ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -2125,6 +2674,124 @@ void CNode::RecordBytesSent(uint64_t bytes)
     nTotalBytesSent += bytes;
 }
 
+namespace {
+
+/** Upload budgets let this much traffic, in seconds at the average rate, go out in a burst. */
+const int64_t UPLOAD_BUDGET_BURST_SECONDS = 10;
+
+const char* const UPLOAD_CLASS_NAMES[UPLOAD_CLASS_COUNT] = { "historical", "tip", "tx", "addr", "other" };
+
+CCriticalSection cs_uploadBudget;
+CUploadBucket uploadBuckets[2][UPLOAD_CLASS_COUNT]; // regular, whitelisted
+uint64_t nUploadBytes[UPLOAD_CLASS_COUNT];
+uint64_t nUploadBackoffs[UPLOAD_CLASS_COUNT];
+
+} // anon namespace
+
+void CUploadBucket::Reset(uint64_t nRateIn, int64_t nNow)
+{
+    nRate = nRateIn;
+    nCredit = (int64_t)nRate * UPLOAD_BUDGET_BURST_SECONDS * 1000000;
+    nLastRefill = nNow;
+}
+
+void CUploadBucket::Refill(int64_t nNow)
+{
+    if (nRate == 0 || nNow <= nLastRefill)
+        return;
+    // Each microsecond earns nRate millionths of a byte. Compare the time instead
+    // of multiplying it out, which could overflow after a long idle period.
+    int64_t nFull = (int64_t)nRate * UPLOAD_BUDGET_BURST_SECONDS * 1000000;
+    int64_t nElapsed = nNow - nLastRefill;
+    if (nElapsed > (nFull - nCredit) / (int64_t)nRate)
+        nCredit = std::max(nCredit, nFull);
+    else
+        nCredit = std::min(nCredit + nElapsed * (int64_t)nRate, nFull);
+    nLastRefill = nNow;
+}
+
+bool ParseUploadClass(const std::string& strName, UploadClass& nClass)
+{
+    for (int i = 0; i < UPLOAD_OTHER; i++) {
+        if (strName == UPLOAD_CLASS_NAMES[i]) {
+            nClass = (UploadClass)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+UploadClass GetUploadClass(const std::string& strCommand)
+{
+    if (strCommand == "cfilter" || strCommand == "cfheaders" || strCommand == "cfcheckpt")
+        return UPLOAD_HISTORICAL_BLOCKS;
+    if (strCommand == "block" || strCommand == "merkleblock" || strCommand == "cmpctblock" ||
+        strCommand == "blocktxn" || strCommand == "headers")
+        return UPLOAD_TIP_RELAY;
+    if (strCommand == "tx" || strCommand == "inv")
+        return UPLOAD_TX_RELAY;
+    if (strCommand == "addr")
+        return UPLOAD_ADDR;
+    return UPLOAD_OTHER;
+}
+
+void SetUploadBudget(bool fWhitelisted, UploadClass nClass, uint64_t nBytesPerSecond)
+{
+    assert(nClass < UPLOAD_OTHER);
+    LOCK(cs_uploadBudget);
+    uploadBuckets[fWhitelisted][nClass].Reset(nBytesPerSecond, GetTimeMicros());
+}
+
+bool UploadBudgetAvailable(bool fWhitelisted, UploadClass nClass)
+{
+    LOCK(cs_uploadBudget);
+    CUploadBucket& bucket = uploadBuckets[fWhitelisted][nClass];
+    if (bucket.nRate == 0)
+        return true;
+    bucket.Refill(GetTimeMicros());
+    bool fAvailable = bucket.nCredit > 0;
+    // Count running out, not every check made while it lasts
+    if (!fAvailable && !bucket.fBackedOff)
+        nUploadBackoffs[nClass]++;
+    bucket.fBackedOff = !fAvailable;
+    return fAvailable;
+}
+
+void RecordUpload(bool fWhitelisted, UploadClass nClass, uint64_t nBytes)
+{
+    LOCK(cs_uploadBudget);
+    nUploadBytes[nClass] += nBytes;
+    CUploadBucket& bucket = uploadBuckets[fWhitelisted][nClass];
+    if (bucket.nRate != 0) {
+        bucket.Refill(GetTimeMicros());
+        bucket.Spend(nBytes);
+    }
+}
+
+void GetUploadClassStats(std::vector<CUploadClassStats>& vStats)
+{
+    LOCK(cs_uploadBudget);
+    int64_t nNow = GetTimeMicros();
+    vStats.clear();
+    for (int i = 0; i < UPLOAD_CLASS_COUNT; i++) {
+        CUploadClassStats stats;
+        stats.strName = UPLOAD_CLASS_NAMES[i];
+        stats.nBytesSent = nUploadBytes[i];
+        stats.nBackoffs = nUploadBackoffs[i];
+        CUploadBucket& bucket = uploadBuckets[false][i];
+        if (bucket.nRate != 0)
+            bucket.Refill(nNow);
+        stats.nLimit = bucket.nRate;
+        stats.nAvailable = bucket.GetAvailable();
+        CUploadBucket& bucketWhitelist = uploadBuckets[true][i];
+        if (bucketWhitelist.nRate != 0)
+            bucketWhitelist.Refill(nNow);
+        stats.nWhitelistLimit = bucketWhitelist.nRate;
+        stats.nWhitelistAvailable = bucketWhitelist.GetAvailable();
+        vStats.push_back(stats);
+    }
+}
+
 uint64_t CNode::GetTotalBytesRecv()
 {
     LOCK(cs_totalBytesRecv);
@@ -2279,11 +2946,15 @@ unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNameIn, bool fInboundIn, SSL *sslIn) :
     ssSend(SER_NETWORK, INIT_PROTO_VERSION),
     addrKnown(5000, 0.001),
-    setInventoryKnown(SendBufferSize() / 1000)
+    filterInventoryKnown(10000, 0.000001)
 {
     ssl = sslIn;
     nServices = 0;
     hSocket = hSocketIn;
+    fSocketRegistered = false;
+    fWriteInterest = false;
+    fRecvReady = false;
+    fSendReady = false;
     nRecvVersion = INIT_PROTO_VERSION;
     nLastSend = 0;
     nLastRecv = 0;
@@ -2310,7 +2981,13 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fGetAddr = false;
     fRelayTxes = false;
     fSentAddr = false;
+    nNextInvSend = 0;
+    minFeeFilter = 0;
+    lastSentFeeFilter = 0;
+    nextSendTimeFeeFilter = 0;
     pfilter = new CBloomFilter();
+    fGetDataBackoff = false;
+    nSendClass = UPLOAD_OTHER;
     nPingNonceSent = 0;
     nPingUsecStart = 0;
     nPingUsecTime = 0;
@@ -2392,11 +3069,64 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+static void SetMessageSizeAndChecksum(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    WriteLE32((uint8_t*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+void BeginSerializedNetMsg(CDataStream& ss, const char* pszCommand)
+{
+    assert(ss.size() == 0);
+    ss << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+}
+
+CSerializedNetMsg FinalizeSerializedNetMsg(CDataStream& ss)
+{
+    assert(ss.size() >= CMessageHeader::HEADER_SIZE);
+    SetMessageSizeAndChecksum(ss);
+    std::shared_ptr<CSerializeData> msg = std::make_shared<CSerializeData>();
+    ss.GetAndClear(*msg);
+    return msg;
+}
+
+void CNode::PushSerializedMessage(const CSerializedNetMsg& msg)
+{
+    const char* pszCommand = &(*msg)[MESSAGE_START_SIZE];
+    PushSerializedMessage(msg, GetUploadClass(std::string(pszCommand, strnlen(pszCommand, CMessageHeader::COMMAND_SIZE))));
+}
+
+void CNode::PushSerializedMessage(const CSerializedNetMsg& msg, UploadClass nClass)
+{
+    LOCK(cs_vSend);
+    const char* pszCommand = &(*msg)[MESSAGE_START_SIZE];
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n",
+             SanitizeString(std::string(pszCommand, strnlen(pszCommand, CMessageHeader::COMMAND_SIZE))),
+             msg->size() - CMessageHeader::HEADER_SIZE, id);
+
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
+    RecordUpload(fWhitelisted, nClass, msg->size());
+
+    // If write queue was empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
+
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
     assert(ssSend.size() == 0);
     ssSend << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+    nSendClass = GetUploadClass(pszCommand);
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
 
@@ -2428,22 +3158,16 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         LEAVE_CRITICAL_SECTION(cs_vSend);
         return;
     }
-    // Set the size
     unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
-
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    SetMessageSizeAndChecksum(ssSend);
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    std::shared_ptr<CSerializeData> msg = std::make_shared<CSerializeData>();
+    ssSend.GetAndClear(*msg);
+    nSendSize += msg->size();
+    RecordUpload(fWhitelisted, nSendClass, msg->size());
+    std::deque<CSerializedNetMsg>::iterator it = vSendMsg.insert(vSendMsg.end(), msg);
 
     // If write queue empty, attempt "optimistic write"
     if (it == vSendMsg.begin())
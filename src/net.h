@@ -6,11 +6,11 @@
 #ifndef BITCOIN_NET_H
 #define BITCOIN_NET_H
 
+#include "amount.h"
 #include "bloom.h"
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -19,7 +19,9 @@
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
+#include <memory>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -63,6 +65,12 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
+/** The default number of message handler threads */
+static const int DEFAULT_MSGHAND_THREADS = 4;
+/** The maximum number of message handler threads */
+static const int MAX_MSGHAND_THREADS = 16;
+/** The maximum number of inbound connections whose TLS handshake may be in progress at once */
+static const size_t MAX_PENDING_TLS_HANDSHAKES = 64;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -77,7 +85,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest = NULL);
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
-void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
+bool StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 SSL_CTX* create_context(bool server_side);
@@ -96,6 +104,28 @@ static std::string validationdescription;
 
 typedef int NodeId;
 
+/**
+ * A complete network message, header (with size and checksum already set)
+ * followed by the payload. It is immutable once built, so the same buffer can
+ * sit in the send queue of any number of peers without being copied.
+ */
+typedef std::shared_ptr<const CSerializeData> CSerializedNetMsg;
+
+/** Write the header of a pszCommand message into ss, before its payload. */
+void BeginSerializedNetMsg(CDataStream& ss, const char* pszCommand);
+/** Set the size and checksum of the message in ss and move it into a CSerializedNetMsg. */
+CSerializedNetMsg FinalizeSerializedNetMsg(CDataStream& ss);
+
+/** Serialize a message once, to be pushed to several peers with CNode::PushSerializedMessage. */
+template<typename T>
+CSerializedNetMsg MakeSerializedNetMsg(const char* pszCommand, const T& payload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    BeginSerializedNetMsg(ss, pszCommand);
+    ss << payload;
+    return FinalizeSerializedNetMsg(ss);
+}
+
 struct CombinerAll
 {
     typedef bool result_type;
@@ -162,7 +192,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSerializedNetMsg> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -207,12 +237,63 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    CAmount minFeeFilter;
 };
 
 
 
 
+/** Kinds of upload traffic, each with a budget of its own (see -uploadbudget). */
+enum UploadClass
+{
+    UPLOAD_HISTORICAL_BLOCKS,   //!< blocks served to peers that are catching up
+    UPLOAD_TIP_RELAY,           //!< recent blocks, compact blocks and headers
+    UPLOAD_TX_RELAY,            //!< transactions and inventory
+    UPLOAD_ADDR,                //!< address relay
+    UPLOAD_OTHER,               //!< everything else, never limited
+    UPLOAD_CLASS_COUNT
+};
+
+/** Traffic and budget of an upload class, for getnettotals. */
+struct CUploadClassStats
+{
+    std::string strName;
+    uint64_t nBytesSent;
+    uint64_t nBackoffs;            //!< times the budget ran out and sending was put off until it recovered
+    uint64_t nLimit;               //!< bytes per second for peers that are not whitelisted, 0 if unlimited
+    int64_t nAvailable;            //!< bytes that can be sent to them before backing off
+    uint64_t nWhitelistLimit;
+    int64_t nWhitelistAvailable;
+};
+
+/**
+ * Token bucket holding the budget of one upload class. Messages are never cut
+ * short: one may take the bucket below zero, and the class then backs off until
+ * the debt is repaid. The credit is kept in millionths of a byte, so that calls
+ * closer together than it takes to earn a byte lose nothing.
+ */
+struct CUploadBucket
+{
+    uint64_t nRate;         // bytes per second, 0 for no limit
+    int64_t nCredit;        // bytes available, times 1000000
+    int64_t nLastRefill;    // microseconds
+    bool fBackedOff;        // the last check found the budget spent
+
+    CUploadBucket() : nRate(0), nCredit(0), nLastRefill(0), fBackedOff(false) {}
+
+    /** Set the rate and fill the bucket */
+    void Reset(uint64_t nRateIn, int64_t nNow);
+    /** Add the credit earned since the last refill, up to the burst allowance */
+    void Refill(int64_t nNow);
+    void Spend(uint64_t nBytes) { nCredit -= (int64_t)nBytes * 1000000; }
+    int64_t GetAvailable() const { return nCredit / 1000000; }
+};
+
 class CNetMessage {
+private:
+    CHash256 hasher;                // double-SHA256 of the data received so far
+    uint256 data_hash;              // set once the message is complete
+
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
@@ -220,7 +301,7 @@ public:
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
+    CDataStream vRecv;              // received message data, in a buffer from the receive buffer pool
     unsigned int nDataPos;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
@@ -233,6 +314,11 @@ public:
         nTime = 0;
     }
 
+    // Messages are moved, never copied, so that vRecv goes back to the pool exactly once
+    CNetMessage(CNetMessage&&) = default;
+    CNetMessage& operator=(CNetMessage&&) = default;
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -246,6 +332,9 @@ public:
         vRecv.SetVersion(nVersionIn);
     }
 
+    /** Double-SHA256 of the message data, hashed as it arrived. Requires complete(). */
+    const uint256& GetMessageHash();
+
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
 };
@@ -265,16 +354,25 @@ public:
     uint64_t nServices;
     SOCKET hSocket;
     CCriticalSection cs_hSocket;
+    bool fSocketRegistered; // the socket is registered with the socket event loop; protected by cs_hSocket
     CDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedNetMsg> vSendMsg;
     CCriticalSection cs_vSend;
+    UploadClass nSendClass; // upload class of the message being built in ssSend; protected by cs_vSend
+    bool fWriteInterest; // the socket event loop waits for the socket to be writable; protected by cs_vSend
+
+    // Edge-triggered readiness reported by the socket event loop, only used by ThreadSocketHandler
+    bool fRecvReady;
+    bool fSendReady;
 
     std::deque<CInv> vRecvGetData;
+    bool fGetDataBackoff; // the upload budget for the next getdata is spent; protected by cs_vRecvMsg
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    CCriticalSection cs_msgProcessing; // held by the message handler thread processing this node, keeps its messages in order
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -308,7 +406,7 @@ public:
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
-    int nRefCount;
+    std::atomic<int> nRefCount;
     NodeId id;
 protected:
 
@@ -332,15 +430,31 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    CCriticalSection cs_vAddrToSend; // protects vAddrToSend and addrKnown, addresses are pushed by the handlers of other peers
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    // The inventory the peer knows about, at least the last 10000 hashes; about 144 KB
+    CRollingBloomFilter filterInventoryKnown;
+    // Transactions still to be announced, in batches; the order they go out in is
+    // decided by their fee rate when the batch is sent
+    std::set<uint256> setInventoryTxToSend;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
+    // Time (in usec) the next batch of transactions is announced; protected by cs_inventory
+    int64_t nNextInvSend;
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
+    // Blocks to announce, as headers if the peer asked for them with sendheaders; protected by cs_inventory
+    std::vector<uint256> vBlockHashesToAnnounce;
+
+    // Lowest fee rate (per 1000 bytes) of the transactions the peer wants to hear about
+    CCriticalSection cs_feeFilter;
+    CAmount minFeeFilter;
+    // The fee filter we last sent, and when we look at ours again; used by SendMessages only
+    CAmount lastSentFeeFilter;
+    int64_t nextSendTimeFeeFilter;
 
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
@@ -414,6 +528,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -422,6 +537,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -436,7 +552,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -444,11 +560,21 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (filterInventoryKnown.contains(inv.hash))
+                return;
+            if (inv.type == MSG_TX)
+                setInventoryTxToSend.insert(inv.hash);
+            else
                 vInventoryToSend.push_back(inv);
         }
     }
 
+    void PushBlockHash(const uint256 &hash)
+    {
+        LOCK(cs_inventory);
+        vBlockHashesToAnnounce.push_back(hash);
+    }
+
     void AskFor(const CInv& inv);
 
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
@@ -460,6 +586,11 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    /** Queue a message built with MakeSerializedNetMsg; takes cs_vSend itself. */
+    void PushSerializedMessage(const CSerializedNetMsg& msg);
+    /** Same, charging the message to upload class nClass rather than the class of its command. */
+    void PushSerializedMessage(const CSerializedNetMsg& msg, UploadClass nClass);
+
     void PushVersion();
 
 
@@ -662,6 +793,20 @@ public:
 
 
 class CTransaction;
+/** Upload budgets */
+bool ParseUploadClass(const std::string& strName, UploadClass& nClass);
+/** The upload class messages with this command are charged to. */
+UploadClass GetUploadClass(const std::string& strCommand);
+/** Limit uploads of class nClass to whitelisted peers, or to the others, to nBytesPerSecond on average (0: no limit). */
+void SetUploadBudget(bool fWhitelisted, UploadClass nClass, uint64_t nBytesPerSecond);
+/** Whether the budget of nClass has room for more right now; when it doesn't, the caller is expected to back off. */
+bool UploadBudgetAvailable(bool fWhitelisted, UploadClass nClass);
+void RecordUpload(bool fWhitelisted, UploadClass nClass, uint64_t nBytes);
+void GetUploadClassStats(std::vector<CUploadClassStats>& vStats);
+
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+
 void RelayTransaction(const CTransaction& tx);
 void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
 
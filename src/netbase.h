@@ -207,5 +207,10 @@ bool SetSocketNonBlocking(SOCKET& hSocket, bool fNonBlocking);
  * Convert milliseconds to a struct timeval for e.g. select.
  */
 struct timeval MillisToTimeval(int64_t nTimeout);
+/**
+ * Wait until a socket is readable (or writable if fWrite), for at most nTimeout milliseconds.
+ * Returns a positive value when the socket is ready, 0 on timeout and SOCKET_ERROR on error.
+ */
+int WaitForSocket(SOCKET hSocket, bool fWrite, int64_t nTimeout);
 
 #endif // BITCOIN_NETBASE_H
@@ -70,11 +70,31 @@ class CTxMemPoolEntry;
 static const double DEFAULT_DECAY = .998;
 
 /**
- * We will instantiate two instances of this class, one to track transactions
- * that were included in a block due to fee, and one for txs included due to
- * priority.  We will lump transactions into a bucket according to their approximate
- * fee or priority and then track how long it took for those txs to be included
- * in a block. There is always a bucket into which any given double value
+ * The moving averages are decayed lazily: instead of multiplying every
+ * bucket by the decay on each block, the stats keep a single running scale
+ * factor and store values divided by it.  Once the scale gets this small the
+ * stored values are renormalized, which keeps them far from overflowing.
+ */
+static const double MIN_DECAY_SCALE = 1e-50;
+
+/** Snapshot of one bucket, as returned by getfeeestimatorinfo */
+struct TxConfirmBucketInfo
+{
+    double upperBound;              //! upper bound of the bucket (inclusive)
+    double txCount;                 //! decayed number of confirmed txs
+    double avgValue;                //! average fee rate or priority of those txs
+    std::vector<double> confirmed;  //! decayed number confirmed within 1..max blocks
+    unsigned int inMempool;         //! txs from this bucket still in the mempool
+};
+
+/**
+ * We will instantiate three instances of this class, one to track transparent
+ * transactions that were included in a block due to fee, one for txs included
+ * due to priority and one for shielded transactions (which are much larger
+ * and would otherwise skew the fee rates of the transparent ones).  We will
+ * lump transactions into a bucket according to their approximate fee or
+ * priority and then track how long it took for those txs to be included in a
+ * block. There is always a bucket into which any given double value
  * (representing a fee or priority) falls.
  *
  * The tracking of unconfirmed (mempool) transactions is completely independent of the
@@ -84,33 +104,28 @@ class TxConfirmStats
 {
 private:
     //Define the buckets we will group transactions into (both fee buckets and priority buckets)
-    std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive)
-    std::map<double, unsigned int> bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
+    std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive), ascending
+
+    // All the moving averages below are stored divided by scale; multiply by
+    // scale to get the actual value.
 
     // For each bucket X:
-    // Count the total # of txs in each bucket
-    // Track the historical moving average of this total over blocks
+    // Track the historical moving average of the # of txs in each bucket
     std::vector<double> txCtAvg;
-    // and calcuate the total for the current block to update the moving average
-    std::vector<int> curBlockTxCt;
 
-    // Count the total # of txs confirmed within Y blocks in each bucket
-    // Track the historical moving average of theses totals over blocks
+    // Track the historical moving average of the # of txs confirmed within Y blocks in each bucket
     std::vector<std::vector<double> > confAvg; // confAvg[Y][X]
-    // and calcuate the totals for the current block to update the moving averages
-    std::vector<std::vector<int> > curBlockConf; // curBlockConf[Y][X]
 
-    // Sum the total priority/fee of all txs in each bucket
-    // Track the historical moving average of this total over blocks
+    // Track the historical moving average of the total priority/fee of all txs in each bucket
     std::vector<double> avg;
-    // and calculate the total for the current block to update the moving average
-    std::vector<double> curBlockVal;
 
     // Combine the conf counts with tx counts to calculate the confirmation % for each Y,X
     // Combine the total value with the tx counts to calculate the avg fee/priority per bucket
 
     std::string dataTypeString;
     double decay = DEFAULT_DECAY;
+    // Decay accumulated since the stored averages were last normalized
+    double scale = 1;
 
     // Mempool counts of outstanding transactions
     // For each bucket X, track the number of transactions in the mempool
@@ -119,9 +134,12 @@ private:
     // transactions still unconfirmed after MAX_CONFIRMS for each bucket
     std::vector<int> oldUnconfTxs;
 
+    /** Fold scale into the stored averages and reset it to 1 */
+    void Normalize();
+
 public:
     /** Find the bucket index of a given value */
-    unsigned int FindBucketIndex(double val);
+    unsigned int FindBucketIndex(double val) const;
 
     /**
      * Initialize the data structures.  This is called by BlockPolicyEstimator's
@@ -135,11 +153,12 @@ public:
      */
     void Initialize(std::vector<double>& defaultBuckets, unsigned int maxConfirms, double decay, std::string dataTypeString);
 
-    /** Clear the state of the curBlock variables to start counting for the new block */
+    /** Roll the mempool counts of the txs that entered maxConfirms blocks ago into oldUnconfTxs */
     void ClearCurrent(unsigned int nBlockHeight);
 
     /**
-     * Record a new transaction data point in the current block stats
+     * Record a new transaction data point in the moving averages of the
+     * current block.  Must be called after UpdateMovingAverages for that block.
      * @param blocksToConfirm the number of blocks it took this transaction to confirm
      * @param val either the fee or the priority when entered of the transaction
      * @warning blocksToConfirm is 1-based and has to be >= 1
@@ -153,8 +172,7 @@ public:
     void removeTx(unsigned int entryHeight, unsigned int nBestSeenHeight,
                   unsigned int bucketIndex);
 
-    /** Update our estimates by decaying our historical moving average and updating
-        with the data gathered from the current block */
+    /** Decay our historical moving averages for a new block.  This only updates scale. */
     void UpdateMovingAverages();
 
     /**
@@ -169,10 +187,16 @@ public:
      * @param nBlockHeight the current block height
      */
     double EstimateMedianVal(int confTarget, double sufficientTxVal,
-                             double minSuccess, bool requireGreater, unsigned int nBlockHeight);
+                             double minSuccess, bool requireGreater, unsigned int nBlockHeight) const;
 
     /** Return the max number of confirms we're tracking */
-    unsigned int GetMaxConfirms() { return confAvg.size(); }
+    unsigned int GetMaxConfirms() const { return confAvg.size(); }
+
+    /** Return the decay applied per block */
+    double GetDecay() const { return decay; }
+
+    /** Return the buckets that have seen any transaction */
+    void GetBucketInfo(std::vector<TxConfirmBucketInfo>& vInfo) const;
 
     /** Write state of estimation data to a file*/
     void Write(CAutoFile& fileout);
@@ -199,6 +223,9 @@ static const double SUFFICIENT_FEETXS = 1;
 /** Require only an avg of 1 tx every 5 blocks in the combined pri bucket (way less pri txs) */
 static const double SUFFICIENT_PRITXS = .2;
 
+/** Shielded txs are rare as well, so use the same threshold for them */
+static const double SUFFICIENT_SHIELDEDTXS = .2;
+
 // Minimum and Maximum values for tracking fees and priorities
 static const double MIN_FEERATE = 10;
 static const double MAX_FEERATE = 1e7;
@@ -227,9 +254,12 @@ public:
     /** Create new BlockPolicyEstimator and initialize stats tracking classes with default values */
     CBlockPolicyEstimator(const CFeeRate& minRelayFee);
 
-    /** Process all the transactions that have been included in a block */
+    /**
+     * Process all the transactions that have been included in a block.
+     * Must be called before the transactions are removed from the mempool.
+     */
     void processBlock(unsigned int nBlockHeight,
-                      std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate);
+                      const std::vector<const CTxMemPoolEntry*>& entries, bool fCurrentEstimate);
 
     /** Process a transaction confirmed in a block*/
     void processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry);
@@ -237,8 +267,8 @@ public:
     /** Process a transaction accepted to the mempool*/
     void processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate);
 
-    /** Remove a transaction from the mempool tracking stats*/
-    void removeTx(uint256 hash);
+    /** Remove a transaction from the mempool tracking stats, returns false if it wasn't tracked */
+    bool removeTx(const uint256& hash);
 
     /** Is this transaction likely included in a block because of its fee?*/
     bool isFeeDataPoint(const CFeeRate &fee, double pri);
@@ -252,6 +282,18 @@ public:
     /** Return a priority estimate */
     double estimatePriority(int confTarget);
 
+    /** Return a fee estimate for transactions with joinsplits */
+    CFeeRate estimateShieldedFee(int confTarget);
+
+    /** Return the height of the last block processed */
+    unsigned int GetBestSeenHeight() const { return nBestSeenHeight; }
+
+    /** Return the number of mempool transactions being tracked */
+    size_t GetTrackedTxCount() const { return mapMemPoolTxs.size(); }
+
+    /** Return the stats for fee, priority and shielded transactions, in that order */
+    std::vector<const TxConfirmStats*> GetStats() const;
+
     /** Write estimation data to a file */
     void Write(CAutoFile& fileout);
 
@@ -274,7 +316,7 @@ private:
     std::map<uint256, TxStatsInfo> mapMemPoolTxs;
 
     /** Classes to track historical data on transaction confirmations */
-    TxConfirmStats feeStats, priStats;
+    TxConfirmStats feeStats, priStats, shieldedStats;
 
     /** Breakpoints to help determine whether a transaction was confirmed by priority or Fee */
     CFeeRate feeLikely, feeUnlikely;
@@ -5,16 +5,20 @@
 
 #include "primitives/block.h"
 #include "primitives/transaction.h"
+#include "blockfilterindex.h"
 #include "main.h"
 #include "httpserver.h"
+#include "rpc/jsonstream.h"
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
 #include "txmempool.h"
+#include "undo.h"
 #include "utilstrencodings.h"
 #include "version.h"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 #include <boost/dynamic_bitset.hpp>
 
 #include <univalue.h>
@@ -22,6 +26,13 @@
 using namespace std;
 
 static const size_t MAX_GETUTXOS_OUTPOINTS = 15; //allow a max of 15 outpoints to be queried at once
+//! Outpoints that can be queried at once when they are posted in the request body
+static const size_t MAX_GETUTXOS_POST_OUTPOINTS = 5000;
+//! Blocks, undo data or headers that can be requested at once from the range endpoints
+static const int MAX_RANGE_BLOCKS = 1000;
+static const int MAX_RANGE_HEADERS = 20000;
+//! A range reply ends early once this many bytes of it, as encoded, are sent; fetch the rest with another request
+static const size_t MAX_RANGE_REPLY_BYTES = 32 * 1024 * 1024;
 
 enum RetFormat {
     RF_UNDEF,
@@ -57,9 +68,9 @@ struct CCoin {
 };
 
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
-extern UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false);
+extern void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails, CJSONStreamWriter& writer, const CBlockUndo* pblockUndo = NULL);
 extern UniValue mempoolInfoToJSON();
-extern UniValue mempoolToJSON(bool fVerbose = false);
+extern void mempoolToJSON(bool fVerbose, CJSONStreamWriter& writer);
 extern void ScriptPubKeyToJSON(const CScript& scriptPubKey, UniValue& out, bool fIncludeHex);
 extern UniValue blockheaderToJSON(const CBlockIndex* blockindex);
 
@@ -237,10 +248,13 @@ static bool rest_block(HTTPRequest* req,
     }
 
     case RF_JSON: {
-        UniValue objBlock = blockToJSON(block, pblockindex, showTxDetails);
-        string strJSON = objBlock.write() + "\n";
         req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        req->StartReply(HTTP_OK);
+        CJSONStreamWriter writer(boost::bind(&HTTPRequest::WriteReplyChunk, req, _1));
+        blockToJSON(block, pblockindex, showTxDetails, writer);
+        writer.Flush();
+        req->WriteReplyChunk("\n");
+        req->EndReply();
         return true;
     }
 
@@ -263,6 +277,290 @@ static bool rest_block_notxdetails(HTTPRequest* req, const std::string& strURIPa
     return rest_block(req, strURIPart, false);
 }
 
+/** Resolve the filter type named in a URI; only the indexed type can be served */
+static bool ParseBlockFilterType(HTTPRequest* req, const std::string& strType, BlockFilterType& filterType)
+{
+    if (!BlockFilterTypeByName(strType, filterType))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Unknown filtertype " + strType);
+    if (!pblockfilterindex || pblockfilterindex->GetFilterType() != filterType)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Index is not enabled for filtertype " + strType);
+    return true;
+}
+
+static bool BlockFilterNotFound(HTTPRequest* req)
+{
+    if (!pblockfilterindex->IsSynced())
+        return RESTERR(req, HTTP_NOT_FOUND, "Filter not found. Block filters are still in the process of being indexed.");
+    return RESTERR(req, HTTP_NOT_FOUND, "Filter not found.");
+}
+
+/** The filter of a block: /rest/blockfilter/<filtertype>/<hash>.<ext>, in its cfilter serialization in binary */
+static bool rest_block_filter(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    const RetFormat rf = ParseDataFormat(params, strURIPart);
+    vector<string> path;
+    boost::split(path, params[0], boost::is_any_of("/"));
+
+    if (path.size() != 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/blockfilter/<filtertype>/<blockhash>.<ext>");
+
+    BlockFilterType filterType;
+    if (!ParseBlockFilterType(req, path[0], filterType))
+        return false;
+
+    uint256 hash;
+    if (!ParseHashStr(path[1], hash))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + path[1]);
+
+    const CBlockIndex* pblockindex = NULL;
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            return RESTERR(req, HTTP_NOT_FOUND, path[1] + " not found");
+        pblockindex = mi->second;
+    }
+
+    BlockFilter filter;
+    uint256 header;
+    if (!pblockfilterindex->LookupFilter(pblockindex, filter) || !pblockfilterindex->LookupFilterHeader(pblockindex, header))
+        return BlockFilterNotFound(req);
+
+    CDataStream ssFilter(SER_NETWORK, PROTOCOL_VERSION);
+    ssFilter << filter;
+
+    switch (rf) {
+    case RF_BINARY: {
+        string binaryFilter = ssFilter.str();
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, binaryFilter);
+        return true;
+    }
+
+    case RF_HEX: {
+        string strHex = HexStr(ssFilter.begin(), ssFilter.end()) + "\n";
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
+        return true;
+    }
+
+    case RF_JSON: {
+        UniValue ret(UniValue::VOBJ);
+        ret.push_back(Pair("filter", HexStr(filter.GetEncodedFilter())));
+        ret.push_back(Pair("header", header.GetHex()));
+        string strJSON = ret.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+}
+
+/** Filter headers of count blocks of the best chain from a block on: /rest/blockfilterheaders/<filtertype>/<count>/<hash>.<ext> */
+static bool rest_filter_headers(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    const RetFormat rf = ParseDataFormat(params, strURIPart);
+    vector<string> path;
+    boost::split(path, params[0], boost::is_any_of("/"));
+
+    if (path.size() != 3)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/blockfilterheaders/<filtertype>/<count>/<blockhash>.<ext>");
+
+    BlockFilterType filterType;
+    if (!ParseBlockFilterType(req, path[0], filterType))
+        return false;
+
+    long count = strtol(path[1].c_str(), NULL, 10);
+    if (count < 1 || count > (long)MAX_GETCFHEADERS_SIZE)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Header count out of range: " + path[1]);
+
+    uint256 hash;
+    if (!ParseHashStr(path[2], hash))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + path[2]);
+
+    std::vector<const CBlockIndex*> vIndex;
+    vIndex.reserve(count);
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(hash);
+        const CBlockIndex* pindex = (it != mapBlockIndex.end()) ? it->second : NULL;
+        while (pindex != NULL && chainActive.Contains(pindex)) {
+            vIndex.push_back(pindex);
+            if (vIndex.size() == (unsigned long)count)
+                break;
+            pindex = chainActive.Next(pindex);
+        }
+    }
+
+    std::vector<uint256> vHeaders(vIndex.size());
+    for (size_t i = 0; i < vIndex.size(); i++)
+        if (!pblockfilterindex->LookupFilterHeader(vIndex[i], vHeaders[i]))
+            return BlockFilterNotFound(req);
+
+    switch (rf) {
+    case RF_BINARY: {
+        CDataStream ssHeaders(SER_NETWORK, PROTOCOL_VERSION);
+        BOOST_FOREACH(const uint256& header, vHeaders)
+            ssHeaders << header;
+        string binaryHeaders = ssHeaders.str();
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, binaryHeaders);
+        return true;
+    }
+
+    case RF_HEX: {
+        CDataStream ssHeaders(SER_NETWORK, PROTOCOL_VERSION);
+        BOOST_FOREACH(const uint256& header, vHeaders)
+            ssHeaders << header;
+        string strHex = HexStr(ssHeaders.begin(), ssHeaders.end()) + "\n";
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
+        return true;
+    }
+
+    case RF_JSON: {
+        UniValue jsonHeaders(UniValue::VARR);
+        BOOST_FOREACH(const uint256& header, vHeaders)
+            jsonHeaders.push_back(header.GetHex());
+        string strJSON = jsonHeaders.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+}
+
+enum RangeKind {
+    RANGE_BLOCKS,
+    RANGE_UNDO,
+    RANGE_HEADERS,
+};
+
+/**
+ * Serve the blocks, undo data or headers of a range of heights of the best
+ * chain: /rest/<kind>range/<height>/<count>.<bin|hex>. Items are concatenated
+ * in their network serialization and sent to the client as they are read.
+ */
+static bool rest_range(HTTPRequest* req, const std::string& strURIPart, RangeKind kind)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    const RetFormat rf = ParseDataFormat(params, strURIPart);
+    if (rf != RF_BINARY && rf != RF_HEX)
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: .bin, .hex)");
+
+    vector<string> path;
+    boost::split(path, params[0], boost::is_any_of("/"));
+    if (path.size() != 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, "No range specified. Use /rest/<kind>range/<height>/<count>.<ext>.");
+
+    int32_t nStart, nCount;
+    const int nMaxCount = (kind == RANGE_HEADERS) ? MAX_RANGE_HEADERS : MAX_RANGE_BLOCKS;
+    if (!ParseInt32(path[0], &nStart) || nStart < 0)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid height: " + path[0]);
+    if (!ParseInt32(path[1], &nCount) || nCount < 1 || nCount > nMaxCount)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Count out of range: " + path[1]);
+    if (kind == RANGE_UNDO && nStart == 0)
+        return RESTERR(req, HTTP_BAD_REQUEST, "The genesis block has no undo data");
+
+    // Take the positions of the whole range in one go, so that it comes from
+    // a single chain even if the tip moves while the data is read.
+    std::vector<CBlockHeader> vHeaders;
+    std::vector<std::pair<CDiskBlockPos, uint256> > vPos;
+    {
+        LOCK(cs_main);
+        if (nStart > chainActive.Height())
+            return RESTERR(req, HTTP_NOT_FOUND, "Height out of range: " + path[0]);
+        const int nEnd = std::min(chainActive.Height(), nStart + nCount - 1);
+        for (int nHeight = nStart; nHeight <= nEnd; nHeight++) {
+            const CBlockIndex* pindex = chainActive[nHeight];
+            if (kind == RANGE_HEADERS) {
+                vHeaders.push_back(pindex->GetBlockHeader());
+            } else if (kind == RANGE_BLOCKS) {
+                if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+                    return RESTERR(req, HTTP_NOT_FOUND, strprintf("Block at height %d not available (pruned data)", nHeight));
+                vPos.push_back(std::make_pair(pindex->GetBlockPos(), pindex->GetBlockHash()));
+            } else {
+                if (!(pindex->nStatus & BLOCK_HAVE_UNDO))
+                    return RESTERR(req, HTTP_NOT_FOUND, strprintf("Undo data at height %d not available (pruned data)", nHeight));
+                vPos.push_back(std::make_pair(pindex->GetUndoPos(), pindex->pprev->GetBlockHash()));
+            }
+        }
+    }
+
+    size_t nBytes = 0;
+    size_t nItems = (kind == RANGE_HEADERS) ? vHeaders.size() : vPos.size();
+    for (size_t i = 0; i < nItems && nBytes < MAX_RANGE_REPLY_BYTES; i++) {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        std::string strError;
+        if (kind == RANGE_HEADERS) {
+            ss << vHeaders[i];
+        } else if (kind == RANGE_BLOCKS) {
+            CBlock block;
+            if (!ReadBlockFromDisk(block, vPos[i].first) || block.GetHash() != vPos[i].second)
+                strError = strprintf("Block at height %d not found", nStart + (int)i);
+            else
+                ss << block;
+        } else {
+            CBlockUndo blockundo;
+            if (!UndoReadFromDisk(blockundo, vPos[i].first, vPos[i].second))
+                strError = strprintf("Undo data at height %d not found", nStart + (int)i);
+            else
+                ss << blockundo;
+        }
+        if (!strError.empty()) {
+            if (i == 0)
+                return RESTERR(req, HTTP_NOT_FOUND, strError);
+            // Part of the reply is out already: cut it short
+            LogPrintf("%s: %s\n", __func__, strError);
+            req->EndReply(false);
+            return false;
+        }
+        if (i == 0) {
+            req->WriteHeader("Content-Type", rf == RF_BINARY ? "application/octet-stream" : "text/plain");
+            req->StartReply(HTTP_OK);
+        }
+        std::string strData = (rf == RF_BINARY) ? ss.str() : HexStr(ss.begin(), ss.end());
+        nBytes += strData.size();
+        req->WriteReplyChunk(strData);
+    }
+
+    if (rf == RF_HEX)
+        req->WriteReplyChunk("\n");
+    req->EndReply();
+    return true;
+}
+
+static bool rest_blockrange(HTTPRequest* req, const std::string& strURIPart)
+{
+    return rest_range(req, strURIPart, RANGE_BLOCKS);
+}
+
+static bool rest_undorange(HTTPRequest* req, const std::string& strURIPart)
+{
+    return rest_range(req, strURIPart, RANGE_UNDO);
+}
+
+static bool rest_headerrange(HTTPRequest* req, const std::string& strURIPart)
+{
+    return rest_range(req, strURIPart, RANGE_HEADERS);
+}
+
 static bool rest_chaininfo(HTTPRequest* req, const std::string& strURIPart)
 {
     if (!CheckWarmup(req))
@@ -322,11 +620,13 @@ static bool rest_mempool_contents(HTTPRequest* req, const std::string& strURIPar
 
     switch (rf) {
     case RF_JSON: {
-        UniValue mempoolObject = mempoolToJSON(true);
-
-        string strJSON = mempoolObject.write() + "\n";
         req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        req->StartReply(HTTP_OK);
+        CJSONStreamWriter writer(boost::bind(&HTTPRequest::WriteReplyChunk, req, _1));
+        mempoolToJSON(true, writer);
+        writer.Flush();
+        req->WriteReplyChunk("\n");
+        req->EndReply();
         return true;
     }
     default: {
@@ -481,17 +781,23 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
     }
     }
 
-    // limit max outpoints
-    if (vOutPoints.size() > MAX_GETUTXOS_OUTPOINTS)
-        return RESTERR(req, HTTP_INTERNAL_SERVER_ERROR, strprintf("Error: max outpoints exceeded (max: %d, tried: %d)", MAX_GETUTXOS_OUTPOINTS, vOutPoints.size()));
+    // limit max outpoints; more can be posted in the request body than fit in a URI
+    const size_t nMaxOutPoints = fInputParsed ? MAX_GETUTXOS_OUTPOINTS : MAX_GETUTXOS_POST_OUTPOINTS;
+    if (vOutPoints.size() > nMaxOutPoints)
+        return RESTERR(req, HTTP_INTERNAL_SERVER_ERROR, strprintf("Error: max outpoints exceeded (max: %d, tried: %d)", nMaxOutPoints, vOutPoints.size()));
 
     // check spentness and form a bitmap (as well as a JSON capable human-readble string representation)
     vector<unsigned char> bitmap;
     vector<CCoin> outs;
     std::string bitmapStringRepresentation;
     boost::dynamic_bitset<unsigned char> hits(vOutPoints.size());
+    int nChainHeight;
+    uint256 hashChainTip;
     {
+        // All outpoints are looked up under one lock, against the tip taken here
         LOCK2(cs_main, mempool.cs);
+        nChainHeight = chainActive.Height();
+        hashChainTip = chainActive.Tip()->GetBlockHash();
 
         CCoinsView viewDummy;
         CCoinsViewCache view(&viewDummy);
@@ -530,7 +836,7 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
         // serialize data
         // use exact same output as mentioned in Bip64
         CDataStream ssGetUTXOResponse(SER_NETWORK, PROTOCOL_VERSION);
-        ssGetUTXOResponse << chainActive.Height() << chainActive.Tip()->GetBlockHash() << bitmap << outs;
+        ssGetUTXOResponse << nChainHeight << hashChainTip << bitmap << outs;
         string ssGetUTXOResponseString = ssGetUTXOResponse.str();
 
         req->WriteHeader("Content-Type", "application/octet-stream");
@@ -540,7 +846,7 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
 
     case RF_HEX: {
         CDataStream ssGetUTXOResponse(SER_NETWORK, PROTOCOL_VERSION);
-        ssGetUTXOResponse << chainActive.Height() << chainActive.Tip()->GetBlockHash() << bitmap << outs;
+        ssGetUTXOResponse << nChainHeight << hashChainTip << bitmap << outs;
         string strHex = HexStr(ssGetUTXOResponse.begin(), ssGetUTXOResponse.end()) + "\n";
 
         req->WriteHeader("Content-Type", "text/plain");
@@ -553,8 +859,8 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
 
         // pack in some essentials
         // use more or less the same output as mentioned in Bip64
-        objGetUTXOResponse.push_back(Pair("chainHeight", chainActive.Height()));
-        objGetUTXOResponse.push_back(Pair("chaintipHash", chainActive.Tip()->GetBlockHash().GetHex()));
+        objGetUTXOResponse.push_back(Pair("chainHeight", nChainHeight));
+        objGetUTXOResponse.push_back(Pair("chaintipHash", hashChainTip.GetHex()));
         objGetUTXOResponse.push_back(Pair("bitmap", bitmapStringRepresentation));
 
         UniValue utxos(UniValue::VARR);
@@ -598,6 +904,11 @@ static const struct {
       {"/rest/mempool/info", rest_mempool_info},
       {"/rest/mempool/contents", rest_mempool_contents},
       {"/rest/headers/", rest_headers},
+      {"/rest/blockfilter/", rest_block_filter},
+      {"/rest/blockfilterheaders/", rest_filter_headers},
+      {"/rest/blockrange/", rest_blockrange},
+      {"/rest/undorange/", rest_undorange},
+      {"/rest/headerrange/", rest_headerrange},
       {"/rest/getutxos", rest_getutxos},
 };
 
@@ -4,15 +4,19 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "amount.h"
+#include "blockfilterindex.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "consensus/validation.h"
 #include "main.h"
 #include "primitives/transaction.h"
+#include "rpc/jsonstream.h"
 #include "rpc/server.h"
+#include "spentindex.h"
 #include "streams.h"
 #include "sync.h"
+#include "undo.h"
 #include "util.h"
 #include "zen/delay.h"
 
@@ -22,30 +26,16 @@
 
 #include <regex>
 
+#include <boost/bind.hpp>
+
 using namespace std;
 
-extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry, const CTxUndo* txundo);
 void ScriptPubKeyToJSON(const CScript& scriptPubKey, UniValue& out, bool fIncludeHex);
 
-double GetDifficultyINTERNAL(const CBlockIndex* blockindex, bool networkDifficulty)
+/** Floating point number that is a multiple of the minimum difficulty, minimum difficulty = 1.0 */
+static double GetDifficultyFromBits(uint32_t bits)
 {
-    // Floating point number that is a multiple of the minimum difficulty,
-    // minimum difficulty = 1.0.
-    if (blockindex == NULL)
-    {
-        if (chainActive.Tip() == NULL)
-            return 1.0;
-        else
-            blockindex = chainActive.Tip();
-    }
-
-    uint32_t bits;
-    if (networkDifficulty) {
-        bits = GetNextWorkRequired(blockindex, nullptr, Params().GetConsensus());
-    } else {
-        bits = blockindex->nBits;
-    }
-
     uint32_t powLimit =
         UintToArith256(Params().GetConsensus().powLimit).GetCompact();
     int nShift = (bits >> 24) & 0xff;
@@ -69,6 +59,25 @@ double GetDifficultyINTERNAL(const CBlockIndex* blockindex, bool networkDifficul
     return dDiff;
 }
 
+double GetDifficultyINTERNAL(const CBlockIndex* blockindex, bool networkDifficulty)
+{
+    if (blockindex == NULL)
+    {
+        if (chainActive.Tip() == NULL)
+            return 1.0;
+        else
+            blockindex = chainActive.Tip();
+    }
+
+    uint32_t bits;
+    if (networkDifficulty) {
+        bits = GetNextWorkRequired(blockindex, nullptr, Params().GetConsensus());
+    } else {
+        bits = blockindex->nBits;
+    }
+    return GetDifficultyFromBits(bits);
+}
+
 double GetDifficulty(const CBlockIndex* blockindex)
 {
     return GetDifficultyINTERNAL(blockindex, false);
@@ -98,14 +107,16 @@ static UniValue ValuePoolDesc(
     return rv;
 }
 
+/** Does not need cs_main; the chain is taken from the chain tip snapshot */
 UniValue blockheaderToJSON(const CBlockIndex* blockindex)
 {
+    std::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshot();
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hash", blockindex->GetBlockHash().GetHex()));
     int confirmations = -1;
     // Only report confirmations if the block is on the main chain
-    if (chainActive.Contains(blockindex))
-        confirmations = chainActive.Height() - blockindex->nHeight + 1;
+    if (tip->Contains(blockindex))
+        confirmations = tip->nHeight - blockindex->nHeight + 1;
     result.push_back(Pair("confirmations", confirmations));
     result.push_back(Pair("height", blockindex->nHeight));
     result.push_back(Pair("version", blockindex->nVersion));
@@ -114,18 +125,19 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
     result.push_back(Pair("nonce", blockindex->nNonce.GetHex()));
     result.push_back(Pair("solution", HexStr(blockindex->nSolution)));
     result.push_back(Pair("bits", strprintf("%08x", blockindex->nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
+    result.push_back(Pair("difficulty", GetDifficultyFromBits(blockindex->nBits)));
     result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
 
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    CBlockIndex *pnext = chainActive.Next(blockindex);
+    const CBlockIndex *pnext = tip->Next(blockindex);
     if (pnext)
         result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
     return result;
 }
 
-UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+/** With pblockUndo, the transaction details also describe the outputs spent by the inputs */
+UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false, const CBlockUndo* pblockUndo = NULL)
 {
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hash", block.GetHash().GetHex()));
@@ -139,12 +151,13 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(Pair("version", block.nVersion));
     result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
     UniValue txs(UniValue::VARR);
-    BOOST_FOREACH(const CTransaction&tx, block.vtx)
+    for (size_t i = 0; i < block.vtx.size(); i++)
     {
+        const CTransaction& tx = block.vtx[i];
         if(txDetails)
         {
             UniValue objTx(UniValue::VOBJ);
-            TxToJSON(tx, uint256(), objTx);
+            TxToJSON(tx, uint256(), objTx, (pblockUndo && i > 0) ? &pblockUndo->vtxundo[i - 1] : NULL);
             txs.push_back(objTx);
         }
         else
@@ -171,6 +184,35 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     return result;
 }
 
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails, CJSONStreamWriter& writer, const CBlockUndo* pblockUndo)
+{
+    // Same members as blockToJSON, with the transactions written one at a time
+    UniValue result;
+    {
+        LOCK(cs_main);
+        result = blockToJSON(block, blockindex, false);
+    }
+    const std::vector<std::string>& keys = result.getKeys();
+    const std::vector<UniValue>& values = result.getValues();
+    writer.BeginObject();
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i] != "tx" || !txDetails) {
+            writer.KeyValue(keys[i], values[i]);
+            continue;
+        }
+        writer.Key("tx");
+        writer.BeginArray();
+        for (size_t i = 0; i < block.vtx.size(); i++)
+        {
+            UniValue objTx(UniValue::VOBJ);
+            TxToJSON(block.vtx[i], uint256(), objTx, (pblockUndo && i > 0) ? &pblockUndo->vtxundo[i - 1] : NULL);
+            writer.Value(objTx);
+        }
+        writer.EndArray();
+    }
+    writer.EndObject();
+}
+
 UniValue getblockcount(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -184,8 +226,7 @@ UniValue getblockcount(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getblockcount", "")
         );
 
-    LOCK(cs_main);
-    return chainActive.Height();
+    return GetChainTipSnapshot()->nHeight;
 }
 
 UniValue getbestblockhash(const UniValue& params, bool fHelp)
@@ -201,8 +242,7 @@ UniValue getbestblockhash(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getbestblockhash", "")
         );
 
-    LOCK(cs_main);
-    return chainActive.Tip()->GetBlockHash().GetHex();
+    return GetChainTipSnapshot()->hashBlock.GetHex();
 }
 
 UniValue getdifficulty(const UniValue& params, bool fHelp)
@@ -218,8 +258,38 @@ UniValue getdifficulty(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getdifficulty", "")
         );
 
-    LOCK(cs_main);
-    return GetNetworkDifficulty();
+    std::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshot();
+    if (tip->pindexTip == NULL)
+        return 1.0;
+    return GetDifficultyFromBits(tip->nNextBits);
+}
+
+/** Requires mempool.cs */
+static UniValue mempoolEntryToJSON(const CTxMemPoolEntry& e)
+{
+    UniValue info(UniValue::VOBJ);
+    info.push_back(Pair("size", (int)e.GetTxSize()));
+    info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
+    info.push_back(Pair("time", e.GetTime()));
+    info.push_back(Pair("height", (int)e.GetHeight()));
+    info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
+    info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+    const CTransaction& tx = e.GetTx();
+    set<string> setDepends;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (mempool.exists(txin.prevout.hash))
+            setDepends.insert(txin.prevout.hash.ToString());
+    }
+
+    UniValue depends(UniValue::VARR);
+    BOOST_FOREACH(const string& dep, setDepends)
+    {
+        depends.push_back(dep);
+    }
+
+    info.push_back(Pair("depends", depends));
+    return info;
 }
 
 UniValue mempoolToJSON(bool fVerbose = false)
@@ -229,33 +299,7 @@ UniValue mempoolToJSON(bool fVerbose = false)
         LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
         BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
-        {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
-            UniValue info(UniValue::VOBJ);
-            info.push_back(Pair("size", (int)e.GetTxSize()));
-            info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
-            info.push_back(Pair("time", e.GetTime()));
-            info.push_back(Pair("height", (int)e.GetHeight()));
-            info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
-            info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
-            const CTransaction& tx = e.GetTx();
-            set<string> setDepends;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                if (mempool.exists(txin.prevout.hash))
-                    setDepends.insert(txin.prevout.hash.ToString());
-            }
-
-            UniValue depends(UniValue::VARR);
-            BOOST_FOREACH(const string& dep, setDepends)
-            {
-                depends.push_back(dep);
-            }
-
-            info.push_back(Pair("depends", depends));
-            o.push_back(Pair(hash.ToString(), info));
-        }
+            o.push_back(Pair(entry.first.ToString(), mempoolEntryToJSON(entry.second)));
         return o;
     }
     else
@@ -271,6 +315,44 @@ UniValue mempoolToJSON(bool fVerbose = false)
     }
 }
 
+/** Number of verbose mempool entries prepared per acquisition of the locks */
+static const size_t MEMPOOL_JSON_BATCH = 1000;
+
+void mempoolToJSON(bool fVerbose, CJSONStreamWriter& writer)
+{
+    // Nothing is written under the locks, as the writer may wait for a slow client
+    vector<uint256> vtxid;
+    mempool.queryHashes(vtxid);
+
+    if (!fVerbose)
+    {
+        writer.BeginArray();
+        BOOST_FOREACH(const uint256& hash, vtxid)
+            writer.Value(hash.ToString());
+        writer.EndArray();
+        return;
+    }
+
+    writer.BeginObject();
+    for (size_t nStart = 0; nStart < vtxid.size(); nStart += MEMPOOL_JSON_BATCH)
+    {
+        vector<pair<string, UniValue> > vEntries;
+        {
+            LOCK2(cs_main, mempool.cs);
+            size_t nEnd = std::min(vtxid.size(), nStart + MEMPOOL_JSON_BATCH);
+            for (size_t i = nStart; i < nEnd; i++) {
+                // Transactions that left the mempool in the meantime are skipped
+                map<uint256, CTxMemPoolEntry>::const_iterator it = mempool.mapTx.find(vtxid[i]);
+                if (it != mempool.mapTx.end())
+                    vEntries.push_back(make_pair(it->first.ToString(), mempoolEntryToJSON(it->second)));
+            }
+        }
+        for (size_t i = 0; i < vEntries.size(); i++)
+            writer.KeyValue(vEntries[i].first, vEntries[i].second);
+    }
+    writer.EndObject();
+}
+
 UniValue getrawmempool(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -312,6 +394,23 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
     return mempoolToJSON(fVerbose);
 }
 
+static void WriteMempool(bool fVerbose, CJSONStreamWriter& writer)
+{
+    mempoolToJSON(fVerbose, writer);
+}
+
+RPCStreamResult getrawmempool_stream(const UniValue& params)
+{
+    if (params.size() > 1)
+        return RPCStreamResult();
+
+    bool fVerbose = false;
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    return boost::bind(&WriteMempool, fVerbose, _1);
+}
+
 UniValue getblockhash(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -327,16 +426,48 @@ UniValue getblockhash(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getblockhash", "1000")
         );
 
-    LOCK(cs_main);
-
     int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > chainActive.Height())
+    const CBlockIndex* pblockindex = (*GetChainTipSnapshot())[nHeight];
+    if (pblockindex == NULL)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
 
-    CBlockIndex* pblockindex = chainActive[nHeight];
     return pblockindex->GetBlockHash().GetHex();
 }
 
+UniValue getblockhashes(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getblockhashes high low\n"
+            "\nReturns the hashes of blocks in the best block chain with a time in a range (requires -timestampindex).\n"
+            "\nArguments:\n"
+            "1. high         (numeric, required) The time after the last block to include\n"
+            "2. low          (numeric, required) The time of the first block to include\n"
+            "\nResult:\n"
+            "[\n"
+            "  \"hash\"       (string) The block hash, in order of block time\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockhashes", "1231614698 1231024505")
+            + HelpExampleRpc("getblockhashes", "1231614698, 1231024505")
+        );
+
+    int64_t nHigh = params[0].get_int64();
+    int64_t nLow = params[1].get_int64();
+    if (nHigh < 0 || nLow < 0 || nHigh > std::numeric_limits<unsigned int>::max() || nLow > std::numeric_limits<unsigned int>::max())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Time out of range");
+
+    std::vector<uint256> vHashes;
+    if (!GetTimestampIndex((unsigned int)nHigh, (unsigned int)nLow, vHashes))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for block hashes");
+
+    UniValue result(UniValue::VARR);
+    for (std::vector<uint256>::const_iterator it = vHashes.begin(); it != vHashes.end(); it++)
+        result.push_back(it->GetHex());
+    return result;
+}
+
 UniValue getblockheader(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -368,8 +499,6 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getblockheader", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
         );
 
-    LOCK(cs_main);
-
     std::string strHash = params[0].get_str();
     uint256 hash(uint256S(strHash));
 
@@ -377,11 +506,11 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
+    // Headers never change once known, so this does not need cs_main
+    const CBlockIndex* pblockindex = LookupBlockIndex(hash);
+    if (pblockindex == NULL)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
     if (!fVerbose)
     {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
@@ -393,46 +522,59 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
     return blockheaderToJSON(pblockindex);
 }
 
-UniValue getblock(const UniValue& params, bool fHelp)
+UniValue getblockfilter(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
-            "getblock \"hash|height\" ( verbose )\n"
-            "\nIf verbose is false, returns a string that is serialized, hex-encoded data for block 'hash|height'.\n"
-            "If verbose is true, returns an Object with information about block <hash|height>.\n"
+            "getblockfilter \"blockhash\" ( \"filtertype\" )\n"
+            "\nRetrieve the compact filter of a particular block.\n"
+            "Requires -blockfilterindex.\n"
             "\nArguments:\n"
-            "1. \"hash|height\"     (string, required) The block hash or height\n"
-            "2. verbose           (boolean, optional, default=true) true for a json object, false for the hex encoded data\n"
-            "\nResult (for verbose = true):\n"
+            "1. \"blockhash\"       (string, required) The hash of the block\n"
+            "2. \"filtertype\"      (string, optional, default=zen) The type name of the filter\n"
+            "\nResult:\n"
             "{\n"
-            "  \"hash\" : \"hash\",       (string) the block hash (same as provided hash)\n"
-            "  \"confirmations\" : n,   (numeric) The number of confirmations, or -1 if the block is not on the main chain\n"
-            "  \"size\" : n,            (numeric) The block size\n"
-            "  \"height\" : n,          (numeric) The block height or index (same as provided height)\n"
-            "  \"version\" : n,         (numeric) The block version\n"
-            "  \"merkleroot\" : \"xxxx\", (string) The merkle root\n"
-            "  \"tx\" : [               (array of string) The transaction ids\n"
-            "     \"transactionid\"     (string) The transaction id\n"
-            "     ,...\n"
-            "  ],\n"
-            "  \"time\" : ttt,          (numeric) The block time in seconds since epoch (Jan 1 1970 GMT)\n"
-            "  \"nonce\" : n,           (numeric) The nonce\n"
-            "  \"bits\" : \"1d00ffff\",   (string) The bits\n"
-            "  \"difficulty\" : x.xxx,  (numeric) The difficulty\n"
-            "  \"previousblockhash\" : \"hash\",  (string) The hash of the previous block\n"
-            "  \"nextblockhash\" : \"hash\"       (string) The hash of the next block\n"
+            "  \"filter\" : \"hex\",   (string) the hex-encoded filter data\n"
+            "  \"header\" : \"hex\"    (string) the hex-encoded filter header\n"
             "}\n"
-            "\nResult (for verbose=false):\n"
-            "\"data\"             (string) A string that is serialized, hex-encoded data for block 'hash'.\n"
             "\nExamples:\n"
-            + HelpExampleCli("getblock", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
-            + HelpExampleRpc("getblock", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
-            + HelpExampleCli("getblock", "12800")
-            + HelpExampleRpc("getblock", "12800")
+            + HelpExampleCli("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\" \"zen\"")
+            + HelpExampleRpc("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\", \"zen\"")
         );
 
-    LOCK(cs_main);
+    uint256 hash(uint256S(params[0].get_str()));
+
+    std::string strFilterType = "zen";
+    if (params.size() > 1)
+        strFilterType = params[1].get_str();
+
+    BlockFilterType filterType;
+    if (!BlockFilterTypeByName(strFilterType, filterType))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown filtertype");
+    if (!pblockfilterindex || pblockfilterindex->GetFilterType() != filterType)
+        throw JSONRPCError(RPC_MISC_ERROR, "Index is not enabled for filtertype " + strFilterType);
+
+    const CBlockIndex* pblockindex = LookupBlockIndex(hash);
+    if (pblockindex == NULL)
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+
+    BlockFilter filter;
+    uint256 header;
+    if (!pblockfilterindex->LookupFilter(pblockindex, filter) || !pblockfilterindex->LookupFilterHeader(pblockindex, header)) {
+        if (!pblockfilterindex->IsSynced())
+            throw JSONRPCError(RPC_MISC_ERROR, "Filter not found. Block filters are still in the process of being indexed.");
+        throw JSONRPCError(RPC_MISC_ERROR, "Filter not found.");
+    }
 
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("filter", HexStr(filter.GetEncodedFilter())));
+    ret.push_back(Pair("header", header.GetHex()));
+    return ret;
+}
+
+/** Find and read the block getblock asks for by hash or height. Requires cs_main. */
+static CBlockIndex* ReadBlockForRPC(const UniValue& params, CBlock& block)
+{
     std::string strHash = params[0].get_str();
 
     // If height is supplied, find the hash
@@ -459,14 +601,9 @@ UniValue getblock(const UniValue& params, bool fHelp)
 
     uint256 hash(uint256S(strHash));
 
-    bool fVerbose = true;
-    if (params.size() > 1)
-        fVerbose = params[1].get_bool();
-
     if (mapBlockIndex.count(hash) == 0)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
     if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
@@ -475,7 +612,113 @@ UniValue getblock(const UniValue& params, bool fHelp)
     if(!ReadBlockFromDisk(block, pblockindex))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
-    if (!fVerbose)
+    return pblockindex;
+
+}
+
+/**
+ * Read the undo data of a block, which holds the outputs spent by each of its
+ * transactions but the coinbase. False if the block has none, as the genesis
+ * block or a block that was never connected.
+ */
+bool ReadBlockUndoForRPC(const CBlock& block, const CBlockIndex* pindex, CBlockUndo& blockUndo)
+{
+    if (!pindex->pprev || !(pindex->nStatus & BLOCK_HAVE_UNDO))
+        return false;
+    if (!UndoReadFromDisk(blockUndo, pindex->GetUndoPos(), pindex->pprev->GetBlockHash()))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read undo data from disk");
+    if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block and undo data inconsistent");
+    return true;
+}
+
+/** The verbosity argument of getblock, which used to be a boolean */
+static int ParseBlockVerbosity(const UniValue& params)
+{
+    if (params.size() < 2)
+        return 1;
+    if (params[1].isNum())
+        return params[1].get_int();
+    return params[1].get_bool() ? 1 : 0;
+}
+
+UniValue getblock(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "getblock \"hash|height\" ( verbosity )\n"
+            "\nIf verbosity is 0, returns a string that is serialized, hex-encoded data for block 'hash|height'.\n"
+            "If verbosity is 1, returns an Object with information about block <hash|height>.\n"
+            "If verbosity is 2, returns an Object with information about block <hash|height> and each of its transactions.\n"
+            "If verbosity is 3, the transactions also describe the outputs spent by their inputs, and their fee, as far as\n"
+            "the undo data of the block is available. It is read once for the whole block.\n"
+            "\nArguments:\n"
+            "1. \"hash|height\"     (string, required) The block hash or height\n"
+            "2. verbosity         (numeric, optional, default=1) 0 for hex encoded data, 1 for a json object, 2 and 3 for\n"
+            "                     a json object with transaction data. true and false stand for 1 and 0\n"
+            "\nResult (for verbosity = 1):\n"
+            "{\n"
+            "  \"hash\" : \"hash\",       (string) the block hash (same as provided hash)\n"
+            "  \"confirmations\" : n,   (numeric) The number of confirmations, or -1 if the block is not on the main chain\n"
+            "  \"size\" : n,            (numeric) The block size\n"
+            "  \"height\" : n,          (numeric) The block height or index (same as provided height)\n"
+            "  \"version\" : n,         (numeric) The block version\n"
+            "  \"merkleroot\" : \"xxxx\", (string) The merkle root\n"
+            "  \"tx\" : [               (array of string) The transaction ids\n"
+            "     \"transactionid\"     (string) The transaction id\n"
+            "     ,...\n"
+            "  ],\n"
+            "  \"time\" : ttt,          (numeric) The block time in seconds since epoch (Jan 1 1970 GMT)\n"
+            "  \"nonce\" : n,           (numeric) The nonce\n"
+            "  \"bits\" : \"1d00ffff\",   (string) The bits\n"
+            "  \"difficulty\" : x.xxx,  (numeric) The difficulty\n"
+            "  \"previousblockhash\" : \"hash\",  (string) The hash of the previous block\n"
+            "  \"nextblockhash\" : \"hash\"       (string) The hash of the next block\n"
+            "}\n"
+            "\nResult (for verbosity = 2 and 3):\n"
+            "{\n"
+            "  ...,                 Same output as verbosity = 1\n"
+            "  \"tx\" : [               (array of Objects) The transactions in the format of getrawtransaction, without hex\n"
+            "     {\n"
+            "       \"txid\" : \"id\",      (string) The transaction id\n"
+            "       ...,\n"
+            "       \"vin\" : [\n"
+            "          {\n"
+            "            ...,\n"
+            "            \"prevout\" : {      (json object, verbosity 3 only, not for the coinbase) The spent output\n"
+            "              \"value\" : x.xxx,    (numeric) The value in " + CURRENCY_UNIT + "\n"
+            "              \"valueZat\" : n,     (numeric) The value in zatoshis\n"
+            "              \"scriptPubKey\" : {...} (json object) As in vout\n"
+            "            }\n"
+            "          }\n"
+            "          ,...\n"
+            "       ],\n"
+            "       ...,\n"
+            "       \"fee\" : x.xxx,        (numeric, verbosity 3 only, not for the coinbase) The fee in " + CURRENCY_UNIT + "\n"
+            "       \"feeZat\" : n          (numeric, verbosity 3 only, not for the coinbase) The fee in zatoshis\n"
+            "     }\n"
+            "     ,...\n"
+            "  ],\n"
+            "  ...                  Same output as verbosity = 1\n"
+            "}\n"
+            "\nResult (for verbosity = 0):\n"
+            "\"data\"             (string) A string that is serialized, hex-encoded data for block 'hash'.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblock", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
+            + HelpExampleRpc("getblock", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
+            + HelpExampleCli("getblock", "12800")
+            + HelpExampleCli("getblock", "12800 3")
+            + HelpExampleRpc("getblock", "12800")
+        );
+
+    LOCK(cs_main);
+
+    CBlock block;
+    CBlockIndex* pblockindex = ReadBlockForRPC(params, block);
+
+    int nVerbosity = ParseBlockVerbosity(params);
+
+    if (nVerbosity <= 0)
     {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
         ssBlock << block;
@@ -483,43 +726,124 @@ UniValue getblock(const UniValue& params, bool fHelp)
         return strHex;
     }
 
-    return blockToJSON(block, pblockindex);
+    CBlockUndo blockUndo;
+    bool fHaveUndo = nVerbosity >= 3 && ReadBlockUndoForRPC(block, pblockindex, blockUndo);
+    return blockToJSON(block, pblockindex, nVerbosity >= 2, fHaveUndo ? &blockUndo : NULL);
+}
+
+static void WriteBlock(std::shared_ptr<const CBlock> pblock, const CBlockIndex* pblockindex, int nVerbosity,
+                       std::shared_ptr<const CBlockUndo> pblockUndo, CJSONStreamWriter& writer)
+{
+    if (nVerbosity <= 0) {
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock << *pblock;
+        writer.Value(HexStr(ssBlock.begin(), ssBlock.end()));
+        return;
+    }
+    blockToJSON(*pblock, pblockindex, nVerbosity >= 2, writer, pblockUndo.get());
+}
+
+RPCStreamResult getblock_stream(const UniValue& params)
+{
+    if (params.size() < 1 || params.size() > 2)
+        return RPCStreamResult();
+
+    LOCK(cs_main);
+
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+    CBlockIndex* pblockindex = ReadBlockForRPC(params, *pblock);
+
+    int nVerbosity = ParseBlockVerbosity(params);
+
+    std::shared_ptr<CBlockUndo> pblockUndo;
+    if (nVerbosity >= 3) {
+        pblockUndo = std::make_shared<CBlockUndo>();
+        if (!ReadBlockUndoForRPC(*pblock, pblockindex, *pblockUndo))
+            pblockUndo.reset();
+    }
+
+    return boost::bind(&WriteBlock, pblock, pblockindex, nVerbosity, pblockUndo, _1);
 }
 
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( verify )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "The statistics are kept up to date as blocks are connected, so this call is quick.\n"
+            "\nArguments:\n"
+            "1. verify    (boolean, optional, default=false) Also read the whole set to check the statistics\n"
+            "               and to compute bytes_serialized and hash_serialized. This may take some time,\n"
+            "               and holds up block processing meanwhile.\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
-            "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
-            "  \"total_amount\": x.xxx          (numeric) The total amount\n"
+            "  \"bogosize\": n,          (numeric) A database independent size of the set: 50 bytes plus the script for each output\n"
+            "  \"muhash\": \"hash\",       (string) MuHash3072 of the set, which does not depend on the order outputs were added in\n"
+            "  \"total_amount\": x.xxx,         (numeric) The total amount\n"
+            "  \"bytes_serialized\": n,  (numeric) With verify only: the serialized size\n"
+            "  \"hash_serialized\": \"hash\",   (string) With verify only: the serialized hash\n"
+            "  \"verified\": true|false         (boolean) With verify only: whether the statistics match the set\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "true")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
+    bool fVerify = false;
+    if (params.size() > 0)
+        fVerify = params[0].get_bool();
+
     UniValue ret(UniValue::VOBJ);
 
+    CCoinsRunningStats running;
     CCoinsStats stats;
-    FlushStateToDisk();
-    if (pcoinsTip->GetStats(stats)) {
-        ret.push_back(Pair("height", (int64_t)stats.nHeight));
-        ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
-        ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
-        ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+    int nHeight;
+    {
+        LOCK(cs_main);
+        running = GetCoinsRunningStats();
+        BlockMap::const_iterator it = mapBlockIndex.find(running.hashBlock);
+        if (it == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "UTXO set statistics are not available");
+        nHeight = it->second->nHeight;
+        if (fVerify) {
+            // The statistics are of the chain tip, so the set read must be too
+            FlushStateToDisk();
+            if (!pcoinsTip->GetStats(stats))
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+        }
+    }
+
+    uint256 hashMuHash;
+    running.muhash.Finalize(hashMuHash);
+
+    ret.push_back(Pair("height", (int64_t)nHeight));
+    ret.push_back(Pair("bestblock", running.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", running.nTransactions));
+    ret.push_back(Pair("txouts", running.nTransactionOutputs));
+    ret.push_back(Pair("bogosize", running.nBogoSize));
+    ret.push_back(Pair("muhash", hashMuHash.GetHex()));
+    ret.push_back(Pair("total_amount", ValueFromAmount(running.nTotalAmount)));
+    if (fVerify) {
+        uint256 hashScanMuHash;
+        stats.muhash.Finalize(hashScanMuHash);
+        bool fVerified = stats.hashBlock == running.hashBlock &&
+                         (int64_t)stats.nTransactions == running.nTransactions &&
+                         (int64_t)stats.nTransactionOutputs == running.nTransactionOutputs &&
+                         (int64_t)stats.nBogoSize == running.nBogoSize &&
+                         stats.nTotalAmount == running.nTotalAmount &&
+                         hashScanMuHash == hashMuHash;
+        if (!fVerified)
+            LogPrintf("gettxoutsetinfo: UTXO set statistics of %s do not match the set: %d transactions, %d outputs, %d amount, muhash %s\n",
+                      stats.hashBlock.ToString(), stats.nTransactions, stats.nTransactionOutputs, stats.nTotalAmount, hashScanMuHash.ToString());
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
         ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
-        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+        ret.push_back(Pair("verified", fVerified));
     }
     return ret;
 }
@@ -604,6 +928,44 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue getspentinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1 || !params[0].isObject())
+        throw runtime_error(
+            "getspentinfo {\"txid\": \"txid\", \"index\": n}\n"
+            "\nReturns the input spending an output (requires -spentindex).\n"
+            "\nArguments:\n"
+            "1. {\n"
+            "  \"txid\" : \"txid\",   (string, required) The transaction id of the output\n"
+            "  \"index\" : n        (numeric, required) The output index\n"
+            "}\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txid\" : \"txid\",   (string) The id of the spending transaction\n"
+            "  \"index\" : n,       (numeric) The index of the spending input\n"
+            "  \"height\" : n       (numeric) The height of the block with the spending transaction\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getspentinfo", "'{\"txid\": \"mytxid\", \"index\": 0}'")
+            + HelpExampleRpc("getspentinfo", "{\"txid\": \"mytxid\", \"index\": 0}")
+        );
+
+    uint256 txid = ParseHashO(params[0].get_obj(), "txid");
+    const UniValue& index = find_value(params[0].get_obj(), "index");
+    if (!index.isNum() || index.get_int() < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid index");
+
+    CSpentIndexValue value;
+    if (!GetSpentIndex(CSpentIndexKey(txid, index.get_int()), value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("txid", value.txid.GetHex()));
+    result.push_back(Pair("index", (int)value.inputIndex));
+    result.push_back(Pair("height", value.blockHeight));
+    return result;
+}
+
 UniValue verifychain(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
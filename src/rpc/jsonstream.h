@@ -0,0 +1,58 @@
+// Copyright (c) 2018 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPC_JSONSTREAM_H
+#define BITCOIN_RPC_JSONSTREAM_H
+
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+
+#include <univalue.h>
+
+/**
+ * Writes a JSON document piece by piece, so that a large reply never has to
+ * exist as one UniValue tree or one string. Containers are opened and closed
+ * explicitly; members and elements can be written from small UniValues.
+ * Output is collected in a buffer that is handed to the sink whenever it
+ * grows past nFlushSize, and on Flush().
+ */
+class CJSONStreamWriter
+{
+public:
+    typedef boost::function<void(const std::string&)> Sink;
+
+    static const size_t DEFAULT_FLUSH_SIZE = 64 * 1024;
+
+    explicit CJSONStreamWriter(const Sink& sinkIn, size_t nFlushSizeIn = DEFAULT_FLUSH_SIZE);
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+
+    /** Write the key of the next member of the current object */
+    void Key(const std::string& key);
+    /** Write a complete value: an array element, or the value after Key() */
+    void Value(const UniValue& val);
+    /** Write one member of the current object */
+    void KeyValue(const std::string& key, const UniValue& val);
+
+    /** Hand all output not yet passed on to the sink */
+    void Flush();
+
+private:
+    Sink sink;
+    size_t nFlushSize;
+    std::string buf;
+    //! For each open container, whether nothing has been written into it yet
+    std::vector<bool> vEmpty;
+    bool fAfterKey;
+
+    void Separate();
+    void MaybeFlush();
+};
+
+#endif // BITCOIN_RPC_JSONSTREAM_H
@@ -16,6 +16,7 @@
 #include "metrics.h"
 #include "miner.h"
 #include "net.h"
+#include "policy/fees.h"
 #include "pow.h"
 #include "rpc/server.h"
 #include "txmempool.h"
@@ -25,6 +26,7 @@
 #include "wallet/wallet.h"
 #endif
 
+#include <cmath>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
@@ -80,20 +82,57 @@ int64_t GetNetworkHashPS(int lookup, int height) {
 
 UniValue getlocalsolps(const UniValue& params, bool fHelp)
 {
-    if (fHelp)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getlocalsolps\n"
+            "getlocalsolps ( verbose )\n"
             "\nReturns the average local solutions per second since this node was started.\n"
             "This is the same information shown on the metrics screen (if enabled).\n"
-            "\nResult:\n"
+            "\nArguments:\n"
+            "1. verbose    (boolean, optional, default=false) Also return the rate of each miner thread\n"
+            "\nResult (for verbose = false):\n"
             "xxx.xxxxx     (numeric) Solutions per second average\n"
+            "\nResult (for verbose = true):\n"
+            "{\n"
+            "  \"solps\": xxx.xxxxx,        (numeric) Solutions per second average\n"
+            "  \"threads\": [               (array) The running miner threads\n"
+            "    {\n"
+            "      \"thread\": n,           (numeric) Thread index\n"
+            "      \"solver\": \"name\",      (string) Equihash solver the thread uses\n"
+            "      \"solps\": xxx.xxxxx     (numeric) Solutions per second average of the thread since it was started\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getlocalsolps", "")
+            + HelpExampleCli("getlocalsolps", "true")
             + HelpExampleRpc("getlocalsolps", "")
        );
 
-    LOCK(cs_main);
-    return GetLocalSolPS();
+    bool fVerbose = false;
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    double dSolPS = GetLocalSolPS();
+    if (!fVerbose)
+        return dSolPS;
+
+    UniValue threads(UniValue::VARR);
+#ifdef ENABLE_MINING
+    std::vector<CMinerThreadRate> vRates;
+    GetMinerThreadRates(vRates);
+    BOOST_FOREACH(const CMinerThreadRate& rate, vRates) {
+        UniValue thread(UniValue::VOBJ);
+        thread.push_back(Pair("thread", rate.nThread));
+        thread.push_back(Pair("solver", rate.solver));
+        thread.push_back(Pair("solps", rate.solps));
+        threads.push_back(thread);
+    }
+#endif
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("solps", dSolPS));
+    result.push_back(Pair("threads", threads));
+    return result;
 }
 
 UniValue getnetworksolps(const UniValue& params, bool fHelp)
@@ -206,6 +245,7 @@ UniValue generate(const UniValue& params, bool fHelp)
     UniValue blockHashes(UniValue::VARR);
     unsigned int n = Params().EquihashN();
     unsigned int k = Params().EquihashK();
+    std::unique_ptr<CEquihashSolver> solver(CreateEquihashSolver(GetArg("-equihashsolver", "default"), n, k));
     while (nHeight < nHeightEnd)
     {
 #ifdef ENABLE_WALLET
@@ -252,7 +292,7 @@ UniValue generate(const UniValue& params, bool fHelp)
                 solutionTargetChecks.increment();
                 return CheckProofOfWork(pblock->GetHash(), pblock->nBits, Params().GetConsensus());
             };
-            bool found = EhBasicSolveUncancellable(n, k, curr_state, validBlock);
+            bool found = solver->Solve(curr_state, validBlock, [](EhSolverCancelCheck pos) { return false; });
             ehSolverRuns.increment();
             if (found) {
                 goto endloop;
@@ -364,7 +404,7 @@ UniValue getmininginfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty",       (double)GetNetworkDifficulty()));
     obj.push_back(Pair("errors",           GetWarnings("statusbar")));
     obj.push_back(Pair("genproclimit",     (int)GetArg("-genproclimit", -1)));
-    obj.push_back(Pair("localsolps"  ,     getlocalsolps(params, false)));
+    obj.push_back(Pair("localsolps"  ,     GetLocalSolPS()));
     obj.push_back(Pair("networksolps",     getnetworksolps(params, false)));
     obj.push_back(Pair("networkhashps",    getnetworksolps(params, false)));
     obj.push_back(Pair("pooledtx",         (uint64_t)mempool.size()));
@@ -881,6 +921,96 @@ UniValue estimatepriority(const UniValue& params, bool fHelp)
     return mempool.estimatePriority(nBlocks);
 }
 
+UniValue getfeeestimatorinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getfeeestimatorinfo\n"
+            "\nReturns the internal state of the fee and priority estimator.\n"
+            "Transactions with joinsplits are tracked separately from transparent ones.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"bestseenheight\": n,     (numeric) height of the last block the estimator processed\n"
+            "  \"trackedtxs\": n,         (numeric) number of mempool transactions being tracked\n"
+            "  \"fee\": {...},            (object) transparent transactions included for their fee rate\n"
+            "  \"priority\": {...},       (object) transparent transactions included for their priority\n"
+            "  \"shielded\": {...}        (object) transactions with joinsplits, by fee rate\n"
+            "}\n"
+            "\nEach of the three objects is:\n"
+            "{\n"
+            "  \"estimates\": [ x, ... ], (array) estimate for a target of 1, 2, ... blocks, -1 if none\n"
+            "  \"buckets\": [             (array) buckets that have seen any transaction\n"
+            "    {\n"
+            "      \"upperbound\": x,     (numeric) upper bound of the bucket, in " + CURRENCY_UNIT + "/kB for fee rates\n"
+            "      \"txcount\": x,        (numeric) decayed number of confirmed transactions\n"
+            "      \"average\": x,        (numeric) average fee rate or priority of those transactions\n"
+            "      \"confirmed\": [ x, ... ], (array) decayed number confirmed within 1, 2, ... blocks\n"
+            "      \"inmempool\": n       (numeric) transactions from this bucket still in the mempool\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getfeeestimatorinfo", "")
+            + HelpExampleRpc("getfeeestimatorinfo", "")
+        );
+
+    unsigned int nBestSeenHeight;
+    size_t nTrackedTxs;
+    std::vector<std::vector<TxConfirmBucketInfo> > vStatsInfo;
+    mempool.GetFeeEstimatorInfo(nBestSeenHeight, nTrackedTxs, vStatsInfo);
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("bestseenheight", (int)nBestSeenHeight));
+    result.push_back(Pair("trackedtxs", (uint64_t)nTrackedTxs));
+
+    const char* statsNames[] = { "fee", "priority", "shielded" };
+    for (unsigned int i = 0; i < vStatsInfo.size(); i++) {
+        bool fFeeRate = (i != 1);
+
+        UniValue estimates(UniValue::VARR);
+        for (unsigned int nBlocks = 1; nBlocks <= MAX_BLOCK_CONFIRMS; nBlocks++) {
+            if (i == 1) {
+                estimates.push_back(UniValue(mempool.estimatePriority(nBlocks)));
+                continue;
+            }
+            CFeeRate feeRate = (i == 0) ? mempool.estimateFee(nBlocks) : mempool.estimateShieldedFee(nBlocks);
+            if (feeRate == CFeeRate(0))
+                estimates.push_back(UniValue(-1.0));
+            else
+                estimates.push_back(ValueFromAmount(feeRate.GetFeePerK()));
+        }
+
+        UniValue buckets(UniValue::VARR);
+        BOOST_FOREACH(const TxConfirmBucketInfo& info, vStatsInfo[i]) {
+            UniValue bucket(UniValue::VOBJ);
+            if (std::isinf(info.upperBound))
+                bucket.push_back(Pair("upperbound", "inf"));
+            else if (fFeeRate)
+                bucket.push_back(Pair("upperbound", ValueFromAmount((CAmount)info.upperBound)));
+            else
+                bucket.push_back(Pair("upperbound", info.upperBound));
+            bucket.push_back(Pair("txcount", info.txCount));
+            if (fFeeRate)
+                bucket.push_back(Pair("average", ValueFromAmount((CAmount)info.avgValue)));
+            else
+                bucket.push_back(Pair("average", info.avgValue));
+            UniValue confirmed(UniValue::VARR);
+            BOOST_FOREACH(double nConfirmed, info.confirmed)
+                confirmed.push_back(UniValue(nConfirmed));
+            bucket.push_back(Pair("confirmed", confirmed));
+            bucket.push_back(Pair("inmempool", (int)info.inMempool));
+            buckets.push_back(bucket);
+        }
+
+        UniValue stats(UniValue::VOBJ);
+        stats.push_back(Pair("estimates", estimates));
+        stats.push_back(Pair("buckets", buckets));
+        result.push_back(Pair(statsNames[i], stats));
+    }
+
+    return result;
+}
+
 UniValue getblocksubsidy(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
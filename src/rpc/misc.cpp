@@ -3,8 +3,10 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "addressindex.h"
 #include "base58.h"
 #include "clientversion.h"
+#include "httpserver.h"
 #include "init.h"
 #include "main.h"
 #include "net.h"
@@ -107,6 +109,70 @@ UniValue getinfo(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getrpcinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcinfo\n"
+            "Returns the state of the RPC server work queues.\n"
+            "Wallet and mining calls are served by queues of their own unless -rpcwalletthreads or\n"
+            "-rpcminingthreads is 0.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"queues\": [               (array) one entry per work queue\n"
+            "    {\n"
+            "      \"name\": \"xxxx\",       (string) default, wallet or mining\n"
+            "      \"threads\": n,         (numeric) worker threads serving the queue\n"
+            "      \"depth\": n,           (numeric) requests waiting for a thread\n"
+            "      \"maxdepth\": n,        (numeric) requests the queue holds before it turns requests away\n"
+            "      \"processed\": n,       (numeric) requests served\n"
+            "      \"rejected\": n,        (numeric) requests turned away because the queue was full\n"
+            "      \"avgwaitms\": x.xxx,   (numeric) average time requests waited for a thread, in milliseconds\n"
+            "      \"maxwaitms\": x.xxx,   (numeric) longest time a request waited for a thread, in milliseconds\n"
+            "      \"avgrunms\": x.xxx,    (numeric) average time taken to serve a request, in milliseconds\n"
+            "      \"maxrunms\": x.xxx     (numeric) longest time taken to serve a request, in milliseconds\n"
+            "    }, ...\n"
+            "  ],\n"
+            "  \"clients\": n,             (numeric) client addresses with requests queued or running\n"
+            "  \"clientmaxinflight\": n,   (numeric) the -rpcclientmaxinflight limit, 0 for none\n"
+            "  \"clientrejected\": n       (numeric) requests turned away by -rpcclientmaxinflight\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrpcinfo", "")
+            + HelpExampleRpc("getrpcinfo", "")
+        );
+
+    std::vector<HTTPWorkQueueStats> vStats;
+    GetHTTPWorkQueueStats(vStats);
+    UniValue queues(UniValue::VARR);
+    BOOST_FOREACH(const HTTPWorkQueueStats& stats, vStats) {
+        UniValue queue(UniValue::VOBJ);
+        queue.push_back(Pair("name", stats.name));
+        queue.push_back(Pair("threads", stats.nThreads));
+        queue.push_back(Pair("depth", (uint64_t)stats.nDepth));
+        queue.push_back(Pair("maxdepth", (uint64_t)stats.nMaxDepth));
+        queue.push_back(Pair("processed", stats.nProcessed));
+        queue.push_back(Pair("rejected", stats.nRejected));
+        queue.push_back(Pair("avgwaitms", stats.nProcessed ? 0.001 * stats.nWaitMicrosTotal / stats.nProcessed : 0.0));
+        queue.push_back(Pair("maxwaitms", 0.001 * stats.nWaitMicrosMax));
+        queue.push_back(Pair("avgrunms", stats.nProcessed ? 0.001 * stats.nRunMicrosTotal / stats.nProcessed : 0.0));
+        queue.push_back(Pair("maxrunms", 0.001 * stats.nRunMicrosMax));
+        queues.push_back(queue);
+    }
+
+    size_t nClients;
+    int nClientMaxInFlight;
+    uint64_t nClientRejected;
+    GetHTTPClientStats(nClients, nClientMaxInFlight, nClientRejected);
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("queues", queues));
+    obj.push_back(Pair("clients", (uint64_t)nClients));
+    obj.push_back(Pair("clientmaxinflight", nClientMaxInFlight));
+    obj.push_back(Pair("clientrejected", nClientRejected));
+    return obj;
+}
+
 #ifdef ENABLE_WALLET
 class DescribeAddressVisitor : public boost::static_visitor<UniValue>
 {
@@ -464,3 +530,280 @@ UniValue setmocktime(const UniValue& params, bool fHelp)
 
     return NullUniValue;
 }
+
+static bool GetAddressIndexString(int type, const uint160& hashBytes, std::string& address)
+{
+    if (type == ADDRESS_INDEX_P2SH)
+        address = CBitcoinAddress(CScriptID(hashBytes)).ToString();
+    else if (type == ADDRESS_INDEX_P2PKH)
+        address = CBitcoinAddress(CKeyID(hashBytes)).ToString();
+    else
+        return false;
+    return true;
+}
+
+/** Addresses given as a single string or as {"addresses": [...]}, in address index form */
+static std::vector<std::pair<uint160, int> > ParseIndexAddresses(const UniValue& param)
+{
+    std::vector<std::string> vstrAddress;
+    if (param.isStr()) {
+        vstrAddress.push_back(param.get_str());
+    } else if (param.isObject()) {
+        const UniValue& addresses = find_value(param.get_obj(), "addresses");
+        if (!addresses.isArray())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Addresses is expected to be an array");
+        for (size_t i = 0; i < addresses.size(); i++)
+            vstrAddress.push_back(addresses[i].get_str());
+    } else {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Expected an address or an object with addresses");
+    }
+
+    std::vector<std::pair<uint160, int> > vAddress;
+    BOOST_FOREACH(const std::string& strAddress, vstrAddress) {
+        CBitcoinAddress address(strAddress);
+        CTxDestination dest = address.Get();
+        if (const CKeyID* keyID = boost::get<CKeyID>(&dest))
+            vAddress.push_back(std::make_pair(uint160(*keyID), (int)ADDRESS_INDEX_P2PKH));
+        else if (const CScriptID* scriptID = boost::get<CScriptID>(&dest))
+            vAddress.push_back(std::make_pair(uint160(*scriptID), (int)ADDRESS_INDEX_P2SH));
+        else
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address: " + strAddress);
+    }
+    return vAddress;
+}
+
+/** Optional "start" and "end" heights of an address index query */
+static void ParseIndexHeightRange(const UniValue& param, int& nStart, int& nEnd)
+{
+    nStart = nEnd = 0;
+    if (!param.isObject())
+        return;
+    const UniValue& start = find_value(param.get_obj(), "start");
+    const UniValue& end = find_value(param.get_obj(), "end");
+    if (!start.isNull())
+        nStart = start.get_int();
+    if (!end.isNull())
+        nEnd = end.get_int();
+    if (nStart < 0 || nEnd < 0 || (nEnd > 0 && nEnd < nStart))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid start or end height");
+}
+
+static void ReadAddressIndex(const std::vector<std::pair<uint160, int> >& vAddress, int nStart, int nEnd,
+                             std::vector<std::pair<CAddressIndexKey, CAmount> >& vIndex)
+{
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddress.begin(); it != vAddress.end(); it++) {
+        if (!GetAddressIndex(it->second, it->first, vIndex, nStart, nEnd))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
+}
+
+static bool CompareAddressIndexByHeight(const std::pair<CAddressIndexKey, CAmount>& a, const std::pair<CAddressIndexKey, CAmount>& b)
+{
+    if (a.first.blockHeight != b.first.blockHeight)
+        return a.first.blockHeight < b.first.blockHeight;
+    return a.first.txindex < b.first.txindex;
+}
+
+static bool CompareAddressUnspentByHeight(const std::pair<CAddressUnspentKey, CAddressUnspentValue>& a, const std::pair<CAddressUnspentKey, CAddressUnspentValue>& b)
+{
+    return a.second.blockHeight < b.second.blockHeight;
+}
+
+UniValue getaddressbalance(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance {\"addresses\": [\"address\", ...]}\n"
+            "\nReturns the balance of addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. {\n"
+            "  \"addresses\"         (array, required) The transparent addresses\n"
+            "    [\n"
+            "      \"address\"       (string) An address\n"
+            "      ,...\n"
+            "    ]\n"
+            "}\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\" : n,      (numeric) The current balance in satoshis\n"
+            "  \"received\" : n      (numeric) The total number of satoshis received, including change\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"znnwwojWQJp1ARgbi1dqYtmnNMfihmg8m1b\"]}'")
+            + HelpExampleRpc("getaddressbalance", "{\"addresses\": [\"znnwwojWQJp1ARgbi1dqYtmnNMfihmg8m1b\"]}")
+        );
+
+    std::vector<std::pair<uint160, int> > vAddress = ParseIndexAddresses(params[0]);
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vIndex;
+    ReadAddressIndex(vAddress, 0, 0, vIndex);
+
+    CAmount nBalance = 0;
+    CAmount nReceived = 0;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vIndex.begin(); it != vIndex.end(); it++) {
+        if (it->second > 0)
+            nReceived += it->second;
+        nBalance += it->second;
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("balance", nBalance));
+    result.push_back(Pair("received", nReceived));
+    return result;
+}
+
+UniValue getaddressutxos(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos {\"addresses\": [\"address\", ...]}\n"
+            "\nReturns all unspent outputs of addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. {\n"
+            "  \"addresses\"         (array, required) The transparent addresses\n"
+            "    [\n"
+            "      \"address\"       (string) An address\n"
+            "      ,...\n"
+            "    ]\n"
+            "}\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\" : \"address\",  (string) The address\n"
+            "    \"txid\" : \"hash\",        (string) The output txid\n"
+            "    \"outputIndex\" : n,      (numeric) The output index\n"
+            "    \"script\" : \"hex\",       (string) The script hex encoded\n"
+            "    \"satoshis\" : n,         (numeric) The number of satoshis of the output\n"
+            "    \"height\" : n            (numeric) The block height\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"znnwwojWQJp1ARgbi1dqYtmnNMfihmg8m1b\"]}'")
+            + HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"znnwwojWQJp1ARgbi1dqYtmnNMfihmg8m1b\"]}")
+        );
+
+    std::vector<std::pair<uint160, int> > vAddress = ParseIndexAddresses(params[0]);
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddress.begin(); it != vAddress.end(); it++) {
+        if (!GetAddressUnspent(it->second, it->first, vUnspent))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
+    std::stable_sort(vUnspent.begin(), vUnspent.end(), CompareAddressUnspentByHeight);
+
+    UniValue result(UniValue::VARR);
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = vUnspent.begin(); it != vUnspent.end(); it++) {
+        std::string address;
+        if (!GetAddressIndexString(it->first.type, it->first.hashBytes, address))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+        UniValue output(UniValue::VOBJ);
+        output.push_back(Pair("address", address));
+        output.push_back(Pair("txid", it->first.txhash.GetHex()));
+        output.push_back(Pair("outputIndex", (int)it->first.index));
+        output.push_back(Pair("script", HexStr(it->second.script.begin(), it->second.script.end())));
+        output.push_back(Pair("satoshis", it->second.satoshis));
+        output.push_back(Pair("height", it->second.blockHeight));
+        result.push_back(output);
+    }
+    return result;
+}
+
+UniValue getaddresstxids(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddresstxids {\"addresses\": [\"address\", ...], \"start\": n, \"end\": n}\n"
+            "\nReturns the txids of all transactions paying to or spending from addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. {\n"
+            "  \"addresses\"         (array, required) The transparent addresses\n"
+            "    [\n"
+            "      \"address\"       (string) An address\n"
+            "      ,...\n"
+            "    ],\n"
+            "  \"start\" : n         (numeric, optional) The first block height to include\n"
+            "  \"end\" : n           (numeric, optional) The last block height to include\n"
+            "}\n"
+            "\nResult:\n"
+            "[\n"
+            "  \"transactionid\"     (string) The transaction id, in block chain order\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"znnwwojWQJp1ARgbi1dqYtmnNMfihmg8m1b\"]}'")
+            + HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"znnwwojWQJp1ARgbi1dqYtmnNMfihmg8m1b\"]}")
+        );
+
+    std::vector<std::pair<uint160, int> > vAddress = ParseIndexAddresses(params[0]);
+    int nStart, nEnd;
+    ParseIndexHeightRange(params[0], nStart, nEnd);
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vIndex;
+    ReadAddressIndex(vAddress, nStart, nEnd, vIndex);
+    if (vAddress.size() > 1)
+        std::stable_sort(vIndex.begin(), vIndex.end(), CompareAddressIndexByHeight);
+
+    UniValue result(UniValue::VARR);
+    std::set<uint256> setSeen;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vIndex.begin(); it != vIndex.end(); it++) {
+        if (setSeen.insert(it->first.txhash).second)
+            result.push_back(it->first.txhash.GetHex());
+    }
+    return result;
+}
+
+UniValue getaddressdeltas(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressdeltas {\"addresses\": [\"address\", ...], \"start\": n, \"end\": n}\n"
+            "\nReturns all changes to the balance of addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. {\n"
+            "  \"addresses\"         (array, required) The transparent addresses\n"
+            "    [\n"
+            "      \"address\"       (string) An address\n"
+            "      ,...\n"
+            "    ],\n"
+            "  \"start\" : n         (numeric, optional) The first block height to include\n"
+            "  \"end\" : n           (numeric, optional) The last block height to include\n"
+            "}\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"satoshis\" : n,         (numeric) The change in satoshis, negative for spent outputs\n"
+            "    \"txid\" : \"hash\",        (string) The txid\n"
+            "    \"index\" : n,            (numeric) The input or output index\n"
+            "    \"blockindex\" : n,       (numeric) The position of the transaction in the block\n"
+            "    \"height\" : n,           (numeric) The block height\n"
+            "    \"address\" : \"address\"   (string) The address\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"znnwwojWQJp1ARgbi1dqYtmnNMfihmg8m1b\"]}'")
+            + HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"znnwwojWQJp1ARgbi1dqYtmnNMfihmg8m1b\"]}")
+        );
+
+    std::vector<std::pair<uint160, int> > vAddress = ParseIndexAddresses(params[0]);
+    int nStart, nEnd;
+    ParseIndexHeightRange(params[0], nStart, nEnd);
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vIndex;
+    ReadAddressIndex(vAddress, nStart, nEnd, vIndex);
+    if (vAddress.size() > 1)
+        std::stable_sort(vIndex.begin(), vIndex.end(), CompareAddressIndexByHeight);
+
+    UniValue result(UniValue::VARR);
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vIndex.begin(); it != vIndex.end(); it++) {
+        std::string address;
+        if (!GetAddressIndexString(it->first.type, it->first.hashBytes, address))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+        UniValue delta(UniValue::VOBJ);
+        delta.push_back(Pair("satoshis", it->second));
+        delta.push_back(Pair("txid", it->first.txhash.GetHex()));
+        delta.push_back(Pair("index", (int)it->first.index));
+        delta.push_back(Pair("blockindex", (int)it->first.txindex));
+        delta.push_back(Pair("height", it->first.blockHeight));
+        delta.push_back(Pair("address", address));
+        result.push_back(delta);
+    }
+    return result;
+}
@@ -108,7 +108,10 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"inflightlimit\": n,        (numeric) How many blocks we request from this peer at once\n"
+            "    \"blocktime\": n,            (numeric) Average time in seconds this peer takes to deliver a block we requested\n"
+            "    \"minfeefilter\": n,         (numeric) The minimum fee rate for transactions this peer accepts, in " + CURRENCY_UNIT + "/kB\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -160,8 +163,12 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("inflightlimit", statestats.nBlocksInFlightLimit));
+            if (statestats.nBlockServiceTime > 0)
+                obj.push_back(Pair("blocktime", ((double)statestats.nBlockServiceTime) / 1e6));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        obj.push_back(Pair("minfeefilter", ValueFromAmount(stats.minFeeFilter)));
 
         ret.push_back(obj);
     }
@@ -367,7 +374,18 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"uploadclasses\": {     (json object) Bytes sent and upload budget per class of traffic (see -uploadbudget)\n"
+            "    \"name\": {            (json object) historical, tip, tx, addr or other\n"
+            "      \"bytessent\": n,                  (numeric) Bytes sent in this class\n"
+            "      \"backoffs\": n,                   (numeric) How many times the budget ran out and sending was put off\n"
+            "      \"limit\": n,                      (numeric) Budget in bytes per second for peers that aren't whitelisted, 0 if unlimited\n"
+            "      \"available\": n,                  (numeric) Bytes that can be sent to them right now, negative while backing off\n"
+            "      \"whitelist_limit\": n,            (numeric) Budget in bytes per second for whitelisted peers, 0 if unlimited\n"
+            "      \"whitelist_available\": n         (numeric) Bytes that can be sent to whitelisted peers right now\n"
+            "    },\n"
+            "    ...\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getnettotals", "")
@@ -378,6 +396,21 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    std::vector<CUploadClassStats> vUploadStats;
+    GetUploadClassStats(vUploadStats);
+    UniValue classes(UniValue::VOBJ);
+    BOOST_FOREACH(const CUploadClassStats& stats, vUploadStats) {
+        UniValue cls(UniValue::VOBJ);
+        cls.push_back(Pair("bytessent", stats.nBytesSent));
+        cls.push_back(Pair("backoffs", stats.nBackoffs));
+        cls.push_back(Pair("limit", stats.nLimit));
+        cls.push_back(Pair("available", stats.nAvailable));
+        cls.push_back(Pair("whitelist_limit", stats.nWhitelistLimit));
+        cls.push_back(Pair("whitelist_available", stats.nWhitelistAvailable));
+        classes.push_back(Pair(stats.strName, cls));
+    }
+    obj.push_back(Pair("uploadclasses", classes));
     return obj;
 }
 
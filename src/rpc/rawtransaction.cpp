@@ -3,6 +3,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "addressindex.h"
 #include "base58.h"
 #include "consensus/validation.h"
 #include "core_io.h"
@@ -17,7 +18,10 @@
 #include "script/script_error.h"
 #include "script/sign.h"
 #include "script/standard.h"
+#include "spentindex.h"
+#include "txmempool.h"
 #include "uint256.h"
+#include "undo.h"
 #ifdef ENABLE_WALLET
 #include "wallet/wallet.h"
 #endif
@@ -112,13 +116,26 @@ UniValue TxJoinSplitToJSON(const CTransaction& tx) {
     return vjoinsplit;
 }
 
-void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry)
+extern bool ReadBlockUndoForRPC(const CBlock& block, const CBlockIndex* pindex, CBlockUndo& blockUndo);
+
+/**
+ * With fSpentInfo, describe inputs with the value and address of the output
+ * they spend, and outputs with the input spending them, as far as the spent
+ * index knows them. With txundo, the outputs spent by the inputs, describe
+ * those too, along with the fee.
+ */
+static void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry, bool fSpentInfo, const CTxUndo* txundo)
 {
+    if (txundo && (tx.IsCoinBase() || txundo->vprevout.size() != tx.vin.size()))
+        txundo = NULL;
+    CAmount nValueIn = 0;
+
     entry.push_back(Pair("txid", tx.GetHash().GetHex()));
     entry.push_back(Pair("version", tx.nVersion));
     entry.push_back(Pair("locktime", (int64_t)tx.nLockTime));
     UniValue vin(UniValue::VARR);
-    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const CTxIn& txin = tx.vin[i];
         UniValue in(UniValue::VOBJ);
         if (tx.IsCoinBase())
             in.push_back(Pair("coinbase", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
@@ -129,6 +146,26 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry)
             o.push_back(Pair("asm", txin.scriptSig.ToString()));
             o.push_back(Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
             in.push_back(Pair("scriptSig", o));
+            CSpentIndexValue spentInfo;
+            if (fSpentInfo && GetSpentIndex(CSpentIndexKey(txin.prevout.hash, txin.prevout.n), spentInfo)) {
+                in.push_back(Pair("value", ValueFromAmount(spentInfo.satoshis)));
+                in.push_back(Pair("valueZat", spentInfo.satoshis));
+                if (spentInfo.addressType == ADDRESS_INDEX_P2PKH)
+                    in.push_back(Pair("address", CBitcoinAddress(CKeyID(spentInfo.addressHash)).ToString()));
+                else if (spentInfo.addressType == ADDRESS_INDEX_P2SH)
+                    in.push_back(Pair("address", CBitcoinAddress(CScriptID(spentInfo.addressHash)).ToString()));
+            }
+            if (txundo) {
+                const CTxOut& prevout = txundo->vprevout[i].txout;
+                nValueIn += prevout.nValue;
+                UniValue p(UniValue::VOBJ);
+                p.push_back(Pair("value", ValueFromAmount(prevout.nValue)));
+                p.push_back(Pair("valueZat", prevout.nValue));
+                UniValue o(UniValue::VOBJ);
+                ScriptPubKeyToJSON(prevout.scriptPubKey, o, true);
+                p.push_back(Pair("scriptPubKey", o));
+                in.push_back(Pair("prevout", p));
+            }
         }
         in.push_back(Pair("sequence", (int64_t)txin.nSequence));
         vin.push_back(in);
@@ -144,6 +181,12 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry)
         UniValue o(UniValue::VOBJ);
         ScriptPubKeyToJSON(txout.scriptPubKey, o, true);
         out.push_back(Pair("scriptPubKey", o));
+        CSpentIndexValue spentInfo;
+        if (fSpentInfo && GetSpentIndex(CSpentIndexKey(tx.GetHash(), i), spentInfo)) {
+            out.push_back(Pair("spentTxId", spentInfo.txid.GetHex()));
+            out.push_back(Pair("spentIndex", (int)spentInfo.inputIndex));
+            out.push_back(Pair("spentHeight", spentInfo.blockHeight));
+        }
         vout.push_back(out);
     }
     entry.push_back(Pair("vout", vout));
@@ -151,6 +194,12 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry)
     UniValue vjoinsplit = TxJoinSplitToJSON(tx);
     entry.push_back(Pair("vjoinsplit", vjoinsplit));
 
+    if (txundo) {
+        CAmount nFee = nValueIn + tx.GetJoinSplitValueIn() - tx.GetValueOut();
+        entry.push_back(Pair("fee", ValueFromAmount(nFee)));
+        entry.push_back(Pair("feeZat", nFee));
+    }
+
     if (!hashBlock.IsNull()) {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
         BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
@@ -167,6 +216,60 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry)
     }
 }
 
+void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry)
+{
+    TxToJSON(tx, hashBlock, entry, false, NULL);
+}
+
+void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry, const CTxUndo* txundo)
+{
+    TxToJSON(tx, hashBlock, entry, false, txundo);
+}
+
+/**
+ * The outputs spent by a transaction: from the undo data of its block, read
+ * once for all the inputs, or from the UTXO set and the mempool if it is not
+ * confirmed. False if they are not available.
+ */
+static bool GetTxUndo(const CTransaction& tx, const uint256& hashBlock, CTxUndo& txundo)
+{
+    if (tx.IsCoinBase())
+        return false;
+
+    if (hashBlock.IsNull()) {
+        CCoinsViewMemPool view(pcoinsTip, mempool);
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            CCoins coins;
+            if (!view.GetCoins(txin.prevout.hash, coins) || !coins.IsAvailable(txin.prevout.n))
+                return false;
+            txundo.vprevout.push_back(CTxInUndo(coins.vout[txin.prevout.n]));
+        }
+        return true;
+    }
+
+    BlockMap::const_iterator mi = mapBlockIndex.find(hashBlock);
+    if (mi == mapBlockIndex.end())
+        return false;
+    const CBlockIndex* pindex = mi->second;
+    if (!(pindex->nStatus & BLOCK_HAVE_UNDO))
+        return false;
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    CBlockUndo blockUndo;
+    if (!ReadBlockUndoForRPC(block, pindex, blockUndo))
+        return false;
+    // The undo data skips the coinbase
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        if (block.vtx[i].GetHash() == tx.GetHash()) {
+            txundo = blockUndo.vtxundo[i - 1];
+            return true;
+        }
+    }
+    return false;
+}
+
 UniValue getrawtransaction(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -181,7 +284,8 @@ UniValue getrawtransaction(const UniValue& params, bool fHelp)
 
             "\nArguments:\n"
             "1. \"txid\"      (string, required) The transaction id\n"
-            "2. verbose       (numeric, optional, default=0) If 0, return a string, other return a json object\n"
+            "2. verbose       (numeric, optional, default=0) If 0, return a string, other return a json object.\n"
+            "                 If 2, the json object also describes the outputs spent by the inputs, and the fee\n"
 
             "\nResult (if verbose is not set or set to 0):\n"
             "\"data\"      (string) The serialized, hex-encoded data for 'txid'\n"
@@ -200,6 +304,14 @@ UniValue getrawtransaction(const UniValue& params, bool fHelp)
             "         \"asm\": \"asm\",  (string) asm\n"
             "         \"hex\": \"hex\"   (string) hex\n"
             "       },\n"
+            "       \"value\": x.xxx,    (numeric, with -spentindex) The value of the spent output in " + CURRENCY_UNIT + "\n"
+            "       \"valueZat\": n,     (numeric, with -spentindex) The value of the spent output in zatoshis\n"
+            "       \"address\": \"addr\", (string, with -spentindex) The address of the spent output\n"
+            "       \"prevout\": {       (json object, if verbose is 2) The spent output\n"
+            "         \"value\": x.xxx,  (numeric) The value in " + CURRENCY_UNIT + "\n"
+            "         \"valueZat\": n,   (numeric) The value in zatoshis\n"
+            "         \"scriptPubKey\": {...} (json object) As in vout\n"
+            "       },\n"
             "       \"sequence\": n      (numeric) The script sequence number\n"
             "     }\n"
             "     ,...\n"
@@ -217,7 +329,10 @@ UniValue getrawtransaction(const UniValue& params, bool fHelp)
             "           \"horizenaddress\"          (string) Horizen address\n"
             "           ,...\n"
             "         ]\n"
-            "       }\n"
+            "       },\n"
+            "       \"spentTxId\" : \"id\",       (string, with -spentindex) The transaction spending the output\n"
+            "       \"spentIndex\" : n,           (numeric, with -spentindex) The spending input\n"
+            "       \"spentHeight\" : n           (numeric, with -spentindex) The height of the spending transaction\n"
             "     }\n"
             "     ,...\n"
             "  ],\n"
@@ -248,6 +363,8 @@ UniValue getrawtransaction(const UniValue& params, bool fHelp)
             "     }\n"
             "     ,...\n"
             "  ],\n"
+            "  \"fee\" : x.xxx,            (numeric, if verbose is 2) The fee in " + CURRENCY_UNIT + "\n"
+            "  \"feeZat\" : n,             (numeric, if verbose is 2) The fee in zatoshis\n"
             "  \"blockhash\" : \"hash\",   (string) the block hash\n"
             "  \"confirmations\" : n,      (numeric) The confirmations\n"
             "  \"time\" : ttt,             (numeric) The transaction time in seconds since epoch (Jan 1 1970 GMT)\n"
@@ -257,15 +374,16 @@ UniValue getrawtransaction(const UniValue& params, bool fHelp)
             "\nExamples:\n"
             + HelpExampleCli("getrawtransaction", "\"mytxid\"")
             + HelpExampleCli("getrawtransaction", "\"mytxid\" 1")
+            + HelpExampleCli("getrawtransaction", "\"mytxid\" 2")
             + HelpExampleRpc("getrawtransaction", "\"mytxid\", 1")
         );
     LOCK(cs_main);
 
     uint256 hash = ParseHashV(params[0], "parameter 1");
 
-    bool fVerbose = false;
+    int nVerbosity = 0;
     if (params.size() > 1)
-        fVerbose = (params[1].get_int() != 0);
+        nVerbosity = params[1].get_int();
 
     CTransaction tx;
     uint256 hashBlock;
@@ -274,12 +392,15 @@ UniValue getrawtransaction(const UniValue& params, bool fHelp)
 
     string strHex = EncodeHexTx(tx);
 
-    if (!fVerbose)
+    if (nVerbosity == 0)
         return strHex;
 
+    CTxUndo txundo;
+    bool fHaveUndo = nVerbosity >= 2 && GetTxUndo(tx, hashBlock, txundo);
+
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hex", strHex));
-    TxToJSON(tx, hashBlock, result);
+    TxToJSON(tx, hashBlock, result, fSpentIndex, fHaveUndo ? &txundo : NULL);
     return result;
 }
 
@@ -887,7 +1008,6 @@ UniValue sendrawtransaction(const UniValue& params, bool fHelp)
             + HelpExampleRpc("sendrawtransaction", "\"signedhex\"")
         );
 
-    LOCK(cs_main);
     RPCTypeCheck(params, boost::assign::list_of(UniValue::VSTR)(UniValue::VBOOL));
 
     // parse hex string from parameter
@@ -900,15 +1020,19 @@ UniValue sendrawtransaction(const UniValue& params, bool fHelp)
     if (params.size() > 1)
         fOverrideFees = params[1].get_bool();
 
+    // Verify proofs and joinsplit signatures before taking cs_main
+    CValidationState state;
+    bool fPreChecked = PreCheckTransactionForMempool(tx, state);
+
+    LOCK(cs_main);
     CCoinsViewCache &view = *pcoinsTip;
     const CCoins* existingCoins = view.AccessCoins(hashTx);
     bool fHaveMempool = mempool.exists(hashTx);
     bool fHaveChain = existingCoins && existingCoins->nHeight < 1000000000;
     if (!fHaveMempool && !fHaveChain) {
         // push to local node and sync with wallets
-        CValidationState state;
-        bool fMissingInputs;
-        if (!AcceptToMemoryPool(mempool, state, tx, false, &fMissingInputs, !fOverrideFees)) {
+        bool fMissingInputs = false;
+        if (!fPreChecked || !AcceptToMemoryPool(mempool, state, tx, false, &fMissingInputs, !fOverrideFees, true)) {
             if (state.IsInvalid()) {
                 throw JSONRPCError(RPC_TRANSACTION_REJECTED, strprintf("%i: %s", state.GetRejectCode(), state.GetRejectReason()));
             } else {
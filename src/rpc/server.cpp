@@ -15,6 +15,7 @@
 #include "asyncrpcqueue.h"
 
 #include <memory>
+#include <set>
 
 #include <univalue.h>
 
@@ -262,6 +263,7 @@ static const CRPCCommand vRPCCommands[] =
     { "control",            "help",                   &help,                   true  },
     { "control",            "stop",                   &stop,                   true  },
     { "control",            "dbg_log",                &dbg_log,                true  },
+    { "control",            "getrpcinfo",             &getrpcinfo,             true  },
 
     /* P2P networking */
     { "network",            "getnetworkinfo",         &getnetworkinfo,         true  },
@@ -280,16 +282,19 @@ static const CRPCCommand vRPCCommands[] =
     { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true  },
     { "blockchain",         "getbestblockhash",       &getbestblockhash,       true  },
     { "blockchain",         "getblockcount",          &getblockcount,          true  },
-    { "blockchain",         "getblock",               &getblock,               true  },
+    { "blockchain",         "getblock",               &getblock,               true,  &getblock_stream },
     { "blockchain",         "getblockhash",           &getblockhash,           true  },
+    { "blockchain",         "getblockhashes",         &getblockhashes,         true  },
     { "blockchain",         "getblockfinalityindex",  &getblockfinalityindex,  true  },
     { "blockchain",         "getglobaltips",          &getglobaltips,          true  },
     { "blockchain",         "getblockheader",         &getblockheader,         true  },
+    { "blockchain",         "getblockfilter",         &getblockfilter,         true  },
     { "blockchain",         "getchaintips",           &getchaintips,           true  },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
-    { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
+    { "blockchain",         "getrawmempool",          &getrawmempool,          true,  &getrawmempool_stream },
     { "blockchain",         "gettxout",               &gettxout,               true  },
+    { "blockchain",         "getspentinfo",           &getspentinfo,           true  },
     { "blockchain",         "gettxoutproof",          &gettxoutproof,          true  },
     { "blockchain",         "verifytxoutproof",       &verifytxoutproof,       true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
@@ -323,12 +328,19 @@ static const CRPCCommand vRPCCommands[] =
     { "rawtransactions",    "fundrawtransaction",     &fundrawtransaction,     false },
 #endif
 
+    /* Address index */
+    { "addressindex",       "getaddressbalance",      &getaddressbalance,      true  },
+    { "addressindex",       "getaddressutxos",        &getaddressutxos,        true  },
+    { "addressindex",       "getaddresstxids",        &getaddresstxids,        true  },
+    { "addressindex",       "getaddressdeltas",       &getaddressdeltas,       true  },
+
     /* Utility functions */
     { "util",               "createmultisig",         &createmultisig,         true  },
     { "util",               "validateaddress",        &validateaddress,        true  }, /* uses wallet if enabled */
     { "util",               "verifymessage",          &verifymessage,          true  },
     { "util",               "estimatefee",            &estimatefee,            true  },
     { "util",               "estimatepriority",       &estimatepriority,       true  },
+    { "util",               "getfeeestimatorinfo",    &getfeeestimatorinfo,    true  },
     { "util",               "z_validateaddress",      &z_validateaddress,      true  }, /* uses wallet if enabled */
 
     /* Not shown in help */
@@ -550,11 +562,114 @@ static UniValue JSONRPCExecOne(const UniValue& req)
     return rpc_result;
 }
 
-std::string JSONRPCExecBatch(const UniValue& vReq)
+bool IsRPCReadOnly(const std::string& strMethod)
+{
+    static const char* const pszReadOnly[] = {
+        "getbestblockhash", "getblock", "getblockchaininfo", "getblockcount",
+        "getblockhash", "getblockheader", "getdifficulty", "getmempoolinfo",
+        "getrawmempool", "gettxout", "gettxoutproof", "verifytxoutproof",
+        "getrawtransaction", "decoderawtransaction", "decodescript",
+        "validateaddress", "z_validateaddress", "verifymessage",
+        "estimatefee", "estimatepriority",
+        "getaddressbalance", "getaddressutxos", "getaddresstxids", "getaddressdeltas",
+        "getblockhashes", "getspentinfo", "getblockfilter",
+    };
+    static const std::set<std::string> setReadOnly(pszReadOnly, pszReadOnly + ARRAYLEN(pszReadOnly));
+    return setReadOnly.count(strMethod) > 0;
+}
+
+static bool IsReadOnlyRequest(const UniValue& req)
 {
+    if (!req.isObject())
+        return false;
+    const UniValue& valMethod = find_value(req.get_obj(), "method");
+    return valMethod.isStr() && IsRPCReadOnly(valMethod.get_str());
+}
+
+namespace {
+
+/**
+ * A run of read-only calls [nNext, nEnd) from one batch. The thread executing
+ * the batch and any helper threads take calls from it until none are left.
+ * Helpers may be scheduled after the run is done; they then find nothing to
+ * take and never touch the batch itself.
+ */
+class CRPCBatchRun
+{
+private:
+    CWaitableCriticalSection cs;
+    CConditionVariable cond;
+    const UniValue& vReq;
+    std::vector<UniValue>& vReply;
+    size_t nNext;
+    const size_t nEnd;
+    size_t nRunning;
+
+public:
+    CRPCBatchRun(const UniValue& vReqIn, std::vector<UniValue>& vReplyIn, size_t nBegin, size_t nEndIn) :
+        vReq(vReqIn), vReply(vReplyIn), nNext(nBegin), nEnd(nEndIn), nRunning(0) {}
+
+    /** Execute calls until none are left to take */
+    void Work()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (nNext < nEnd) {
+            size_t reqIdx = nNext++;
+            nRunning++;
+            lock.unlock();
+            vReply[reqIdx] = JSONRPCExecOne(vReq[reqIdx]);
+            lock.lock();
+            nRunning--;
+        }
+        cond.notify_all();
+    }
+
+    /** Wait until the calls taken by other threads have finished */
+    void Wait()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (nNext < nEnd || nRunning > 0)
+            cond.wait(lock);
+    }
+};
+
+} // anon namespace
+
+std::string JSONRPCExecBatch(const UniValue& vReq, const RPCBatchDispatcher& dispatch)
+{
+    size_t nParallel = 1;
+    if (!dispatch.empty())
+        nParallel = std::max(GetArg("-rpcbatchparallel", DEFAULT_RPC_BATCH_PARALLEL), (int64_t)1);
+
+    std::vector<UniValue> vReply(vReq.size());
+    size_t reqIdx = 0;
+    while (reqIdx < vReq.size()) {
+        size_t nEnd = reqIdx;
+        if (nParallel > 1) {
+            while (nEnd < vReq.size() && IsReadOnlyRequest(vReq[nEnd]))
+                nEnd++;
+        }
+        if (nEnd - reqIdx < 2) {
+            vReply[reqIdx] = JSONRPCExecOne(vReq[reqIdx]);
+            reqIdx++;
+            continue;
+        }
+
+        std::shared_ptr<CRPCBatchRun> run = std::make_shared<CRPCBatchRun>(vReq, vReply, reqIdx, nEnd);
+        size_t nHelpers = std::min(nParallel, nEnd - reqIdx) - 1;
+        for (size_t i = 0; i < nHelpers; i++) {
+            // With the work queue busy this thread simply does more of the work
+            if (!dispatch(boost::bind(&CRPCBatchRun::Work, run)))
+                break;
+        }
+        run->Work();
+        run->Wait();
+        reqIdx = nEnd;
+    }
+
     UniValue ret(UniValue::VARR);
-    for (size_t reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    for (size_t i = 0; i < vReply.size(); i++)
+        ret.push_back(vReply[i]);
 
     return ret.write() + "\n";
 }
@@ -588,6 +703,34 @@ UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params
     g_rpcSignals.PostCommand(*pcmd);
 }
 
+RPCStreamResult CRPCTable::executeStream(const std::string &strMethod, const UniValue &params) const
+{
+    const CRPCCommand *pcmd = tableRPC[strMethod];
+    if (!pcmd || !pcmd->streamActor)
+        return RPCStreamResult();
+
+    {
+        LOCK(cs_rpcWarmup);
+        if (fRPCInWarmup)
+            throw JSONRPCError(RPC_IN_WARMUP, rpcWarmupStatus);
+    }
+
+    g_rpcSignals.PreCommand(*pcmd);
+
+    RPCStreamResult writeResult;
+    try
+    {
+        writeResult = pcmd->streamActor(params);
+    }
+    catch (const std::exception& e)
+    {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+
+    g_rpcSignals.PostCommand(*pcmd);
+    return writeResult;
+}
+
 std::string HelpExampleCli(const std::string& methodname, const std::string& args)
 {
     return "> zen-cli " + methodname + " " + args + "\n";
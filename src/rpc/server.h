@@ -34,6 +34,9 @@ namespace RPCServer
 class CBlockIndex;
 class CNetAddr;
 
+/** Default for -rpcbatchparallel, the number of calls of one batch that may run at the same time */
+static const int DEFAULT_RPC_BATCH_PARALLEL = 4;
+
 class JSONRequest
 {
 public:
@@ -119,6 +122,17 @@ void RPCRunLater(const std::string& name, boost::function<void(void)> func, int6
 
 typedef UniValue(*rpcfn_type)(const UniValue& params, bool fHelp);
 
+class CJSONStreamWriter;
+/** Writes a result prepared by a stream actor */
+typedef boost::function<void(CJSONStreamWriter&)> RPCStreamResult;
+/**
+ * Optional variant of an actor for results too large to build as one UniValue.
+ * It checks the parameters and gathers what it needs, throwing errors like the
+ * actor, and returns a function that writes the result without throwing.
+ * An empty function makes the caller fall back to the actor.
+ */
+typedef RPCStreamResult(*rpcstreamfn_type)(const UniValue& params);
+
 class CRPCCommand
 {
 public:
@@ -126,6 +140,7 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
+    rpcstreamfn_type streamActor;
 };
 
 /**
@@ -148,6 +163,14 @@ public:
      * @throws an exception (UniValue) when an error happens.
      */
     UniValue execute(const std::string &method, const UniValue &params) const;
+
+    /**
+     * Execute a method through its stream actor.
+     * @returns Function writing the result, or an empty function if the
+     * method has no stream actor or left the call to its regular actor.
+     * @throws an exception (UniValue) when an error happens.
+     */
+    RPCStreamResult executeStream(const std::string &method, const UniValue &params) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -201,6 +224,7 @@ extern UniValue getblocktemplate(const UniValue& params, bool fHelp);
 extern UniValue submitblock(const UniValue& params, bool fHelp);
 extern UniValue estimatefee(const UniValue& params, bool fHelp);
 extern UniValue estimatepriority(const UniValue& params, bool fHelp);
+extern UniValue getfeeestimatorinfo(const UniValue& params, bool fHelp);
 
 extern UniValue getnewaddress(const UniValue& params, bool fHelp); // in rpcwallet.cpp
 extern UniValue getaccountaddress(const UniValue& params, bool fHelp);
@@ -234,7 +258,12 @@ extern UniValue walletpassphrasechange(const UniValue& params, bool fHelp);
 extern UniValue walletlock(const UniValue& params, bool fHelp);
 extern UniValue encryptwallet(const UniValue& params, bool fHelp);
 extern UniValue validateaddress(const UniValue& params, bool fHelp);
+extern UniValue getaddressbalance(const UniValue& params, bool fHelp);
+extern UniValue getaddressutxos(const UniValue& params, bool fHelp);
+extern UniValue getaddresstxids(const UniValue& params, bool fHelp);
+extern UniValue getaddressdeltas(const UniValue& params, bool fHelp);
 extern UniValue getinfo(const UniValue& params, bool fHelp);
+extern UniValue getrpcinfo(const UniValue& params, bool fHelp);
 extern UniValue getwalletinfo(const UniValue& params, bool fHelp);
 extern UniValue getblockchaininfo(const UniValue& params, bool fHelp);
 extern UniValue getnetworkinfo(const UniValue& params, bool fHelp);
@@ -265,13 +294,18 @@ extern UniValue getdifficulty(const UniValue& params, bool fHelp);
 extern UniValue settxfee(const UniValue& params, bool fHelp);
 extern UniValue getmempoolinfo(const UniValue& params, bool fHelp);
 extern UniValue getrawmempool(const UniValue& params, bool fHelp);
+extern RPCStreamResult getrawmempool_stream(const UniValue& params);
 extern UniValue getblockhash(const UniValue& params, bool fHelp);
+extern UniValue getblockhashes(const UniValue& params, bool fHelp);
 extern UniValue getblockheader(const UniValue& params, bool fHelp);
+extern UniValue getblockfilter(const UniValue& params, bool fHelp);
 extern UniValue getblock(const UniValue& params, bool fHelp);
+extern RPCStreamResult getblock_stream(const UniValue& params);
 extern UniValue getblockfinalityindex(const UniValue& params, bool fHelp);
 extern UniValue getglobaltips(const UniValue& params, bool fHelp);
 extern UniValue gettxoutsetinfo(const UniValue& params, bool fHelp);
 extern UniValue gettxout(const UniValue& params, bool fHelp);
+extern UniValue getspentinfo(const UniValue& params, bool fHelp);
 extern UniValue verifychain(const UniValue& params, bool fHelp);
 extern UniValue getchaintips(const UniValue& params, bool fHelp);
 extern UniValue invalidateblock(const UniValue& params, bool fHelp);
@@ -306,6 +340,18 @@ extern UniValue dbg_log(const UniValue &params, bool fHelp); // print a line in
 bool StartRPC();
 void InterruptRPC();
 void StopRPC();
-std::string JSONRPCExecBatch(const UniValue& vReq);
+
+/** Hands a job to another thread; returns false if it was not accepted */
+typedef boost::function<bool(const boost::function<void(void)>&)> RPCBatchDispatcher;
+
+/** Whether a command only reads state, so that calls to it in a batch may run in parallel */
+bool IsRPCReadOnly(const std::string& strMethod);
+/**
+ * Execute a JSON-RPC batch and return the replies, in request order.
+ * Consecutive calls to read-only commands are spread over up to
+ * -rpcbatchparallel threads, the calling thread and jobs handed to dispatch.
+ * Any other call runs on its own, after everything before it has finished.
+ */
+std::string JSONRPCExecBatch(const UniValue& vReq, const RPCBatchDispatcher& dispatch = RPCBatchDispatcher());
 
 #endif // BITCOIN_RPCSERVER_H
@@ -347,6 +347,12 @@ public:
         d.insert(d.end(), begin(), end());
         clear();
     }
+
+    /** Exchange the whole underlying buffer with d, without copying, and rewind. */
+    void swap(vector_type& d) {
+        vch.swap(d);
+        nReadPos = 0;
+    }
 };
 
 class CDataStream : public CBaseDataStream<CSerializeData>
@@ -28,13 +28,18 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxUsage);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    size_t nUsage;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
 extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern size_t nOrphanUsage;
+
+static const size_t nNoOrphanUsageLimit = std::numeric_limits<size_t>::max();
 
 CService ip(uint32_t i)
 {
@@ -188,13 +193,55 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, nNoOrphanUsageLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, nNoOrphanUsageLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, nNoOrphanUsageLimit);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(nOrphanUsage, 0);
+}
+
+static CTransaction OrphanSpendingRandomPrevout()
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_limits)
+{
+    // Memory limit, with peer 0 owning most of the pool
+    for (int i = 0; i < 40; i++)
+        AddOrphanTx(OrphanSpendingRandomPrevout(), i < 30 ? 0 : i);
+    size_t nUsagePerOrphan = nOrphanUsage / 40;
+    BOOST_CHECK(nUsagePerOrphan > 0);
+
+    // A peer cannot hold more than its share: peer 0 loses its own orphans only
+    LimitOrphanTxSize(1000, nUsagePerOrphan * 4 * ORPHAN_POOL_PEER_SHARE);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 14);
+    int nFromPeer0 = 0;
+    BOOST_FOREACH(const PAIRTYPE(uint256, COrphanTx)& item, mapOrphanTransactions)
+        if (item.second.fromPeer == 0)
+            nFromPeer0++;
+    BOOST_CHECK_EQUAL(nFromPeer0, 4);
+
+    LimitOrphanTxSize(1000, nUsagePerOrphan * 5);
+    BOOST_CHECK(nOrphanUsage <= nUsagePerOrphan * 5);
+
+    // Expiry
+    SetMockTime(GetTime() + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL + 1);
+    LimitOrphanTxSize(1000, nNoOrphanUsageLimit);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK_EQUAL(nOrphanUsage, 0);
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,93 @@
+// Copyright (c) 2018 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "key.h"
+#include "random.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(addressindex_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(addressindex_script_key)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    int type;
+    uint160 hashBytes;
+
+    BOOST_CHECK(GetAddressIndexKey(GetScriptForDestination(pubkey.GetID()), type, hashBytes));
+    BOOST_CHECK_EQUAL(type, ADDRESS_INDEX_P2PKH);
+    BOOST_CHECK(hashBytes == uint160(pubkey.GetID()));
+
+    CScript redeem = GetScriptForDestination(pubkey.GetID());
+    BOOST_CHECK(GetAddressIndexKey(GetScriptForDestination(CScriptID(redeem)), type, hashBytes));
+    BOOST_CHECK_EQUAL(type, ADDRESS_INDEX_P2SH);
+    BOOST_CHECK(hashBytes == uint160(CScriptID(redeem)));
+
+    // Bare public keys and data carriers have no address
+    BOOST_CHECK(!GetAddressIndexKey(CScript() << ToByteVector(pubkey) << OP_CHECKSIG, type, hashBytes));
+    BOOST_CHECK(!GetAddressIndexKey(CScript() << OP_RETURN, type, hashBytes));
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_key_order)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    uint160 hashBytes = key.GetPubKey().GetID();
+    CAddressIndexKey low(ADDRESS_INDEX_P2PKH, hashBytes, 255, 3, GetRandHash(), 0, false);
+    CAddressIndexKey high(ADDRESS_INDEX_P2PKH, hashBytes, 256, 0, GetRandHash(), 0, false);
+
+    CDataStream ssLow(SER_DISK, CLIENT_VERSION), ssHigh(SER_DISK, CLIENT_VERSION);
+    ssLow << low;
+    ssHigh << high;
+    BOOST_CHECK_EQUAL(ssLow.size(), low.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+    // Keys of one address sort by height, then by position in the block
+    BOOST_CHECK(ssLow.str() < ssHigh.str());
+
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << CAddressIndexIteratorKey(ADDRESS_INDEX_P2PKH, hashBytes, 256);
+    BOOST_CHECK_EQUAL(ssPrefix.size(), 25U);
+    BOOST_CHECK(ssLow.str() < ssPrefix.str());
+    BOOST_CHECK_EQUAL(ssHigh.str().compare(0, ssPrefix.size(), ssPrefix.str()), 0);
+
+    CAddressIndexKey read;
+    ssHigh >> read;
+    BOOST_CHECK_EQUAL(read.blockHeight, 256);
+    BOOST_CHECK_EQUAL(read.txindex, 0U);
+    BOOST_CHECK(read.txhash == high.txhash);
+    BOOST_CHECK(read.hashBytes == hashBytes);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_unspent_value)
+{
+    CAddressUnspentKey key(ADDRESS_INDEX_P2SH, uint160(), GetRandHash(), 7);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << key;
+    BOOST_CHECK_EQUAL(ss.size(), key.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+    CAddressUnspentKey keyRead;
+    ss >> keyRead;
+    BOOST_CHECK_EQUAL(keyRead.type, ADDRESS_INDEX_P2SH);
+    BOOST_CHECK_EQUAL(keyRead.index, 7U);
+    BOOST_CHECK(keyRead.txhash == key.txhash);
+
+    CAddressUnspentValue value;
+    BOOST_CHECK(value.IsNull());
+    value = CAddressUnspentValue(5 * COIN, CScript() << OP_TRUE, 100);
+    BOOST_CHECK(!value.IsNull());
+    ss << value;
+    CAddressUnspentValue valueRead;
+    ss >> valueRead;
+    BOOST_CHECK_EQUAL(valueRead.satoshis, 5 * COIN);
+    BOOST_CHECK_EQUAL(valueRead.blockHeight, 100);
+    BOOST_CHECK(valueRead.script == value.script);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,159 @@
+// Copyright (c) 2018 The Zen Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+#include "hash.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "script/script.h"
+#include "streams.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilter_tests, BasicTestingSetup)
+
+static GCSFilter::Element RandomElement()
+{
+    uint256 hash = GetRandHash();
+    return GCSFilter::Element(hash.begin(), hash.end());
+}
+
+BOOST_AUTO_TEST_CASE(gcsfilter_test)
+{
+    GCSFilter::ElementSet included, excluded;
+    for (int i = 0; i < 100; i++) {
+        included.insert(RandomElement());
+        excluded.insert(RandomElement());
+    }
+
+    GCSFilter filter(GCSFilter::Params(0, 0, 10, 1 << 10), included);
+    BOOST_CHECK_EQUAL(filter.GetN(), 100U);
+    BOOST_FOREACH(const GCSFilter::Element& element, included) {
+        BOOST_CHECK(filter.Match(element));
+
+        GCSFilter::ElementSet single;
+        single.insert(element);
+        BOOST_CHECK(filter.MatchAny(single));
+    }
+    BOOST_CHECK(filter.MatchAny(included));
+
+    // A decoded filter matches the same
+    GCSFilter decoded(filter.GetParams(), filter.GetEncoded());
+    BOOST_CHECK_EQUAL(decoded.GetN(), filter.GetN());
+    BOOST_CHECK(decoded.GetEncoded() == filter.GetEncoded());
+    BOOST_FOREACH(const GCSFilter::Element& element, included)
+        BOOST_CHECK(decoded.Match(element));
+
+    // Each excluded element matches with probability 1/M
+    GCSFilter strict(GCSFilter::Params(0, 0, 19, 784931), included);
+    BOOST_CHECK(!strict.MatchAny(excluded));
+
+    // A filter short of data is refused
+    std::vector<unsigned char> vTruncated(filter.GetEncoded().begin(), filter.GetEncoded().end() - 1);
+    BOOST_CHECK_THROW(GCSFilter(filter.GetParams(), vTruncated), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(gcsfilter_empty_test)
+{
+    GCSFilter empty;
+    BOOST_CHECK_EQUAL(empty.GetN(), 0U);
+    BOOST_CHECK_EQUAL(empty.GetEncoded().size(), 1U);
+    BOOST_CHECK(!empty.Match(RandomElement()));
+
+    GCSFilter::ElementSet noElements;
+    GCSFilter built(GCSFilter::Params(), noElements);
+    BOOST_CHECK(built.GetEncoded() == empty.GetEncoded());
+    GCSFilter decoded(GCSFilter::Params(), empty.GetEncoded());
+    BOOST_CHECK_EQUAL(decoded.GetN(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_basic_test)
+{
+    std::vector<unsigned char> vchKeyHash(20, 1);
+    CScript plainScript = CScript() << OP_DUP << OP_HASH160 << vchKeyHash << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript replayScript = plainScript;
+    replayScript << ToByteVector(GetRandHash()) << 100 << OP_CHECKBLOCKATHEIGHT;
+    CScript p2shScript = CScript() << OP_HASH160 << std::vector<unsigned char>(20, 2) << OP_EQUAL;
+    CScript opReturnScript = CScript() << OP_RETURN << std::vector<unsigned char>(8, 3);
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vout.resize(1);
+    coinbase.vout[0].scriptPubKey = p2shScript;
+
+    CMutableTransaction tx;
+    tx.nVersion = 2;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 1);
+    tx.vout.resize(3);
+    tx.vout[0].scriptPubKey = replayScript;
+    tx.vout[1].scriptPubKey = opReturnScript;
+    tx.vout[2].scriptPubKey = CScript();
+    tx.vjoinsplit.resize(1);
+    tx.vjoinsplit[0].nullifiers[0] = GetRandHash();
+    tx.vjoinsplit[0].nullifiers[1] = GetRandHash();
+    tx.vjoinsplit[0].commitments[0] = GetRandHash();
+    tx.vjoinsplit[0].commitments[1] = GetRandHash();
+
+    CBlock block;
+    block.vtx.push_back(coinbase);
+    block.vtx.push_back(tx);
+    block.hashPrevBlock = GetRandHash();
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    GCSFilter::ElementSet elements = ZenFilterElements(block);
+    // Two output scripts, one outpoint, two nullifiers and two commitments
+    BOOST_CHECK_EQUAL(elements.size(), 7U);
+
+    BlockFilter blockFilter(BLOCK_FILTER_ZEN, block);
+    BOOST_CHECK(blockFilter.GetBlockHash() == block.GetHash());
+    const GCSFilter& filter = blockFilter.GetFilter();
+    BOOST_CHECK_EQUAL(filter.GetN(), 7U);
+
+    // Replay protection is left out of output scripts
+    BOOST_CHECK(filter.Match(GCSFilter::Element(plainScript.begin(), plainScript.end())));
+    BOOST_CHECK(!filter.Match(GCSFilter::Element(replayScript.begin(), replayScript.end())));
+    BOOST_CHECK(filter.Match(GCSFilter::Element(p2shScript.begin(), p2shScript.end())));
+    BOOST_CHECK(!filter.Match(GCSFilter::Element(opReturnScript.begin(), opReturnScript.end())));
+
+    CDataStream ssOutPoint(SER_NETWORK, PROTOCOL_VERSION);
+    ssOutPoint << tx.vin[0].prevout;
+    BOOST_CHECK(filter.Match(GCSFilter::Element(ssOutPoint.begin(), ssOutPoint.end())));
+    BOOST_FOREACH(const uint256& nullifier, tx.vjoinsplit[0].nullifiers)
+        BOOST_CHECK(filter.Match(GCSFilter::Element(nullifier.begin(), nullifier.end())));
+    BOOST_FOREACH(const uint256& commitment, tx.vjoinsplit[0].commitments)
+        BOOST_CHECK(filter.Match(GCSFilter::Element(commitment.begin(), commitment.end())));
+
+    // The header chains the filter hashes
+    uint256 prevHeader = GetRandHash();
+    uint256 hashFilter = blockFilter.GetHash();
+    BOOST_CHECK(hashFilter == Hash(filter.GetEncoded().begin(), filter.GetEncoded().end()));
+    BOOST_CHECK(blockFilter.ComputeHeader(prevHeader) == Hash(hashFilter.begin(), hashFilter.end(), prevHeader.begin(), prevHeader.end()));
+
+    // Round trip through the cfilter serialization
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << blockFilter;
+    BlockFilter blockFilter2;
+    ss >> blockFilter2;
+    BOOST_CHECK_EQUAL(blockFilter2.GetFilterType(), BLOCK_FILTER_ZEN);
+    BOOST_CHECK(blockFilter2.GetBlockHash() == blockFilter.GetBlockHash());
+    BOOST_CHECK(blockFilter2.GetEncodedFilter() == blockFilter.GetEncodedFilter());
+    BOOST_CHECK(blockFilter2.GetFilter().Match(GCSFilter::Element(plainScript.begin(), plainScript.end())));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_type_names)
+{
+    BlockFilterType filterType;
+    BOOST_CHECK(BlockFilterTypeByName("zen", filterType));
+    BOOST_CHECK_EQUAL(filterType, BLOCK_FILTER_ZEN);
+    BOOST_CHECK_EQUAL(BlockFilterTypeName(BLOCK_FILTER_ZEN), "zen");
+    // The zen filter is not the BIP158 basic filter
+    BOOST_CHECK(!BlockFilterTypeByName("basic", filterType));
+    BOOST_CHECK(!BlockFilterTypeByName("extended", filterType));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
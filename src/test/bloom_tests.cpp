@@ -182,6 +182,25 @@ BOOST_AUTO_TEST_CASE(bloom_match)
     BOOST_CHECK_MESSAGE(!filter.IsRelevantAndUpdate(tx), "Simple Bloom filter matched COutPoint for an output we didn't care about");
 }
 
+// Build the merkleblock from precomputed transaction elements as well as from
+// the block itself, and check both give the same result and filter updates.
+static void CheckPrecomputedMatch(const CBlock& block, const CBloomFilter& filter)
+{
+    std::vector<CBloomTxElements> vtxElements;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        vtxElements.push_back(CBloomTxElements(tx));
+
+    CBloomFilter filter1(filter), filter2(filter);
+    CMerkleBlock merkleBlock1(block, filter1);
+    CMerkleBlock merkleBlock2(block.GetBlockHeader(), vtxElements, filter2);
+
+    CDataStream ss1(SER_NETWORK, PROTOCOL_VERSION), ss2(SER_NETWORK, PROTOCOL_VERSION);
+    ss1 << merkleBlock1 << filter1;
+    ss2 << merkleBlock2 << filter2;
+    BOOST_CHECK(ss1.str() == ss2.str());
+    BOOST_CHECK(merkleBlock1.vMatchedTxn == merkleBlock2.vMatchedTxn);
+}
+
 BOOST_AUTO_TEST_CASE(merkle_block_1)
 {
     // Random real block (0000000000013b8ab2cd513b0261a14096412195a72a0c4827d229dcc7e0f7af)
@@ -239,6 +258,7 @@ BOOST_AUTO_TEST_CASE(merkle_block_2)
     // Match the first transaction
     filter.insert(uint256S("0xe980fe9f792d014e73b95203dc1335c5f9ce19ac537a419e6df5b47aecb93b70"));
 
+    CheckPrecomputedMatch(block, filter);
     CMerkleBlock merkleBlock(block, filter);
     BOOST_CHECK(merkleBlock.header.GetHash() == block.GetHash());
 
@@ -293,6 +313,7 @@ BOOST_AUTO_TEST_CASE(merkle_block_2_with_update_none)
     // Match the first transaction
     filter.insert(uint256S("0xe980fe9f792d014e73b95203dc1335c5f9ce19ac537a419e6df5b47aecb93b70"));
 
+    CheckPrecomputedMatch(block, filter);
     CMerkleBlock merkleBlock(block, filter);
     BOOST_CHECK(merkleBlock.header.GetHash() == block.GetHash());
 
@@ -429,6 +450,7 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_p2pubkey_only)
     // ...and the output address of the 4th transaction
     filter.insert(ParseHex("b6efd80d99179f4f4ff6f4dd0a007d018c385d21"));
 
+    CheckPrecomputedMatch(block, filter);
     CMerkleBlock merkleBlock(block, filter);
     BOOST_CHECK(merkleBlock.header.GetHash() == block.GetHash());
 
@@ -839,4 +839,42 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     }
 }
 
+BOOST_AUTO_TEST_CASE(coins_running_stats)
+{
+    uint256 txid1 = GetRandHash(), txid2 = GetRandHash();
+    CTxOut out1(1000, CScript() << OP_1);
+    CTxOut out2(250, CScript() << OP_2 << OP_3);
+    CTxOut unspendable(10, CScript() << OP_RETURN);
+
+    CCoinsRunningStats stats;
+    stats.AddOutput(txid1, 0, out1, 10, true);
+    stats.AddOutput(txid2, 1, out2, 11, false);
+    stats.AddOutput(txid2, 2, unspendable, 11, false);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, 2);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, 1250);
+    BOOST_CHECK_EQUAL(stats.nBogoSize, 50 + 1 + 50 + 2);
+
+    // A block spending out1 in a delta of its own
+    CCoinsRunningStats delta;
+    delta.RemoveOutput(txid1, 0, out1, 10, true);
+    delta.RemoveOutput(txid2, 2, unspendable, 11, false);
+    stats.Apply(delta);
+
+    CCoinsRunningStats expected;
+    expected.AddOutput(txid2, 1, out2, 11, false);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, expected.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, expected.nTotalAmount);
+    BOOST_CHECK_EQUAL(stats.nBogoSize, expected.nBogoSize);
+    uint256 hash, hashExpected;
+    stats.muhash.Finalize(hash);
+    expected.muhash.Finalize(hashExpected);
+    BOOST_CHECK(hash == hashExpected);
+
+    // The height and coinbase flag are part of what is committed to
+    CCoinsRunningStats other;
+    other.AddOutput(txid2, 1, out2, 11, true);
+    other.muhash.Finalize(hash);
+    BOOST_CHECK(hash != hashExpected);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -8,7 +8,10 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "crypto/muhash.h"
 #include "random.h"
+#include "streams.h"
+#include "uint256.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
@@ -248,4 +251,88 @@ BOOST_AUTO_TEST_CASE(hmac_sha512_testvectors) {
                    "b6022cac3c4982b10d5eeb55c3e4de15134676fb6de0446065c97440fa8c6a58");
 }
 
+BOOST_AUTO_TEST_CASE(num3072_reduction) {
+    // 2^3072 - 1 is the prime plus 1103716
+    unsigned char data[Num3072::BYTE_SIZE], out[Num3072::BYTE_SIZE];
+    memset(data, 0xff, sizeof(data));
+    Num3072(data).ToBytes(out);
+    BOOST_CHECK_EQUAL(ReadLE32(out), 1103716U);
+    for (size_t i = 4; i < sizeof(out); i++)
+        BOOST_CHECK_EQUAL(out[i], 0);
+
+    // x * y / y == x
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = insecure_rand();
+    Num3072 x(data), y;
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = insecure_rand();
+    y = Num3072(data);
+    Num3072 z = x;
+    z.Multiply(y);
+    z.Divide(y);
+    unsigned char outx[Num3072::BYTE_SIZE];
+    x.ToBytes(outx);
+    z.ToBytes(out);
+    BOOST_CHECK(memcmp(out, outx, sizeof(out)) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(muhash_tests) {
+    uint256 hash;
+    // The empty set hashes the number 1
+    MuHash3072().Finalize(hash);
+    BOOST_CHECK_EQUAL(hash.GetHex(), "dd5ad2a105c2d29495f577245c357409002329b9f4d6182c0af3dc2f462555c8");
+
+    std::vector<uint256> elements;
+    for (int i = 0; i < 8; i++)
+        elements.push_back(GetRandHash());
+
+    // The order elements are added in does not matter
+    MuHash3072 forward, backward;
+    for (size_t i = 0; i < elements.size(); i++) {
+        forward.Insert(elements[i].begin(), 32);
+        backward.Insert(elements[elements.size() - 1 - i].begin(), 32);
+    }
+    uint256 hashForward, hashBackward;
+    forward.Finalize(hashForward);
+    backward.Finalize(hashBackward);
+    BOOST_CHECK(hashForward == hashBackward);
+
+    // Removing an element, even before it is added, cancels it out
+    MuHash3072 partial;
+    partial.Remove(elements[0].begin(), 32);
+    for (size_t i = 0; i < elements.size(); i++)
+        partial.Insert(elements[i].begin(), 32);
+    MuHash3072 rest;
+    for (size_t i = 1; i < elements.size(); i++)
+        rest.Insert(elements[i].begin(), 32);
+    uint256 hashPartial, hashRest;
+    partial.Finalize(hashPartial);
+    rest.Finalize(hashRest);
+    BOOST_CHECK(hashPartial == hashRest);
+    BOOST_CHECK(hashPartial != hashForward);
+
+    // Combining sets
+    MuHash3072 first, second;
+    first.Insert(elements[0].begin(), 32);
+    second.Insert(elements[0].begin(), 32).Remove(elements[0].begin(), 32);
+    for (size_t i = 1; i < elements.size(); i++)
+        second.Insert(elements[i].begin(), 32);
+    first *= second;
+    uint256 hashCombined;
+    first.Finalize(hashCombined);
+    BOOST_CHECK(hashCombined == hashForward);
+
+    // Serialization keeps removals apart
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    ss << partial;
+    BOOST_CHECK_EQUAL(ss.size(), 2 * Num3072::BYTE_SIZE);
+    MuHash3072 read;
+    ss >> read;
+    read.Finalize(hash);
+    BOOST_CHECK(hash == hashPartial);
+    read.Insert(elements[0].begin(), 32);
+    read.Finalize(hash);
+    BOOST_CHECK(hash == hashForward);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
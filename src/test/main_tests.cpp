@@ -84,6 +84,22 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK_EQUAL(nSum, 2099999990760000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(block_download_limit_test)
+{
+    // Unknown round trip or service time
+    BOOST_CHECK_EQUAL(GetBlockDownloadLimit(std::numeric_limits<int64_t>::max(), 0), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetBlockDownloadLimit(std::numeric_limits<int64_t>::max(), 10000), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetBlockDownloadLimit(100000, 0), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // 2 * (1 + round trip / service time)
+    BOOST_CHECK_EQUAL(GetBlockDownloadLimit(100000, 10000), 22);
+    BOOST_CHECK_EQUAL(GetBlockDownloadLimit(100000, 30000), 8);
+
+    // Bounded on both sides
+    BOOST_CHECK_EQUAL(GetBlockDownloadLimit(100000, 1000000), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetBlockDownloadLimit(1000000, 1000), MAX_BLOCKS_IN_TRANSIT_PER_PEER_LIMIT);
+}
+
 bool ReturnFalse() { return false; }
 bool ReturnTrue() { return true; }
 
@@ -0,0 +1,132 @@
+// Copyright (c) 2012-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "hash.h"
+#include "net.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
+
+static CSerializeData MakeMessage(const std::vector<unsigned char>& payload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    BeginSerializedNetMsg(ss, "block");
+    ss.write((const char*)&payload[0], payload.size());
+    return *FinalizeSerializedNetMsg(ss);
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_incremental_checksum)
+{
+    std::vector<unsigned char> payload(300 * 1024);
+    GetRandBytes(&payload[0], payload.size());
+    CSerializeData data = MakeMessage(payload);
+
+    // Feed the message in uneven pieces, as it would come off the socket
+    CNetMessage msg(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    size_t nPos = 0;
+    size_t nChunk = 1;
+    while (nPos < data.size()) {
+        unsigned int nBytes = std::min(nChunk, data.size() - nPos);
+        int handled = msg.in_data ? msg.readData(&data[nPos], nBytes) : msg.readHeader(&data[nPos], nBytes);
+        BOOST_REQUIRE(handled > 0);
+        nPos += handled;
+        nChunk = nChunk * 3 + 7;
+    }
+    BOOST_REQUIRE(msg.complete());
+    BOOST_CHECK(msg.hdr.nMessageSize == payload.size());
+    BOOST_CHECK(std::equal(payload.begin(), payload.end(), msg.vRecv.begin()));
+
+    uint256 hash = Hash(payload.begin(), payload.end());
+    BOOST_CHECK(msg.GetMessageHash() == hash);
+    BOOST_CHECK(ReadLE32(msg.GetMessageHash().begin()) == msg.hdr.nChecksum);
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_empty_payload)
+{
+    CSerializeData data = MakeMessage(std::vector<unsigned char>(1));
+    // Same header, announcing no data
+    data.resize(CMessageHeader::HEADER_SIZE);
+    WriteLE32((unsigned char*)&data[CMessageHeader::MESSAGE_SIZE_OFFSET], 0);
+
+    CNetMessage msg(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(msg.readHeader(&data[0], data.size()), (int)data.size());
+    BOOST_REQUIRE(msg.complete());
+    uint256 hash = Hash(data.end(), data.end());
+    BOOST_CHECK(msg.GetMessageHash() == hash);
+}
+
+BOOST_AUTO_TEST_CASE(upload_budget)
+{
+    UploadClass nClass;
+    BOOST_CHECK(ParseUploadClass("historical", nClass) && nClass == UPLOAD_HISTORICAL_BLOCKS);
+    BOOST_CHECK(ParseUploadClass("addr", nClass) && nClass == UPLOAD_ADDR);
+    BOOST_CHECK(!ParseUploadClass("other", nClass));
+    BOOST_CHECK(!ParseUploadClass("", nClass));
+    BOOST_CHECK(GetUploadClass("cmpctblock") == UPLOAD_TIP_RELAY);
+    BOOST_CHECK(GetUploadClass("tx") == UPLOAD_TX_RELAY);
+    BOOST_CHECK(GetUploadClass("ping") == UPLOAD_OTHER);
+
+    // Unlimited unless configured
+    RecordUpload(false, UPLOAD_ADDR, 100 * 1000 * 1000);
+    BOOST_CHECK(UploadBudgetAvailable(false, UPLOAD_ADDR));
+
+    std::vector<CUploadClassStats> vStats;
+    GetUploadClassStats(vStats);
+    uint64_t nBackoffs = vStats[UPLOAD_ADDR].nBackoffs;
+
+    // A message may overdraw the budget, and the class then backs off
+    SetUploadBudget(false, UPLOAD_ADDR, 1000);
+    BOOST_CHECK(UploadBudgetAvailable(false, UPLOAD_ADDR));
+    RecordUpload(false, UPLOAD_ADDR, 1000 * 1000);
+    BOOST_CHECK(!UploadBudgetAvailable(false, UPLOAD_ADDR));
+    BOOST_CHECK(!UploadBudgetAvailable(false, UPLOAD_ADDR));
+    // Whitelisted peers have budgets of their own
+    BOOST_CHECK(UploadBudgetAvailable(true, UPLOAD_ADDR));
+
+    GetUploadClassStats(vStats);
+    BOOST_REQUIRE_EQUAL(vStats.size(), (size_t)UPLOAD_CLASS_COUNT);
+    BOOST_CHECK_EQUAL(vStats[UPLOAD_ADDR].strName, "addr");
+    BOOST_CHECK_EQUAL(vStats[UPLOAD_ADDR].nLimit, 1000U);
+    BOOST_CHECK(vStats[UPLOAD_ADDR].nAvailable < 0);
+    // Backing off once counts once, however often the budget is checked meanwhile
+    BOOST_CHECK_EQUAL(vStats[UPLOAD_ADDR].nBackoffs, nBackoffs + 1);
+
+    SetUploadBudget(false, UPLOAD_ADDR, 0);
+    BOOST_CHECK(UploadBudgetAvailable(false, UPLOAD_ADDR));
+}
+
+BOOST_AUTO_TEST_CASE(upload_bucket_refill)
+{
+    // 1000 bytes per second, refilled every 100us, when each refill earns a tenth of a byte
+    CUploadBucket bucket;
+    int64_t nNow = 1000000;
+    bucket.Reset(1000, nNow);
+    int64_t nFull = bucket.GetAvailable();
+    BOOST_CHECK_EQUAL(nFull, 10000);
+    bucket.Spend(nFull);
+    BOOST_CHECK_EQUAL(bucket.GetAvailable(), 0);
+    for (int i = 0; i < 30000; i++) {
+        nNow += 100;
+        bucket.Refill(nNow);
+    }
+    BOOST_CHECK_EQUAL(bucket.GetAvailable(), 3000);
+
+    // Debt is repaid at the same rate
+    bucket.Spend(5000);
+    for (int i = 0; i < 10000; i++) {
+        nNow += 100;
+        bucket.Refill(nNow);
+    }
+    BOOST_CHECK_EQUAL(bucket.GetAvailable(), -1000);
+
+    // No more than the burst allowance accumulates, however long the bucket idles
+    bucket.Refill(nNow + 1000000LL * 1000000);
+    BOOST_CHECK_EQUAL(bucket.GetAvailable(), nFull);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
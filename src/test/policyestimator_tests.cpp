@@ -204,4 +204,85 @@ BOOST_AUTO_TEST_CASE(TxConfirmStats_FindBucketIndex)
     BOOST_CHECK_EQUAL(txcs.FindBucketIndex(nan("")), 0);
 }
 
+BOOST_AUTO_TEST_CASE(TxConfirmStats_LazyDecay)
+{
+    std::vector<double> buckets {10.0, 100.0};
+    TxConfirmStats txcs;
+    std::vector<TxConfirmBucketInfo> vInfo;
+
+    // Decay fast enough for the stored averages to be normalized a few times
+    txcs.Initialize(buckets, MAX_BLOCK_CONFIRMS, 0.5, "Test");
+    txcs.UpdateMovingAverages();
+    txcs.Record(2, 50.0);
+    txcs.GetBucketInfo(vInfo);
+    BOOST_CHECK_EQUAL(vInfo.size(), 1);
+    BOOST_CHECK_EQUAL(vInfo[0].upperBound, 100.0);
+    BOOST_CHECK_EQUAL(vInfo[0].txCount, 1.0);
+    BOOST_CHECK_EQUAL(vInfo[0].avgValue, 50.0);
+    BOOST_CHECK_EQUAL(vInfo[0].confirmed[0], 0.0);
+    BOOST_CHECK_EQUAL(vInfo[0].confirmed[1], 1.0);
+
+    for (int i = 0; i < 10; i++)
+        txcs.UpdateMovingAverages();
+    txcs.GetBucketInfo(vInfo);
+    BOOST_CHECK_CLOSE(vInfo[0].txCount, pow(0.5, 10), 1e-6);
+
+    for (int i = 0; i < 1000; i++) {
+        txcs.UpdateMovingAverages();
+        txcs.Record(1, 5.0);
+    }
+    // The first bucket has settled at 1 / (1 - decay) txs
+    txcs.GetBucketInfo(vInfo);
+    BOOST_CHECK_EQUAL(vInfo[0].upperBound, 10.0);
+    BOOST_CHECK_CLOSE(vInfo[0].txCount, 2.0, 1e-6);
+    BOOST_CHECK_CLOSE(vInfo[0].avgValue, 5.0, 1e-6);
+    BOOST_CHECK_CLOSE(vInfo[0].confirmed[0], 2.0, 1e-6);
+}
+
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimates_Shielded)
+{
+    CTxMemPool mpool(CFeeRate(1000));
+    std::list<CTransaction> dummyConflicted;
+    CAmount fee(10000);
+
+    CMutableTransaction tx;
+    tx.nVersion = 2;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0LL;
+    tx.vjoinsplit.push_back(JSDescription());
+    CFeeRate feeRate(fee, ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
+
+    // Every shielded tx gets mined in the next block
+    std::vector<CTransaction> block;
+    int blocknum = 0;
+    while (blocknum < 50) {
+        for (int k = 0; k < 5; k++) {
+            tx.vin[0].prevout.n = 100*blocknum+k;
+            uint256 hash = tx.GetHash();
+            mpool.addUnchecked(hash, CTxMemPoolEntry(tx, fee, GetTime(), 0, blocknum, mpool.HasNoInputsOf(tx)));
+            block.push_back(tx);
+        }
+        mpool.removeForBlock(block, ++blocknum, dummyConflicted);
+        block.clear();
+    }
+
+    // They are only used for the shielded estimate
+    BOOST_CHECK(mpool.estimateFee(1) == CFeeRate(0));
+    BOOST_CHECK_EQUAL(mpool.estimatePriority(1), -1);
+    BOOST_CHECK(mpool.estimateShieldedFee(1).GetFeePerK() <= feeRate.GetFeePerK());
+    BOOST_CHECK(mpool.estimateShieldedFee(1).GetFeePerK() >= feeRate.GetFeePerK() - 1);
+
+    unsigned int nBestSeenHeight;
+    size_t nTrackedTxs;
+    std::vector<std::vector<TxConfirmBucketInfo> > vStatsInfo;
+    mpool.GetFeeEstimatorInfo(nBestSeenHeight, nTrackedTxs, vStatsInfo);
+    BOOST_CHECK_EQUAL(nBestSeenHeight, 50);
+    BOOST_CHECK_EQUAL(nTrackedTxs, 0);
+    BOOST_CHECK_EQUAL(vStatsInfo.size(), 3);
+    BOOST_CHECK(vStatsInfo[0].empty());
+    BOOST_CHECK(vStatsInfo[1].empty());
+    BOOST_CHECK_EQUAL(vStatsInfo[2].size(), 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 
 #include "rpc/server.h"
 #include "rpc/client.h"
+#include "rpc/jsonstream.h"
 
 #include "base58.h"
 #include "netbase.h"
@@ -11,6 +12,7 @@
 #include "test/test_bitcoin.h"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
 
 #include <univalue.h>
@@ -212,6 +214,80 @@ BOOST_AUTO_TEST_CASE(json_parse_errors)
     BOOST_CHECK_THROW(ParseNonRFCJSONValue("3J98t1WpEZ73CNmQviecrnyiWrnqRhWNL"), std::runtime_error);
 }
 
+static void AppendChunk(std::vector<std::string>* pvChunks, const std::string& chunk)
+{
+    pvChunks->push_back(chunk);
+}
+
+static void AppendString(std::string* pstr, const std::string& chunk)
+{
+    pstr->append(chunk);
+}
+
+BOOST_AUTO_TEST_CASE(json_stream_writer)
+{
+    UniValue inner(UniValue::VOBJ);
+    inner.push_back(Pair("a \"quoted\" key", 1));
+    inner.push_back(Pair("list", UniValue(UniValue::VARR)));
+    UniValue arr(UniValue::VARR);
+    arr.push_back(inner);
+    arr.push_back(NullUniValue);
+    arr.push_back("x\ny");
+    UniValue doc(UniValue::VOBJ);
+    doc.push_back(Pair("empty", UniValue(UniValue::VOBJ)));
+    doc.push_back(Pair("arr", arr));
+    doc.push_back(Pair("n", 1.5));
+
+    // The same document written piecewise, with a tiny flush size
+    std::vector<std::string> vChunks;
+    CJSONStreamWriter writer(boost::bind(&AppendChunk, &vChunks, _1), 4);
+    writer.BeginObject();
+    writer.Key("empty");
+    writer.BeginObject();
+    writer.EndObject();
+    writer.Key("arr");
+    writer.BeginArray();
+    writer.BeginObject();
+    writer.KeyValue("a \"quoted\" key", 1);
+    writer.Key("list");
+    writer.BeginArray();
+    writer.EndArray();
+    writer.EndObject();
+    writer.Value(NullUniValue);
+    writer.Value("x\ny");
+    writer.EndArray();
+    writer.KeyValue("n", 1.5);
+    writer.EndObject();
+    writer.Flush();
+
+    BOOST_CHECK(vChunks.size() > 1);
+    BOOST_CHECK_EQUAL(boost::algorithm::join(vChunks, ""), doc.write());
+
+    // Nothing left to flush
+    writer.Flush();
+    size_t nChunks = vChunks.size();
+    writer.Flush();
+    BOOST_CHECK_EQUAL(vChunks.size(), nChunks);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_stream_actor)
+{
+    UniValue params(UniValue::VARR);
+    params.push_back(true);
+    std::string strStream;
+    RPCStreamResult writeResult = tableRPC.executeStream("getrawmempool", params);
+    BOOST_REQUIRE(writeResult);
+    CJSONStreamWriter writer(boost::bind(&AppendString, &strStream, _1));
+    writeResult(writer);
+    writer.Flush();
+    BOOST_CHECK_EQUAL(strStream, tableRPC.execute("getrawmempool", params).write());
+
+    // Commands without a stream actor are left to the regular one
+    BOOST_CHECK(!tableRPC.executeStream("getblockcount", UniValue(UniValue::VARR)));
+    // Errors are thrown before anything is written
+    BOOST_CHECK_THROW(tableRPC.executeStream("getblock", ParseNonRFCJSONValue("[\"x\"]")), UniValue);
+}
+
 BOOST_AUTO_TEST_CASE(rpc_ban)
 {
     BOOST_CHECK_NO_THROW(CallRPC(string("clearbanned")));
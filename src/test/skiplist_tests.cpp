@@ -100,4 +100,43 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(chaintipsnapshot_test)
+{
+    // A main chain of 2000 blocks and a branch of 500 blocks off block 999.
+    std::vector<CBlockIndex> vBlocksMain(2000);
+    for (unsigned int i=0; i<vBlocksMain.size(); i++) {
+        vBlocksMain[i].nHeight = i;
+        vBlocksMain[i].pprev = i ? &vBlocksMain[i - 1] : NULL;
+        vBlocksMain[i].BuildSkip();
+    }
+    std::vector<CBlockIndex> vBlocksSide(500);
+    for (unsigned int i=0; i<vBlocksSide.size(); i++) {
+        vBlocksSide[i].nHeight = i + 1000;
+        vBlocksSide[i].pprev = i ? &vBlocksSide[i - 1] : &vBlocksMain[999];
+        vBlocksSide[i].BuildSkip();
+    }
+
+    CChain chain;
+    chain.SetTip(&vBlocksMain.back());
+    CChainTipSnapshot snapshot;
+    snapshot.pindexTip = chain.Tip();
+    snapshot.nHeight = chain.Height();
+
+    // The snapshot answers like the chain it was taken from.
+    for (int n=0; n<1000; n++) {
+        int r = insecure_rand() % 2500;
+        const CBlockIndex* pindex = (r < 2000) ? &vBlocksMain[r] : &vBlocksSide[r - 2000];
+        BOOST_CHECK_EQUAL(snapshot.Contains(pindex), chain.Contains(pindex));
+        BOOST_CHECK(snapshot.Next(pindex) == chain.Next(pindex));
+        BOOST_CHECK(snapshot[r] == chain[r]);
+    }
+    BOOST_CHECK(snapshot[-1] == NULL);
+
+    // An empty snapshot contains nothing.
+    CChainTipSnapshot empty;
+    BOOST_CHECK(empty[0] == NULL);
+    BOOST_CHECK(!empty.Contains(&vBlocksMain[0]));
+    BOOST_CHECK(empty.Next(&vBlocksMain[0]) == NULL);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -14,9 +14,16 @@
 #include <utility>
 #include <vector>
 
+struct CAddressIndexKey;
+struct CAddressUnspentKey;
+struct CAddressUnspentValue;
 class CBlockFileInfo;
 class CBlockIndex;
 struct CDiskTxPos;
+struct CSpentIndexKey;
+struct CSpentIndexValue;
+struct CTimestampIndexKey;
+class uint160;
 class uint256;
 
 //! -dbcache default (MiB)
@@ -47,6 +54,14 @@ public:
                     CAnchorsMap &mapAnchors,
                     CNullifiersMap &mapNullifiers);
     bool GetStats(CCoinsStats &stats) const;
+
+    /** Store stats with the next write of the chain state they are of */
+    void SetRunningStats(const CCoinsRunningStats &stats);
+    /** Read the stats stored with the chain state, if there are any */
+    bool GetRunningStats(CCoinsRunningStats &stats) const;
+
+private:
+    CCoinsRunningStats pendingStats;
 };
 
 /** Access to the block database (blocks/index/) */
@@ -65,6 +80,27 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    /**
+     * Add a block's address index entries, or remove them if fConnect is false,
+     * and apply its changes to the address unspent index, in one batch.
+     * Null unspent values erase their entry.
+     */
+    bool UpdateAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vIndex,
+                            const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent,
+                            bool fConnect);
+    /** Read the balance changes of an address, optionally only those from height nStart to nEnd */
+    bool ReadAddressIndex(int type, const uint160 &hashBytes,
+                          std::vector<std::pair<CAddressIndexKey, CAmount> > &vIndex,
+                          int nStart = 0, int nEnd = 0);
+    bool ReadAddressUnspentIndex(int type, const uint160 &hashBytes,
+                                 std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent);
+    /** Record the inputs spending outputs; null values erase their entry */
+    bool UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &vect);
+    bool ReadSpentIndex(const CSpentIndexKey &key, CSpentIndexValue &value);
+    bool WriteTimestampIndex(const CTimestampIndexKey &key);
+    bool EraseTimestampIndex(const CTimestampIndexKey &key);
+    /** Read the hashes of blocks with a time from nLow up to but not including nHigh */
+    bool ReadTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<uint256> &vHashes);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
@@ -259,13 +259,15 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
                                 std::list<CTransaction>& conflicts, bool fCurrentEstimate)
 {
     LOCK(cs);
-    std::vector<CTxMemPoolEntry> entries;
+    std::vector<const CTxMemPoolEntry*> entries;
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
-        uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
-            entries.push_back(mapTx[hash]);
+        std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(tx.GetHash());
+        if (it != mapTx.end())
+            entries.push_back(&it->second);
     }
+    // Before the txs in the new block are removed from the mempool, update policy estimates
+    minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
         std::list<CTransaction> dummy;
@@ -273,8 +275,6 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
         removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
     }
-    // After the txs in the new block have been removed from the mempool, update policy estimates
-    minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
 }
 
 void CTxMemPool::clear()
@@ -422,6 +422,23 @@ double CTxMemPool::estimatePriority(int nBlocks) const
     LOCK(cs);
     return minerPolicyEstimator->estimatePriority(nBlocks);
 }
+CFeeRate CTxMemPool::estimateShieldedFee(int nBlocks) const
+{
+    LOCK(cs);
+    return minerPolicyEstimator->estimateShieldedFee(nBlocks);
+}
+
+void CTxMemPool::GetFeeEstimatorInfo(unsigned int& nBestSeenHeight, size_t& nTrackedTxs,
+                                     std::vector<std::vector<TxConfirmBucketInfo> >& vStatsInfo) const
+{
+    LOCK(cs);
+    nBestSeenHeight = minerPolicyEstimator->GetBestSeenHeight();
+    nTrackedTxs = minerPolicyEstimator->GetTrackedTxCount();
+    std::vector<const TxConfirmStats*> vStats = minerPolicyEstimator->GetStats();
+    vStatsInfo.resize(vStats.size());
+    for (unsigned int i = 0; i < vStats.size(); i++)
+        vStats[i]->GetBucketInfo(vStatsInfo[i]);
+}
 
 bool
 CTxMemPool::WriteFeeEstimates(CAutoFile& fileout) const
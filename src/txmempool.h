@@ -63,6 +63,7 @@ public:
 };
 
 class CBlockPolicyEstimator;
+struct TxConfirmBucketInfo;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
@@ -172,6 +173,13 @@ public:
 
     /** Estimate priority needed to get into the next nBlocks */
     double estimatePriority(int nBlocks) const;
+
+    /** Estimate fee rate needed for a tx with joinsplits to get into the next nBlocks */
+    CFeeRate estimateShieldedFee(int nBlocks) const;
+
+    /** Dump the fee estimator's fee, priority and shielded buckets, for getfeeestimatorinfo */
+    void GetFeeEstimatorInfo(unsigned int& nBestSeenHeight, size_t& nTrackedTxs,
+                             std::vector<std::vector<TxConfirmBucketInfo> >& vStatsInfo) const;
     
     /** Write/Read estimates to disk */
     bool WriteFeeEstimates(CAutoFile& fileout) const;
@@ -74,34 +74,15 @@ int TLSManager::waitFor(SSLConnectionRoutine eRoutine, SOCKET hSocket, SSL* ssl,
             break;
         }
 
-        fd_set socketSet;
-        FD_ZERO(&socketSet);
-        FD_SET(hSocket, &socketSet);
-
-        struct timeval timeout = {timeoutSec, 0};
-
-        if (sslErr == SSL_ERROR_WANT_READ) {
-            int result = select(hSocket + 1, &socketSet, NULL, NULL, &timeout);
-            if (result == 0) {
-                LogPrint("net", "TLS: ERROR: %s: %s: WANT_READ timeout\n", __FILE__, __func__);
-                nErr = -1;
-                break;
-            } else if (result == -1) {
-                LogPrint("net", "TLS: ERROR: %s: %s: WANT_READ ssl_err_code: %s; errno: %s\n", __FILE__, __func__, ERR_error_string(sslErr, NULL), strerror(errno));
-                nErr = -1;
-                break;
-            }
-        } else {
-            int result = select(hSocket + 1, NULL, &socketSet, NULL, &timeout);
-            if (result == 0) {
-                LogPrint("net", "TLS: ERROR: %s: %s: WANT_WRITE timeout\n", __FILE__, __func__);
-                nErr = -1;
-                break;
-            } else if (result == -1) {
-                LogPrint("net", "TLS: ERROR: %s: %s: WANT_WRITE ssl_err_code: %s; errno: %s\n", __FILE__, __func__, ERR_error_string(sslErr, NULL), strerror(errno));
-                nErr = -1;
-                break;
-            }
+        int result = WaitForSocket(hSocket, sslErr == SSL_ERROR_WANT_WRITE, timeoutSec * 1000);
+        if (result == 0) {
+            LogPrint("net", "TLS: ERROR: %s: %s: %s timeout\n", __FILE__, __func__, sslErr == SSL_ERROR_WANT_READ ? "WANT_READ" : "WANT_WRITE");
+            nErr = -1;
+            break;
+        } else if (result == -1) {
+            LogPrint("net", "TLS: ERROR: %s: %s: %s ssl_err_code: %s; errno: %s\n", __FILE__, __func__, sslErr == SSL_ERROR_WANT_READ ? "WANT_READ" : "WANT_WRITE", ERR_error_string(sslErr, NULL), strerror(errno));
+            nErr = -1;
+            break;
         }
     }
 
@@ -242,39 +223,65 @@ bool TLSManager::prepareCredentials()
     return bPrepared;
 }
 /**
- * @brief accept a TLS connection
+ * @brief prepare the server side of a TLS connection. The handshake itself is
+ * driven by continueHandshake, so that it never blocks the caller.
  * 
- * @param hSocket the TLS socket.
+ * @param hSocket the TLS socket, must be non-blocking.
  * @param addr incoming address.
- * @param tls_ctx_server TLS server context.
  * @return SSL* returns pointer to the ssl object if successful, otherwise returns NULL
  */
-SSL* TLSManager::accept(SOCKET hSocket, const CAddress& addr)
+SSL* TLSManager::startAccept(SOCKET hSocket, const CAddress& addr)
 {
     LogPrint("net", "TLS: accepting connection from %s (tid = %X)\n", addr.ToString(), pthread_self());
 
-    SSL* ssl = NULL;
-    bool bAcceptedTLS = false;
-
-    if ((ssl = SSL_new(tls_ctx_server))) {
-        if (SSL_set_fd(ssl, hSocket)) {
-            if (TLSManager::waitFor(SSL_ACCEPT, hSocket, ssl, (DEFAULT_CONNECT_TIMEOUT / 1000)) == 1)
-                bAcceptedTLS = true;
-        }
+    SSL* ssl = SSL_new(tls_ctx_server);
+    if (ssl && !SSL_set_fd(ssl, hSocket)) {
+        SSL_free(ssl);
+        ssl = NULL;
     }
 
-    if (bAcceptedTLS) {
-        LogPrintf("TLS: connection from %s has been accepted. Using cipher: %s\n", addr.ToString(), SSL_get_cipher(ssl));
-    } else {
+    if (!ssl)
         LogPrintf("TLS: ERROR: %s: %s: TLS connection from %s failed\n", __FILE__, __func__, addr.ToString());
 
-        if (ssl) {
-            SSL_free(ssl);
-            ssl = NULL;
-        }
+    return ssl;
+}
+/**
+ * @brief Advance a TLS handshake on a non-blocking socket as far as possible without waiting.
+ * 
+ * @param eRoutine SSL_CONNECT or SSL_ACCEPT.
+ * @param ssl pointer to an SSL instance.
+ * @param fWantWrite set when the handshake has to be continued: true if it waits for the socket to be writable, false if readable.
+ * @return int returns 1 when the handshake is complete, 0 when it has to be continued, -1 on failure.
+ */
+int TLSManager::continueHandshake(SSLConnectionRoutine eRoutine, SSL* ssl, bool& fWantWrite)
+{
+    ERR_clear_error(); // clear the error queue
+
+    int nErr;
+    switch (eRoutine) {
+    case SSL_CONNECT:
+        nErr = SSL_connect(ssl);
+        break;
+
+    case SSL_ACCEPT:
+        nErr = SSL_accept(ssl);
+        break;
+
+    default:
+        return -1;
     }
 
-    return ssl;
+    if (nErr == 1)
+        return 1;
+
+    int sslErr = SSL_get_error(ssl, nErr);
+    if (sslErr == SSL_ERROR_WANT_READ || sslErr == SSL_ERROR_WANT_WRITE) {
+        fWantWrite = (sslErr == SSL_ERROR_WANT_WRITE);
+        return 0;
+    }
+
+    LogPrint("net", "TLS: WARNING: %s: %s: ssl_err_code: %s; errno: %s\n", __FILE__, __func__, ERR_error_string(sslErr, NULL), strerror(errno));
+    return -1;
 }
 /**
  * @brief Determines whether a string exists in the non-TLS address pool.
@@ -323,30 +330,23 @@ void TLSManager::cleanNonTLSPool(std::vector<NODE_ADDR>& vPool, CCriticalSection
  * @brief Handles send and recieve functionality in TLS Sockets.
  * 
  * @param pnode reference to the CNode object.
- * @param fdsetRecv 
- * @param fdsetSend 
- * @param fdsetError 
+ * @param fRecvReady the socket is ready for reading; cleared once a read would block.
+ * @param fSendReady the socket is ready for writing; cleared once the send buffer has been serviced.
  * @return int returns -1 when socket is invalid. returns 0 otherwise.
  */
-int TLSManager::threadSocketHandler(CNode* pnode, fd_set& fdsetRecv, fd_set& fdsetSend, fd_set& fdsetError)
+int TLSManager::threadSocketHandler(CNode* pnode, bool& fRecvReady, bool& fSendReady)
 {
     //
     // Receive
     //
-    bool recvSet = false, sendSet = false, errorSet = false;
-
     {
         LOCK(pnode->cs_hSocket);
 
         if (pnode->hSocket == INVALID_SOCKET)
             return -1;
-
-        recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
-        sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
-        errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
     }
 
-    if (recvSet || errorSet) {
+    if (fRecvReady) {
         TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
         if (lockRecv) {
             {
@@ -388,25 +388,33 @@ int TLSManager::threadSocketHandler(CNode* pnode, fd_set& fdsetRecv, fd_set& fds
                     if (!pnode->fDisconnect)
                         LogPrint("net", "socket closed (%s)\n", pnode->addr.ToString());
                     pnode->CloseSocketDisconnect();
+                    fRecvReady = false;
                 } else if (nBytes < 0) {
                     // error
                     //
                     if (bIsSSL) {
-                        if (nRet != SSL_ERROR_WANT_READ && nRet != SSL_ERROR_WANT_WRITE) // SSL_read() operation has to be repeated because of SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE (https://wiki.openssl.org/index.php/Manual:SSL_read(3)#NOTES)
+                        if (nRet == SSL_ERROR_WANT_READ) {
+                            // no complete record available yet, wait for the socket to become readable again
+                            fRecvReady = false;
+                        } else if (nRet != SSL_ERROR_WANT_WRITE) // SSL_read() operation has to be repeated because of SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE (https://wiki.openssl.org/index.php/Manual:SSL_read(3)#NOTES)
                         {
                             if (!pnode->fDisconnect)
                                 LogPrintf("ERROR: SSL_read %s\n", ERR_error_string(nRet, NULL));
                             pnode->CloseSocketDisconnect();
+                            fRecvReady = false;
                         } else {
                             // preventive measure from exhausting CPU usage
                             //
                             MilliSleep(1); // 1 msec
                         }
                     } else {
-                        if (nRet != WSAEWOULDBLOCK && nRet != WSAEMSGSIZE && nRet != WSAEINTR && nRet != WSAEINPROGRESS) {
+                        if (nRet == WSAEWOULDBLOCK) {
+                            fRecvReady = false;
+                        } else if (nRet != WSAEMSGSIZE && nRet != WSAEINTR && nRet != WSAEINPROGRESS) {
                             if (!pnode->fDisconnect)
                                 LogPrintf("ERROR: socket recv %s\n", NetworkErrorString(nRet));
                             pnode->CloseSocketDisconnect();
+                            fRecvReady = false;
                         }
                     }
                 }
@@ -417,10 +425,12 @@ int TLSManager::threadSocketHandler(CNode* pnode, fd_set& fdsetRecv, fd_set& fds
     //
     // Send
     //
-    if (sendSet) {
+    if (fSendReady) {
         TRY_LOCK(pnode->cs_vSend, lockSend);
-        if (lockSend)
+        if (lockSend) {
             SocketSendData(pnode);
+            fSendReady = false;
+        }
     }
     return 0;
 }
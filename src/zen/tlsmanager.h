@@ -49,10 +49,11 @@ public:
         const std::vector<boost::filesystem::path>& trustedDirs);
 
      bool prepareCredentials();
-     SSL* accept(SOCKET hSocket, const CAddress& addr);
+     SSL* startAccept(SOCKET hSocket, const CAddress& addr);
+     int continueHandshake(SSLConnectionRoutine eRoutine, SSL* ssl, bool& fWantWrite);
      bool isNonTLSAddr(const string& strAddr, const vector<NODE_ADDR>& vPool, CCriticalSection& cs);
      void cleanNonTLSPool(std::vector<NODE_ADDR>& vPool, CCriticalSection& cs);
-     int threadSocketHandler(CNode* pnode, fd_set& fdsetRecv, fd_set& fdsetSend, fd_set& fdsetError);
+     int threadSocketHandler(CNode* pnode, bool& fRecvReady, bool& fSendReady);
      bool initialize();
 };
 }